@@ -76,6 +76,26 @@
 #endif
 #endif
 
+/*
+ * Copy literals and matches 16 bytes at once when enough room is left in the
+ * input and output buffers (the copy may overrun the end of the literal run
+ * or of the match, but never the buffers). The decompressed data, and the
+ * bitstream, are the same. Define FASTLZ_NO_WIDECOPY to disable.
+ */
+#if !defined(FASTLZ_NO_WIDECOPY)
+#define FASTLZ_WIDECOPY
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FASTLZ_COPY16(d,s) _mm_storeu_si128((__m128i*)(void*)(d), _mm_loadu_si128((const __m128i*)(const void*)(s)))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FASTLZ_COPY16(d,s) vst1q_u8((d), vld1q_u8(s))
+#else
+#define FASTLZ_COPY16(d,s) memcpy((d), (s), 16)
+#endif
+#endif
+
 /*
  * FIXME: use preprocessor magic to set this on different platforms!
  */
@@ -114,6 +134,14 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
 static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int maxout);
 #include "fastlz.c"
 
+/* decompressor variant stopping once a given output size is reached */
+#define FASTLZ_PARTIAL
+#undef FASTLZ_DECOMPRESSOR
+#define FASTLZ_DECOMPRESSOR fastlz1_decompress_partial
+static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int target, int maxout);
+#include "fastlz.c"
+#undef FASTLZ_PARTIAL
+
 #undef FASTLZ_LEVEL
 #define FASTLZ_LEVEL 2
 
@@ -129,6 +157,13 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
 static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int maxout);
 #include "fastlz.c"
 
+#define FASTLZ_PARTIAL
+#undef FASTLZ_DECOMPRESSOR
+#define FASTLZ_DECOMPRESSOR fastlz2_decompress_partial
+static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int target, int maxout);
+#include "fastlz.c"
+#undef FASTLZ_PARTIAL
+
 int fastlz_compress(const void* input, int length, void* output)
 {
   /* for short block, choose fastlz1 */
@@ -153,6 +188,23 @@ int fastlz_decompress(const void* input, int length, void* output, int maxout)
   return 0;
 }
 
+int fastlz_decompress_partial(const void* input, int length, void* output, int target, int maxout)
+{
+  /* magic identifier for compression level */
+  int level = ((*(const flzuint8*)input) >> 5) + 1;
+
+  if(target > maxout)
+    target = maxout;
+
+  if(level == 1)
+    return fastlz1_decompress_partial(input, length, output, target, maxout);
+  if(level == 2)
+    return fastlz2_decompress_partial(input, length, output, target, maxout);
+
+  /* unknown level, trigger error */
+  return 0;
+}
+
 int fastlz_compress_level(int level, const void* input, int length, void* output)
 {
   if(level == 1)
@@ -165,6 +217,7 @@ int fastlz_compress_level(int level, const void* input, int length, void* output
 
 #else /* !defined(FASTLZ_COMPRESSOR) && !defined(FASTLZ_DECOMPRESSOR) */
 
+#if !defined(FASTLZ_PARTIAL)
 static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void* output)
 {
   const flzuint8* ip = (const flzuint8*) input;
@@ -419,12 +472,21 @@ static FASTLZ_INLINE int FASTLZ_COMPRESSOR(const void* input, int length, void*
   return op - (flzuint8*)output;
 }
 
+#endif /* !defined(FASTLZ_PARTIAL) */
+
+#if defined(FASTLZ_PARTIAL)
+static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int target, int maxout)
+#else
 static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void* output, int maxout)
+#endif
 {
   const flzuint8* ip = (const flzuint8*) input;
   const flzuint8* ip_limit  = ip + length;
   flzuint8* op = (flzuint8*) output;
   flzuint8* op_limit = op + maxout;
+#if defined(FASTLZ_PARTIAL)
+  flzuint8* op_target = op + target;
+#endif
   flzuint32 ctrl = (*ip++) & 31;
   int loop = 1;
 
@@ -481,12 +543,32 @@ static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void
       {
         /* optimize copy for a run */
         flzuint8 b = ref[-1];
+#if defined(FASTLZ_WIDECOPY)
+        memset(op, b, len + 3);
+        op += len + 3;
+#else
         *op++ = b;
         *op++ = b;
         *op++ = b;
         for(; len; --len)
           *op++ = b;
+#endif
+      }
+#if defined(FASTLZ_WIDECOPY)
+      /* copy 16 bytes at once if the match does not overlap a 16-byte copy */
+      else if(FASTLZ_EXPECT_CONDITIONAL(op - ref >= 16 - 1 && op + len + 3 + 15 <= op_limit))
+      {
+        flzuint8* const end = op + len + 3;
+        ref--;
+        do
+        {
+          FASTLZ_COPY16(op, ref);
+          op += 16;
+          ref += 16;
+        } while(op < end);
+        op = end;
       }
+#endif
       else
       {
 #if !defined(FASTLZ_STRICT_ALIGN)
@@ -536,16 +618,33 @@ static FASTLZ_INLINE int FASTLZ_DECOMPRESSOR(const void* input, int length, void
         return 0;
 #endif
 
-      *op++ = *ip++; 
-      for(--ctrl; ctrl; ctrl--)
+#if defined(FASTLZ_WIDECOPY)
+      /* literal runs are at most MAX_COPY (32) bytes long */
+      if(FASTLZ_EXPECT_CONDITIONAL(op + MAX_COPY <= op_limit && ip + MAX_COPY <= ip_limit))
+      {
+        FASTLZ_COPY16(op, ip);
+        FASTLZ_COPY16(op + 16, ip + 16);
+        op += ctrl;
+        ip += ctrl;
+      }
+      else
+#endif
+      {
         *op++ = *ip++;
+        for(--ctrl; ctrl; ctrl--)
+          *op++ = *ip++;
+      }
 
       loop = FASTLZ_EXPECT_CONDITIONAL(ip < ip_limit);
       if(loop)
         ctrl = *ip++;
     }
   }
+#if defined(FASTLZ_PARTIAL)
+  while(FASTLZ_EXPECT_CONDITIONAL(loop) && op < op_target);
+#else
   while(FASTLZ_EXPECT_CONDITIONAL(loop));
+#endif
 
   return op - (flzuint8*)output;
 }
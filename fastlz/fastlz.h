@@ -86,6 +86,18 @@ ZFASTEXTERN int fastlz_compress(const void* input, int length, void* output);
 
 ZFASTEXTERN int fastlz_decompress(const void* input, int length, void* output, int maxout); 
 
+/**
+  Decompress the beginning of a block of compressed data, stopping once at
+  least target bytes are decompressed, and returns the size of the
+  decompressed data (at least target bytes unless the block is shorter, and
+  at most maxout bytes). If error occurs, 0 (zero) will be returned instead.
+
+  The output buffer must be large enough for the whole decompressed block
+  (maxout), as the last copied literals or match may go past target.
+ */
+
+ZFASTEXTERN int fastlz_decompress_partial(const void* input, int length, void* output, int target, int maxout);
+
 /**
   Compress a block of data in the input buffer and returns the size of 
   compressed block. The size of input buffer is specified by length. The 
@@ -0,0 +1,490 @@
+/*
+  zlib-like interface to fast block compression (LZ4 or FastLZ) libraries
+  Copyright (C) 2010-2013 Exalead SA. (http://www.exalead.com/)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Remarks/Bugs:
+  LZ4 compression library by Yann Collet (yann.collet.73@gmail.com)
+  FastLZ compression library by Ariya Hidayat (ariya@kde.org)
+  Library encapsulation by Xavier Roche (fastlz@exalead.com)
+*/
+
+/* benchmark the library: throughput, ratio, per-block latency and memory
+   across block sizes, backends and levels */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "fastlzlib.h"
+
+/* maximum number of block sizes, levels and files */
+#define MAX_ITEMS 32
+
+/* default synthetic data size */
+#define SYNTHETIC_SIZE ( 4*1024*1024 )
+
+/* fragment size fed to the stream in buffered mode (input and output) */
+#define BUFFERED_CHUNK 997
+
+static void usage(char *arg0) {
+  fprintf(stderr,
+          "%s, FastLZ benchmark tool.\n"
+          "Usage: %s [options] [filename ..]\t#corpus files (synthetic data"
+          " if none)\n"
+          "\t[--lz4|--fastlz]\t#compression type (both)\n"
+          "\t[--level n]\t#compression level, may be repeated (1, 2, 9)\n"
+          "\t[--blocksize n]\t#block size, may be repeated (1KB .. 16MB)\n"
+          "\t[--threads n]\t#number of (de)compression threads (1)\n"
+          "\t[--iterations n]\t#runs of each test, the best is kept (3)\n"
+          "\t[--synthetic n]\t#also use n bytes of synthetic data (4MB)\n"
+          "\t[--buffered]\t#also measure buffered streams (small fragments)\n"
+          ,
+          arg0, arg0);
+}
+
+static void error(const char *msg) {
+  fprintf(stderr, "%s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static void syserror(const char *msg) {
+  const int e = errno;
+  fprintf(stderr, "%s: %s\n", msg, strerror(e));
+  exit(EXIT_FAILURE);
+}
+
+static void flzerror(zfast_stream *s, const char *msg) {
+  fprintf(stderr, "%s: %s\n", msg, s->msg != NULL ? s->msg : "unknown error");
+  exit(EXIT_FAILURE);
+}
+
+/* stream memory accounting (allocations are prefixed by their size) */
+typedef struct bench_memory {
+  pthread_mutex_t lock;
+  size_t current;
+  size_t peak;
+} bench_memory;
+
+static voidpf bench_zalloc(voidpf opaque, uInt items, uInt size) {
+  bench_memory *const mem = (bench_memory*) opaque;
+  const size_t bytes = (size_t) items*size;
+  size_t *const ptr = (size_t*) malloc(bytes + 16);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  *ptr = bytes;
+  pthread_mutex_lock(&mem->lock);
+  mem->current += bytes;
+  if (mem->current > mem->peak) {
+    mem->peak = mem->current;
+  }
+  pthread_mutex_unlock(&mem->lock);
+  return (char*) ptr + 16;
+}
+
+static void bench_zfree(voidpf opaque, voidpf address) {
+  bench_memory *const mem = (bench_memory*) opaque;
+  if (address != NULL) {
+    size_t *const ptr = (size_t*) ( (char*) address - 16 );
+    pthread_mutex_lock(&mem->lock);
+    mem->current -= *ptr;
+    pthread_mutex_unlock(&mem->lock);
+    free(ptr);
+  }
+}
+
+/* monotonic clock, in seconds */
+static double bench_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a data set */
+typedef struct bench_data {
+  char name[32];
+  Bytef *data;
+  size_t size;
+} bench_data;
+
+/* synthetic data of the given entropy (bytes uniformly distributed among
+   2^bits values) */
+static void bench_synthetic(bench_data *d, int bits, size_t size) {
+  unsigned int seed = 1;
+  size_t i;
+  d->data = malloc(size);
+  if (d->data == NULL) {
+    error("memory exhausted");
+  }
+  for(i = 0 ; i < size ; i++) {
+    seed = seed*1103515245U + 12345U;
+    d->data[i] = bits != 0 ? (Bytef) ( ( seed >> 16 ) & ( ( 1 << bits ) - 1 ) )
+      : 0;
+  }
+  d->size = size;
+  sprintf(d->name, "entropy-%d", bits);
+}
+
+static void bench_file(bench_data *d, const char *filename) {
+  FILE *const fp = fopen(filename, "rb");
+  const char *const base = strrchr(filename, '/');
+  long size;
+  if (fp == NULL) {
+    syserror("can not open input file");
+  }
+  if (fseek(fp, 0, SEEK_END) != 0 || ( size = ftell(fp) ) < 0
+      || fseek(fp, 0, SEEK_SET) != 0) {
+    syserror("can not read input file");
+  }
+  d->size = (size_t) size;
+  d->data = malloc(d->size + 1);
+  if (d->data == NULL) {
+    error("memory exhausted");
+  }
+  if (fread(d->data, 1, d->size, fp) != d->size) {
+    syserror("can not read input file");
+  }
+  fclose(fp);
+  snprintf(d->name, sizeof(d->name), "%s", base != NULL ? base + 1 : filename);
+}
+
+/* per-block latencies (seconds) */
+typedef struct bench_latency {
+  double *samples;
+  size_t count;
+  /* time accumulated for the block being processed */
+  double pending;
+} bench_latency;
+
+static int bench_compare(const void *a, const void *b) {
+  const double x = *(const double*) a;
+  const double y = *(const double*) b;
+  return x < y ? -1 : ( x > y ? 1 : 0 );
+}
+
+/* latency percentile, in microseconds */
+static double bench_percentile(bench_latency *lat, int percent) {
+  if (lat->count != 0) {
+    qsort(lat->samples, lat->count, sizeof(double), bench_compare);
+    return lat->samples[( lat->count - 1 )*percent / 100]*1e6;
+  }
+  return 0;
+}
+
+/* one test configuration */
+typedef struct bench_config {
+  zfast_stream_compressor type;
+  int level;
+  uInt block_size;
+  int nthreads;
+  int buffered;
+} bench_config;
+
+/* one test result */
+typedef struct bench_result {
+  double ctime;
+  double dtime;
+  size_t csize;
+  bench_latency clat;
+  bench_latency dlat;
+  size_t cpeak;
+  size_t dpeak;
+} bench_result;
+
+/* compress (or decompress) the whole input, feeding the stream with blocks
+   (direct mode) or small fragments (buffered mode) ; a block is completed
+   when total_in (compressing) or total_out (decompressing) reaches the next
+   block boundary */
+static size_t bench_stream(zfast_stream *s, const bench_config *conf,
+                           int compress, const Bytef *in, size_t in_size,
+                           Bytef *out, size_t out_size, bench_latency *lat) {
+  size_t in_offs = 0;
+  size_t out_offs = 0;
+  uLong next_block = conf->block_size;
+  int code;
+  lat->count = 0;
+  lat->pending = 0;
+  do {
+    const size_t in_chunk = conf->buffered ? BUFFERED_CHUNK
+      : ( compress ? conf->block_size : in_size - in_offs );
+    const size_t out_chunk = conf->buffered ? BUFFERED_CHUNK
+      : out_size - out_offs;
+    const int is_last = in_size - in_offs <= in_chunk;
+    double start;
+    s->next_in = (Bytef*) &in[in_offs];
+    s->avail_in = (uInt) ( is_last ? in_size - in_offs : in_chunk );
+    s->next_out = &out[out_offs];
+    s->avail_out = (uInt) ( out_size - out_offs < out_chunk
+                            ? out_size - out_offs : out_chunk );
+    start = bench_clock();
+    code = compress
+      ? fastlzlibCompress(s, is_last ? Z_FINISH : Z_NO_FLUSH)
+      : fastlzlibDecompress(s);
+    lat->pending += bench_clock() - start;
+    in_offs = s->next_in - in;
+    out_offs = s->next_out - out;
+    if (( compress ? s->total_in : s->total_out ) >= next_block
+        || code == Z_STREAM_END) {
+      lat->samples[lat->count++] = lat->pending;
+      lat->pending = 0;
+      next_block += conf->block_size;
+    }
+  } while(code == Z_OK || ( code == Z_BUF_ERROR && out_offs < out_size
+                            && in_offs < in_size ));
+  if (code != Z_STREAM_END) {
+    flzerror(s, compress ? "compression error" : "decompression error");
+  }
+  return out_offs;
+}
+
+static void bench_run(const bench_data *d, const bench_config *conf,
+                      int iterations, Bytef *cbuf, size_t cbuf_size,
+                      Bytef *dbuf, bench_result *r) {
+  bench_memory mem;
+  int it;
+  memset(&mem, 0, sizeof(mem));
+  pthread_mutex_init(&mem.lock, NULL);
+  r->ctime = r->dtime = 0;
+  for(it = 0 ; it < iterations ; it++) {
+    zfast_stream s;
+    double start, elapsed;
+    size_t dsize;
+
+    /* compress */
+    memset(&s, 0, sizeof(s));
+    s.zalloc = bench_zalloc;
+    s.zfree = bench_zfree;
+    s.opaque = &mem;
+    mem.peak = mem.current = 0;
+    start = bench_clock();
+    if (fastlzlibCompressInitMT(&s, conf->level, conf->block_size,
+                                conf->nthreads) != Z_OK
+        || fastlzlibSetCompressor(&s, conf->type) != Z_OK) {
+      flzerror(&s, "unable to initialize the compressor");
+    }
+    r->csize = bench_stream(&s, conf, 1, d->data, d->size, cbuf, cbuf_size,
+                            &r->clat);
+    fastlzlibCompressEnd(&s);
+    elapsed = bench_clock() - start;
+    if (it == 0 || elapsed < r->ctime) {
+      r->ctime = elapsed;
+    }
+    r->cpeak = mem.peak;
+
+    /* decompress */
+    memset(&s, 0, sizeof(s));
+    s.zalloc = bench_zalloc;
+    s.zfree = bench_zfree;
+    s.opaque = &mem;
+    mem.peak = mem.current = 0;
+    start = bench_clock();
+    if (fastlzlibDecompressInitMT(&s, conf->block_size,
+                                  conf->nthreads) != Z_OK
+        || fastlzlibSetCompressor(&s, conf->type) != Z_OK) {
+      flzerror(&s, "unable to initialize the decompressor");
+    }
+    dsize = bench_stream(&s, conf, 0, cbuf, r->csize, dbuf, d->size + 1,
+                         &r->dlat);
+    fastlzlibDecompressEnd(&s);
+    elapsed = bench_clock() - start;
+    if (it == 0 || elapsed < r->dtime) {
+      r->dtime = elapsed;
+    }
+    r->dpeak = mem.peak;
+
+    /* sanity check */
+    if (it == 0 && ( dsize != d->size
+                     || memcmp(dbuf, d->data, d->size) != 0 )) {
+      error("decompressed data differs from the original");
+    }
+  }
+  pthread_mutex_destroy(&mem.lock);
+}
+
+static double bench_speed(size_t size, double elapsed) {
+  return elapsed > 0 ? size / elapsed / 1e6 : 0;
+}
+
+int main(int argc, char **argv) {
+  bench_data data[MAX_ITEMS + 9];
+  int ndata = 0;
+  int types[2];
+  int ntypes = 0;
+  int levels[MAX_ITEMS];
+  int nlevels = 0;
+  uInt block_sizes[MAX_ITEMS];
+  int nblock_sizes = 0;
+  int nthreads = 1;
+  int iterations = 3;
+  size_t synthetic = 0;
+  int buffered = 0;
+  int i;
+
+  /* process args */
+  for(i = 1 ; i < argc ; i++) {
+    if (strcmp(argv[i], "--lz4") == 0 && ntypes < 2) {
+      types[ntypes++] = COMPRESSOR_LZ4;
+    }
+    else if (strcmp(argv[i], "--fastlz") == 0 && ntypes < 2) {
+      types[ntypes++] = COMPRESSOR_FASTLZ;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--level") == 0) {
+      if (nlevels == MAX_ITEMS
+          || sscanf(argv[i + 1], "%d", &levels[nlevels]) != 1) {
+        error("invalid level");
+      }
+      nlevels++;
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--blocksize") == 0) {
+      if (nblock_sizes == MAX_ITEMS
+          || sscanf(argv[i + 1], "%u", &block_sizes[nblock_sizes]) != 1) {
+        error("invalid size");
+      }
+      nblock_sizes++;
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--threads") == 0) {
+      if (sscanf(argv[i + 1], "%d", &nthreads) != 1 || nthreads <= 0) {
+        error("invalid number of threads");
+      }
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--iterations") == 0) {
+      if (sscanf(argv[i + 1], "%d", &iterations) != 1 || iterations <= 0) {
+        error("invalid number of iterations");
+      }
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--synthetic") == 0) {
+      unsigned long size;
+      if (sscanf(argv[i + 1], "%lu", &size) != 1 || size == 0) {
+        error("invalid size");
+      }
+      synthetic = size;
+      i++;
+    }
+    else if (strcmp(argv[i], "--buffered") == 0) {
+      buffered = 1;
+    }
+    else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else if (ndata < MAX_ITEMS) {
+      bench_file(&data[ndata++], argv[i]);
+    }
+    else {
+      error("too many files");
+    }
+  }
+
+  /* defaults */
+  if (ntypes == 0) {
+    types[ntypes++] = COMPRESSOR_LZ4;
+    types[ntypes++] = COMPRESSOR_FASTLZ;
+  }
+  if (nlevels == 0) {
+    levels[nlevels++] = 1;
+    levels[nlevels++] = 2;
+    levels[nlevels++] = Z_BEST_COMPRESSION;
+  }
+  if (nblock_sizes == 0) {
+    uInt size;
+    for(size = 1024 ; size <= 16*1024*1024 ; size *= 4) {
+      block_sizes[nblock_sizes++] = size;
+    }
+  }
+  if (ndata == 0 && synthetic == 0) {
+    synthetic = SYNTHETIC_SIZE;
+  }
+  if (synthetic != 0) {
+    int bits;
+    for(bits = 0 ; bits <= 8 ; bits += 2) {
+      bench_synthetic(&data[ndata++], bits, synthetic);
+    }
+  }
+
+  printf("%-16s %-6s %3s %8s %3s %-8s %6s %9s %9s %15s %15s %9s %9s\n",
+         "data", "type", "lvl", "block", "thr", "path", "ratio",
+         "comp MB/s", "dec MB/s", "comp p50/p99 us", "dec p50/p99 us",
+         "cmem KB", "dmem KB");
+
+  for(i = 0 ; i < ndata ; i++) {
+    const bench_data *const d = &data[i];
+    const size_t cbuf_size = (size_t) ( d->size + d->size / 8 ) + 1024*1024;
+    Bytef *const cbuf = malloc(cbuf_size);
+    Bytef *const dbuf = malloc(d->size + 1);
+    int t, l, b, p;
+    if (cbuf == NULL || dbuf == NULL) {
+      error("memory exhausted");
+    }
+    for(t = 0 ; t < ntypes ; t++) {
+      for(l = 0 ; l < nlevels ; l++) {
+        for(b = 0 ; b < nblock_sizes ; b++) {
+          for(p = 0 ; p <= buffered ; p++) {
+            const size_t nblocks = d->size / block_sizes[b] + 2;
+            bench_config conf;
+            bench_result r;
+            memset(&r, 0, sizeof(r));
+            conf.type = (zfast_stream_compressor) types[t];
+            conf.level = levels[l];
+            conf.block_size = block_sizes[b];
+            conf.nthreads = nthreads;
+            conf.buffered = p;
+            r.clat.samples = malloc(nblocks*sizeof(double));
+            r.dlat.samples = malloc(nblocks*sizeof(double));
+            if (r.clat.samples == NULL || r.dlat.samples == NULL) {
+              error("memory exhausted");
+            }
+            bench_run(d, &conf, iterations, cbuf, cbuf_size, dbuf, &r);
+            printf("%-16s %-6s %3d %8u %3d %-8s %6.3f %9.1f %9.1f"
+                   " %7.0f/%-7.0f %7.0f/%-7.0f %9lu %9lu\n",
+                   d->name, conf.type == COMPRESSOR_LZ4 ? "lz4" : "fastlz",
+                   conf.level, conf.block_size, conf.nthreads,
+                   conf.buffered ? "buffered" : "direct",
+                   d->size != 0 ? (double) r.csize / d->size : 0,
+                   bench_speed(d->size, r.ctime),
+                   bench_speed(d->size, r.dtime),
+                   bench_percentile(&r.clat, 50),
+                   bench_percentile(&r.clat, 99),
+                   bench_percentile(&r.dlat, 50),
+                   bench_percentile(&r.dlat, 99),
+                   (unsigned long) ( r.cpeak / 1024 ),
+                   (unsigned long) ( r.dpeak / 1024 ));
+            fflush(stdout);
+            free(r.clat.samples);
+            free(r.dlat.samples);
+          }
+        }
+      }
+    }
+    free(cbuf);
+    free(dbuf);
+  }
+
+  for(i = 0 ; i < ndata ; i++) {
+    free(data[i].data);
+  }
+  return EXIT_SUCCESS;
+}
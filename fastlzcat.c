@@ -28,12 +28,24 @@
 
 /* compress or uncompress streams */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* O_DIRECT */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include "fastlzlib.h"
 
+/* pipelined I/O (reader and writer threads) */
+#if !defined(_WIN32)
+#define FASTLZCAT_PIPELINE
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 static void usage(char *arg0) {
   fprintf(stderr,
           "%s, FastLZ compression/decompression tool.\n"
@@ -41,11 +53,27 @@ static void usage(char *arg0) {
           "\t[--output (filename|-)]\t#output filename or stdout\n"
           "\t[--compress|--decompress]\t#mode\n"
           "\t[--lz4|--fastlz]\t#compression type\n"
-          "\t[--fast|--normal]\t#compression speed\n"
+          "\t[--fast|--normal|--best]\t#compression speed\n"
           "\t[--inbufsize n]\t#input buffer size (262144)\n"
           "\t[--outbufsize n]\t#output buffer size (1048576)\n"
           "\t[--blocksize n]\t#block stream size (1048576)\n"
           "\t[--flush]\t#flush uncompressed data regularly\n"
+          "\t[--threads n]\t#number of (de)compression threads (1)\n"
+          "\t[--linked]\t#compress using previous blocks data (LZ4 only)\n"
+          "\t[--dictionary filename]\t#preset dictionary (LZ4 only)\n"
+          "\t[--index]\t#write a block index to allow seeking\n"
+          "\t[--checksum]\t#write block checksums\n"
+          "\t[--compact]\t#use compact block headers\n"
+          "\t[--compressor-id]\t#record the compression type in the stream\n"
+          "\t[--adaptive n]\t#skip incompressible blocks, target n MB/s\n"
+          "\t[--incompressible n]\t#skip blocks with less than n/1000 matches\n"
+          "\t[--table n]\t#LZ4 hash table of 2^n bytes (10 to 20)\n"
+          "\t[--offset n]\t#decompress from the uncompressed offset n\n"
+          "\t[--append]\t#append to the indexed output file (with --index)\n"
+          "\t[--pipeline]\t#read and write while (de)compressing\n"
+          "\t[--direct]\t#pipeline using direct I/O on files (O_DIRECT)\n"
+          "\t[-T n]\t#process up to n files concurrently\n"
+          "\t[--suffix s]\t#one output file per input, adding (or removing) s\n"
           ,
           arg0, arg0);
 }
@@ -66,6 +94,669 @@ static void flzerror(zfast_stream *s, const char *msg) {
   exit(EXIT_FAILURE);
 }
 
+/* stream settings, shared by all files */
+typedef struct cat_config {
+  int compress;
+  int flush;
+  zfast_stream_compressor type;
+  int perfs;
+  uInt block_size;
+  uInt inbufsize;
+  uInt outbufsize;
+  int nthreads;
+  int flags;
+  uInt speed;
+  uInt threshold;
+  int table_log;
+  /* preset dictionary, if any */
+  const Bytef *dict;
+  uInt dict_size;
+} cat_config;
+
+/* load the index trailer found at the end of a stream file */
+static zfast_index *index_load(FILE *fp) {
+  zfast_index *const index = fastlzlibIndexCreate();
+  Bytef tail[20];
+  Bytef *trailer;
+  uInt size;
+  if (index == NULL) {
+    error("memory exhausted");
+  }
+  if (fseek(fp, - (long) sizeof(tail), SEEK_END) != 0
+      || fread(tail, 1, sizeof(tail), fp) != sizeof(tail)) {
+    syserror("can not read the stream end");
+  }
+  if (fastlzlibGetIndexSize(tail, sizeof(tail), &size) != Z_OK
+      || ( trailer = malloc(size) ) == NULL
+      || fseek(fp, - (long) size, SEEK_END) != 0
+      || fread(trailer, 1, size, fp) != size
+      || fastlzlibIndexLoad(index, trailer, size) != Z_OK) {
+    error("no index found in the stream");
+  }
+  free(trailer);
+  return index;
+}
+
+/* initialize a stream using the command line settings */
+static void stream_init(zfast_stream *stream, const cat_config *cfg) {
+  memset(stream, 0, sizeof(*stream));
+    
+  if (cfg->compress) {
+    if (fastlzlibCompressInitMT(stream, cfg->perfs, cfg->block_size,
+                                cfg->nthreads) != Z_OK) {
+      flzerror(stream, "unable to initialize the compressor");
+    }
+  } else {
+    if (fastlzlibDecompressInitMT(stream, cfg->block_size,
+                                  cfg->nthreads) != Z_OK) {
+      flzerror(stream, "unable to initialize the uncompressor");
+    }
+  }
+
+  if (fastlzlibSetCompressor(stream, cfg->type) != Z_OK) {
+    flzerror(stream, "unable to initialize the specified compressor");
+  }
+
+  if (cfg->compress && fastlzlibSetFlags(stream, cfg->flags) != Z_OK) {
+    flzerror(stream, "unable to set the specified flags");
+  }
+
+  if (cfg->compress && fastlzlibSetTargetSpeed(stream, cfg->speed) != Z_OK) {
+    flzerror(stream, "unable to set the target speed");
+  }
+
+  if (cfg->compress
+      && fastlzlibSetIncompressibleThreshold(stream, cfg->threshold)
+      != Z_OK) {
+    flzerror(stream, "unable to set the incompressible threshold");
+  }
+
+  if (cfg->compress && cfg->table_log != 0
+      && fastlzlibSetHashTableSize(stream, cfg->table_log) != Z_OK) {
+    flzerror(stream, "unable to set the hash table size");
+  }
+
+  if (cfg->dict != NULL) {
+    const int success = cfg->compress
+      ? fastlzlibCompressSetDictionary(stream, cfg->dict, cfg->dict_size)
+      : fastlzlibDecompressSetDictionary(stream, cfg->dict, cfg->dict_size);
+    if (success != Z_OK) {
+      flzerror(stream, "unable to set the dictionary");
+    }
+  }
+}
+
+#ifdef FASTLZCAT_PIPELINE
+
+/* number of buffers of the read and write pipelines */
+#define PIPELINE_DEPTH 3
+
+/* buffers alignment (and I/O sizes granularity) for direct I/O */
+#define DIRECT_ALIGN 4096
+
+/* size rounded up to the direct I/O alignment */
+#define DIRECT_ROUND(SIZE)                                              \
+  ( (SIZE) + ( DIRECT_ALIGN - (SIZE) % DIRECT_ALIGN ) % DIRECT_ALIGN )
+
+/* buffer of a pipeline */
+typedef struct pipe_buffer {
+  Bytef *data;
+  size_t size;
+  /* last buffer */
+  int eof;
+} pipe_buffer;
+
+/* ring of buffers between an I/O thread and the main thread: buffers
+   [head .. head + count[ are filled, and owned by the consumer */
+typedef struct pipe_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pipe_buffer buffers[PIPELINE_DEPTH];
+  int head;
+  int count;
+  /* buffers capacity */
+  size_t capacity;
+  /* file, and its descriptor if using direct I/O (-1 otherwise) */
+  FILE *fp;
+  int fd;
+  /* flush the output after each buffer */
+  int flush;
+  pthread_t thread;
+} pipe_queue;
+
+static void *pipe_alloc(size_t size) {
+  void *ptr;
+  if (posix_memalign(&ptr, DIRECT_ALIGN, size) != 0) {
+    error("memory exhausted");
+  }
+  return ptr;
+}
+
+static void pipe_init(pipe_queue *q, size_t capacity) {
+  int i;
+  memset(q, 0, sizeof(*q));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  q->capacity = capacity;
+  q->fd = -1;
+  for(i = 0 ; i < PIPELINE_DEPTH ; i++) {
+    q->buffers[i].data = pipe_alloc(capacity);
+  }
+}
+
+static void pipe_free(pipe_queue *q) {
+  int i;
+  for(i = 0 ; i < PIPELINE_DEPTH ; i++) {
+    free(q->buffers[i].data);
+  }
+  pthread_cond_destroy(&q->cond);
+  pthread_mutex_destroy(&q->lock);
+}
+
+/* producer: wait for the next free buffer */
+static pipe_buffer *pipe_next_free(pipe_queue *q) {
+  pipe_buffer *b;
+  pthread_mutex_lock(&q->lock);
+  while(q->count == PIPELINE_DEPTH) {
+    pthread_cond_wait(&q->cond, &q->lock);
+  }
+  b = &q->buffers[( q->head + q->count ) % PIPELINE_DEPTH];
+  pthread_mutex_unlock(&q->lock);
+  return b;
+}
+
+/* producer: hand the buffer returned by pipe_next_free() to the consumer */
+static void pipe_push(pipe_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  q->count++;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* consumer: wait for the next filled buffer */
+static pipe_buffer *pipe_next(pipe_queue *q) {
+  pipe_buffer *b;
+  pthread_mutex_lock(&q->lock);
+  while(q->count == 0) {
+    pthread_cond_wait(&q->cond, &q->lock);
+  }
+  b = &q->buffers[q->head];
+  pthread_mutex_unlock(&q->lock);
+  return b;
+}
+
+/* consumer: release the buffer returned by pipe_next() */
+static void pipe_pop(pipe_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  q->head = ( q->head + 1 ) % PIPELINE_DEPTH;
+  q->count--;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* reader thread: fill buffers until the end of the input */
+static void *pipe_reader(void *arg) {
+  pipe_queue *const q = (pipe_queue*) arg;
+  int eof;
+  do {
+    pipe_buffer *const b = pipe_next_free(q);
+    if (q->fd != -1) {
+      /* a short direct read is the end of the file (the next read would not
+         be aligned anyway) */
+      ssize_t n;
+      for(b->size = 0 ; b->size < q->capacity ; b->size += n) {
+        n = read(q->fd, &b->data[b->size], q->capacity - b->size);
+        if (n < 0) {
+          syserror("read error");
+        } else if (n == 0) {
+          break;
+        } else if ((size_t) n < q->capacity - b->size) {
+          b->size += n;
+          break;
+        }
+      }
+      eof = b->size < q->capacity;
+    } else {
+      b->size = fread(b->data, 1, q->capacity, q->fp);
+      if (ferror(q->fp)) {
+        syserror("read error");
+      }
+      eof = feof(q->fp);
+    }
+    b->eof = eof;
+    pipe_push(q);
+  } while(!eof);
+  return NULL;
+}
+
+/* write all bytes to a file descriptor */
+static void pipe_write_fd(int fd, const Bytef *data, size_t size) {
+  while(size != 0) {
+    const ssize_t n = write(fd, data, size);
+    if (n <= 0) {
+      syserror("write error");
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+/* writer thread: write buffers until the last one ; direct I/O writes are
+   staged so that all writes but the last one are aligned */
+static void *pipe_writer(void *arg) {
+  pipe_queue *const q = (pipe_queue*) arg;
+  Bytef *const stage = q->fd != -1 ? pipe_alloc(q->capacity) : NULL;
+  size_t staged = 0;
+  int eof;
+  do {
+    pipe_buffer *const b = pipe_next(q);
+    if (q->fd != -1) {
+      size_t offs, len;
+      for(offs = 0 ; offs < b->size ; offs += len) {
+        len = b->size - offs < q->capacity - staged
+          ? b->size - offs : q->capacity - staged;
+        memcpy(&stage[staged], &b->data[offs], len);
+        staged += len;
+        if (staged == q->capacity) {
+          pipe_write_fd(q->fd, stage, staged);
+          staged = 0;
+        }
+      }
+    } else if (b->size != 0
+               && ( fwrite(b->data, 1, b->size, q->fp) != b->size
+                    || ( q->flush && fflush(q->fp) != 0 ) ) ) {
+      syserror("write error");
+    }
+    eof = b->eof;
+    pipe_pop(q);
+  } while(!eof);
+  /* unaligned tail */
+  if (q->fd != -1) {
+    const size_t aligned = staged - staged % DIRECT_ALIGN;
+    pipe_write_fd(q->fd, stage, aligned);
+    if (staged != aligned) {
+      if (fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL) & ~O_DIRECT) != 0) {
+        syserror("write error");
+      }
+      pipe_write_fd(q->fd, &stage[aligned], staged - aligned);
+    }
+    free(stage);
+  }
+  return NULL;
+}
+
+#endif
+
+/* input and output of cat_process(): files and buffers, or the pipelined
+   reader and writer threads (if not NULL) */
+typedef struct cat_io {
+  FILE *instream;
+  /* no output if NULL */
+  FILE *outstream;
+  Bytef *buf;
+  Bytef *dest;
+#ifdef FASTLZCAT_PIPELINE
+  pipe_queue *reader;
+  pipe_queue *writer;
+#endif
+} cat_io;
+
+/* (de)compress a whole input into the output */
+static void cat_process(zfast_stream *stream, const cat_config *cfg,
+                        const cat_io *io) {
+  int is_eof = 0;
+  while(!is_eof) {
+    Bytef *buf = io->buf;
+    size_t n;
+    int success;
+#ifdef FASTLZCAT_PIPELINE
+    if (io->reader != NULL) {
+      const pipe_buffer *const b = pipe_next(io->reader);
+      buf = b->data;
+      n = b->size;
+      is_eof = b->eof;
+    } else
+#endif
+    {
+      n = fread(buf, 1, cfg->inbufsize, io->instream);
+      if (ferror(io->instream)) {
+        syserror("read error");
+      }
+      is_eof = feof(io->instream);
+    }
+    stream->next_in = buf;
+    stream->avail_in = (uInt) n;
+    do {
+      Bytef *dest = io->dest;
+#ifdef FASTLZCAT_PIPELINE
+      if (io->writer != NULL) {
+        dest = pipe_next_free(io->writer)->data;
+      }
+#endif
+      stream->next_out = dest;
+      stream->avail_out = cfg->outbufsize;
+      if (cfg->compress) {
+        success = fastlzlibCompress(stream,
+                                    is_eof ? Z_FINISH
+                                    : ( cfg->flush
+                                        ? Z_SYNC_FLUSH
+                                        : Z_NO_FLUSH )
+                                    );
+      } else {
+        success = fastlzlibDecompress(stream);
+      }
+
+      if (success == Z_STREAM_END) {
+        if (stream->avail_in > 0 || !is_eof) {
+          error("premature EOF before end of stream");
+        }
+      }
+
+      if (io->outstream != NULL && stream->next_out != dest) {
+        const size_t len = stream->next_out - dest;
+#ifdef FASTLZCAT_PIPELINE
+        if (io->writer != NULL) {
+          pipe_buffer *const b = pipe_next_free(io->writer);
+          b->size = len;
+          b->eof = 0;
+          pipe_push(io->writer);
+        } else
+#endif
+        if (fwrite(dest, 1, len, io->outstream) != len
+            || ( cfg->flush && fflush(io->outstream) != 0 ) ) {
+          syserror("write error");
+        }
+      }
+    } while(success == Z_OK);
+
+    /* Z_BUF_ERROR means that we need to feed more */
+    if (success == Z_BUF_ERROR) {
+      if (is_eof && stream->avail_out != 0) {
+        error("premature end of stream");
+      }
+    }
+    else if (success == Z_NEED_DICT) {
+      error("missing or incorrect dictionary");
+    }
+    else if (success < 0) {
+      flzerror(stream, "stream error");
+    }
+
+#ifdef FASTLZCAT_PIPELINE
+    if (io->reader != NULL) {
+      pipe_pop(io->reader);
+    }
+#endif
+  }
+}
+
+/* list mode: scan the block headers of a stream, without processing it
+   ("buf" holds a header, "dest" is used to skip data on stdin) */
+static void cat_list(FILE *instream, Bytef *buf, Bytef *dest,
+                     uInt outbufsize) {
+  const uInt inbufsize = fastlzlibGetHeaderSize();
+  uLong total_out = 0;
+  uLong total_in = 0;
+  int is_eof = 0;
+  while(!is_eof) {
+    /* next block */
+    const size_t n = fread(buf, 1, inbufsize, instream);
+    uInt compressed_size;
+    uInt uncompressed_size;
+    if (ferror(instream)) {
+      syserror("read error");
+    }
+    is_eof = feof(instream);
+    if (n != inbufsize) {
+      error("truncated input");
+    }
+    if (fastlzlibGetStreamInfo(buf, n, &compressed_size,
+                              &uncompressed_size) != Z_OK) {
+      error("stream read error");
+    }
+    fprintf(stdout, "%s block at %u ([%u .. %u[):"
+            "\tcompressed=%u\tuncompressed=%u"
+            "\t[block_size=%u]\n",
+            compressed_size != uncompressed_size 
+            ? "compressed" : "uncompressed",
+            (int) total_in,
+            (int) total_out,
+            (int) ( total_out + uncompressed_size ),
+            (int) compressed_size,
+            (int) uncompressed_size,
+            fastlzlibGetStreamBlockSize(buf, n));
+
+    /* check eof consistency */
+    if (compressed_size == 0 && uncompressed_size == 0) {
+      int n = fread(buf, 1, 1, instream);
+      const int is_eof = feof(instream);
+      if (n != 0 || !is_eof) {
+        error("premature EOF before end of stream");
+      }
+    }
+    else if (is_eof) {
+      error("premature end of stream");
+    }
+    
+    /* skip compressed data */
+    if (fseek(instream, compressed_size, SEEK_CUR) != 0) {
+      if (errno == EBADF) {
+        /* fseek() on stdin */
+        int skip, n;
+        for(skip = compressed_size
+              ; skip > 0
+              && ( n = fread(dest, 1, outbufsize, instream) ) > 0
+              ; skip -= n) ;
+        if (skip != 0) {
+          syserror("seek error");
+        }
+      } else {
+        syserror("seek error");
+      }
+    }
+    total_in += n + compressed_size;
+    total_out += uncompressed_size;
+  }
+}
+
+#ifdef FASTLZCAT_PIPELINE
+
+/* a file of the parallel mode */
+typedef struct cat_job {
+  const char *filename;
+  /* temporary output, to be appended to the concatenated output in order */
+  FILE *tmp;
+  int done;
+} cat_job;
+
+/* files of the parallel mode, picked in order by worker threads as soon as
+   they are idle (so that uneven file sizes are balanced) */
+typedef struct cat_jobs {
+  pthread_mutex_t lock;
+  const cat_config *cfg;
+  cat_job *jobs;
+  int njobs;
+  /* next file to be picked */
+  int next;
+  /* next file to be appended to the concatenated output, and whether a
+     thread is appending files */
+  int written;
+  int appending;
+  /* concatenated output, or NULL */
+  FILE *outstream;
+  /* suffix of per-file outputs, or NULL */
+  const char *suffix;
+} cat_jobs;
+
+/* append done files to the concatenated output, in order ; a single thread
+   appends at a time, and copies without holding the lock (the files done
+   meanwhile are appended by the same thread) */
+static void cat_jobs_flush(cat_jobs *q, Bytef *dest) {
+  pthread_mutex_lock(&q->lock);
+  if (q->appending) {
+    pthread_mutex_unlock(&q->lock);
+    return;
+  }
+  q->appending = 1;
+  while(q->written < q->njobs && q->jobs[q->written].done) {
+    FILE *const tmp = q->jobs[q->written].tmp;
+    size_t n;
+    pthread_mutex_unlock(&q->lock);
+    rewind(tmp);
+    while(( n = fread(dest, 1, q->cfg->outbufsize, tmp) ) != 0) {
+      if (fwrite(dest, 1, n, q->outstream) != n) {
+        syserror("write error");
+      }
+    }
+    if (ferror(tmp)) {
+      syserror("read error");
+    }
+    fclose(tmp);
+    pthread_mutex_lock(&q->lock);
+    q->written++;
+  }
+  q->appending = 0;
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* output filename of a per-file output */
+static char *cat_output_name(const char *filename, const char *suffix,
+                             int compress) {
+  const size_t len = strlen(filename);
+  const size_t slen = strlen(suffix);
+  char *const name = malloc(len + slen + 1);
+  if (name == NULL) {
+    error("memory exhausted");
+  }
+  if (compress) {
+    memcpy(name, filename, len);
+    memcpy(&name[len], suffix, slen + 1);
+  } else if (len > slen && strcmp(&filename[len - slen], suffix) == 0) {
+    memcpy(name, filename, len - slen);
+    name[len - slen] = '\0';
+  } else {
+    fprintf(stderr, "%s: unknown suffix\n", filename);
+    exit(EXIT_FAILURE);
+  }
+  return name;
+}
+
+/* worker thread of the parallel mode, using its own stream */
+static void *cat_worker(void *arg) {
+  cat_jobs *const q = (cat_jobs*) arg;
+  Bytef *const buf = malloc(q->cfg->inbufsize);
+  Bytef *const dest = malloc(q->cfg->outbufsize);
+  zfast_stream stream;
+  cat_io io;
+  if (buf == NULL || dest == NULL) {
+    error("memory exhausted");
+  }
+  stream_init(&stream, q->cfg);
+  io.buf = buf;
+  io.dest = dest;
+  io.reader = NULL;
+  io.writer = NULL;
+  for(;;) {
+    cat_job *job;
+    FILE *instream;
+    FILE *outstream = NULL;
+    pthread_mutex_lock(&q->lock);
+    job = q->next < q->njobs ? &q->jobs[q->next++] : NULL;
+    pthread_mutex_unlock(&q->lock);
+    if (job == NULL) {
+      break;
+    }
+    instream = strcmp(job->filename, "-") == 0
+      ? stdin : fopen(job->filename, "rb");
+    if (instream == NULL) {
+      syserror("can not open input file");
+    }
+    if (q->outstream != NULL) {
+      outstream = tmpfile();
+      if (outstream == NULL) {
+        syserror("can not create temporary file");
+      }
+    } else if (q->suffix != NULL) {
+      char *const name = cat_output_name(job->filename, q->suffix,
+                                         q->cfg->compress);
+      outstream = fopen(name, "wb");
+      if (outstream == NULL) {
+        syserror("can not open output file");
+      }
+      free(name);
+    }
+    io.instream = instream;
+    io.outstream = outstream;
+    cat_process(&stream, q->cfg, &io);
+    fastlzlibReset(&stream);
+    stream.total_in = stream.total_out = 0;
+    if (instream != stdin) {
+      fclose(instream);
+    }
+    if (q->outstream != NULL) {
+      pthread_mutex_lock(&q->lock);
+      job->tmp = outstream;
+      job->done = 1;
+      pthread_mutex_unlock(&q->lock);
+      cat_jobs_flush(q, dest);
+    } else if (outstream != NULL && fclose(outstream) != 0) {
+      syserror("write error");
+    }
+  }
+  fastlzlibEnd(&stream);
+  free(buf);
+  free(dest);
+  return NULL;
+}
+
+/* parallel mode: process files concurrently using "nworkers" threads,
+   into a concatenated output (in order) or per-file outputs */
+static void cat_parallel(const cat_config *cfg, char **argv,
+                         const int *files, int nfiles, int nworkers,
+                         const char *output, const char *suffix) {
+  pthread_t *const threads = malloc(sizeof(pthread_t) * nworkers);
+  cat_jobs q;
+  int i;
+  memset(&q, 0, sizeof(q));
+  pthread_mutex_init(&q.lock, NULL);
+  q.cfg = cfg;
+  q.jobs = calloc(nfiles, sizeof(cat_job));
+  q.njobs = nfiles;
+  q.suffix = suffix;
+  if (threads == NULL || q.jobs == NULL) {
+    error("memory exhausted");
+  }
+  for(i = 0 ; i < nfiles ; i++) {
+    q.jobs[i].filename = argv[files[i]];
+  }
+  if (output != NULL) {
+    q.outstream = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+    if (q.outstream == NULL) {
+      syserror("can not open output file");
+    }
+  }
+  if (nworkers > nfiles) {
+    nworkers = nfiles;
+  }
+  for(i = 0 ; i < nworkers ; i++) {
+    if (pthread_create(&threads[i], NULL, cat_worker, &q) != 0) {
+      error("unable to create a worker thread");
+    }
+  }
+  for(i = 0 ; i < nworkers ; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (q.outstream != NULL && q.outstream != stdout
+      && fclose(q.outstream) != 0) {
+    syserror("write error");
+  }
+  pthread_mutex_destroy(&q.lock);
+  free(q.jobs);
+  free(threads);
+}
+
+#endif
+
 int main(int argc, char **argv) {
   int *files = malloc(sizeof(int) * argc);
   int nfiles = 0;
@@ -78,6 +769,20 @@ int main(int argc, char **argv) {
   uInt block_size = 262144;
   uInt inbufsize = 1048576;
   uInt outbufsize = 1048576;
+  int nthreads = 1;
+  int flags = 0;
+  const char *dictionary = NULL;
+  long offset = -1;
+  uInt speed = 0;
+  uInt threshold = 16;
+  int table_log = 0;
+  int pipeline = 0;
+  int direct = 0;
+  int append = 0;
+  int njobs = 0;
+  const char *suffix = NULL;
+  Bytef *dict = NULL;
+  cat_config cfg;
   int i;
 
   /* process args */
@@ -97,6 +802,36 @@ int main(int argc, char **argv) {
     else if (strcmp(argv[i], "--flush") == 0) {
       flush = 1;
     }
+    else if (strcmp(argv[i], "--linked") == 0) {
+      flags |= ZFAST_FLAG_LINKED_BLOCKS;
+    }
+    else if (strcmp(argv[i], "--index") == 0) {
+      flags |= ZFAST_FLAG_INDEX;
+    }
+    else if (strcmp(argv[i], "--checksum") == 0) {
+      flags |= ZFAST_FLAG_CHECKSUM;
+    }
+    else if (strcmp(argv[i], "--compact") == 0) {
+      flags |= ZFAST_FLAG_COMPACT_HEADERS;
+    }
+    else if (strcmp(argv[i], "--compressor-id") == 0) {
+      flags |= ZFAST_FLAG_COMPRESSOR_ID;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--offset") == 0) {
+      if (sscanf(argv[i + 1], "%ld", &offset) != 1 || offset < 0) {
+        error("invalid offset");
+      }
+      i++;
+    }
+    else if (strcmp(argv[i], "--pipeline") == 0) {
+      pipeline = 1;
+    }
+    else if (strcmp(argv[i], "--append") == 0) {
+      append = 1;
+    }
+    else if (strcmp(argv[i], "--direct") == 0) {
+      pipeline = direct = 1;
+    }
     else if (strcmp(argv[i], "--lz4") == 0) {
       type = COMPRESSOR_LZ4;
     }
@@ -109,6 +844,31 @@ int main(int argc, char **argv) {
     else if (strcmp(argv[i], "--normal") == 0) {
       perfs = 2;
     }
+    else if (strcmp(argv[i], "--best") == 0) {
+      perfs = Z_BEST_COMPRESSION;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--adaptive") == 0) {
+      if (sscanf(argv[i + 1], "%u", &speed) != 1) {
+        error("invalid speed");
+      }
+      flags |= ZFAST_FLAG_ADAPTIVE;
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--incompressible") == 0) {
+      if (sscanf(argv[i + 1], "%u", &threshold) != 1 || threshold > 1000) {
+        error("invalid threshold");
+      }
+      flags |= ZFAST_FLAG_SKIP_INCOMPRESSIBLE;
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--table") == 0) {
+      if (sscanf(argv[i + 1], "%d", &table_log) != 1
+          || table_log < ZFAST_TABLE_LOG_MIN
+          || table_log > ZFAST_TABLE_LOG_MAX) {
+        error("invalid table size");
+      }
+      i++;
+    }
     else if (i + 1 < argc && strcmp(argv[i], "--inbufsize") == 0) {
       int size;
       if (sscanf(argv[i + 1], "%d", &size) == 1) {
@@ -136,6 +896,29 @@ int main(int argc, char **argv) {
       }
       i++;
     }
+    else if (i + 1 < argc && strcmp(argv[i], "--dictionary") == 0) {
+      dictionary = argv[i + 1];
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "-T") == 0) {
+      if (sscanf(argv[i + 1], "%d", &njobs) != 1 || njobs <= 0) {
+        error("invalid number of jobs");
+      }
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--suffix") == 0) {
+      suffix = argv[i + 1];
+      if (suffix[0] == '\0') {
+        error("invalid suffix");
+      }
+      i++;
+    }
+    else if (i + 1 < argc && strcmp(argv[i], "--threads") == 0) {
+      if (sscanf(argv[i + 1], "%d", &nthreads) != 1 || nthreads <= 0) {
+        error("invalid number of threads");
+      }
+      i++;
+    }
     else if (strcmp(argv[i], "-c") == 0
              || strcmp(argv[i], "--stdout") == 0
              || strcmp(argv[i], "--to-stdout") == 0) {
@@ -170,35 +953,125 @@ int main(int argc, char **argv) {
     output = NULL;
   }
 
+  /* pipelined I/O */
+#ifdef FASTLZCAT_PIPELINE
+#ifndef O_DIRECT
+  if (direct) {
+    error("direct I/O is not supported on this system");
+  }
+#endif
+  if (pipeline && list) {
+    error("--pipeline can not be used with --list");
+  }
+  if (direct && offset >= 0) {
+    error("--direct can not be used with --offset");
+  }
+  /* direct I/O sizes are multiple of the alignment */
+  if (direct) {
+    inbufsize = DIRECT_ROUND(inbufsize);
+  }
+  /* parallel mode: files are processed by independent streams */
+  if (njobs != 0 && ( list || pipeline || offset >= 0 )) {
+    error("-T can not be used with --list, --pipeline or --offset");
+  }
+#else
+  if (pipeline) {
+    error("pipelined I/O is not supported on this system");
+  }
+  if (njobs != 0) {
+    error("parallel mode is not supported on this system");
+  }
+#endif
+  if (suffix != NULL && ( njobs == 0 || output != NULL )) {
+    error("--suffix requires -T, and can not be used with --output");
+  }
+  if (append && ( !compress || ( flags & ZFAST_FLAG_INDEX ) == 0
+                  || output == NULL || strcmp(output, "-") == 0
+                  || nfiles != 1 || njobs != 0 || direct )) {
+    error("--append requires --compress, --index, a single input and an "
+          "output file, and can not be used with -T or --direct");
+  }
+
+  cfg.compress = compress;
+  cfg.flush = flush;
+  cfg.type = type;
+  cfg.perfs = perfs;
+  cfg.block_size = block_size;
+  cfg.inbufsize = inbufsize;
+  cfg.outbufsize = outbufsize;
+  cfg.nthreads = nthreads;
+  cfg.flags = flags;
+  cfg.speed = speed;
+  cfg.threshold = threshold;
+  cfg.table_log = table_log;
+  cfg.dict = NULL;
+  cfg.dict_size = 0;
+
+  if (dictionary != NULL && nfiles != 0) {
+    FILE *const fp = fopen(dictionary, "rb");
+    dict = malloc(65536);
+    if (fp == NULL) {
+      syserror("can not open dictionary file");
+    }
+    /* use the last 64KB */
+    if (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) > 65536) {
+      fseek(fp, -65536, SEEK_END);
+    } else {
+      fseek(fp, 0, SEEK_SET);
+    }
+    cfg.dict_size = (uInt) fread(dict, 1, 65536, fp);
+    if (ferror(fp)) {
+      syserror("can not read dictionary file");
+    }
+    fclose(fp);
+    cfg.dict = dict;
+  }
+
+#ifdef FASTLZCAT_PIPELINE
+  if (njobs != 0 && nfiles != 0) {
+    cat_parallel(&cfg, argv, files, nfiles, njobs, output, suffix);
+  } else
+#endif
+
   /* rock'in */
   if (nfiles != 0) {
     FILE *outstream = NULL;
     int closeoutstream = 0;
-    Bytef *buf = malloc(inbufsize);
-    Bytef *dest = malloc(outbufsize);
+    Bytef *const inbuf = malloc(inbufsize);
+    Bytef *const outbuf = malloc(outbufsize);
     int i;
     zfast_stream stream;
-    memset(&stream, 0, sizeof(stream));
-    
-    if (compress) {
-      if (fastlzlibCompressInit2(&stream, perfs, block_size) != Z_OK) {
-        flzerror(&stream, "unable to initialize the compressor");
-      }
-    } else {
-      if (fastlzlibDecompressInit2(&stream, block_size) != Z_OK) {
-        flzerror(&stream, "unable to initialize the uncompressor");
-      }
-    }
-
-    if (fastlzlibSetCompressor(&stream, type) != Z_OK) {
-      flzerror(&stream, "unable to initialize the specified compressor");
-    }
+#ifdef FASTLZCAT_PIPELINE
+    pipe_queue reader;
+    pipe_queue writer;
+    int writing = 0;
+#endif
+    stream_init(&stream, &cfg);
 
     if (output != NULL) {
       if (strcmp(output, "-") == 0) {
         outstream = stdout;
         closeoutstream = 0;
       } else {
+#if defined(FASTLZCAT_PIPELINE) && defined(O_DIRECT)
+        if (direct) {
+          const int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,
+                              0666);
+          outstream = fd != -1 ? fdopen(fd, "wb") : NULL;
+        } else
+#endif
+        /* append to an existing stream, if any */
+        if (append && ( outstream = fopen(output, "r+b") ) != NULL) {
+          zfast_index *const index = index_load(outstream);
+          zfast_uint64 position;
+          if (fastlzlibCompressAppend(&stream, index, &position) != Z_OK) {
+            flzerror(&stream, "unable to append to the output file");
+          }
+          if (fseek(outstream, (long) position, SEEK_SET) != 0) {
+            syserror("seek error");
+          }
+          fastlzlibIndexFree(index);
+        } else
         outstream = fopen(output, "wb");
         if (outstream == NULL) {
           syserror("can not open output file");
@@ -206,19 +1079,39 @@ int main(int argc, char **argv) {
         closeoutstream = 1;
       }
     }
+
+#ifdef FASTLZCAT_PIPELINE
+    if (pipeline) {
+      pipe_init(&reader, inbufsize);
+      if (outstream != NULL) {
+        pipe_init(&writer, DIRECT_ROUND(outbufsize));
+        writer.fp = outstream;
+        writer.fd = direct && closeoutstream ? fileno(outstream) : -1;
+        writer.flush = flush;
+        if (pthread_create(&writer.thread, NULL, pipe_writer, &writer) != 0) {
+          error("unable to create the writer thread");
+        }
+        writing = 1;
+      }
+    }
+#endif
     
     for(i = 0 ; i < nfiles ; i++, fastlzlibReset(&stream),
           stream.total_in = stream.total_out = 0) {
       FILE *instream;
       int closeinstream;
       const char*const filename = argv[files[i]];
-      uLong total_out = 0;
-      uLong total_in = 0;
      
       if (strcmp(filename, "-") == 0) {
         instream = stdin;
         closeinstream = 0;
       } else {
+#if defined(FASTLZCAT_PIPELINE) && defined(O_DIRECT)
+        if (direct) {
+          const int fd = open(filename, O_RDONLY | O_DIRECT);
+          instream = fd != -1 ? fdopen(fd, "rb") : NULL;
+        } else
+#endif
         instream = fopen(filename, "rb");
         if (instream == NULL) {
           syserror("can not open input file");
@@ -226,119 +1119,46 @@ int main(int argc, char **argv) {
         closeinstream = 1;
       }
 
-      if (instream != NULL) {
-        while(!feof(instream)) {
-          int n = fread(buf, 1, inbufsize, instream);
-          const int is_eof = feof(instream);
-          if (n >= 0) {
-
-            /* list mode (scan stream without reading/processing) */
-            if (list) {
-              /* next block */
-              uInt compressed_size;
-              uInt uncompressed_size;
-              if (n != (int) inbufsize) {
-                error("truncated input");
-              }
-              if (fastlzlibGetStreamInfo(buf, n, &compressed_size,
-                                        &uncompressed_size) != Z_OK) {
-                error("stream read error");
-              }
-              fprintf(stdout, "%s block at %u ([%u .. %u[):"
-                      "\tcompressed=%u\tuncompressed=%u"
-                      "\t[block_size=%u]\n",
-                      compressed_size != uncompressed_size 
-                      ? "compressed" : "uncompressed",
-                      (int) total_in,
-                      (int) total_out,
-                      (int) ( total_out + uncompressed_size ),
-                      (int) compressed_size,
-                      (int) uncompressed_size,
-                      fastlzlibGetStreamBlockSize(buf, n));
-
-              /* check eof consistency */
-              if (compressed_size == 0 && uncompressed_size == 0) {
-                int n = fread(buf, 1, 1, instream);
-                const int is_eof = feof(instream);
-                if (n != 0 || !is_eof) {
-                  error("premature EOF before end of stream");
-                }
-              }
-              else if (is_eof) {
-                error("premature end of stream");
-              }
-              
-              /* skip compressed data */
-              if (fseek(instream, compressed_size, SEEK_CUR) != 0) {
-                if (errno == EBADF) {
-                  /* fseek() on stdin */
-                  int skip, n;
-                  for(skip = compressed_size
-                        ; skip > 0
-                        && ( n = fread(dest, 1, outbufsize, instream) ) > 0
-                        ; skip -= n) ;
-                  if (skip != 0) {
-                    syserror("seek error");
-                  }
-                } else {
-                  syserror("seek error");
-                }
-              }
-              total_in += n + compressed_size;
-              total_out += uncompressed_size;
-            }
+      /* seek using the index trailer */
+      if (offset >= 0 && !compress && !list) {
+        zfast_index *const index = index_load(instream);
+        zfast_uint64 position;
+        if (fastlzlibSeek(&stream, index, offset, &position) != Z_OK) {
+          flzerror(&stream, "unable to seek");
+        }
+        if (fseek(instream, (long) position, SEEK_SET) != 0) {
+          syserror("seek error");
+        }
+        fastlzlibIndexFree(index);
+      }
 
-            /* compress/uncompress mode */
-            else {
-              int success;
-              stream.next_in = buf;
-              stream.avail_in = n;
-              do {
-                stream.next_out = dest;
-                stream.avail_out = outbufsize;
-                if (compress) {
-                  success = fastlzlibCompress(&stream,
-                                              is_eof ? Z_FINISH
-                                              : ( flush
-                                                  ? Z_SYNC_FLUSH
-                                                  : Z_NO_FLUSH )
-                                              );
-                } else {
-                  success = fastlzlibDecompress(&stream);
-                }
-
-                if (success == Z_STREAM_END) {
-                  if (stream.avail_in > 0 || !is_eof) {
-                    error("premature EOF before end of stream");
-                  }
-                }
-              
-                if (outstream != NULL && stream.next_out != dest) {
-                  const size_t len = stream.next_out - dest;
-                  if (len > 0) {
-                    if (fwrite(dest, 1, len, outstream) != len
-                        || ( flush && fflush(outstream) != 0 ) ) {
-                      syserror("write error");
-                    }
-                  }
-                }
-              } while(success == Z_OK);
-
-              /* Z_BUF_ERROR means that we need to feed more */
-              if (success == Z_BUF_ERROR) {
-                if (is_eof && stream.avail_out != 0) {
-                  error("premature end of stream");
-                }
-              }
-              else if (success < 0) {
-                flzerror(&stream, "stream error");
-              }
-             
+      if (instream != NULL) {
+        if (list) {
+          cat_list(instream, inbuf, outbuf, outbufsize);
+        } else {
+          cat_io io;
+          io.instream = instream;
+          io.outstream = outstream;
+          io.buf = inbuf;
+          io.dest = outbuf;
+#ifdef FASTLZCAT_PIPELINE
+          io.reader = pipeline ? &reader : NULL;
+          io.writer = writing ? &writer : NULL;
+          if (pipeline) {
+            reader.fp = instream;
+            reader.fd = direct && closeinstream ? fileno(instream) : -1;
+            if (pthread_create(&reader.thread, NULL, pipe_reader,
+                               &reader) != 0) {
+              error("unable to create the reader thread");
             }
-            
-          } else if (n < 0) {
-            syserror("read error");
           }
+#endif
+          cat_process(&stream, &cfg, &io);
+#ifdef FASTLZCAT_PIPELINE
+          if (pipeline) {
+            pthread_join(reader.thread, NULL);
+          }
+#endif
         }
         
         if (closeinstream && instream != NULL) {
@@ -351,17 +1171,31 @@ int main(int argc, char **argv) {
     }
 
     /* cleanup */
+#ifdef FASTLZCAT_PIPELINE
+    if (writing) {
+      pipe_buffer *const b = pipe_next_free(&writer);
+      b->size = 0;
+      b->eof = 1;
+      pipe_push(&writer);
+      pthread_join(writer.thread, NULL);
+      pipe_free(&writer);
+    }
+    if (pipeline) {
+      pipe_free(&reader);
+    }
+#endif
     if (closeoutstream && outstream != NULL) {
       fclose(outstream);
     }
     fastlzlibEnd(&stream);
-    free(buf);
-    free(dest);
+    free(inbuf);
+    free(outbuf);
   } else {
     usage(argv[0]);
     return EXIT_FAILURE;
   }
 
+  free(dict);
   free(files);
   return EXIT_SUCCESS;
 }
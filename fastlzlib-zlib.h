@@ -43,12 +43,13 @@
 #define deflateReset fastlzlibCompressReset
 #define inflateSync  fastlzlibDecompressSync
 #define inflateReset fastlzlibDecompressReset
+#define deflateSetDictionary fastlzlibCompressSetDictionary
+#define inflateSetDictionary fastlzlibDecompressSetDictionary
 
 /*
   Undefined symbols:
   
   deflateInit2
-  deflateSetDictionary
   deflateCopy
   deflateParams
   deflateTune
@@ -56,7 +57,6 @@
   deflatePrime
   deflateSetHeader
   inflateInit2
-  inflateSetDictionary
   inflateCopy
   inflatePrime
   inflateGetHeader
@@ -42,10 +42,45 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 
 #include "fastlzlib.h"
 
+/* use worker threads */
+#ifdef ZFAST_USE_THREADS
+#include <pthread.h>
+#endif
+
+/* memory-mapped readers */
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#else
+#include <windows.h>
+#endif
+
+/* hardware CRC32C (SSE4.2 instruction, or ARMv8 CRC extension, selected at
+   runtime unless enabled at build time) */
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define ZFAST_CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) \
+  && ( defined(__ARM_FEATURE_CRC32) || defined(__linux__) )
+#define ZFAST_CRC32C_ARMV8
+#include <arm_acle.h>
+#ifndef __ARM_FEATURE_CRC32
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
+
 /* use LZ4 */
 #ifdef ZFAST_USE_LZ4
 #include "lz4/lz4.h"
@@ -76,15 +111,82 @@
 #define POWER_BASE 10
 #define POWER_TO_BLOCK_SIZE(P) ( 1 << ( P + POWER_BASE ) )
 
-/* estimated upper boundary of compressed size */
-#define BUFFER_BLOCK_SIZE(S)                                            \
-  ( BLOCK_SIZE(S) + BLOCK_SIZE(S) / EXPANSION_RATIO + HEADER_SIZE*2)
+/* size of a checksum meta block */
+#define META_CHECKSUM_SIZE ( HEADER_SIZE + 1 + 4 )
+
+/* estimated upper boundary of compressed size (including the checksum meta
+   block, if any) */
+#define BUFFER_SIZE_FOR_BLOCK(BS)                               \
+  ( (BS) + (BS) / EXPANSION_RATIO + HEADER_SIZE*2 + META_CHECKSUM_SIZE)
+#define BUFFER_BLOCK_SIZE(S) BUFFER_SIZE_FOR_BLOCK(BLOCK_SIZE(S))
+
+/* internal backend levels beyond Z_BEST_COMPRESSION: LZ4HC using the given
+   compression level (adaptive mode) */
+#define LEVEL_HC(L) ( Z_BEST_COMPRESSION + 1 + (L) )
+
+/* adaptive mode: number of level steps, and blocks between two probes of
+   the next (slower) step */
+#define ADAPTIVE_STEPS          5
+#define ADAPTIVE_PROBE_INTERVAL 64
+
+/* incompressible blocks pre-scan: sampled input, and default threshold
+   (per mille of sampled positions repeating a previous sequence) */
+#define SAMPLES                 16
+#define SAMPLE_SIZE             256
+#define DEFAULT_INCOMPRESSIBLE  16
 
 /* block types (base ; the lower four bits are used for block size) */
 #define BLOCK_TYPE_RAW         (0x10)
 #define BLOCK_TYPE_COMPRESSED  (0xc0)
 #define BLOCK_TYPE_BAD_MAGIC   (0xffff)
 
+/* block type flag: the block uses previous blocks data (LZ4 linked blocks) */
+#define BLOCK_FLAG_LINKED      (0x20)
+
+/* meta block (no uncompressed data ; first payload byte is the subtype) */
+#define BLOCK_TYPE_META        (0x40)
+
+/* meta block subtypes */
+#define META_TYPE_DICTIONARY   (0x01)  /* 32-bit preset dictionary id */
+#define META_TYPE_INDEX        (0x02)  /* block index (stream trailer) */
+#define META_TYPE_CHECKSUM     (0x03)  /* 32-bit CRC32C of the next block */
+#define META_TYPE_COMPRESSOR   (0x04)  /* 8-bit backend of the next blocks */
+
+/* index meta block: subtype, last block flag, entries, and (last block)
+   trailer size */
+#define INDEX_ENTRY_SIZE       8
+#define INDEX_BLOCK_ENTRIES(BS) ( ( (BS) - 2 - 4 ) / INDEX_ENTRY_SIZE )
+
+/* size of a dictionary meta block */
+#define META_DICTIONARY_SIZE   ( HEADER_SIZE + 1 + 4 )
+
+/* size of a compressor meta block */
+#define META_COMPRESSOR_SIZE   ( HEADER_SIZE + 1 + 1 )
+
+/* stream header of compact streams (full header, and version byte) */
+#define BLOCK_TYPE_STREAM      (0x80)
+#define STREAM_VERSION_COMPACT (0x02)
+#define STREAM_HEADER_SIZE     ( HEADER_SIZE + 1 )
+
+/* compact block header: the block type (lower four bits are zero), the
+   LEB128 compressed size, and the LEB128 uncompressed size (unless raw) ;
+   a zero type is the EOF marker */
+#define COMPACT_TYPE_EOF       (0x00)
+#define COMPACT_HEADER_MAX_SIZE ( 1 + 5 + 5 )
+
+/* the stream header is repeated as a sync marker every SYNC_INTERVAL bytes
+   of compressed data (compact streams) */
+#define SYNC_INTERVAL       65536
+
+/* history window of linked blocks */
+#define HISTORY_SIZE        65536
+
+/* history buffer size (the window is moved back every HISTORY_SIZE bytes) */
+#define HISTORY_BUFFER_SIZE(S) ( HISTORY_SIZE*2 + BLOCK_SIZE(S) )
+
+/* backend work area size of a stream state */
+#define WRK_SIZE(ST) ( (ST)->wrk_size((ST)->level, (ST)->table_log) )
+
 /* fake level for decompression */
 #define ZFAST_LEVEL_DECOMPRESS (-2)
 
@@ -106,11 +208,12 @@
 #define ZFAST_HAS_BUFFERED_OUTPUT(S)                    \
   ( s->state->outBuffOffs < s->state->dec_size )
 
-/* compress stream */
-#define ZFAST_COMPRESS s->state->compress
-
-/* decompress stream */
-#define ZFAST_DECOMPRESS s->state->decompress
+/* compact headers: the stream header (or a sync marker) is to be written */
+#define ZFAST_SYNC_PENDING(S)                                           \
+  ( ( (S)->state->flags & ZFAST_FLAG_COMPACT_HEADERS ) != 0             \
+    && ( !(S)->state->compact                                           \
+         || ( (S)->total_out - (S)->state->sync_out >= SYNC_INTERVAL    \
+              && !ZFAST_INPUT_IS_EMPTY(S) ) ) )
 
 /* inlining */
 #ifndef ZFASTINLINE
@@ -118,7 +221,7 @@
 #endif
 
 /* tools */
-#define READ_8(adr)  (*(adr))
+#define READ_8(adr)  ( (uInt) *(adr) )
 #define READ_16(adr) ( READ_8(adr) | (READ_8((adr)+1) << 8) )
 #define READ_32(adr) ( READ_16(adr) | (READ_16((adr)+2) << 16) )
 #define WRITE_8(buff, n) do {                          \
@@ -139,6 +242,19 @@ static const char MAGIC[8] = {'F', 'a', 's', 't', 'L', 'Z', 0x01, 0};
 /* magic for stream (7 bytes with terminating \0) */
 static const char* BLOCK_MAGIC = "FastLZ";
 
+/* CRC32C kernel, updating crc with size bytes of data */
+typedef uInt (*zfast_crc32c_kernel)(uInt crc, const Bytef *data, size_t size);
+
+/* adaptive mode level selection (one per compressing thread) */
+typedef struct zfast_adaptive {
+  /* current step (0 is the fastest level) */
+  int step;
+  /* blocks compressed since the last probe */
+  uInt blocks;
+  /* measured speed of each step (MB/s), 0 if unknown */
+  uInt speed[ADAPTIVE_STEPS];
+} zfast_adaptive;
+
 /* opaque structure for "state" zlib structure member */
 struct internal_state {
   /* magic ; must be BLOCK_MAGIC */
@@ -174,11 +290,111 @@ struct internal_state {
 
   /* block decompression backend function */
   int (*decompress)(const void* input, int length, void* output, int maxout); 
+  /* configured decompression backend function (restored upon reset, after a
+     compressor meta block selected another one) */
+  int (*default_decompress)(const void* input, int length, void* output,
+                            int maxout);
+
+  /* block checksum function (CRC32C kernel selected for the running CPU by
+     fastlz_cpu_crc32c()) */
+  zfast_crc32c_kernel crc32c;
+
+  /* block compression backend function using a persistent work area
+     (NULL if the backend does not use one) */
+  int (*compress_wrk)(void *wrk, int level, int table_log, const void* input,
+                      int length, void* output);
+  /* size of the work area needed by compress_wrk for a given level and
+     hash table size */
+  int (*wrk_size)(int level, int table_log);
+  /* work area (lazily allocated upon first compressed block) */
+  void *wrk;
+  /* backend hash table size (log2 of bytes, 0 for the backend default) */
+  int table_log;
+
+  /* allocator of the block buffers, history and work areas, if any (see
+     fastlzlibSetAllocator) */
+  zfast_alloc_func alloc;
+  zfast_free_func dealloc;
+  void *alloc_opaque;
+
+  /* stream flags (ZFAST_FLAG_*) */
+  int flags;
+  /* compressor type (COMPRESSOR_*), or -1 for a custom compressor */
+  int compressor;
+  /* configured compressor type (restored upon reset, see
+     default_decompress) */
+  int default_compressor;
+  /* target compression speed of adaptive mode (MB/s, 0 if none), and level
+     selection state of the calling thread */
+  uInt target_speed;
+  zfast_adaptive adaptive;
+  /* pre-scan threshold of incompressible blocks (per mille, 0 if none) */
+  uInt incompressible;
+
+  /* previous uncompressed data (linked blocks), the window being the last
+     HISTORY_SIZE bytes of dict[0 .. dict_size[ */
+  Bytef *dict;
+  uInt dict_size;
+
+  /* preset dictionary (last HISTORY_SIZE bytes), and its id (adler32) */
+  Bytef *preset;
+  uInt preset_size;
+  uLong preset_id;
+  /* LZ4 streaming state with the preset dictionary loaded (compressing) */
+  void *preset_wrk;
+  /* dictionary meta block to be written (compressing), or dictionary
+     expected before the next block (decompressing) */
+  int preset_pending;
+  uLong pending_id;
+  /* compressor meta block to be written (compressing) */
+  int compressor_pending;
+
+  /* the EOF marker has been written (compressing) */
+  int eof;
+
+  /* next idle stream (stream pool) */
+  struct internal_state *next;
+
+  /* block index of the compressed stream (ZFAST_FLAG_INDEX) */
+  zfast_index *index;
+  /* index trailer being written (compressing), and entries written so far */
+  int index_pending;
+  uInt index_written;
+  /* uncompressed bytes to be skipped after a seek (decompressing) */
+  zfast_uint64 skip;
+
+  /* checksum of the next block to be verified (decompressing) */
+  int checksum_pending;
+  uInt checksum;
+
+  /* compact headers: the stream header has been written (compressing) or
+     read (decompressing), and total_out at the last sync marker */
+  int compact;
+  uLong sync_out;
+
+  /* worker threads (multi-threaded mode only, NULL otherwise) */
+  struct zfast_workers *workers;
+
+  /* statistics counters (updated by workers with workers->lock held) */
+  zfast_stats stats;
 };
 
 /* our typed internal state */
 typedef struct internal_state zfast_stream_internal;
 
+static zfast_crc32c_kernel fastlz_cpu_crc32c(void);
+
+#ifdef ZFAST_USE_LZ4
+static void lz4_linked_start(zfast_stream *const s);
+#endif
+#ifdef ZFAST_USE_THREADS
+static int fastlzlibWorkersInit(zfast_stream *s, int nthreads);
+static void fastlzlibWorkersFreeWork(zfast_stream *s);
+static void fastlzlibWorkersFree(zfast_stream *s);
+static void fastlzlibWorkersReset(zfast_stream *s);
+static uInt fastlzlibWorkersMemory(zfast_stream *s);
+#endif
+
 /* code version */
 const char * fastlzlibVersion() {
   return FASTLZ_VERSION_STRING;
@@ -229,19 +445,203 @@ static void zfree(zfast_stream *s, voidpf address) {
   }
 }
 
+/* alignment of the allocations of fastlzlibSetAllocator() allocators */
+#define ALLOC_ALIGNMENT 64
+
+/* header of these allocations, placed before the returned address */
+typedef struct zfast_alloc_header {
+  size_t size;
+  zfast_alloc_kind kind;
+} zfast_alloc_header;
+
+/* allocate a block buffer, history or work area, using the allocator of
+   the stream if any */
+static voidpf zalloc_block(zfast_stream *s, uInt size, zfast_alloc_kind kind) {
+  zfast_stream_internal *const state = s->state;
+  if (state->alloc != NULL) {
+    const size_t total = (size_t) size + ALLOC_ALIGNMENT;
+    Bytef *const ptr = (Bytef*) state->alloc(state->alloc_opaque, total,
+                                             ALLOC_ALIGNMENT, kind);
+    if (ptr != NULL) {
+      zfast_alloc_header *const hdr = (zfast_alloc_header*) ptr;
+      hdr->size = total;
+      hdr->kind = kind;
+      return &ptr[ALLOC_ALIGNMENT];
+    }
+    return NULL;
+  } else {
+    return zalloc(s, size, 1);
+  }
+}
+
+/* free memory allocated by zalloc_block() */
+static void zfree_block(zfast_stream *s, voidpf address) {
+  zfast_stream_internal *const state = s->state;
+  if (state->alloc != NULL) {
+    Bytef *const ptr = &((Bytef*) address)[-ALLOC_ALIGNMENT];
+    const zfast_alloc_header *const hdr = (const zfast_alloc_header*) ptr;
+    state->dealloc(state->alloc_opaque, ptr, hdr->size, hdr->kind);
+  } else {
+    zfree(s, address);
+  }
+}
+
+/* statistics counters (only maintained if built with -DZFAST_USE_STATS) */
+#ifdef ZFAST_USE_STATS
+#define STATS_ADD(ST, FIELD, N) ( (ST)->FIELD += (N) )
+#define STATS_CLOCK() fastlz_clock_nsec()
+#else
+#define STATS_ADD(ST, FIELD, N) ( (void) (ST), (void) (N) )
+#define STATS_CLOCK() ( (zfast_uint64) 0 )
+#endif
+
+#ifdef ZFAST_USE_STATS
+/* statistics of all ended streams */
+static zfast_stats global_stats;
+#ifdef ZFAST_USE_THREADS
+static pthread_mutex_t global_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* add the "src" counters to "dest" */
+static void fastlz_stats_merge(zfast_stats *dest, const zfast_stats *src) {
+  dest->blocks_compressed += src->blocks_compressed;
+  dest->blocks_raw += src->blocks_raw;
+  dest->bytes_direct_in += src->bytes_direct_in;
+  dest->bytes_direct_out += src->bytes_direct_out;
+  dest->bytes_buffered_in += src->bytes_buffered_in;
+  dest->bytes_buffered_out += src->bytes_buffered_out;
+  dest->backend_ns += src->backend_ns;
+  dest->buf_errors += src->buf_errors;
+  dest->syncs += src->syncs;
+  dest->seeks += src->seeks;
+  dest->bytes_skipped += src->bytes_skipped;
+}
+#endif
+
+/* move the statistics of an ending stream to the process-wide ones */
+static void fastlz_stats_retire(zfast_stats *stats) {
+#ifdef ZFAST_USE_STATS
+#ifdef ZFAST_USE_THREADS
+  pthread_mutex_lock(&global_stats_lock);
+#endif
+  fastlz_stats_merge(&global_stats, stats);
+#ifdef ZFAST_USE_THREADS
+  pthread_mutex_unlock(&global_stats_lock);
+#endif
+#endif
+  memset(stats, 0, sizeof(*stats));
+}
+
+/* an index entry (one per stream block) */
+typedef struct zfast_index_entry {
+  /* block offset in the compressed and uncompressed stream */
+  zfast_uint64 coffs;
+  zfast_uint64 uoffs;
+  /* block size (header included) and uncompressed size */
+  uInt csize;
+  uInt usize;
+} zfast_index_entry;
+
+struct zfast_index {
+  zfast_index_entry *entries;
+  uInt count;
+  uInt capacity;
+  /* end of indexed blocks in the compressed and uncompressed stream */
+  zfast_uint64 csize;
+  zfast_uint64 usize;
+  /* the stream uses compact headers */
+  int compact;
+  /* compressor recorded in the stream, or -1 */
+  int compressor;
+  /* size of the index trailer following the indexed blocks, if any */
+  uInt trailer;
+};
+
+/* append a block to an index */
+static int fastlzlibIndexAppend(zfast_index *index, uInt csize, uInt usize) {
+  if (index->count == index->capacity) {
+    const uInt capacity = index->capacity != 0 ? index->capacity * 2 : 64;
+    zfast_index_entry *const entries = (zfast_index_entry*)
+      realloc(index->entries, capacity * sizeof(zfast_index_entry));
+    if (entries == NULL) {
+      return Z_MEM_ERROR;
+    }
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+  index->entries[index->count].coffs = index->csize;
+  index->entries[index->count].uoffs = index->usize;
+  index->entries[index->count].csize = csize;
+  index->entries[index->count].usize = usize;
+  index->count++;
+  index->csize += csize;
+  index->usize += usize;
+  return Z_OK;
+}
+
+/* free the backend work area(s) */
+static void fastlzlibFreeWork(zfast_stream *s) {
+#ifdef ZFAST_USE_THREADS
+  if (s->state->workers != NULL) {
+    fastlzlibWorkersFreeWork(s);
+  }
+#endif
+  if (s->state->wrk != NULL) {
+    zfree_block(s, s->state->wrk);
+    s->state->wrk = NULL;
+  }
+  if (s->state->preset_wrk != NULL) {
+    zfree_block(s, s->state->preset_wrk);
+    s->state->preset_wrk = NULL;
+  }
+}
+
+/* allocate the backend work area, if the backend uses one */
+static ZFASTINLINE void* fastlzlibAllocWork(zfast_stream *s) {
+  if (s->state->compress_wrk != NULL) {
+    /* note: upon allocation failure, the backend is used without work area */
+    void *const wrk = zalloc_block(s, WRK_SIZE(s->state), ZFAST_ALLOC_WORK);
+    /* work areas start zeroed (the backend keeps state across blocks) */
+    if (wrk != NULL) {
+      memset(wrk, 0, WRK_SIZE(s->state));
+    }
+    return wrk;
+  }
+  return NULL;
+}
+
 /* free private fields */
 static void fastlzlibFree(zfast_stream *s) {
   if (s != NULL) {
     if (s->state != NULL) {
       assert(strcmp(s->state->magic, MAGIC) == 0);
+      fastlzlibFreeWork(s);
+#ifdef ZFAST_USE_THREADS
+      if (s->state->workers != NULL) {
+        fastlzlibWorkersFree(s);
+      }
+#endif
+      if (s->state->dict != NULL) {
+        zfree_block(s, s->state->dict);
+        s->state->dict = NULL;
+      }
+      if (s->state->preset != NULL) {
+        zfree_block(s, s->state->preset);
+        s->state->preset = NULL;
+      }
+      if (s->state->index != NULL) {
+        fastlzlibIndexFree(s->state->index);
+        s->state->index = NULL;
+      }
       if (s->state->inBuff != NULL) {
-        zfree(s, s->state->inBuff);
+        zfree_block(s, s->state->inBuff);
         s->state->inBuff = NULL;
       }
       if (s->state->outBuff != NULL) {
-        zfree(s, s->state->outBuff);
+        zfree_block(s, s->state->outBuff);
         s->state->outBuff = NULL;
       }
+      fastlz_stats_retire(&s->state->stats);
       zfree(s, s->state);
       s->state = NULL;
     }
@@ -251,6 +651,11 @@ static void fastlzlibFree(zfast_stream *s) {
 /* reset internal state */
 static void fastlzlibReset(zfast_stream *s) {
   assert(strcmp(s->state->magic, MAGIC) == 0);
+#ifdef ZFAST_USE_THREADS
+  if (s->state->workers != NULL) {
+    fastlzlibWorkersReset(s);
+  }
+#endif
   s->msg = NULL;
   s->state->inHdrOffs = 0;
   s->state->block_type = 0;
@@ -258,6 +663,36 @@ static void fastlzlibReset(zfast_stream *s) {
   s->state->dec_size = 0;
   s->state->inBuffOffs = 0;
   s->state->outBuffOffs = 0;
+  s->state->dict_size = 0;
+  s->state->eof = 0;
+  s->state->index_pending = 0;
+  s->state->index_written = 0;
+  s->state->skip = 0;
+  s->state->checksum_pending = 0;
+  s->state->checksum = 0;
+  s->state->compact = 0;
+  s->state->sync_out = 0;
+  /* the configured backend replaces the one of a compressor meta block */
+  s->state->compressor = s->state->default_compressor;
+  s->state->decompress = s->state->default_decompress;
+  if (s->state->index != NULL) {
+    s->state->index->count = 0;
+    s->state->index->csize = 0;
+    s->state->index->usize = 0;
+    s->state->index->trailer = 0;
+  }
+#ifdef ZFAST_USE_LZ4
+  if (s->state->wrk != NULL && s->state->dict != NULL
+      && ( s->state->flags & ZFAST_FLAG_LINKED_BLOCKS ) != 0) {
+    lz4_linked_start(s);
+  }
+#endif
+  /* the preset dictionary id is written again (compressing) */
+  s->state->preset_pending = ZFAST_IS_COMPRESSING(s)
+    && s->state->preset != NULL;
+  /* and so is the compressor id */
+  s->state->compressor_pending = ZFAST_IS_COMPRESSING(s)
+    && ( s->state->flags & ZFAST_FLAG_COMPRESSOR_ID ) != 0;
   s->total_in = 0;
   s->total_out = 0;
 }
@@ -277,7 +712,10 @@ static ZFASTINLINE int fastlzlibGetBlockSizeLevel(int block_size) {
 /* compression backend for LZ4 */
 static int lz4_backend_compress(int level, const void* input, int length,
                                 void* output) {
-  if (level == Z_BEST_COMPRESSION) {
+  if (level > Z_BEST_COMPRESSION) {
+    return LZ4_compressHC2(input, output, length, level - LEVEL_HC(0));
+  }
+  else if (level == Z_BEST_COMPRESSION) {
     return LZ4_compressHC(input, output, length);
   }
   else {
@@ -285,6 +723,133 @@ static int lz4_backend_compress(int level, const void* input, int length,
   }
 }
 
+/* compression backend for LZ4, using a persistent LZ4/LZ4HC state (the hash
+   table size only applies to LZ4, as LZ4HC uses its own tables) ; the LZ4
+   hash table is kept across blocks, and reset after LZ4HC used the state
+   (adaptive mode) */
+static int lz4_backend_compress_wrk(void *wrk, int level, int table_log,
+                                    const void* input, int length,
+                                    void* output) {
+  const int log = table_log != 0 ? table_log : LZ4_MEMORY_USAGE;
+  int done;
+  if (level > Z_BEST_COMPRESSION) {
+    done = LZ4_compressHC2_withStateHC(wrk, input, output, length,
+                                       level - LEVEL_HC(0));
+  }
+  else if (level == Z_BEST_COMPRESSION) {
+    done = LZ4_compressHC_withStateHC(wrk, input, output, length);
+  }
+  else {
+    return LZ4_compress_withStateLog(wrk, input, output, length, log);
+  }
+  LZ4_resetStateLog(wrk, log);
+  return done;
+}
+
+/* LZ4/LZ4HC state size (suitable for *_withState and streaming functions);
+   LZ4HC states are also large enough for the fast levels of the adaptive
+   mode */
+static int lz4_backend_wrk_size(int level, int table_log) {
+  int size = sizeof(LZ4_stream_t);
+  if (table_log != 0 && LZ4_sizeofStateLog(table_log) > size) {
+    size = LZ4_sizeofStateLog(table_log);
+  }
+  if (level >= Z_BEST_COMPRESSION && (int) sizeof(LZ4_streamHC_t) > size) {
+    size = sizeof(LZ4_streamHC_t);
+  }
+  return size;
+}
+
+/* reset the LZ4/LZ4HC streaming state of linked blocks */
+static void lz4_linked_reset(zfast_stream_internal *const state) {
+  if (state->level == Z_BEST_COMPRESSION) {
+    LZ4_resetStreamHC((LZ4_streamHC_t*) state->wrk, 0);
+  }
+  else {
+    LZ4_resetStream((LZ4_stream_t*) state->wrk);
+  }
+}
+
+/* load a dictionary in the LZ4/LZ4HC streaming state of linked blocks */
+static void lz4_linked_load(zfast_stream_internal *const state,
+                            const Bytef *dict, uInt size) {
+  if (state->level == Z_BEST_COMPRESSION) {
+    LZ4_loadDictHC((LZ4_streamHC_t*) state->wrk, (const char*) dict, size);
+  }
+  else {
+    LZ4_loadDict((LZ4_stream_t*) state->wrk, (const char*) dict, size);
+  }
+}
+
+/* start a new linked blocks sequence, with the preset dictionary as initial
+   history if any (the loaded state is kept to cheapen further resets) */
+static void lz4_linked_start(zfast_stream *const s) {
+  zfast_stream_internal *const state = s->state;
+  state->dict_size = 0;
+  if (state->preset == NULL) {
+    lz4_linked_reset(state);
+    return;
+  }
+  memcpy(state->dict, state->preset, state->preset_size);
+  state->dict_size = state->preset_size;
+  if (state->preset_wrk != NULL) {
+    memcpy(state->wrk, state->preset_wrk, WRK_SIZE(state));
+  }
+  else {
+    lz4_linked_reset(state);
+    lz4_linked_load(state, state->dict, state->dict_size);
+    /* note: upon allocation failure, the dictionary is loaded every time */
+    state->preset_wrk = zalloc_block(s, WRK_SIZE(state), ZFAST_ALLOC_WORK);
+    if (state->preset_wrk != NULL) {
+      memcpy(state->preset_wrk, state->wrk, WRK_SIZE(state));
+    }
+  }
+}
+
+/* compress a linked block: the input is appended to the history buffer, and
+   compressed using up to HISTORY_SIZE bytes of previous data */
+static int lz4_linked_compress(zfast_stream_internal *const state,
+                               const void* input, int length, void* output) {
+  char *source;
+  /* move the history window back to the begining of the buffer */
+  if (state->dict_size + length
+      > HISTORY_SIZE*2 + state->block_size) {
+    if (state->level == Z_BEST_COMPRESSION) {
+      state->dict_size = LZ4_saveDictHC((LZ4_streamHC_t*) state->wrk,
+                                        (char*) state->dict, HISTORY_SIZE);
+    }
+    else {
+      state->dict_size = LZ4_saveDict((LZ4_stream_t*) state->wrk,
+                                      (char*) state->dict, HISTORY_SIZE);
+    }
+  }
+  /* compress from the history buffer (the previous data is a prefix) */
+  source = (char*) &state->dict[state->dict_size];
+  memcpy(source, input, length);
+  state->dict_size += length;
+  if (state->level == Z_BEST_COMPRESSION) {
+    return LZ4_compressHC_continue((LZ4_streamHC_t*) state->wrk, source,
+                                   output, length);
+  }
+  else {
+    return LZ4_compress_continue((LZ4_stream_t*) state->wrk, source,
+                                 output, length);
+  }
+}
+
+/* decompress a linked block, using up to HISTORY_SIZE bytes of previous
+   data */
+static int lz4_linked_decompress(const zfast_stream_internal *const state,
+                                 const void* input, int length, void* output,
+                                 int maxout) {
+  const uInt size = state->dict_size < HISTORY_SIZE
+    ? state->dict_size : HISTORY_SIZE;
+  return LZ4_decompress_safe_usingDict(input, output, length, maxout,
+                                       (const char*) &state->dict
+                                       [state->dict_size - size],
+                                       size);
+}
+
 /* decompression backend for LZ4 */
 static int lz4_backend_decompress(const void* input, int length, void* output,
                                   int maxout) {
@@ -292,6 +857,13 @@ static int lz4_backend_decompress(const void* input, int length, void* output,
   /* return LZ4_uncompress(input, output, maxout); */
 }
 
+/* decompression backend for LZ4, stopping once "target" bytes are decoded */
+static int lz4_backend_decompress_partial(const void* input, int length,
+                                          void* output, int target,
+                                          int maxout) {
+  return LZ4_decompress_safe_partial(input, output, length, target, maxout);
+}
+
 #endif
 
 #ifdef ZFAST_USE_FASTLZ
@@ -306,39 +878,103 @@ static int fastlz_backend_compress(int level, const void* input, int length,
 }
 
 #define fastlz_backend_decompress fastlz_decompress
+#define fastlz_backend_decompress_partial fastlz_decompress_partial
 
 #endif
 
+/* decompress the begining of a block, until at least "target" bytes are
+   decoded (or the whole block) ; "output" must hold the whole block, and
+   custom backends always decompress the whole block */
+static int fastlz_decompress_prefix(int (*decompress)(const void* input,
+                                                      int length,
+                                                      void* output,
+                                                      int maxout),
+                                    const void* input, int length,
+                                    void* output, int target, int maxout) {
+#ifdef ZFAST_USE_LZ4
+  if (decompress == lz4_backend_decompress) {
+    return lz4_backend_decompress_partial(input, length, output, target,
+                                          maxout);
+  }
+#endif
+#ifdef ZFAST_USE_FASTLZ
+  if (decompress == fastlz_backend_decompress) {
+    return fastlz_backend_decompress_partial(input, length, output, target,
+                                             maxout);
+  }
+#endif
+  (void) target;
+  return decompress(input, length, output, maxout);
+}
+
 /* initialize private fields */
 static int fastlzlibInit(zfast_stream *s, int block_size) {
   if (s != NULL) {
     int code;
+    /* the counters need not be initialized by the caller (and a reused
+       stream still holds those of its previous stream) */
+    s->total_in = 0;
+    s->total_out = 0;
     if (fastlzlibGetBlockSizeLevel(block_size) == -1) {
       s->msg = "block size is invalid";
       return Z_STREAM_ERROR;
     }
     s->state = (zfast_stream_internal*)
       zalloc(s, sizeof(zfast_stream_internal), 1);
+    if (s->state == NULL) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
     strcpy(s->state->magic, MAGIC);
     s->state->compress = NULL;
     s->state->decompress = NULL;
+    s->state->default_decompress = NULL;
+    s->state->compress_wrk = NULL;
+    s->state->wrk_size = NULL;
+    s->state->wrk = NULL;
+    s->state->table_log = 0;
+    s->state->alloc = NULL;
+    s->state->dealloc = NULL;
+    s->state->alloc_opaque = NULL;
+    s->state->crc32c = fastlz_cpu_crc32c();
+    s->state->workers = NULL;
+    s->state->flags = 0;
+    s->state->dict = NULL;
+    s->state->dict_size = 0;
+    s->state->preset = NULL;
+    s->state->preset_size = 0;
+    s->state->preset_id = 0;
+    s->state->preset_wrk = NULL;
+    s->state->preset_pending = 0;
+    s->state->pending_id = 0;
+    s->state->compressor_pending = 0;
+    s->state->target_speed = 0;
+    s->state->incompressible = DEFAULT_INCOMPRESSIBLE;
+    memset(&s->state->adaptive, 0, sizeof(s->state->adaptive));
+    s->state->eof = 0;
+    s->state->next = NULL;
+    s->state->index = NULL;
+    s->state->index_pending = 0;
+    s->state->index_written = 0;
+    s->state->skip = 0;
+    s->state->checksum_pending = 0;
+    s->state->checksum = 0;
+    s->state->compact = 0;
+    s->state->sync_out = 0;
+    s->state->inBuff = NULL;
+    s->state->outBuff = NULL;
+    memset(&s->state->stats, 0, sizeof(s->state->stats));
     if ( ( code = fastlzlibSetCompressor(s, COMPRESSOR_DEFAULT) ) != Z_OK) {
       fastlzlibFree(s);
       return code;
     }
+    /* note: inBuff and outBuff are allocated upon first buffered block */
     s->state->block_size = (uInt) block_size;
-    s->state->inBuff = zalloc(s, BUFFER_BLOCK_SIZE(s), 1);
-    s->state->outBuff = zalloc(s, BUFFER_BLOCK_SIZE(s), 1);
-    if (s->state->inBuff != NULL && s->state->outBuff != NULL) {
-      fastlzlibReset(s);
-      return Z_OK;
-    }
-    s->msg = "memory exhausted";
-    fastlzlibFree(s);
+    fastlzlibReset(s);
+    return Z_OK;
   } else {
     return Z_STREAM_ERROR;
   }
-  return Z_MEM_ERROR;
 }
 
 int fastlzlibCompressInit2(zfast_stream *s, int level, int block_size) {
@@ -353,6 +989,22 @@ int fastlzlibCompressInit2(zfast_stream *s, int level, int block_size) {
   return success;
 }
 
+int fastlzlibCompressInitMT(zfast_stream *s, int level, int block_size,
+                            int nthreads) {
+  int success = fastlzlibCompressInit2(s, level, block_size);
+#ifdef ZFAST_USE_THREADS
+  if (success == Z_OK && nthreads > 1) {
+    success = fastlzlibWorkersInit(s, nthreads);
+    if (success != Z_OK) {
+      fastlzlibFree(s);
+    }
+  }
+#else
+  (void) nthreads;
+#endif
+  return success;
+}
+
 int fastlzlibCompressInit(zfast_stream *s, int level) {
   return fastlzlibCompressInit2(s, level, DEFAULT_BLOCK_SIZE);
 }
@@ -365,6 +1017,21 @@ int fastlzlibDecompressInit2(zfast_stream *s, int block_size) {
   return success;
 }
 
+int fastlzlibDecompressInitMT(zfast_stream *s, int block_size, int nthreads) {
+  int success = fastlzlibDecompressInit2(s, block_size);
+#ifdef ZFAST_USE_THREADS
+  if (success == Z_OK && nthreads > 1) {
+    success = fastlzlibWorkersInit(s, nthreads);
+    if (success != Z_OK) {
+      fastlzlibFree(s);
+    }
+  }
+#else
+  (void) nthreads;
+#endif
+  return success;
+}
+
 int fastlzlibDecompressInit(zfast_stream *s) {
   return fastlzlibDecompressInit2(s, DEFAULT_BLOCK_SIZE);
 }
@@ -372,21 +1039,48 @@ int fastlzlibDecompressInit(zfast_stream *s) {
 void fastlzlibSetCompress(zfast_stream *s,
                           int (*compress)(int level, const void* input,
                                           int length, void* output)) {
+  fastlzlibFreeWork(s);
   s->state->compress = compress;
+  s->state->compress_wrk = NULL;
+  s->state->wrk_size = NULL;
+  s->state->compressor = -1;
+  s->state->default_compressor = -1;
+}
+
+/* set the block compressor function using a persistent work area */
+static void fastlzlibSetCompressWork(zfast_stream *s,
+                                     int (*compress_wrk)(void *wrk, int level,
+                                                         int table_log,
+                                                         const void* input,
+                                                         int length,
+                                                         void* output),
+                                     int (*wrk_size)(int level,
+                                                     int table_log)) {
+  s->state->compress_wrk = compress_wrk;
+  s->state->wrk_size = wrk_size;
 }
 
 void fastlzlibSetDecompress(zfast_stream *s,
                             int (*decompress)(const void* input, int length,
                                               void* output, int maxout)) {
   s->state->decompress = decompress;
+  s->state->default_decompress = decompress;
 }
 
 int fastlzlibSetCompressor(zfast_stream *s,
                            zfast_stream_compressor compressor) {
+  if (s->total_in != 0) {
+    s->msg = "the compressor must be set before processing the stream";
+    return Z_STREAM_ERROR;
+  }
 #ifdef ZFAST_USE_LZ4
   if (compressor == COMPRESSOR_LZ4) {
     fastlzlibSetCompress(s, lz4_backend_compress);
+    fastlzlibSetCompressWork(s, lz4_backend_compress_wrk,
+                             lz4_backend_wrk_size);
     fastlzlibSetDecompress(s, lz4_backend_decompress);
+    s->state->compressor = COMPRESSOR_LZ4;
+    s->state->default_compressor = COMPRESSOR_LZ4;
     return Z_OK;
   }
 #endif
@@ -394,78 +1088,540 @@ int fastlzlibSetCompressor(zfast_stream *s,
   if (compressor == COMPRESSOR_FASTLZ) {
     fastlzlibSetCompress(s, fastlz_backend_compress);
     fastlzlibSetDecompress(s, fastlz_backend_decompress);
+    s->state->compressor = COMPRESSOR_FASTLZ;
+    s->state->default_compressor = COMPRESSOR_FASTLZ;
     return Z_OK;
   }
 #endif
   return Z_VERSION_ERROR;
 }
 
-int fastlzlibCompressEnd(zfast_stream *s) {
-  if (s == NULL) {
+/* select the decompression backend announced by a compressor meta block,
+   until the stream is reset ; the work area (compressing only) is left
+   untouched */
+static int fastlzlibSelectDecompressor(zfast_stream_internal *const state,
+                                       int compressor) {
+  if (compressor == state->compressor) {
+    return Z_OK;
+  }
+#ifdef ZFAST_USE_LZ4
+  if (compressor == COMPRESSOR_LZ4) {
+    state->decompress = lz4_backend_decompress;
+    state->compressor = COMPRESSOR_LZ4;
+    return Z_OK;
+  }
+#endif
+#ifdef ZFAST_USE_FASTLZ
+  if (compressor == COMPRESSOR_FASTLZ) {
+    state->decompress = fastlz_backend_decompress;
+    state->compressor = COMPRESSOR_FASTLZ;
+    return Z_OK;
+  }
+#endif
+  return Z_VERSION_ERROR;
+}
+
+int fastlzlibSetFlags(zfast_stream *s, int flags) {
+  if (s == NULL || s->state == NULL) {
     return Z_STREAM_ERROR;
   }
-  fastlzlibFree(s);
+  if (s->total_in != 0 || s->total_out != 0) {
+    s->msg = "flags must be set before processing the stream";
+    return Z_STREAM_ERROR;
+  }
+  if ( ( flags & ZFAST_FLAG_LINKED_BLOCKS ) != 0) {
+#ifdef ZFAST_USE_LZ4
+#ifdef ZFAST_USE_THREADS
+    if (s->state->workers != NULL) {
+      s->msg = "linked blocks are not supported in multi-threaded mode";
+      return Z_STREAM_ERROR;
+    }
+#endif
+#else
+    s->msg = "linked blocks require the LZ4 compressor";
+    return Z_VERSION_ERROR;
+#endif
+    /* see fastlzlibSetHashTableSize() */
+    if (s->state->table_log != 0) {
+      s->msg = "hash table size can not be changed with linked blocks";
+      return Z_STREAM_ERROR;
+    }
+  }
+  /* reinitialized upon next block */
+  fastlzlibFreeWork(s);
+  s->state->flags = flags;
+  s->state->compressor_pending = ZFAST_IS_COMPRESSING(s)
+    && ( flags & ZFAST_FLAG_COMPRESSOR_ID ) != 0;
   return Z_OK;
 }
 
-int fastlzlibDecompressEnd(zfast_stream *s) {
-  return fastlzlibCompressEnd(s);
+int fastlzlibGetFlags(zfast_stream *s) {
+  if (s == NULL || s->state == NULL) {
+    return 0;
+  }
+  return s->state->flags;
 }
 
-int fastlzlibCompressReset(zfast_stream *s) {
-  if (s == NULL) {
+int fastlzlibSetTargetSpeed(zfast_stream *s, uInt speed) {
+  if (s == NULL || s->state == NULL || !ZFAST_IS_COMPRESSING(s)) {
     return Z_STREAM_ERROR;
   }
-  fastlzlibReset(s);
+  s->state->target_speed = speed;
   return Z_OK;
 }
 
-int fastlzlibDecompressReset(zfast_stream *s) {
-  return fastlzlibCompressReset(s);
+int fastlzlibSetIncompressibleThreshold(zfast_stream *s, uInt threshold) {
+  if (s == NULL || s->state == NULL || !ZFAST_IS_COMPRESSING(s)
+      || threshold > 1000) {
+    return Z_STREAM_ERROR;
+  }
+  s->state->incompressible = threshold;
+  return Z_OK;
 }
 
-int fastlzlibCompressMemory(zfast_stream *s) {
-  if (s == NULL || s->state == NULL) {
-    return -1;
+int fastlzlibSetHashTableSize(zfast_stream *s, int table_log) {
+  if (s == NULL || s->state == NULL || !ZFAST_IS_COMPRESSING(s)
+      || ( table_log != 0 && ( table_log < ZFAST_TABLE_LOG_MIN
+                               || table_log > ZFAST_TABLE_LOG_MAX ) )) {
+    return Z_STREAM_ERROR;
   }
-  return (int) ( sizeof(zfast_stream_internal) + BUFFER_BLOCK_SIZE(s) * 2 );
+  if (s->total_in != 0 || s->total_out != 0) {
+    s->msg = "hash table size must be set before processing the stream";
+    return Z_STREAM_ERROR;
+  }
+  /* the streaming state of linked blocks uses the default table size */
+  if (table_log != 0 && ( s->state->flags & ZFAST_FLAG_LINKED_BLOCKS ) != 0) {
+    s->msg = "hash table size can not be changed with linked blocks";
+    return Z_STREAM_ERROR;
+  }
+  /* the work areas are allocated again with the new size */
+  if (table_log != s->state->table_log) {
+    fastlzlibFreeWork(s);
+    s->state->table_log = table_log;
+  }
+  return Z_OK;
 }
 
-int fastlzlibDecompressMemory(zfast_stream *s) {
-  return fastlzlibCompressMemory(s);
+/* adler32 checksum (dictionary id) */
+static uLong fastlz_adler32(const Bytef *data, uInt size) {
+  uLong a = 1, b = 0;
+  while(size != 0) {
+    /* largest n such as 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1 */
+    uInt n = size < 5552 ? size : 5552;
+    size -= n;
+    for( ; n != 0 ; n--, data++) {
+      a += *data;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return ( b << 16 ) | a;
 }
 
-static ZFASTINLINE void inSeek(zfast_stream *s, uInt offs) {
-  assert(s->avail_in >= offs);
-  s->next_in += offs;
-  s->avail_in -= offs;
-  s->total_in += offs;
-}
+/* CRC32C (Castagnoli) lookup table, for the software implementation */
+static const uInt crc32c_table[256] = {
+  0x00000000U, 0xf26b8303U, 0xe13b70f7U, 0x1350f3f4U, 0xc79a971fU, 0x35f1141cU,
+  0x26a1e7e8U, 0xd4ca64ebU, 0x8ad958cfU, 0x78b2dbccU, 0x6be22838U, 0x9989ab3bU,
+  0x4d43cfd0U, 0xbf284cd3U, 0xac78bf27U, 0x5e133c24U, 0x105ec76fU, 0xe235446cU,
+  0xf165b798U, 0x030e349bU, 0xd7c45070U, 0x25afd373U, 0x36ff2087U, 0xc494a384U,
+  0x9a879fa0U, 0x68ec1ca3U, 0x7bbcef57U, 0x89d76c54U, 0x5d1d08bfU, 0xaf768bbcU,
+  0xbc267848U, 0x4e4dfb4bU, 0x20bd8edeU, 0xd2d60dddU, 0xc186fe29U, 0x33ed7d2aU,
+  0xe72719c1U, 0x154c9ac2U, 0x061c6936U, 0xf477ea35U, 0xaa64d611U, 0x580f5512U,
+  0x4b5fa6e6U, 0xb93425e5U, 0x6dfe410eU, 0x9f95c20dU, 0x8cc531f9U, 0x7eaeb2faU,
+  0x30e349b1U, 0xc288cab2U, 0xd1d83946U, 0x23b3ba45U, 0xf779deaeU, 0x05125dadU,
+  0x1642ae59U, 0xe4292d5aU, 0xba3a117eU, 0x4851927dU, 0x5b016189U, 0xa96ae28aU,
+  0x7da08661U, 0x8fcb0562U, 0x9c9bf696U, 0x6ef07595U, 0x417b1dbcU, 0xb3109ebfU,
+  0xa0406d4bU, 0x522bee48U, 0x86e18aa3U, 0x748a09a0U, 0x67dafa54U, 0x95b17957U,
+  0xcba24573U, 0x39c9c670U, 0x2a993584U, 0xd8f2b687U, 0x0c38d26cU, 0xfe53516fU,
+  0xed03a29bU, 0x1f682198U, 0x5125dad3U, 0xa34e59d0U, 0xb01eaa24U, 0x42752927U,
+  0x96bf4dccU, 0x64d4cecfU, 0x77843d3bU, 0x85efbe38U, 0xdbfc821cU, 0x2997011fU,
+  0x3ac7f2ebU, 0xc8ac71e8U, 0x1c661503U, 0xee0d9600U, 0xfd5d65f4U, 0x0f36e6f7U,
+  0x61c69362U, 0x93ad1061U, 0x80fde395U, 0x72966096U, 0xa65c047dU, 0x5437877eU,
+  0x4767748aU, 0xb50cf789U, 0xeb1fcbadU, 0x197448aeU, 0x0a24bb5aU, 0xf84f3859U,
+  0x2c855cb2U, 0xdeeedfb1U, 0xcdbe2c45U, 0x3fd5af46U, 0x7198540dU, 0x83f3d70eU,
+  0x90a324faU, 0x62c8a7f9U, 0xb602c312U, 0x44694011U, 0x5739b3e5U, 0xa55230e6U,
+  0xfb410cc2U, 0x092a8fc1U, 0x1a7a7c35U, 0xe811ff36U, 0x3cdb9bddU, 0xceb018deU,
+  0xdde0eb2aU, 0x2f8b6829U, 0x82f63b78U, 0x709db87bU, 0x63cd4b8fU, 0x91a6c88cU,
+  0x456cac67U, 0xb7072f64U, 0xa457dc90U, 0x563c5f93U, 0x082f63b7U, 0xfa44e0b4U,
+  0xe9141340U, 0x1b7f9043U, 0xcfb5f4a8U, 0x3dde77abU, 0x2e8e845fU, 0xdce5075cU,
+  0x92a8fc17U, 0x60c37f14U, 0x73938ce0U, 0x81f80fe3U, 0x55326b08U, 0xa759e80bU,
+  0xb4091bffU, 0x466298fcU, 0x1871a4d8U, 0xea1a27dbU, 0xf94ad42fU, 0x0b21572cU,
+  0xdfeb33c7U, 0x2d80b0c4U, 0x3ed04330U, 0xccbbc033U, 0xa24bb5a6U, 0x502036a5U,
+  0x4370c551U, 0xb11b4652U, 0x65d122b9U, 0x97baa1baU, 0x84ea524eU, 0x7681d14dU,
+  0x2892ed69U, 0xdaf96e6aU, 0xc9a99d9eU, 0x3bc21e9dU, 0xef087a76U, 0x1d63f975U,
+  0x0e330a81U, 0xfc588982U, 0xb21572c9U, 0x407ef1caU, 0x532e023eU, 0xa145813dU,
+  0x758fe5d6U, 0x87e466d5U, 0x94b49521U, 0x66df1622U, 0x38cc2a06U, 0xcaa7a905U,
+  0xd9f75af1U, 0x2b9cd9f2U, 0xff56bd19U, 0x0d3d3e1aU, 0x1e6dcdeeU, 0xec064eedU,
+  0xc38d26c4U, 0x31e6a5c7U, 0x22b65633U, 0xd0ddd530U, 0x0417b1dbU, 0xf67c32d8U,
+  0xe52cc12cU, 0x1747422fU, 0x49547e0bU, 0xbb3ffd08U, 0xa86f0efcU, 0x5a048dffU,
+  0x8ecee914U, 0x7ca56a17U, 0x6ff599e3U, 0x9d9e1ae0U, 0xd3d3e1abU, 0x21b862a8U,
+  0x32e8915cU, 0xc083125fU, 0x144976b4U, 0xe622f5b7U, 0xf5720643U, 0x07198540U,
+  0x590ab964U, 0xab613a67U, 0xb831c993U, 0x4a5a4a90U, 0x9e902e7bU, 0x6cfbad78U,
+  0x7fab5e8cU, 0x8dc0dd8fU, 0xe330a81aU, 0x115b2b19U, 0x020bd8edU, 0xf0605beeU,
+  0x24aa3f05U, 0xd6c1bc06U, 0xc5914ff2U, 0x37faccf1U, 0x69e9f0d5U, 0x9b8273d6U,
+  0x88d28022U, 0x7ab90321U, 0xae7367caU, 0x5c18e4c9U, 0x4f48173dU, 0xbd23943eU,
+  0xf36e6f75U, 0x0105ec76U, 0x12551f82U, 0xe03e9c81U, 0x34f4f86aU, 0xc69f7b69U,
+  0xd5cf889dU, 0x27a40b9eU, 0x79b737baU, 0x8bdcb4b9U, 0x988c474dU, 0x6ae7c44eU,
+  0xbe2da0a5U, 0x4c4623a6U, 0x5f16d052U, 0xad7d5351U
+};
 
-static ZFASTINLINE void outSeek(zfast_stream *s, uInt offs) {
-  assert(s->avail_out >= offs);
-  s->next_out += offs;
-  s->avail_out -= offs;
-  s->total_out += offs;
+/* CRC32C checksum, software version */
+static uInt fastlz_crc32c_sw(uInt crc, const Bytef *data, size_t size) {
+  crc = ~crc;
+  for( ; size != 0 ; size--, data++) {
+    crc = crc32c_table[( crc ^ *data ) & 0xff] ^ ( crc >> 8 );
+  }
+  return ~crc;
 }
 
-/* write an header to "dest" */
-static ZFASTINLINE int fastlz_write_header(Bytef* dest,
-                                           uInt type,
-                                           uInt block_size,
-                                           uInt compressed,
-                                           uInt original) {
-  const int bs = fastlzlibGetBlockSizeLevel(block_size);
-  const int packed_type = type + bs;
-  assert(bs >= 0x0 && bs <= 0xf);
-  assert( ( type & 0x0f ) == 0);
-  
-  memcpy(&dest[0], BLOCK_MAGIC, 7);
-  WRITE_8(&dest[7], packed_type);
-  WRITE_32(&dest[8], compressed);
-  WRITE_32(&dest[12], original);
-  return HEADER_SIZE;
-}
+#ifdef ZFAST_CRC32C_SSE42
+
+/* CRC32C checksum, SSE4.2 version */
+__attribute__((target("sse4.2")))
+static uInt fastlz_crc32c_sse42(uInt crc, const Bytef *data, size_t size) {
+  crc = ~crc;
+#ifdef __x86_64__
+  for( ; size >= 8 ; size -= 8, data += 8) {
+    unsigned long long v;
+    memcpy(&v, data, 8);
+    crc = (uInt) _mm_crc32_u64(crc, v);
+  }
+#endif
+  for( ; size >= 4 ; size -= 4, data += 4) {
+    unsigned int v;
+    memcpy(&v, data, 4);
+    crc = _mm_crc32_u32(crc, v);
+  }
+  for( ; size != 0 ; size--, data++) {
+    crc = _mm_crc32_u8(crc, *data);
+  }
+  return ~crc;
+}
+
+#elif defined(ZFAST_CRC32C_ARMV8)
+
+/* CRC32C checksum, ARMv8 version */
+#ifndef __ARM_FEATURE_CRC32
+#ifdef __clang__
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+#endif
+static uInt fastlz_crc32c_armv8(uInt crc, const Bytef *data, size_t size) {
+  crc = ~crc;
+  for( ; size >= 8 ; size -= 8, data += 8) {
+    unsigned long long v;
+    memcpy(&v, data, 8);
+    crc = __crc32cd(crc, v);
+  }
+  for( ; size != 0 ; size--, data++) {
+    crc = __crc32cb(crc, *data);
+  }
+  return ~crc;
+}
+
+#endif
+
+/* select the CRC32C kernel of the running CPU, using the CPU instruction if
+   any (probed when a stream is initialized, and bound to the state) */
+static zfast_crc32c_kernel fastlz_cpu_crc32c(void) {
+#ifdef ZFAST_CRC32C_SSE42
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return fastlz_crc32c_sse42;
+  }
+#elif defined(ZFAST_CRC32C_ARMV8)
+#ifndef __ARM_FEATURE_CRC32
+  if (( getauxval(AT_HWCAP) & HWCAP_CRC32 ) != 0)
+#endif
+  return fastlz_crc32c_armv8;
+#endif
+  return fastlz_crc32c_sw;
+}
+
+/* CRC32C checksum (block checksums), using the kernel bound to the state */
+static uInt fastlz_crc32c(const zfast_stream_internal *state,
+                          const void *data, uInt size) {
+  return state->crc32c(0, (const Bytef*) data, size);
+}
+
+/* set the preset dictionary (only the last HISTORY_SIZE bytes are kept) */
+static int fastlzlibSetPreset(zfast_stream *s, const Bytef *dictionary,
+                              uInt dictLength) {
+  const uInt size = dictLength < HISTORY_SIZE ? dictLength : HISTORY_SIZE;
+  Bytef *const preset = zalloc_block(s, size != 0 ? size : 1,
+                                     ZFAST_ALLOC_HISTORY);
+  if (preset == NULL) {
+    s->msg = "memory exhausted";
+    return Z_MEM_ERROR;
+  }
+  memcpy(preset, &dictionary[dictLength - size], size);
+  if (s->state->preset != NULL) {
+    zfree_block(s, s->state->preset);
+  }
+  s->state->preset = preset;
+  s->state->preset_size = size;
+  s->state->preset_id = fastlz_adler32(dictionary, dictLength);
+  return Z_OK;
+}
+
+/* load the preset dictionary as linked blocks history (decompressing) */
+static int fastlzlibLoadPreset(zfast_stream *s) {
+  if (s->state->dict == NULL) {
+    s->state->dict = zalloc_block(s, HISTORY_BUFFER_SIZE(s),
+                                  ZFAST_ALLOC_HISTORY);
+    if (s->state->dict == NULL) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
+  }
+  memcpy(s->state->dict, s->state->preset, s->state->preset_size);
+  s->state->dict_size = s->state->preset_size;
+  s->state->preset_pending = 0;
+  return Z_OK;
+}
+
+int fastlzlibCompressSetDictionary(zfast_stream *s, const Bytef *dictionary,
+                                   uInt dictLength) {
+  int code;
+  if (s == NULL || s->state == NULL || dictionary == NULL
+      || !ZFAST_IS_COMPRESSING(s)) {
+    return Z_STREAM_ERROR;
+  }
+  if (s->total_in != 0 || s->total_out != 0) {
+    s->msg = "dictionary must be set before processing the stream";
+    return Z_STREAM_ERROR;
+  }
+#ifdef ZFAST_USE_LZ4
+#ifdef ZFAST_USE_THREADS
+  if (s->state->workers != NULL) {
+    s->msg = "dictionaries are not supported in multi-threaded mode";
+    return Z_STREAM_ERROR;
+  }
+#endif
+  if (s->state->compressor != COMPRESSOR_LZ4) {
+    s->msg = "dictionaries require the LZ4 compressor";
+    return Z_VERSION_ERROR;
+  }
+  code = fastlzlibSetPreset(s, dictionary, dictLength);
+  if (code != Z_OK) {
+    return code;
+  }
+  /* dictionary streams are linked streams ; reinitialized upon next block */
+  fastlzlibFreeWork(s);
+  s->state->flags |= ZFAST_FLAG_LINKED_BLOCKS;
+  s->state->preset_pending = 1;
+  return Z_OK;
+#else
+  (void) code;
+  (void) dictLength;
+  s->msg = "dictionaries require the LZ4 compressor";
+  return Z_VERSION_ERROR;
+#endif
+}
+
+int fastlzlibDecompressSetDictionary(zfast_stream *s, const Bytef *dictionary,
+                                     uInt dictLength) {
+  int code;
+  if (s == NULL || s->state == NULL || dictionary == NULL
+      || !ZFAST_IS_DECOMPRESSING(s)) {
+    return Z_STREAM_ERROR;
+  }
+  /* the stream is waiting for a specific dictionary */
+  if (s->state->preset_pending
+      && fastlz_adler32(dictionary, dictLength) != s->state->pending_id) {
+    s->msg = "incorrect dictionary";
+    return Z_DATA_ERROR;
+  }
+  code = fastlzlibSetPreset(s, dictionary, dictLength);
+  if (code != Z_OK) {
+    return code;
+  }
+  if (s->state->preset_pending) {
+    return fastlzlibLoadPreset(s);
+  }
+  return Z_OK;
+}
+
+int fastlzlibCompressEnd(zfast_stream *s) {
+  if (s == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  fastlzlibFree(s);
+  return Z_OK;
+}
+
+int fastlzlibDecompressEnd(zfast_stream *s) {
+  return fastlzlibCompressEnd(s);
+}
+
+int fastlzlibCompressReset(zfast_stream *s) {
+  if (s == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  fastlzlibReset(s);
+  return Z_OK;
+}
+
+int fastlzlibDecompressReset(zfast_stream *s) {
+  return fastlzlibCompressReset(s);
+}
+
+int fastlzlibCompressMemory(zfast_stream *s) {
+  if (s == NULL || s->state == NULL) {
+    return -1;
+  }
+  {
+    const uInt wrk = ( s->state->wrk != NULL
+                       ? (uInt) WRK_SIZE(s->state) : 0 )
+      + ( s->state->preset_wrk != NULL
+          ? (uInt) WRK_SIZE(s->state) : 0 )
+      + ( s->state->dict != NULL ? HISTORY_BUFFER_SIZE(s) : 0 )
+      + s->state->preset_size
+      + ( s->state->index != NULL
+          ? s->state->index->capacity * sizeof(zfast_index_entry) : 0 );
+    const uInt buffers = ( s->state->inBuff != NULL ? BUFFER_BLOCK_SIZE(s) : 0 )
+      + ( s->state->outBuff != NULL ? BUFFER_BLOCK_SIZE(s) : 0 );
+#ifdef ZFAST_USE_THREADS
+    if (s->state->workers != NULL) {
+      return (int) ( sizeof(zfast_stream_internal) + buffers
+                     + wrk + fastlzlibWorkersMemory(s) );
+    }
+#endif
+    return (int) ( sizeof(zfast_stream_internal) + buffers + wrk );
+  }
+}
+
+/* release the input and output buffers if they are not in use */
+static void fastlzlibReleaseBuffers(zfast_stream *s) {
+  /* no buffered input */
+  if (s->state->inBuff != NULL && s->state->inBuffOffs == 0) {
+    zfree_block(s, s->state->inBuff);
+    s->state->inBuff = NULL;
+  }
+  /* no buffered output */
+  if (s->state->outBuff != NULL && !ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+    zfree_block(s, s->state->outBuff);
+    s->state->outBuff = NULL;
+  }
+}
+
+int fastlzlibRelease(zfast_stream *s) {
+  if (s == NULL || s->state == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  fastlzlibReleaseBuffers(s);
+  /* the work area does not hold any state (unlike linked blocks) */
+  if (s->state->wrk != NULL
+      && ( s->state->flags & ZFAST_FLAG_LINKED_BLOCKS ) == 0) {
+    zfree_block(s, s->state->wrk);
+    s->state->wrk = NULL;
+  }
+  return Z_OK;
+}
+
+int fastlzlibDecompressMemory(zfast_stream *s) {
+  return fastlzlibCompressMemory(s);
+}
+
+static ZFASTINLINE void inSeek(zfast_stream *s, uInt offs) {
+  assert(s->avail_in >= offs);
+  s->next_in += offs;
+  s->avail_in -= offs;
+  s->total_in += offs;
+}
+
+static ZFASTINLINE void outSeek(zfast_stream *s, uInt offs) {
+  assert(s->avail_out >= offs);
+  s->next_out += offs;
+  s->avail_out -= offs;
+  s->total_out += offs;
+}
+
+/* write an header to "dest" */
+static ZFASTINLINE int fastlz_write_header(Bytef* dest,
+                                           uInt type,
+                                           uInt block_size,
+                                           uInt compressed,
+                                           uInt original) {
+  const int bs = fastlzlibGetBlockSizeLevel(block_size);
+  const int packed_type = type + bs;
+  assert(bs >= 0x0 && bs <= 0xf);
+  assert( ( type & 0x0f ) == 0);
+  
+  memcpy(&dest[0], BLOCK_MAGIC, 7);
+  WRITE_8(&dest[7], packed_type);
+  WRITE_32(&dest[8], compressed);
+  WRITE_32(&dest[12], original);
+  return HEADER_SIZE;
+}
+
+/* write a dictionary meta block to "dest" */
+static ZFASTINLINE int fastlz_write_meta_dictionary(Bytef* dest,
+                                                    uInt block_size,
+                                                    uLong id) {
+  fastlz_write_header(dest, BLOCK_TYPE_META, block_size, 1 + 4, 0);
+  WRITE_8(&dest[HEADER_SIZE], META_TYPE_DICTIONARY);
+  WRITE_32(&dest[HEADER_SIZE + 1], id);
+  return META_DICTIONARY_SIZE;
+}
+
+/* write a compressor meta block to "dest" */
+static ZFASTINLINE int fastlz_write_meta_compressor(Bytef* dest,
+                                                    uInt block_size,
+                                                    int compressor) {
+  fastlz_write_header(dest, BLOCK_TYPE_META, block_size, 1 + 1, 0);
+  WRITE_8(&dest[HEADER_SIZE], META_TYPE_COMPRESSOR);
+  WRITE_8(&dest[HEADER_SIZE + 1], compressor);
+  return META_COMPRESSOR_SIZE;
+}
+
+/* write to "dest" the checksum meta block of the next block */
+static uInt fastlz_write_meta_checksum(Bytef* dest, uInt block_size,
+                                       uInt checksum) {
+  fastlz_write_header(dest, BLOCK_TYPE_META, block_size, 1 + 4, 0);
+  WRITE_8(&dest[HEADER_SIZE], META_TYPE_CHECKSUM);
+  WRITE_32(&dest[HEADER_SIZE + 1], checksum);
+  return META_CHECKSUM_SIZE;
+}
+
+/* size of the index trailer (index meta blocks) */
+static uLong fastlz_index_trailer_size(const zfast_index *index,
+                                       uInt block_size) {
+  const uInt epb = INDEX_BLOCK_ENTRIES(block_size);
+  const uLong nblocks = index->count != 0
+    ? ( index->count + epb - 1 ) / epb : 1;
+  return nblocks * ( HEADER_SIZE + 2 )
+    + (uLong) index->count * INDEX_ENTRY_SIZE + 4;
+}
+
+/* write to "dest" the index meta block starting at entry "first" */
+static uInt fastlz_write_index_block(Bytef* dest, const zfast_index *index,
+                                     uInt first, uInt block_size,
+                                     uLong trailer_size) {
+  const uInt epb = INDEX_BLOCK_ENTRIES(block_size);
+  const uInt n = index->count - first < epb ? index->count - first : epb;
+  const int last = first + n == index->count;
+  const uInt payload = 2 + n*INDEX_ENTRY_SIZE + ( last ? 4 : 0 );
+  Bytef *p = &dest[HEADER_SIZE];
+  uInt i;
+  fastlz_write_header(dest, BLOCK_TYPE_META, block_size, payload, 0);
+  WRITE_8(&p[0], META_TYPE_INDEX);
+  WRITE_8(&p[1], last | ( index->compact ? 2 : 0 )
+          | ( ( index->compressor + 1 ) << 4 ));
+  p += 2;
+  for(i = first ; i < first + n ; i++, p += INDEX_ENTRY_SIZE) {
+    WRITE_32(&p[0], index->entries[i].csize);
+    WRITE_32(&p[4], index->entries[i].usize);
+  }
+  /* the last block ends with the trailer size, to be found from the end */
+  if (last) {
+    WRITE_32(&p[0], trailer_size);
+  }
+  return HEADER_SIZE + payload;
+}
 
 /* read an header from "source" */
 static ZFASTINLINE void fastlz_read_header(const Bytef* source,
@@ -488,6 +1644,117 @@ static ZFASTINLINE void fastlz_read_header(const Bytef* source,
   }
 }
 
+/* size of the minimal LEB128 encoding of "value" */
+static ZFASTINLINE uInt fastlz_varint_size(uInt value) {
+  uInt size;
+  for(size = 1 ; value >= 0x80 ; value >>= 7, size++) ;
+  return size;
+}
+
+/* write "value" as a LEB128 varint of exactly "size" bytes (padded) */
+static ZFASTINLINE uInt fastlz_write_varint(Bytef* dest, uInt value,
+                                            uInt size) {
+  uInt i;
+  assert(size >= fastlz_varint_size(value));
+  for(i = 0 ; i + 1 < size ; i++, value >>= 7) {
+    dest[i] = (Bytef) ( ( value & 0x7f ) | 0x80 );
+  }
+  dest[i] = (Bytef) value;
+  return size;
+}
+
+/* read a LEB128 varint ; returns its size, 0 if incomplete, or -1 if
+   invalid */
+static ZFASTINLINE int fastlz_read_varint(const Bytef* source, uInt length,
+                                          uInt *value) {
+  uInt i;
+  *value = 0;
+  for(i = 0 ; i < length && i < 5 ; i++) {
+    *value |= (uInt) ( source[i] & 0x7f ) << ( 7*i );
+    if ( ( source[i] & 0x80 ) == 0) {
+      return i + 1;
+    }
+  }
+  return i == 5 ? -1 : 0;
+}
+
+/* write a compact header to "dest" ; the compressed size is written using
+   "size" bytes, so that the header size is known before compressing */
+static ZFASTINLINE uInt fastlz_write_compact_header(Bytef* dest, uInt type,
+                                                    uInt compressed,
+                                                    uInt original,
+                                                    uInt size) {
+  uInt done = 1;
+  WRITE_8(&dest[0], type);
+  done += fastlz_write_varint(&dest[done], compressed, size);
+  if ( ( type & ~BLOCK_FLAG_LINKED ) != BLOCK_TYPE_RAW) {
+    done += fastlz_write_varint(&dest[done], original,
+                                fastlz_varint_size(original));
+  }
+  return done;
+}
+
+/* read the header of the next block from "source": a full header, or a
+   compact header in compact streams ; returns the header size (the block
+   type being BLOCK_TYPE_BAD_MAGIC if invalid), or 0 if more data is
+   needed */
+static ZFASTINLINE uInt fastlz_read_any_header(int compact,
+                                               const Bytef* source,
+                                               uInt length,
+                                               uInt default_block_size,
+                                               uInt *type,
+                                               uInt *block_size,
+                                               uInt *compressed,
+                                               uInt *original) {
+  /* full header (always starting with the magic) */
+  if (!compact || ( length != 0 && source[0] == BLOCK_MAGIC[0] ) ) {
+    if (length < HEADER_SIZE) {
+      return 0;
+    }
+    fastlz_read_header(source, type, block_size, compressed, original);
+    return HEADER_SIZE;
+  }
+  else if (length == 0) {
+    return 0;
+  }
+  *block_size = default_block_size;
+  *compressed = *original = 0;
+  *type = READ_8(&source[0]);
+  if (*type == COMPACT_TYPE_EOF) {
+    *type = BLOCK_TYPE_COMPRESSED;
+    return 1;
+  }
+  else if (*type == BLOCK_TYPE_RAW
+           || *type == BLOCK_TYPE_COMPRESSED
+           || *type == ( BLOCK_TYPE_RAW | BLOCK_FLAG_LINKED )
+           || *type == ( BLOCK_TYPE_COMPRESSED | BLOCK_FLAG_LINKED )) {
+    const int raw = ( *type & ~BLOCK_FLAG_LINKED ) == BLOCK_TYPE_RAW;
+    const int n = fastlz_read_varint(&source[1], length - 1, compressed);
+    int m = 0;
+    if (n > 0 && !raw) {
+      m = fastlz_read_varint(&source[1 + n], length - 1 - n, original);
+    } else {
+      *original = *compressed;
+    }
+    if (n > 0 && ( raw || m > 0 ) ) {
+      return 1 + n + m;
+    }
+    else if (n == 0 || ( n > 0 && m == 0 ) ) {
+      return 0;
+    }
+  }
+  *type = BLOCK_TYPE_BAD_MAGIC;
+  return 1;
+}
+
+/* write the stream header of compact streams (also used as sync marker) */
+static ZFASTINLINE uInt fastlz_write_stream_header(Bytef* dest,
+                                                   uInt block_size) {
+  fastlz_write_header(dest, BLOCK_TYPE_STREAM, block_size, 1, 0);
+  WRITE_8(&dest[HEADER_SIZE], STREAM_VERSION_COMPACT);
+  return STREAM_HEADER_SIZE;
+}
+
 int fastlzlibGetStreamBlockSize(const void* input, int length) {
   uInt block_size = 0;
   if (length >= HEADER_SIZE) {
@@ -522,495 +1789,3737 @@ int fastlzlibGetStreamInfo(const void* input, int length,
   }
 }
 
-/* helper for fastlz_compress */
-static ZFASTINLINE int fastlz_compress_hdr(const zfast_stream *const s,
-                                           const void* input, uInt length,
-                                           void* output, uInt output_length,
-                                           int block_size, int level,
-                                           int flush) {
-  uInt done = 0;
-  Bytef*const output_start = (Bytef*) output;
-  if (length > 0) {
-    void*const output_data_start = &output_start[HEADER_SIZE];
-    uInt type;
-    /* compress and fill header after */
-    if (length > MIN_BLOCK_SIZE) {
-      done = ZFAST_COMPRESS(level, input, length, output_data_start);
-      assert(done + HEADER_SIZE*2 <= output_length);
-      if (done < length) {
-        type = BLOCK_TYPE_COMPRESSED;
-      }
-      /* compressed version is greater ; use raw data */
-      else {
-        memcpy(output_data_start, input, length);
-        done = length;
-        type = BLOCK_TYPE_RAW;
-      }
-    }
-    /* store small chunk as raw data */
-    else {
-      assert(length + HEADER_SIZE*2 <= output_length);
-      memcpy(output_data_start, input, length);
-      done = length;
-      type = BLOCK_TYPE_RAW;
-    }
-    /* write back header */
-    done += fastlz_write_header(output_start, type, block_size, done, length);
-  }
-  /* write an EOF marker (empty block with compressed=uncompressed=0) */
-  if (flush == Z_FINISH) {
-    Bytef*const output_end = &output_start[done];
-    done += fastlz_write_header(output_end, BLOCK_TYPE_COMPRESSED, block_size,
-                                0, 0);
+zfast_index* fastlzlibIndexCreate(void) {
+  zfast_index *const index = (zfast_index*) malloc(sizeof(zfast_index));
+  if (index != NULL) {
+    index->entries = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->compact = 0;
+    index->compressor = -1;
+    index->csize = 0;
+    index->usize = 0;
+    index->trailer = 0;
   }
-  assert(done <= output_length);
-  return done;
+  return index;
 }
 
-/*
- * Compression and decompression processing routine.
- * The only difference with compression is that the input and output are
- * variables (may change with flush)
- */
-static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
-                                        const int may_buffer) {
-  const Bytef *in = NULL;
-  const uInt prev_avail_in = s->avail_in;
-  const uInt prev_avail_out = s->avail_out;
+void fastlzlibIndexFree(zfast_index *index) {
+  if (index != NULL) {
+    if (index->entries != NULL) {
+      free(index->entries);
+    }
+    free(index);
+  }
+}
 
-  /* returns Z_OK if something was processed, Z_BUF_ERROR otherwise */
-#define PROGRESS_OK() ( ( s->avail_in != prev_avail_in                \
-                          || s->avail_out != prev_avail_out )         \
-                        ? Z_OK : Z_BUF_ERROR )
-  
-  /* sanity check for next_in/next_out */
-  if (s->next_in == NULL && !ZFAST_INPUT_IS_EMPTY(s)) {
-    s->msg = "invalid input";
+int fastlzlibIndexAddBlock(zfast_index *index, const void* input,
+                           int length) {
+  uInt block_type;
+  uInt block_size;
+  uInt str_size;
+  uInt dec_size;
+  if (index == NULL || input == NULL) {
     return Z_STREAM_ERROR;
   }
-  else if (s->next_out == NULL && !ZFAST_OUTPUT_IS_FULL(s)) {
-    s->msg = "invalid output";
+  if (length < HEADER_SIZE) {
+    return Z_BUF_ERROR;
+  }
+  fastlz_read_header((const Bytef*) input, &block_type, &block_size,
+                     &str_size, &dec_size);
+  if (block_type == BLOCK_TYPE_BAD_MAGIC) {
+    return Z_DATA_ERROR;
+  }
+  /* EOF marker */
+  else if (block_type != BLOCK_TYPE_META && str_size == 0 && dec_size == 0) {
+    return Z_STREAM_END;
+  }
+  /* stream header of compact streams */
+  else if (block_type == BLOCK_TYPE_STREAM) {
+    index->compact = 1;
+  }
+  return fastlzlibIndexAppend(index, HEADER_SIZE + str_size, dec_size);
+}
+
+int fastlzlibIndexLookup(const zfast_index *index, zfast_uint64 offset,
+                         zfast_uint64 *compressed_offset,
+                         zfast_uint64 *block_offset) {
+  uInt lo = 0;
+  uInt hi;
+  if (index == NULL || compressed_offset == NULL || block_offset == NULL) {
     return Z_STREAM_ERROR;
   }
-  
-  /* output buffer data to be processed */
-  if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
-    /* maximum size that can be copied */
-    uInt size = s->state->dec_size - s->state->outBuffOffs;
-    if (size > s->avail_out) {
-      size = s->avail_out;
+  if (offset >= index->usize) {
+    if (offset == index->usize) {
+      *compressed_offset = index->csize;
+      *block_offset = index->usize;
+      return Z_OK;
     }
-    /* copy and seek */
-    if (size > 0) {
-      memcpy(s->next_out, &s->state->outBuff[s->state->outBuffOffs], size);
-      s->state->outBuffOffs += size;
-      outSeek(s, size);
+    return Z_BUF_ERROR;
+  }
+  /* last block starting at or before offset (a data block, as meta blocks
+     starting at the same offset come before it) */
+  hi = index->count;
+  while(hi - lo > 1) {
+    const uInt mid = lo + ( hi - lo ) / 2;
+    if (index->entries[mid].uoffs <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
     }
-    /* and return chunk */
-    return PROGRESS_OK();
   }
+  /* restart at the meta blocks preceding the block (checksum) */
+  while(lo != 0 && index->entries[lo - 1].usize == 0
+        && index->entries[lo - 1].uoffs == index->entries[lo].uoffs) {
+    lo--;
+  }
+  *compressed_offset = index->entries[lo].coffs;
+  *block_offset = index->entries[lo].uoffs;
+  return Z_OK;
+}
+
+int fastlzlibIndexSerialize(const zfast_index *index, int block_size,
+                            Bytef *dest, uLongf *destLen) {
+  uLong trailer_size;
+  uLong done = 0;
+  uInt first = 0;
+  if (index == NULL || dest == NULL || destLen == NULL
+      || fastlzlibGetBlockSizeLevel(block_size) == -1) {
+    return Z_STREAM_ERROR;
+  }
+  trailer_size = fastlz_index_trailer_size(index, block_size);
+  if (*destLen < trailer_size) {
+    return Z_BUF_ERROR;
+  }
+  do {
+    done += fastlz_write_index_block(&dest[done], index, first, block_size,
+                                     trailer_size);
+    first += INDEX_BLOCK_ENTRIES(block_size);
+  } while(first < index->count);
+  assert(done == trailer_size);
+  *destLen = done;
+  return Z_OK;
+}
+
+uLong fastlzlibIndexSerializedSize(const zfast_index *index, int block_size) {
+  if (index == NULL || fastlzlibGetBlockSizeLevel(block_size) == -1) {
+    return 0;
+  }
+  return fastlz_index_trailer_size(index, block_size);
+}
+
+int fastlzlibGetIndexSize(const void* input, int length, uInt *size) {
+  const Bytef *const in = (const Bytef*) input;
+  uInt block_type;
+  uInt block_size;
+  uInt str_size;
+  uInt dec_size;
+  if (input == NULL || size == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (length < HEADER_SIZE + 4) {
+    return Z_BUF_ERROR;
+  }
+  /* EOF marker, preceded by the trailer size */
+  fastlz_read_header(&in[length - HEADER_SIZE], &block_type, &block_size,
+                     &str_size, &dec_size);
+  if (block_type != BLOCK_TYPE_COMPRESSED || str_size != 0 || dec_size != 0) {
+    return Z_DATA_ERROR;
+  }
+  *size = (uInt) READ_32(&in[length - HEADER_SIZE - 4]);
+  if (*size < HEADER_SIZE + 2 + 4 || *size > 0x7fffffff - HEADER_SIZE) {
+    return Z_DATA_ERROR;
+  }
+  *size += HEADER_SIZE;
+  return Z_OK;
+}
+
+int fastlzlibIndexLoad(zfast_index *index, const void* input, uLong length) {
+  const Bytef *const in = (const Bytef*) input;
+  uLong offs = 0;
+  if (index == NULL || input == NULL || index->count != 0) {
+    return Z_STREAM_ERROR;
+  }
+  for(;;) {
+    uInt block_type;
+    uInt block_size;
+    uInt str_size;
+    uInt dec_size;
+    const Bytef *p;
+    uInt n;
+    int last;
+    if (length - offs < HEADER_SIZE) {
+      break;
+    }
+    fastlz_read_header(&in[offs], &block_type, &block_size,
+                       &str_size, &dec_size);
+    p = &in[offs + HEADER_SIZE];
+    if (block_type != BLOCK_TYPE_META || dec_size != 0 || str_size < 2
+        || length - offs - HEADER_SIZE < str_size
+        || p[0] != META_TYPE_INDEX) {
+      break;
+    }
+    last = ( p[1] & 1 ) != 0;
+    index->compact = ( p[1] & 2 ) != 0;
+    index->compressor = (int) ( p[1] >> 4 ) - 1;
+    if (str_size < 2 + ( last ? 4 : 0 )
+        || ( str_size - 2 - ( last ? 4 : 0 ) ) % INDEX_ENTRY_SIZE != 0) {
+      break;
+    }
+    for(n = ( str_size - 2 - ( last ? 4 : 0 ) ) / INDEX_ENTRY_SIZE, p += 2
+          ; n != 0 ; n--, p += INDEX_ENTRY_SIZE) {
+      if (fastlzlibIndexAppend(index, (uInt) READ_32(&p[0]),
+                               (uInt) READ_32(&p[4])) != Z_OK) {
+        index->count = 0;
+        index->csize = index->usize = 0;
+        return Z_MEM_ERROR;
+      }
+    }
+    offs += HEADER_SIZE + str_size;
+    /* last block: check trailer size, and (optional) EOF marker */
+    if (last) {
+      if ( (uInt) READ_32(p) == offs
+           && ( offs == length
+                || ( length - offs == HEADER_SIZE
+                     && fastlzlibIndexAddBlock(index, &in[offs], HEADER_SIZE)
+                     == Z_STREAM_END ) ) ) {
+        index->trailer = (uInt) offs;
+        return Z_OK;
+      }
+      break;
+    }
+  }
+  index->count = 0;
+  index->csize = index->usize = 0;
+  index->compact = 0;
+  index->compressor = -1;
+  index->trailer = 0;
+  return Z_DATA_ERROR;
+}
+
+const zfast_index* fastlzlibGetIndex(zfast_stream *s) {
+  if (s == NULL || s->state == NULL) {
+    return NULL;
+  }
+  return s->state->index;
+}
+
+int fastlzlibSeek(zfast_stream *s, const zfast_index *index,
+                  zfast_uint64 offset, zfast_uint64 *compressed_offset) {
+  zfast_uint64 block_offset;
+  int code;
+  if (s == NULL || s->state == NULL || index == NULL
+      || compressed_offset == NULL || !ZFAST_IS_DECOMPRESSING(s)) {
+    return Z_STREAM_ERROR;
+  }
+#ifdef ZFAST_USE_THREADS
+  if (s->state->workers != NULL) {
+    s->msg = "seeking is not supported in multi-threaded mode";
+    return Z_STREAM_ERROR;
+  }
+#endif
+  code = fastlzlibIndexLookup(index, offset, compressed_offset,
+                              &block_offset);
+  if (code != Z_OK) {
+    s->msg = "offset beyond end of stream";
+    return code;
+  }
+  /* restart at the block, skipping its begining */
+  fastlzlibReset(s);
+  /* the compressor meta block is not read again */
+  if (index->compressor >= 0
+      && fastlzlibSelectDecompressor(s->state, index->compressor) != Z_OK) {
+    s->msg = "unsupported compressor";
+    return Z_VERSION_ERROR;
+  }
+  s->state->compact = index->compact;
+  s->state->skip = offset - block_offset;
+  s->total_in = (uLong) *compressed_offset;
+  s->total_out = (uLong) offset;
+  STATS_ADD(&s->state->stats, seeks, 1);
+  return Z_OK;
+}
+
+int fastlzlibCompressAppend(zfast_stream *s, const zfast_index *index,
+                            zfast_uint64 *compressed_offset) {
+  zfast_stream_internal *state;
+  zfast_index *own;
+  uInt i;
+  if (s == NULL || s->state == NULL || compressed_offset == NULL
+      || !ZFAST_IS_COMPRESSING(s)
+      || ( s->state->flags & ZFAST_FLAG_INDEX ) == 0) {
+    return Z_STREAM_ERROR;
+  }
+  state = s->state;
+  if ( ( state->flags & ZFAST_FLAG_LINKED_BLOCKS ) != 0
+       || state->preset != NULL) {
+    s->msg = "streams using linked blocks or a preset dictionary can not be "
+      "appended";
+    return Z_STREAM_ERROR;
+  }
+
+  /* checkpoint: resume the stream just finished */
+  if (index == NULL) {
+    if (!state->eof || state->index == NULL || ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+      s->msg = "the stream is not finished";
+      return Z_STREAM_ERROR;
+    }
+    own = state->index;
+  }
+  /* reopened stream: its blocks are indexed by the new stream */
+  else {
+    if (s->total_in != 0 || s->total_out != 0
+        || ZFAST_HAS_BUFFERED_OUTPUT(s) || state->str_size != 0) {
+      s->msg = "the stream has already started";
+      return Z_STREAM_ERROR;
+    }
+    /* all blocks, contiguous (not the data blocks of a reader) */
+    for(i = 0 ; i < index->count ; i++) {
+      if (index->entries[i].coffs != ( i != 0
+                                       ? index->entries[i - 1].coffs
+                                       + index->entries[i - 1].csize : 0 )) {
+        s->msg = "incomplete index";
+        return Z_DATA_ERROR;
+      }
+    }
+    if (index->compact
+        != ( ( state->flags & ZFAST_FLAG_COMPACT_HEADERS ) != 0 )
+        || index->compressor
+        != ( ( state->flags & ZFAST_FLAG_COMPRESSOR_ID ) != 0
+             ? state->compressor : -1 )) {
+      s->msg = "the stream was compressed using different settings";
+      return Z_STREAM_ERROR;
+    }
+    if (state->index == NULL) {
+      state->index = fastlzlibIndexCreate();
+      if (state->index == NULL) {
+        s->msg = "memory exhausted";
+        return Z_MEM_ERROR;
+      }
+    }
+    own = state->index;
+    own->count = 0;
+    own->csize = own->usize = 0;
+    for(i = 0 ; i < index->count ; i++) {
+      if (fastlzlibIndexAppend(own, index->entries[i].csize,
+                               index->entries[i].usize) != Z_OK) {
+        s->msg = "memory exhausted";
+        return Z_MEM_ERROR;
+      }
+    }
+    own->compact = index->compact;
+    own->compressor = index->compressor;
+    own->trailer = index->trailer;
+    s->total_in = (uLong) index->usize;
+  }
+
+  /* the previous trailer is kept as meta blocks: only the EOF marker is
+     overwritten by the new blocks */
+  if (own->trailer != 0) {
+    if (fastlzlibIndexAppend(own, own->trailer, 0) != Z_OK) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
+    own->trailer = 0;
+  }
+  *compressed_offset = own->csize;
+  s->total_out = (uLong) own->csize;
+  state->eof = 0;
+  state->index_pending = 0;
+  state->index_written = 0;
+  state->compact = own->compact;
+  state->sync_out = s->total_out;
+  state->compressor_pending = 0;
+#ifdef ZFAST_USE_THREADS
+  /* multi-threaded: the EOF marker of the previous stream was flushed */
+  if (state->workers != NULL) {
+    fastlzlibWorkersReset(s);
+  }
+#endif
+  return Z_OK;
+}
+
+/* monotonic clock, in nanoseconds (statistics) and microseconds (adaptive
+   mode) */
+static zfast_uint64 fastlz_clock_nsec(void) {
+#ifdef _WIN32
+  LARGE_INTEGER count;
+  LARGE_INTEGER freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (zfast_uint64) ( count.QuadPart / freq.QuadPart ) * 1000000000
+    + (zfast_uint64) ( count.QuadPart % freq.QuadPart ) * 1000000000
+    / (zfast_uint64) freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (zfast_uint64) ts.tv_sec * 1000000000 + (zfast_uint64) ts.tv_nsec;
+#endif
+}
+
+static ZFASTINLINE zfast_uint64 fastlz_clock_usec(void) {
+  return fastlz_clock_nsec() / 1000;
+}
+
+/* quick compressibility estimate of a block: repeated 4-byte sequences (LZ
+   matches) are looked for in SAMPLES evenly spaced chunks ; returns non-zero
+   if at least "threshold" per mille of the positions repeat a previous one
+   (note: a byte histogram would not do, as LZ4/FastLZ only use matches) */
+static int fastlz_sample_compressible(const Bytef *input, uInt length,
+                                      uInt threshold) {
+  uInt table[1 << 10];
+  const uInt chunk = length > SAMPLES*SAMPLE_SIZE ? SAMPLE_SIZE : length;
+  const uInt stride = length > SAMPLES*SAMPLE_SIZE ? length / SAMPLES : length;
+  uInt hits = 0;
+  uInt probes = 0;
+  uInt offs;
+  memset(table, 0, sizeof(table));
+  for(offs = 0 ; offs + chunk <= length && chunk >= 4 ; offs += stride) {
+    const Bytef *p;
+    for(p = &input[offs] ; p + 4 <= &input[offs + chunk] ; p++) {
+      const uInt v = (uInt) p[0] | ( (uInt) p[1] << 8 )
+        | ( (uInt) p[2] << 16 ) | ( (uInt) p[3] << 24 );
+      const uInt h = ( ( v * 2654435761U ) & 0xffffffff ) >> 22;
+      hits += table[h] == v;
+      table[h] = v;
+      probes++;
+    }
+  }
+  return hits * 1000 >= probes * threshold;
+}
+
+/* number of level steps of adaptive mode ; the slowest step is the stream
+   level (note: FastLZ level 1 is not significantly faster than level 2) */
+static ZFASTINLINE int fastlz_adaptive_steps(const zfast_stream_internal
+                                             *const state) {
+  if (state->compressor == COMPRESSOR_LZ4
+      && state->level == Z_BEST_COMPRESSION) {
+    return ADAPTIVE_STEPS;
+  }
+  return 1;
+}
+
+/* backend level of an adaptive mode step: the fastest level, LZ4HC using
+   1, 2 and 4 attempts per match search, and the stream level */
+static ZFASTINLINE int fastlz_adaptive_level(const zfast_stream_internal
+                                             *const state, int step) {
+  if (step == fastlz_adaptive_steps(state) - 1) {
+    return state->level;
+  }
+  else if (step == 0) {
+    return Z_BEST_SPEED;
+  }
+  return LEVEL_HC(1 << ( step - 1 ));
+}
+
+/* account the speed of the last compressed block, and select the slowest
+   step whose speed is within the target (the next step is probed again
+   every ADAPTIVE_PROBE_INTERVAL blocks) */
+static void fastlz_adaptive_update(zfast_adaptive *const a, int steps,
+                                   uInt target, uInt length,
+                                   zfast_uint64 usec) {
+  const uInt speed = (uInt) ( length / ( usec != 0 ? usec : 1 ) );
+  a->speed[a->step] = a->speed[a->step] != 0
+    ? ( a->speed[a->step]*3 + speed ) / 4 : speed;
+  if (++a->blocks >= ADAPTIVE_PROBE_INTERVAL) {
+    a->blocks = 0;
+    if (a->step + 1 < steps) {
+      a->speed[a->step + 1] = 0;
+    }
+  }
+  if (a->speed[a->step] < target && a->step > 0) {
+    a->step--;
+  }
+  else if (a->step + 1 < steps
+           && ( a->speed[a->step + 1] == 0
+                || a->speed[a->step + 1] >= target ) ) {
+    a->step++;
+  }
+}
+
+/* helper for fastlz_compress */
+static ZFASTINLINE int fastlz_compress_hdr(zfast_stream_internal *const
+                                           state, void *wrk,
+                                           zfast_adaptive *const adaptive,
+                                           zfast_stats *const stats,
+                                           const void* input, uInt length,
+                                           void* output, uInt output_length,
+                                           int block_size, int level,
+                                           int flush) {
+  uInt done = 0;
+  uInt meta = 0;
+  Bytef*const output_start = (Bytef*) output;
+  const int compact = ( state->flags & ZFAST_FLAG_COMPACT_HEADERS ) != 0;
+  /* block checksum: a meta block precedes the checksummed block */
+  if (length > 0 && ( state->flags & ZFAST_FLAG_CHECKSUM ) != 0) {
+    meta = fastlz_write_meta_checksum(output_start, block_size,
+                                      fastlz_crc32c(state, input, length));
+  }
+  if (length > 0) {
+    /* compact header: the compressed size is padded to the size of the
+       uncompressed one, which is an upper bound */
+    const uInt size_len = fastlz_varint_size(length);
+    uInt header_size = compact ? 1 + size_len*2 : HEADER_SIZE;
+    Bytef*const output_block_start = &output_start[meta];
+    void*const output_data_start = &output_block_start[header_size];
+    uInt type;
+    uInt linked = 0;
+    const zfast_uint64 backend_start = STATS_CLOCK();
+    /* compress and fill header after */
+#ifdef ZFAST_USE_LZ4
+    /* linked blocks: always compressed, to keep the history */
+    if ( ( state->flags & ZFAST_FLAG_LINKED_BLOCKS ) != 0) {
+      done = lz4_linked_compress(state, input, length, output_data_start);
+      linked = BLOCK_FLAG_LINKED;
+    } else
+#endif
+    if (length > MIN_BLOCK_SIZE) {
+      /* adaptive mode: incompressible blocks are stored as is, and the level
+         is selected to meet the target speed */
+      const int adapt = adaptive != NULL
+        && ( state->flags & ZFAST_FLAG_ADAPTIVE ) != 0;
+      const int prescan = state->incompressible != 0
+        && ( state->flags & ( ZFAST_FLAG_ADAPTIVE
+                              | ZFAST_FLAG_SKIP_INCOMPRESSIBLE ) ) != 0;
+      const int timed = adapt && state->target_speed != 0;
+      const int steps = timed ? fastlz_adaptive_steps(state) : 1;
+      zfast_uint64 start = 0;
+      if (prescan
+          && !fastlz_sample_compressible((const Bytef*) input, length,
+                                         state->incompressible)) {
+        done = 0;
+      } else {
+        if (timed) {
+          if (adaptive->step >= steps) {
+            adaptive->step = steps - 1;
+          }
+          level = fastlz_adaptive_level(state, adaptive->step);
+          start = fastlz_clock_usec();
+        }
+        if (wrk != NULL) {
+          done = state->compress_wrk(wrk, level, state->table_log,
+                                     input, length, output_data_start);
+        } else {
+          done = state->compress(level, input, length, output_data_start);
+        }
+        if (timed) {
+          fastlz_adaptive_update(adaptive, steps, state->target_speed, length,
+                                 fastlz_clock_usec() - start);
+        }
+      }
+    }
+    STATS_ADD(stats, backend_ns, STATS_CLOCK() - backend_start);
+    if (length > MIN_BLOCK_SIZE || linked != 0) {
+      assert(meta + done + HEADER_SIZE*2 <= output_length);
+      if (done > 0 && done < length) {
+        type = BLOCK_TYPE_COMPRESSED;
+      }
+      /* compressed version is greater ; use raw data */
+      else {
+        type = BLOCK_TYPE_RAW;
+      }
+    }
+    /* store small chunk as raw data */
+    else {
+      assert(meta + length + HEADER_SIZE*2 <= output_length);
+      type = BLOCK_TYPE_RAW;
+    }
+    /* raw data (the compact header is shorter, without uncompressed size) */
+    if (type == BLOCK_TYPE_RAW) {
+      if (compact) {
+        header_size = 1 + size_len;
+      }
+      memcpy(&output_block_start[header_size], input, length);
+      done = length;
+      STATS_ADD(stats, blocks_raw, 1);
+    } else {
+      STATS_ADD(stats, blocks_compressed, 1);
+    }
+    /* write back header */
+    if (compact) {
+      fastlz_write_compact_header(output_block_start, type | linked, done,
+                                  length, size_len);
+    } else {
+      fastlz_write_header(output_block_start, type | linked, block_size,
+                          done, length);
+    }
+    done += meta + header_size;
+  }
+  /* write an EOF marker (empty block with compressed=uncompressed=0) */
+  if (flush == Z_FINISH) {
+    Bytef*const output_end = &output_start[done];
+    if (compact) {
+      WRITE_8(output_end, COMPACT_TYPE_EOF);
+      done++;
+    } else {
+      done += fastlz_write_header(output_end, BLOCK_TYPE_COMPRESSED,
+                                  block_size, 0, 0);
+    }
+  }
+  assert(done <= output_length);
+  return done;
+}
+
+/* output room needed to compress a block of "length" bytes directly on client
+   memory (the block, its checksum meta block and the EOF marker) ; the LZ4
+   bound is much tighter than the generic worst case used for other backends */
+static ZFASTINLINE uInt fastlz_compress_room(const zfast_stream_internal
+                                             *const state, uInt length) {
+  const uInt meta = ( state->flags & ZFAST_FLAG_CHECKSUM ) != 0
+    ? META_CHECKSUM_SIZE : 0;
+#ifdef ZFAST_USE_LZ4
+  if (state->compressor == COMPRESSOR_LZ4) {
+    return LZ4_COMPRESSBOUND(length) + HEADER_SIZE*2 + meta;
+  }
+#endif
+  return length + length / EXPANSION_RATIO + EXPANSION_SECURITY + meta;
+}
+
+/* compress a whole buffer as a standalone stream (the stream header when using
+   compact headers, the blocks and the EOF marker) directly into "dest" ;
+   returns Z_OK, or Z_BUF_ERROR if the destination buffer is too small */
+static int fastlz_compress_buffer(zfast_stream_internal *const state,
+                                  void *wrk, zfast_stats *const stats,
+                                  Bytef *dest, uLongf *destLen,
+                                  const Bytef *source, uLong sourceLen) {
+  const uLong block_size = state->block_size;
+  uLong offs = 0;
+  uLong done = 0;
+  if ( ( state->flags & ZFAST_FLAG_COMPACT_HEADERS ) != 0) {
+    if (*destLen < STREAM_HEADER_SIZE) {
+      return Z_BUF_ERROR;
+    }
+    done = fastlz_write_stream_header(dest, state->block_size);
+  }
+  do {
+    const uLong remaining = sourceLen - offs;
+    const uInt size = (uInt) ( remaining < block_size
+                               ? remaining : block_size );
+    const int flush = offs + size == sourceLen ? Z_FINISH : Z_NO_FLUSH;
+    const uLong needed = fastlz_compress_room(state, size);
+    /* the backend writes directly on client memory */
+    if (*destLen - done < needed) {
+      return Z_BUF_ERROR;
+    }
+    done += fastlz_compress_hdr(state, wrk, NULL, stats,
+                                &source[offs], size,
+                                &dest[done], (uInt) needed,
+                                state->block_size, state->level, flush);
+    offs += size;
+  } while(offs != sourceLen);
+  *destLen = done;
+  return Z_OK;
+}
+
+/* compress a batch item (see fastlzlibCompressBatch()) */
+static void fastlz_compress_item(zfast_stream_internal *const state,
+                                 void *wrk, zfast_stats *const stats,
+                                 zfast_batch_item *const item) {
+  uLongf size = item->avail_out;
+  item->code = fastlz_compress_buffer(state, wrk, stats, item->next_out, &size,
+                                      item->next_in, item->avail_in);
+  item->total_out = item->code == Z_OK ? (uInt) size : 0;
+}
+
+/* check a block header read by fastlz_read_header() */
+static ZFASTINLINE int fastlz_check_header(zfast_stream *const s,
+                                           uInt block_type,
+                                           uInt block_size,
+                                           uInt str_size,
+                                           uInt dec_size) {
+  if (block_type == BLOCK_TYPE_BAD_MAGIC) {
+    s->msg = "corrupted compressed stream (bad magic)";
+    return Z_DATA_ERROR;
+  }
+  else if (block_type != BLOCK_TYPE_RAW
+           && block_type != BLOCK_TYPE_COMPRESSED
+#ifdef ZFAST_USE_LZ4
+           && block_type != ( BLOCK_TYPE_RAW | BLOCK_FLAG_LINKED )
+           && block_type != ( BLOCK_TYPE_COMPRESSED | BLOCK_FLAG_LINKED )
+#endif
+           && block_type != BLOCK_TYPE_META
+           && block_type != BLOCK_TYPE_STREAM
+           ) {
+    s->msg = "corrupted compressed stream (illegal block type)";
+    return Z_VERSION_ERROR;
+  }
+  else if ( ( block_type == BLOCK_TYPE_META
+              || block_type == BLOCK_TYPE_STREAM )
+           && ( str_size == 0 || dec_size != 0 ) ) {
+    s->msg = "corrupted compressed stream (illegal meta block)";
+    return Z_DATA_ERROR;
+  }
+  else if (block_size > BLOCK_SIZE(s)) {
+    s->msg = "block size too large";
+    return Z_VERSION_ERROR;
+  }
+  else if (dec_size > BUFFER_BLOCK_SIZE(s)) {
+    s->msg = "corrupted compressed stream (illegal decompressed size)";
+    return Z_VERSION_ERROR;
+  }
+  else if (str_size > BUFFER_BLOCK_SIZE(s)) {
+    s->msg = "corrupted compressed stream (illegal stream size)";
+    return Z_VERSION_ERROR;
+  }
+  return Z_OK;
+}
+
+/* helper for fastlz_decompress ; returns the decompressed size */
+static ZFASTINLINE int fastlz_decompress_hdr(const zfast_stream_internal *const
+                                             state,
+                                             uInt block_type,
+                                             const void* input, uInt length,
+                                             void* output,
+                                             uInt output_length) {
+  switch(block_type) {
+  case BLOCK_TYPE_COMPRESSED:
+    return state->decompress(input, length, output, output_length);
+  case BLOCK_TYPE_META:
+  case BLOCK_TYPE_STREAM:
+    return 0;
+#ifdef ZFAST_USE_LZ4
+  case BLOCK_TYPE_COMPRESSED | BLOCK_FLAG_LINKED:
+    return lz4_linked_decompress(state, input, length, output, output_length);
+  case BLOCK_TYPE_RAW | BLOCK_FLAG_LINKED:
+#endif
+  case BLOCK_TYPE_RAW:
+    if (output_length >= length) {
+      memcpy(output, input, length);
+      return length;
+    }
+    break;
+  default:
+    assert(0);
+    break;
+  }
+  return 0;
+}
+
+/* allocate the input or output buffer upon first use */
+static ZFASTINLINE int fastlzlibAllocBuffer(zfast_stream *const s,
+                                            Bytef **const buff) {
+  if (*buff == NULL) {
+    *buff = zalloc_block(s, BUFFER_BLOCK_SIZE(s), ZFAST_ALLOC_BUFFER);
+    if (*buff == NULL) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
+  }
+  return Z_OK;
+}
+
+/* append uncompressed data to the linked blocks history buffer */
+static ZFASTINLINE void fastlzlibHistoryAppend(zfast_stream *const s,
+                                               const Bytef *data, uInt size) {
+  zfast_stream_internal *const state = s->state;
+  if (size >= HISTORY_SIZE) {
+    memcpy(state->dict, &data[size - HISTORY_SIZE], HISTORY_SIZE);
+    state->dict_size = HISTORY_SIZE;
+    return;
+  }
+  /* move the history window back to the begining of the buffer */
+  if (state->dict_size + size > HISTORY_BUFFER_SIZE(s)) {
+    memmove(state->dict, &state->dict[state->dict_size - HISTORY_SIZE],
+            HISTORY_SIZE);
+    state->dict_size = HISTORY_SIZE;
+  }
+  memcpy(&state->dict[state->dict_size], data, size);
+  state->dict_size += size;
+}
+
+/* allocate LZ4 streaming state and history buffer of linked blocks */
+static int fastlzlibLinkedInit(zfast_stream *const s) {
+#ifdef ZFAST_USE_LZ4
+  if (s->state->compressor != COMPRESSOR_LZ4) {
+    s->msg = "linked blocks require the LZ4 compressor";
+    return Z_VERSION_ERROR;
+  }
+  if (s->state->dict == NULL) {
+    s->state->dict = zalloc_block(s, HISTORY_BUFFER_SIZE(s),
+                                  ZFAST_ALLOC_HISTORY);
+    s->state->dict_size = 0;
+  }
+  if (s->state->dict != NULL && s->state->wrk == NULL) {
+    s->state->wrk = fastlzlibAllocWork(s);
+    if (s->state->wrk != NULL) {
+      lz4_linked_start(s);
+    }
+  }
+  if (s->state->wrk == NULL || s->state->dict == NULL) {
+    s->msg = "memory exhausted";
+    return Z_MEM_ERROR;
+  }
+  return Z_OK;
+#else
+  s->msg = "linked blocks require the LZ4 compressor";
+  return Z_VERSION_ERROR;
+#endif
+}
+
+/* size of the next index block written by fastlzlibWriteIndex(), including
+   the trailer and the EOF marker after the last one */
+static ZFASTINLINE uInt fastlzlibIndexBlockSize(const zfast_stream *const s) {
+  const zfast_stream_internal *const state = s->state;
+  const zfast_index *const index = state->index;
+  const uInt epb = INDEX_BLOCK_ENTRIES(BLOCK_SIZE(s));
+  const uInt n = index->count - state->index_written < epb
+    ? index->count - state->index_written : epb;
+  const int last = state->index_written + n == index->count;
+  return HEADER_SIZE + 2 + n*INDEX_ENTRY_SIZE + ( last ? 4 + HEADER_SIZE : 0 );
+}
+
+/* write the next index trailer block, and the EOF marker after the last one
+   (compressing) */
+static int fastlzlibWriteIndex(zfast_stream *const s, const int may_buffer) {
+  zfast_stream_internal *const state = s->state;
+  const zfast_index *const index = state->index;
+  const uInt epb = INDEX_BLOCK_ENTRIES(BLOCK_SIZE(s));
+  const uInt n = index->count - state->index_written < epb
+    ? index->count - state->index_written : epb;
+  const int last = state->index_written + n == index->count;
+  const uInt size = fastlzlibIndexBlockSize(s);
+  Bytef *dest;
+  uInt done;
+
+  /* where to write ? */
+  if (s->avail_out >= size) {
+    dest = s->next_out;
+  } else if (may_buffer) {
+    const int code = fastlzlibAllocBuffer(s, &state->outBuff);
+    if (code != Z_OK) {
+      return code;
+    }
+    dest = state->outBuff;
+  } else {
+    s->msg = "need more room on output";
+    return Z_BUF_ERROR;
+  }
+
+  done = fastlz_write_index_block(dest, index, state->index_written,
+                                  BLOCK_SIZE(s),
+                                  fastlz_index_trailer_size(index,
+                                                            BLOCK_SIZE(s)));
+  state->index_written += n;
+  if (last) {
+    state->index->trailer =
+      (uInt) fastlz_index_trailer_size(index, BLOCK_SIZE(s));
+    done += fastlz_write_header(&dest[done], BLOCK_TYPE_COMPRESSED,
+                                BLOCK_SIZE(s), 0, 0);
+    state->index_pending = 0;
+    state->eof = 1;
+  }
+  assert(done == size);
+
+  /* direct, or buffered (flushed by the next call) */
+  if (dest == s->next_out) {
+    outSeek(s, done);
+    if (state->eof) {
+      return Z_STREAM_END;
+    }
+  } else {
+    state->dec_size = done;
+    state->outBuffOffs = 0;
+  }
+  return Z_OK;
+}
+
+/*
+ * Compression and decompression processing routine.
+ * The only difference with compression is that the input and output are
+ * variables (may change with flush)
+ */
+static ZFASTINLINE int fastlzlibProcess(zfast_stream *const s, const int flush,
+                                        const int may_buffer) {
+  const Bytef *in = NULL;
+  const uInt prev_avail_in = s->avail_in;
+  const uInt prev_avail_out = s->avail_out;
+
+  /* returns Z_OK if something was processed, Z_BUF_ERROR otherwise */
+#define PROGRESS_OK() ( ( s->avail_in != prev_avail_in                \
+                          || s->avail_out != prev_avail_out )         \
+                        ? Z_OK : Z_BUF_ERROR )
+  
+  /* sanity check for next_in/next_out */
+  if (s->next_in == NULL && !ZFAST_INPUT_IS_EMPTY(s)) {
+    s->msg = "invalid input";
+    return Z_STREAM_ERROR;
+  }
+  else if (s->next_out == NULL && !ZFAST_OUTPUT_IS_FULL(s)) {
+    s->msg = "invalid output";
+    return Z_STREAM_ERROR;
+  }
+  
+  /* output buffer data to be processed */
+  if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+    /* maximum size that can be copied */
+    uInt size = s->state->dec_size - s->state->outBuffOffs;
+    if (size > s->avail_out) {
+      size = s->avail_out;
+    }
+    /* copy and seek */
+    if (size > 0) {
+      memcpy(s->next_out, &s->state->outBuff[s->state->outBuffOffs], size);
+      STATS_ADD(&s->state->stats, bytes_buffered_out, size);
+      s->state->outBuffOffs += size;
+      outSeek(s, size);
+    }
+    /* the EOF marker has been flushed */
+    if (s->state->eof && !ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+      return Z_STREAM_END;
+    }
+    /* and return chunk */
+    return PROGRESS_OK();
+  }
+
+  /* read next block (note: output buffer is empty here) */
+  else if (s->state->str_size == 0) {
+    /* for error reporting only */
+    uInt block_size = 0;
+
+    /* decompressing: header is present */
+    if (ZFAST_IS_DECOMPRESSING(s)) {
+      uInt block_type;
+      uInt str_size;
+      uInt dec_size;
+      uInt hdr_size;
+
+      /* waiting for the preset dictionary */
+      if (s->state->preset_pending) {
+        s->adler = s->state->pending_id;
+        return Z_NEED_DICT;
+      }
+
+      /* sync to a block */
+      if (flush == Z_SYNC_FLUSH && s->state->inHdrOffs == 0) {
+        return Z_NEED_DICT;
+      }
+      
+      /* header on client region */
+      if (s->state->inHdrOffs == 0
+          && ( hdr_size = fastlz_read_any_header(s->state->compact,
+                                                 s->next_in, s->avail_in,
+                                                 BLOCK_SIZE(s),
+                                                 &block_type, &block_size,
+                                                 &str_size, &dec_size) )
+          != 0) {
+        /* not buffered: check if we can do the job at once */
+        if (!may_buffer) {
+          /* input buffer too small */
+          if (s->avail_in - hdr_size < str_size) {
+            s->msg = "need more data on input";
+            return Z_BUF_ERROR;
+          }
+          /* output buffer too small */
+          else if (s->avail_out < dec_size) {
+            s->msg = "need more room on output";
+            return Z_BUF_ERROR;
+          }
+        }
+        inSeek(s, hdr_size);
+      }
+      /* header read in progress or will be in multiple passes (sheesh) */
+      else {
+        /* we are to go buffered for the header - check if this is allowed */
+        if (s->state->inHdrOffs == 0 && !may_buffer) {
+          s->msg = "need more data on input";
+          return Z_BUF_ERROR;
+        }
+        /* copy bytes until the header is complete */
+        do {
+          if (s->avail_in == 0) {
+            /* please come back later (header not fully processed) */
+            return PROGRESS_OK();
+          }
+          s->state->inHdr[s->state->inHdrOffs++] = *s->next_in;
+          inSeek(s, 1);
+          hdr_size = fastlz_read_any_header(s->state->compact,
+                                            s->state->inHdr,
+                                            s->state->inHdrOffs,
+                                            BLOCK_SIZE(s),
+                                            &block_type, &block_size,
+                                            &str_size, &dec_size);
+        } while(hdr_size == 0);
+        s->state->inHdrOffs = 0;
+      }
+
+      /* apply/eat the header and continue */
+      s->state->block_type = block_type;
+      s->state->str_size = str_size;
+      s->state->dec_size = dec_size;
+
+      /* compressed and uncompressed == 0 : EOF marker */
+      if (s->state->str_size == 0 && s->state->dec_size == 0) {
+        return Z_STREAM_END;
+      }
+    }
+    /* compressing: fixed input size (unless flush) */
+    else {
+      uInt block_type = BLOCK_TYPE_COMPRESSED;
+      uInt str_size = BLOCK_SIZE(s);
+
+      /* stream already finished */
+      if (s->state->eof) {
+        return Z_STREAM_END;
+      }
+
+      /* linked blocks: the LZ4 streaming state and history are needed */
+      if ( ( s->state->flags & ZFAST_FLAG_LINKED_BLOCKS ) != 0) {
+        const int code = fastlzlibLinkedInit(s);
+        if (code != Z_OK) {
+          return code;
+        }
+      }
+
+      /* index: allocated when the first block is written */
+      if ( ( s->state->flags & ZFAST_FLAG_INDEX ) != 0
+           && s->state->index == NULL) {
+        s->state->index = fastlzlibIndexCreate();
+        if (s->state->index == NULL) {
+          s->msg = "memory exhausted";
+          return Z_MEM_ERROR;
+        }
+      }
+
+      /* index trailer, followed by the EOF marker */
+      if (s->state->index_pending) {
+        return fastlzlibWriteIndex(s, may_buffer);
+      }
+
+      /* compact headers: stream header, repeated as a sync marker */
+      if (ZFAST_SYNC_PENDING(s)) {
+        const uLong sync_out = s->total_out;
+        if (s->avail_out >= STREAM_HEADER_SIZE) {
+          outSeek(s, fastlz_write_stream_header(s->next_out, BLOCK_SIZE(s)));
+        } else if (may_buffer) {
+          const int code = fastlzlibAllocBuffer(s, &s->state->outBuff);
+          if (code != Z_OK) {
+            return code;
+          }
+          s->state->dec_size =
+            fastlz_write_stream_header(s->state->outBuff, BLOCK_SIZE(s));
+          s->state->outBuffOffs = 0;
+        } else {
+          s->msg = "need more room on output";
+          return Z_BUF_ERROR;
+        }
+        s->state->sync_out = sync_out;
+        s->state->compact = 1;
+        /* the compressor id follows each sync marker */
+        s->state->compressor_pending =
+          ( s->state->flags & ZFAST_FLAG_COMPRESSOR_ID ) != 0;
+        if (s->state->index != NULL) {
+          s->state->index->compact = 1;
+          if (fastlzlibIndexAppend(s->state->index, STREAM_HEADER_SIZE, 0)
+              != Z_OK) {
+            s->msg = "memory exhausted";
+            return Z_MEM_ERROR;
+          }
+        }
+        return Z_OK;
+      }
+
+      /* compressor id: the decoder selects its backend accordingly */
+      if (s->state->compressor_pending && s->state->compressor < 0) {
+        s->state->compressor_pending = 0;
+      }
+      else if (s->state->compressor_pending) {
+        if (s->avail_out >= META_COMPRESSOR_SIZE) {
+          outSeek(s, fastlz_write_meta_compressor(s->next_out, BLOCK_SIZE(s),
+                                                  s->state->compressor));
+        } else if (may_buffer) {
+          const int code = fastlzlibAllocBuffer(s, &s->state->outBuff);
+          if (code != Z_OK) {
+            return code;
+          }
+          s->state->dec_size =
+            fastlz_write_meta_compressor(s->state->outBuff, BLOCK_SIZE(s),
+                                         s->state->compressor);
+          s->state->outBuffOffs = 0;
+        } else {
+          s->msg = "need more room on output";
+          return Z_BUF_ERROR;
+        }
+        s->state->compressor_pending = 0;
+        if (s->state->index != NULL) {
+          s->state->index->compressor = s->state->compressor;
+          if (fastlzlibIndexAppend(s->state->index, META_COMPRESSOR_SIZE, 0)
+              != Z_OK) {
+            s->msg = "memory exhausted";
+            return Z_MEM_ERROR;
+          }
+        }
+        return Z_OK;
+      }
+
+      /* preset dictionary: write its id before the first block */
+      if (s->state->preset_pending) {
+        if (s->avail_out >= META_DICTIONARY_SIZE) {
+          outSeek(s, fastlz_write_meta_dictionary(s->next_out, BLOCK_SIZE(s),
+                                                  s->state->preset_id));
+        } else if (may_buffer) {
+          const int code = fastlzlibAllocBuffer(s, &s->state->outBuff);
+          if (code != Z_OK) {
+            return code;
+          }
+          s->state->dec_size =
+            fastlz_write_meta_dictionary(s->state->outBuff, BLOCK_SIZE(s),
+                                         s->state->preset_id);
+          s->state->outBuffOffs = 0;
+        } else {
+          s->msg = "need more room on output";
+          return Z_BUF_ERROR;
+        }
+        s->state->preset_pending = 0;
+        if (s->state->index != NULL
+            && fastlzlibIndexAppend(s->state->index, META_DICTIONARY_SIZE, 0)
+            != Z_OK) {
+          s->msg = "memory exhausted";
+          return Z_MEM_ERROR;
+        }
+        return Z_OK;
+      }
+
+      /* not enough room on input */
+      if (str_size > s->avail_in) {
+        if (flush > Z_NO_FLUSH) {
+          str_size = s->avail_in;
+        } else if (!may_buffer) {
+          s->msg = "need more data on input";
+          return Z_BUF_ERROR;
+        }
+      }
+
+      /* not buffered: the worst case must fit (see CompressNeeded) */
+      if (!may_buffer
+          && s->avail_out < fastlz_compress_room(s->state, str_size)) {
+        s->msg = "need more room on output";
+        return Z_BUF_ERROR;
+      }
+
+      /* apply/eat the header and continue */
+      s->state->block_type = block_type;
+      s->state->str_size = str_size;
+      s->state->dec_size = 0;  /* yet unknown */
+    }
+    
+    /* output not buffered yet */
+    s->state->outBuffOffs = s->state->dec_size;
+
+    /* sanity check */
+    {
+      const int code = fastlz_check_header(s, s->state->block_type,
+                                           block_size, s->state->str_size,
+                                           s->state->dec_size);
+      if (code != Z_OK) {
+        return code;
+      }
+    }
+
+    /* linked blocks: history is needed */
+    if ( ( s->state->block_type & BLOCK_FLAG_LINKED ) != 0
+         && s->state->dict == NULL) {
+      s->state->dict = zalloc_block(s, HISTORY_BUFFER_SIZE(s),
+                                    ZFAST_ALLOC_HISTORY);
+      if (s->state->dict == NULL) {
+        s->msg = "memory exhausted";
+        return Z_MEM_ERROR;
+      }
+    }
+    
+    /* direct data fully available (ie. complete compressed block) ? */
+    if (s->avail_in >= s->state->str_size) {
+      in = s->next_in;
+      inSeek(s, s->state->str_size);
+      STATS_ADD(&s->state->stats, bytes_direct_in, s->state->str_size);
+    }
+    /* otherwise, buffered */
+    else {
+      s->state->inBuffOffs = 0;
+    }
+  }
+
+  /* notes: */
+  /* - header always processed at this point */
+  /* - no output buffer data to be processed (outBuffOffs == 0) */
+ 
+  /* buffered data: copy as much as possible to inBuff until we have the
+     block data size */
+  if (in == NULL) {
+    /* remaining data to copy in input buffer */
+    if (s->state->inBuffOffs < s->state->str_size) {
+      uInt size = s->state->str_size - s->state->inBuffOffs;
+      if (size > s->avail_in) {
+        size = s->avail_in;
+      }
+      if (size > 0) {
+        const int code = fastlzlibAllocBuffer(s, &s->state->inBuff);
+        if (code != Z_OK) {
+          return code;
+        }
+        memcpy(&s->state->inBuff[s->state->inBuffOffs], s->next_in, size);
+        s->state->inBuffOffs += size;
+        inSeek(s, size);
+        STATS_ADD(&s->state->stats, bytes_buffered_in, size);
+      }
+    }
+    /* block stream size (ie. compressed one) reached */
+    if (s->state->inBuffOffs == s->state->str_size) {
+      in = s->state->inBuff;
+      /* we are about to eat buffered data */
+      s->state->inBuffOffs = 0;
+    }
+    /* forced flush: adjust str_size */
+    else if (ZFAST_IS_COMPRESSING(s) && flush != Z_NO_FLUSH) {
+      in = s->state->inBuff;
+      s->state->str_size = s->state->inBuffOffs;
+      /* we are about to eat buffered data, reset it (now empty) */
+      s->state->inBuffOffs = 0;
+    }
+  }
+
+  /* we have a complete compressed block (str_size) : where to uncompress ? */
+  if (in != NULL) {
+    Bytef *out = NULL;
+    const uInt in_size = s->state->str_size;
+
+    int flush_now = flush;
+    /* we are supposed to finish, but we did not eat all data: ignore for now */
+    if (flush_now == Z_FINISH && !ZFAST_INPUT_IS_EMPTY(s)) {
+      flush_now = Z_NO_FLUSH;
+    }
+
+    /* stream header: compact headers follow */
+    if (ZFAST_IS_DECOMPRESSING(s)
+        && s->state->block_type == BLOCK_TYPE_STREAM) {
+      /* input eaten */
+      s->state->str_size = 0;
+      if (in[0] != STREAM_VERSION_COMPACT) {
+        s->msg = "unsupported stream version";
+        return Z_VERSION_ERROR;
+      }
+      s->state->compact = 1;
+    }
+    /* meta block: no output */
+    else if (ZFAST_IS_DECOMPRESSING(s)
+             && s->state->block_type == BLOCK_TYPE_META) {
+      /* input eaten */
+      s->state->str_size = 0;
+
+      /* preset dictionary: expected as initial history */
+      if (in[0] == META_TYPE_DICTIONARY) {
+        if (in_size != 1 + 4) {
+          s->msg = "corrupted compressed stream (illegal meta block)";
+          return Z_DATA_ERROR;
+        }
+        s->state->pending_id = (uInt) READ_32(&in[1]);
+        s->state->preset_pending = 1;
+        if (s->state->preset != NULL
+            && s->state->preset_id == s->state->pending_id) {
+          const int code = fastlzlibLoadPreset(s);
+          if (code != Z_OK) {
+            return code;
+          }
+        } else {
+          s->adler = s->state->pending_id;
+          return Z_NEED_DICT;
+        }
+      }
+      /* block checksum: verified after the next block */
+      else if (in[0] == META_TYPE_CHECKSUM) {
+        if (in_size != 1 + 4) {
+          s->msg = "corrupted compressed stream (illegal meta block)";
+          return Z_DATA_ERROR;
+        }
+        s->state->checksum = (uInt) READ_32(&in[1]);
+        s->state->checksum_pending = 1;
+      }
+      /* backend of the following blocks */
+      else if (in[0] == META_TYPE_COMPRESSOR) {
+        if (in_size != 1 + 1) {
+          s->msg = "corrupted compressed stream (illegal meta block)";
+          return Z_DATA_ERROR;
+        }
+        if (fastlzlibSelectDecompressor(s->state, in[1]) != Z_OK) {
+          s->msg = "unsupported compressor";
+          return Z_VERSION_ERROR;
+        }
+      }
+      /* other subtypes are skipped */
+    }
+    /* decompressing */
+    else if (ZFAST_IS_DECOMPRESSING(s)) {
+      int done;
+      const uInt out_size = s->state->dec_size;
+      zfast_uint64 backend_start;
+
+      /* can decompress directly on client memory (unless seeking) */
+      if (s->avail_out >= s->state->dec_size && s->state->skip == 0) {
+        out = s->next_out;
+        outSeek(s, s->state->dec_size);
+        STATS_ADD(&s->state->stats, bytes_direct_out, out_size);
+        /* no buffer */
+        s->state->outBuffOffs = s->state->dec_size;
+      }
+      /* otherwise in output buffer */
+      else {
+        const int code = fastlzlibAllocBuffer(s, &s->state->outBuff);
+        if (code != Z_OK) {
+          return code;
+        }
+        out = s->state->outBuff;
+        s->state->outBuffOffs = 0;
+      }
+
+      /* input eaten */
+      s->state->str_size = 0;
+
+      /* rock'in */
+      backend_start = STATS_CLOCK();
+      done = fastlz_decompress_hdr(s->state, s->state->block_type,
+                                   in, in_size, out, out_size);
+      STATS_ADD(&s->state->stats, backend_ns, STATS_CLOCK() - backend_start);
+      if ( ( s->state->block_type & ~BLOCK_FLAG_LINKED ) == BLOCK_TYPE_RAW) {
+        STATS_ADD(&s->state->stats, blocks_raw, 1);
+      } else {
+        STATS_ADD(&s->state->stats, blocks_compressed, 1);
+      }
+      if (done != (int) s->state->dec_size) {
+        s->msg = "unable to decompress block stream";
+        return Z_STREAM_ERROR;
+      }
+
+      /* verify the block while it is still in cache */
+      if (s->state->checksum_pending) {
+        s->state->checksum_pending = 0;
+        if (fastlz_crc32c(s->state, out, out_size) != s->state->checksum) {
+          s->msg = "corrupted compressed stream (incorrect block checksum)";
+          return Z_DATA_ERROR;
+        }
+      }
+
+      /* keep history for next linked blocks */
+      if ( ( s->state->block_type & BLOCK_FLAG_LINKED ) != 0) {
+        fastlzlibHistoryAppend(s, out, out_size);
+      }
+
+      /* seeking: skip the begining of the buffered block */
+      if (s->state->skip != 0) {
+        const uInt size = s->state->skip < out_size
+          ? (uInt) s->state->skip : out_size;
+        s->state->outBuffOffs += size;
+        s->state->skip -= size;
+      }
+    }
+    /* compressing */
+    else {
+      /* note: if < MIN_BLOCK_SIZE, fastlz_compress_hdr will not compress */
+      const uInt estimated_dec_size = fastlz_compress_room(s->state, in_size);
+      uInt done;
+
+      /* index: the trailer is written before the EOF marker */
+      if (flush_now == Z_FINISH && s->state->index != NULL) {
+        flush_now = Z_SYNC_FLUSH;
+        s->state->index_pending = 1;
+      }
+
+      /* backend work area, kept for the stream lifetime */
+      if (s->state->wrk == NULL && in_size > MIN_BLOCK_SIZE) {
+        s->state->wrk = fastlzlibAllocWork(s);
+      }
+
+      /* can compress directly on client memory */
+      if (s->avail_out >= estimated_dec_size) {
+        done = fastlz_compress_hdr(s->state, s->state->wrk,
+                                   &s->state->adaptive, &s->state->stats,
+                                   in, in_size,
+                                   s->next_out, estimated_dec_size,
+                                   BLOCK_SIZE(s),
+                                   s->state->level,
+                                   flush_now);
+        /* seek output */
+        outSeek(s, done);
+        STATS_ADD(&s->state->stats, bytes_direct_out, done);
+        /* no buffer */
+        s->state->outBuffOffs = s->state->dec_size;
+      }
+      /* otherwise in output buffer */
+      else {
+        const int code = fastlzlibAllocBuffer(s, &s->state->outBuff);
+        if (code != Z_OK) {
+          return code;
+        }
+        done = fastlz_compress_hdr(s->state, s->state->wrk,
+                                   &s->state->adaptive, &s->state->stats,
+                                   in, in_size,
+                                   s->state->outBuff,
+                                   BUFFER_BLOCK_SIZE(s),
+                                   BLOCK_SIZE(s),
+                                   s->state->level,
+                                   flush_now);
+        /* produced size (in outBuff) */
+        s->state->dec_size = done;
+        /* buffered */
+        s->state->outBuffOffs = 0;
+      }
+
+      /* input eaten */
+      s->state->str_size = 0;
+
+      /* EOF marker written */
+      if (flush_now == Z_FINISH) {
+        s->state->eof = 1;
+      }
+
+      /* empty final block: nothing written, the trailer follows at once */
+      if (s->state->index_pending && done == 0) {
+        return fastlzlibWriteIndex(s, may_buffer);
+      }
+
+      /* index: record the block (and its checksum meta block) */
+      if (s->state->index != NULL && in_size != 0) {
+        uInt size = done - ( s->state->eof ? HEADER_SIZE : 0 );
+        int code = Z_OK;
+        if ( ( s->state->flags & ZFAST_FLAG_CHECKSUM ) != 0) {
+          code = fastlzlibIndexAppend(s->state->index, META_CHECKSUM_SIZE, 0);
+          size -= META_CHECKSUM_SIZE;
+        }
+        if (code != Z_OK
+            || fastlzlibIndexAppend(s->state->index, size, in_size) != Z_OK) {
+          s->msg = "memory exhausted";
+          return Z_MEM_ERROR;
+        }
+      }
+    }
+  }
+
+  /* new output buffer data to be processed ; same logic as begining */
+  if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+    /* maximum size that can be copied */
+    uInt size = s->state->dec_size - s->state->outBuffOffs;
+    if (size > s->avail_out) {
+      size = s->avail_out;
+    }
+    /* copy and seek */
+    if (size > 0) {
+      memcpy(s->next_out, &s->state->outBuff[s->state->outBuffOffs], size);
+      STATS_ADD(&s->state->stats, bytes_buffered_out, size);
+      s->state->outBuffOffs += size;
+      outSeek(s, size);
+    }
+  }
+
+  /* so far so good */
+
+  /* success and EOF */
+  if (flush == Z_FINISH
+      && ZFAST_INPUT_IS_EMPTY(s)
+      && !ZFAST_HAS_BUFFERED_OUTPUT(s)
+      && !s->state->index_pending) {
+    if (!ZFAST_IS_DECOMPRESSING(s)) {
+      return Z_STREAM_END;
+    }
+    /* we are supposed to be done in decompressing but did not see any EOF */
+    else {
+      s->msg = "unexpected EOF";
+      return Z_BUF_ERROR;
+    }
+  }
+  /* success */
+  else {
+    return PROGRESS_OK();
+  }
+#undef PROGRESS_OK
+}
+
+/* same as fastlzlibProcess(), but retry once if first call did not produce any
+   data (ie. only modified the state machine) */
+static ZFASTINLINE int fastlzlibProcess2(zfast_stream *const s, const int flush,
+                                         const int may_buffer) {
+  const uInt prev_avail_in = s->avail_in;
+  const uInt prev_avail_out = s->avail_out;
+  const int success = fastlzlibProcess(s, flush, may_buffer);
+  const uInt avail_in = s->avail_in;
+  const uInt avail_out = s->avail_out;
+  /* successful, ate input, no data on output ? */
+  if (success == 0
+      && avail_out == prev_avail_out && avail_in != prev_avail_in
+      && flush != Z_NO_FLUSH) {
+    return fastlzlibProcess(s, flush, may_buffer);
+  } else {
+    return success;
+  }
+}
+
+#ifdef ZFAST_USE_THREADS
+
+/* maximum number of worker threads */
+#define MAX_THREADS 256
+
+/* number of blocks in flight per worker thread */
+#define JOBS_PER_THREAD 2
+
+/* job status */
+#define JOB_FREE     0  /* unused */
+#define JOB_FILLING  1  /* header and/or input being filled by the client */
+#define JOB_QUEUED   2  /* queued or being processed by a worker thread */
+#define JOB_DONE     3  /* processed ; output to be flushed to the client */
+
+/* a block processed by a worker thread */
+typedef struct zfast_job {
+  /* job status (JOB_*) */
+  int status;
+  /* flush mode for this block (compressing) */
+  int flush;
+  /* block header and data read so far, and size of the header once
+     complete (decompressing) */
+  Bytef hdr[HEADER_SIZE];
+  uInt hdr_offs;
+  uInt hdr_size;
+  uInt block_type;
+  uInt str_size;
+  /* block input data */
+  Bytef *inBuff;
+  uInt in_size;
+  /* block output data, and offset of data already flushed to the client */
+  Bytef *outBuff;
+  uInt out_size;
+  uInt out_offs;
+  /* block checksum to be verified (decompressing) */
+  int verify;
+  uInt checksum;
+  /* backend of the block, selected when it was queued (decompressing) */
+  int (*decompress)(const void* input, int length, void* output, int maxout);
+  /* processing result (Z_OK upon success) */
+  int code;
+} zfast_job;
+
+/* a worker thread */
+typedef struct zfast_worker {
+  /* the worker pool */
+  struct zfast_workers *w;
+  pthread_t thread;
+  /* backend work area of this thread (see fastlzlibAllocWork) */
+  void *wrk;
+  /* adaptive mode level selection of this thread */
+  zfast_adaptive adaptive;
+} zfast_worker;
+
+/* worker threads and their jobs ring */
+typedef struct zfast_workers {
+  /* the owning stream state (backend, level and block size) */
+  zfast_stream_internal *state;
+
+  pthread_mutex_t lock;
+  /* signaled when a job is queued, or upon shutdown */
+  pthread_cond_t queued;
+  /* signaled when a job is done */
+  pthread_cond_t done;
+
+  zfast_worker *threads;
+  int nthreads;
+  int shutdown;
+  /* backend work areas have been allocated */
+  int wrk_ready;
+
+  /* jobs ring ; job sequence number "n" is stored in jobs[n % njobs] */
+  zfast_job *jobs;
+  uInt njobs;
+  /* oldest job, the next one to be flushed to the client */
+  uInt head;
+  /* job being filled ; all jobs in [head .. tail[ are queued or done */
+  uInt tail;
+  /* next job to be picked by a worker thread */
+  uInt next;
+  /* the EOF marker has been queued (compressing) or read (decompressing) */
+  int finished;
+  /* checksum of the next block to be queued (decompressing) */
+  int checksum_pending;
+  uInt checksum;
+  /* meta blocks preceding the oldest job (compressing: sync marker and
+     compressor id, which depend on the stream position), and whether they
+     were written */
+  Bytef meta[STREAM_HEADER_SIZE + META_COMPRESSOR_SIZE];
+  uInt meta_size;
+  uInt meta_offs;
+  int meta_done;
+  /* batch being compressed (see fastlzlibCompressBatch()) ; items from
+     batch_next are to be picked, batch_pending ones are not done yet */
+  zfast_batch_item *batch;
+  uInt batch_count;
+  uInt batch_next;
+  uInt batch_pending;
+  /* statistics counters of the worker threads (moved to the stream ones
+     when the threads are stopped) */
+  zfast_stats stats;
+} zfast_workers;
+
+#define JOB_AT(W, N) ( &(W)->jobs[(N) % (W)->njobs] )
+
+/* worker thread: process queued jobs until shutdown */
+static void* fastlzlibWorker(void *arg) {
+  zfast_worker *const self = (zfast_worker*) arg;
+  zfast_workers *const w = self->w;
+  pthread_mutex_lock(&w->lock);
+  for(;;) {
+    if (w->next != w->tail) {
+      zfast_job *const job = JOB_AT(w, w->next);
+      zfast_stream_internal *const state = w->state;
+      zfast_stats stats;
+      w->next++;
+      pthread_mutex_unlock(&w->lock);
+      memset(&stats, 0, sizeof(stats));
+      if (state->level != ZFAST_LEVEL_DECOMPRESS) {
+        job->out_size = fastlz_compress_hdr(state, self->wrk,
+                                            &self->adaptive, &stats,
+                                            job->inBuff, job->in_size,
+                                            job->outBuff,
+                                            BUFFER_SIZE_FOR_BLOCK(state
+                                                                  ->block_size),
+                                            state->block_size, state->level,
+                                            job->flush);
+        job->code = Z_OK;
+      } else {
+        const zfast_uint64 backend_start = STATS_CLOCK();
+        const int done = job->block_type == BLOCK_TYPE_COMPRESSED
+          ? job->decompress(job->inBuff, job->in_size,
+                            job->outBuff, job->out_size)
+          : fastlz_decompress_hdr(state, job->block_type,
+                                  job->inBuff, job->in_size,
+                                  job->outBuff, job->out_size);
+        STATS_ADD(&stats, backend_ns, STATS_CLOCK() - backend_start);
+        if (job->block_type == BLOCK_TYPE_COMPRESSED) {
+          STATS_ADD(&stats, blocks_compressed, 1);
+        } else if (job->block_type == BLOCK_TYPE_RAW) {
+          STATS_ADD(&stats, blocks_raw, 1);
+        }
+        job->code = done == (int) job->out_size ? Z_OK : Z_STREAM_ERROR;
+        /* verify the block while it is still in cache */
+        if (job->code == Z_OK && job->verify
+            && fastlz_crc32c(state, job->outBuff, job->out_size)
+            != job->checksum) {
+          job->code = Z_DATA_ERROR;
+        }
+      }
+      job->out_offs = 0;
+      pthread_mutex_lock(&w->lock);
+#ifdef ZFAST_USE_STATS
+      fastlz_stats_merge(&w->stats, &stats);
+#endif
+      job->status = JOB_DONE;
+      pthread_cond_broadcast(&w->done);
+    } else if (w->batch_next < w->batch_count) {
+      zfast_batch_item *const item = &w->batch[w->batch_next++];
+      zfast_stats stats;
+      pthread_mutex_unlock(&w->lock);
+      memset(&stats, 0, sizeof(stats));
+      fastlz_compress_item(w->state, self->wrk, &stats, item);
+      pthread_mutex_lock(&w->lock);
+#ifdef ZFAST_USE_STATS
+      fastlz_stats_merge(&w->stats, &stats);
+#endif
+      if (--w->batch_pending == 0) {
+        pthread_cond_broadcast(&w->done);
+      }
+    } else if (w->shutdown) {
+      break;
+    } else {
+      pthread_cond_wait(&w->queued, &w->lock);
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* stop worker threads and free all jobs */
+static void fastlzlibWorkersFree(zfast_stream *s) {
+  zfast_workers *const w = s->state->workers;
+  int i;
+  uInt j;
+  pthread_mutex_lock(&w->lock);
+  w->shutdown = 1;
+  pthread_cond_broadcast(&w->queued);
+  pthread_mutex_unlock(&w->lock);
+  for(i = 0 ; i < w->nthreads ; i++) {
+    pthread_join(w->threads[i].thread, NULL);
+  }
+#ifdef ZFAST_USE_STATS
+  fastlz_stats_merge(&s->state->stats, &w->stats);
+#endif
+  pthread_cond_destroy(&w->done);
+  pthread_cond_destroy(&w->queued);
+  pthread_mutex_destroy(&w->lock);
+  if (w->jobs != NULL) {
+    for(j = 0 ; j < w->njobs ; j++) {
+      if (w->jobs[j].inBuff != NULL) {
+        zfree_block(s, w->jobs[j].inBuff);
+      }
+      if (w->jobs[j].outBuff != NULL) {
+        zfree_block(s, w->jobs[j].outBuff);
+      }
+    }
+    zfree(s, w->jobs);
+  }
+  if (w->threads != NULL) {
+    zfree(s, w->threads);
+  }
+  zfree(s, w);
+  s->state->workers = NULL;
+}
+
+/* free the backend work areas of worker threads ; queued jobs are waited,
+   and the jobs ring is kept (data being filled or not yet flushed) */
+static void fastlzlibWorkersFreeWork(zfast_stream *s) {
+  zfast_workers *const w = s->state->workers;
+  int i;
+  uInt j;
+  pthread_mutex_lock(&w->lock);
+  for(j = 0 ; j < w->njobs ; j++) {
+    while(w->jobs[j].status == JOB_QUEUED) {
+      pthread_cond_wait(&w->done, &w->lock);
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+  for(i = 0 ; i < w->nthreads ; i++) {
+    if (w->threads[i].wrk != NULL) {
+      zfree_block(s, w->threads[i].wrk);
+      w->threads[i].wrk = NULL;
+    }
+  }
+  w->wrk_ready = 0;
+}
+
+/* allocate the backend work areas of worker threads */
+static ZFASTINLINE void fastlzlibWorkersAllocWork(zfast_stream *s) {
+  zfast_workers *const w = s->state->workers;
+  int i;
+  for(i = 0 ; i < w->nthreads ; i++) {
+    w->threads[i].wrk = fastlzlibAllocWork(s);
+  }
+  w->wrk_ready = 1;
+}
+
+/* compress the items of a batch, the calling thread taking its share */
+static void fastlzlibWorkersBatch(zfast_stream *s, zfast_batch_item *items,
+                                  uInt count) {
+  zfast_workers *const w = s->state->workers;
+  if (!w->wrk_ready) {
+    fastlzlibWorkersAllocWork(s);
+  }
+  pthread_mutex_lock(&w->lock);
+  w->batch = items;
+  w->batch_count = count;
+  w->batch_next = 0;
+  w->batch_pending = count;
+  pthread_cond_broadcast(&w->queued);
+  while(w->batch_next < w->batch_count) {
+    zfast_batch_item *const item = &w->batch[w->batch_next++];
+    pthread_mutex_unlock(&w->lock);
+    fastlz_compress_item(s->state, s->state->wrk, &s->state->stats, item);
+    pthread_mutex_lock(&w->lock);
+    w->batch_pending--;
+  }
+  while(w->batch_pending != 0) {
+    pthread_cond_wait(&w->done, &w->lock);
+  }
+  w->batch = NULL;
+  w->batch_count = w->batch_next = 0;
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* start "nthreads" worker threads */
+static int fastlzlibWorkersInit(zfast_stream *s, int nthreads) {
+  zfast_workers *w;
+  uInt j;
+  if (nthreads > MAX_THREADS) {
+    nthreads = MAX_THREADS;
+  }
+  w = (zfast_workers*) zalloc(s, sizeof(zfast_workers), 1);
+  if (w == NULL) {
+    s->msg = "memory exhausted";
+    return Z_MEM_ERROR;
+  }
+  memset(w, 0, sizeof(zfast_workers));
+  w->state = s->state;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->queued, NULL);
+  pthread_cond_init(&w->done, NULL);
+  s->state->workers = w;
+
+  /* allocate jobs */
+  w->njobs = (uInt) nthreads * JOBS_PER_THREAD;
+  w->jobs = (zfast_job*) zalloc(s, sizeof(zfast_job), w->njobs);
+  w->threads = (zfast_worker*) zalloc(s, sizeof(zfast_worker), nthreads);
+  if (w->jobs == NULL || w->threads == NULL) {
+    s->msg = "memory exhausted";
+    return Z_MEM_ERROR;
+  }
+  memset(w->jobs, 0, sizeof(zfast_job) * w->njobs);
+  memset(w->threads, 0, sizeof(zfast_worker) * nthreads);
+  for(j = 0 ; j < w->njobs ; j++) {
+    w->jobs[j].inBuff = zalloc_block(s, ZFAST_IS_COMPRESSING(s)
+                                     ? BLOCK_SIZE(s) : BUFFER_BLOCK_SIZE(s),
+                                     ZFAST_ALLOC_BUFFER);
+    w->jobs[j].outBuff = zalloc_block(s, BUFFER_BLOCK_SIZE(s),
+                                      ZFAST_ALLOC_BUFFER);
+    if (w->jobs[j].inBuff == NULL || w->jobs[j].outBuff == NULL) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
+  }
+
+  /* start threads */
+  for(w->nthreads = 0 ; w->nthreads < nthreads ; w->nthreads++) {
+    w->threads[w->nthreads].w = w;
+    if (pthread_create(&w->threads[w->nthreads].thread, NULL,
+                       fastlzlibWorker, &w->threads[w->nthreads]) != 0) {
+      s->msg = "unable to create thread";
+      return Z_MEM_ERROR;
+    }
+  }
+
+  return Z_OK;
+}
+
+/* wait for all queued jobs to be done, and reset the jobs ring */
+static void fastlzlibWorkersReset(zfast_stream *s) {
+  zfast_workers *const w = s->state->workers;
+  uInt j;
+  pthread_mutex_lock(&w->lock);
+  for(j = 0 ; j < w->njobs ; j++) {
+    while(w->jobs[j].status == JOB_QUEUED) {
+      pthread_cond_wait(&w->done, &w->lock);
+    }
+    w->jobs[j].status = JOB_FREE;
+  }
+  w->head = w->tail = w->next = 0;
+  w->finished = 0;
+  w->checksum_pending = 0;
+  w->meta_size = w->meta_offs = 0;
+  w->meta_done = 0;
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* memory used by jobs */
+static uInt fastlzlibWorkersMemory(zfast_stream *s) {
+  const zfast_workers *const w = s->state->workers;
+  const uInt in_size = ZFAST_IS_COMPRESSING(s)
+    ? BLOCK_SIZE(s) : BUFFER_BLOCK_SIZE(s);
+  const uInt wrk = w->wrk_ready && s->state->compress_wrk != NULL
+    ? (uInt) WRK_SIZE(s->state) : 0;
+  return sizeof(zfast_workers) + w->nthreads * ( sizeof(zfast_worker) + wrk )
+    + w->njobs * ( sizeof(zfast_job) + in_size + BUFFER_BLOCK_SIZE(s) );
+}
+
+/* queue the job being filled */
+static ZFASTINLINE void fastlzlibWorkersSubmit(zfast_workers *const w,
+                                               const int flush) {
+  zfast_job *const job = JOB_AT(w, w->tail);
+  assert(job->status == JOB_FILLING);
+  job->flush = flush;
+  pthread_mutex_lock(&w->lock);
+  job->status = JOB_QUEUED;
+  w->tail++;
+  pthread_cond_signal(&w->queued);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* is the oldest job done ? (wait for it if "wait" is non zero) */
+static ZFASTINLINE int fastlzlibWorkersHeadDone(zfast_workers *const w,
+                                                const int wait) {
+  zfast_job *const job = JOB_AT(w, w->head);
+  int done;
+  assert(w->head != w->tail);
+  pthread_mutex_lock(&w->lock);
+  while(wait && job->status != JOB_DONE) {
+    pthread_cond_wait(&w->done, &w->lock);
+  }
+  done = job->status == JOB_DONE;
+  pthread_mutex_unlock(&w->lock);
+  return done;
+}
+
+/* compressing: prepare the meta blocks preceding the oldest job, and index
+   them with the job blocks, as the single-threaded mode does when starting a
+   block */
+static int fastlzlibWorkersMeta(zfast_stream *const s,
+                                const zfast_job *const job) {
+  zfast_stream_internal *const state = s->state;
+  zfast_workers *const w = state->workers;
+  int code = Z_OK;
+  w->meta_size = w->meta_offs = 0;
+  w->meta_done = 1;
+
+  /* index: allocated when the first block is written */
+  if ( ( state->flags & ZFAST_FLAG_INDEX ) != 0 && state->index == NULL) {
+    state->index = fastlzlibIndexCreate();
+    if (state->index == NULL) {
+      s->msg = "memory exhausted";
+      return Z_MEM_ERROR;
+    }
+  }
+
+  /* compact headers: stream header, repeated as a sync marker */
+  if ( ( state->flags & ZFAST_FLAG_COMPACT_HEADERS ) != 0
+       && ( !state->compact
+            || ( s->total_out - state->sync_out >= SYNC_INTERVAL
+                 && job->in_size != 0 ) ) ) {
+    state->sync_out = s->total_out;
+    w->meta_size += fastlz_write_stream_header(&w->meta[w->meta_size],
+                                               BLOCK_SIZE(s));
+    state->compact = 1;
+    /* the compressor id follows each sync marker */
+    state->compressor_pending =
+      ( state->flags & ZFAST_FLAG_COMPRESSOR_ID ) != 0;
+    if (state->index != NULL) {
+      state->index->compact = 1;
+      code = fastlzlibIndexAppend(state->index, STREAM_HEADER_SIZE, 0);
+    }
+  }
+
+  /* compressor id (not recorded for custom backends) */
+  if (state->compressor_pending) {
+    state->compressor_pending = 0;
+    if (state->compressor >= 0) {
+      w->meta_size += fastlz_write_meta_compressor(&w->meta[w->meta_size],
+                                                   BLOCK_SIZE(s),
+                                                   state->compressor);
+      if (state->index != NULL && code == Z_OK) {
+        state->index->compressor = state->compressor;
+        code = fastlzlibIndexAppend(state->index, META_COMPRESSOR_SIZE, 0);
+      }
+    }
+  }
+
+  /* index: record the block (and its checksum meta block) */
+  if (state->index != NULL && job->in_size != 0 && code == Z_OK) {
+    uInt size = job->out_size;
+    if ( ( state->flags & ZFAST_FLAG_CHECKSUM ) != 0) {
+      code = fastlzlibIndexAppend(state->index, META_CHECKSUM_SIZE, 0);
+      size -= META_CHECKSUM_SIZE;
+    }
+    if (code == Z_OK) {
+      code = fastlzlibIndexAppend(state->index, size, job->in_size);
+    }
+  }
+  if (code != Z_OK) {
+    s->msg = "memory exhausted";
+  }
+  return code;
+}
+
+/* flush done jobs to the client, in order ; returns the first job error */
+static ZFASTINLINE int fastlzlibWorkersFlush(zfast_stream *const s) {
+  zfast_workers *const w = s->state->workers;
+  while(w->head != w->tail && !ZFAST_OUTPUT_IS_FULL(s)
+        && fastlzlibWorkersHeadDone(w, 0)) {
+    zfast_job *const job = JOB_AT(w, w->head);
+    uInt size = job->out_size - job->out_offs;
+    if (job->code != Z_OK) {
+      s->msg = job->code == Z_DATA_ERROR
+        ? "corrupted compressed stream (incorrect block checksum)"
+        : "unable to decompress block stream";
+      return job->code;
+    }
+    /* compressing: meta blocks preceding the job, in stream order */
+    if (ZFAST_IS_COMPRESSING(s)) {
+      if (!w->meta_done) {
+        const int code = fastlzlibWorkersMeta(s, job);
+        if (code != Z_OK) {
+          return code;
+        }
+      }
+      if (w->meta_offs < w->meta_size) {
+        size = w->meta_size - w->meta_offs;
+        if (size > s->avail_out) {
+          size = s->avail_out;
+        }
+        memcpy(s->next_out, &w->meta[w->meta_offs], size);
+        w->meta_offs += size;
+        outSeek(s, size);
+        STATS_ADD(&s->state->stats, bytes_buffered_out, size);
+        continue;
+      }
+    }
+    if (size > s->avail_out) {
+      size = s->avail_out;
+    }
+    memcpy(s->next_out, &job->outBuff[job->out_offs], size);
+    job->out_offs += size;
+    outSeek(s, size);
+    STATS_ADD(&s->state->stats, bytes_buffered_out, size);
+    if (job->out_offs == job->out_size) {
+      job->status = JOB_FREE;
+      w->head++;
+      w->meta_done = 0;
+    }
+  }
+  return Z_OK;
+}
+
+/*
+ * Multi-threaded compression processing routine.
+ * Input blocks are copied to the jobs ring and compressed by worker threads ;
+ * compressed blocks are flushed to the client in stream order.
+ */
+static int fastlzlibProcessMT(zfast_stream *const s, const int flush,
+                              const int may_buffer) {
+  zfast_workers *const w = s->state->workers;
+  const uInt prev_avail_in = s->avail_in;
+  const uInt prev_avail_out = s->avail_out;
+
+  /* sanity check for next_in/next_out */
+  if (s->next_in == NULL && !ZFAST_INPUT_IS_EMPTY(s)) {
+    s->msg = "invalid input";
+    return Z_STREAM_ERROR;
+  }
+  else if (s->next_out == NULL && !ZFAST_OUTPUT_IS_FULL(s)) {
+    s->msg = "invalid output";
+    return Z_STREAM_ERROR;
+  }
+
+  /* backend work areas, kept for the stream lifetime */
+  if (!w->wrk_ready) {
+    fastlzlibWorkersAllocWork(s);
+  }
+
+  /* not buffered: we need a complete block (unless flushing) */
+  if (!may_buffer && flush == Z_NO_FLUSH && s->avail_in < BLOCK_SIZE(s)
+      && JOB_AT(w, w->tail)->status != JOB_FILLING) {
+    s->msg = "need more data on input";
+    return Z_BUF_ERROR;
+  }
+
+  for(;;) {
+    /* flush done jobs to the client, in order */
+    const int code = fastlzlibWorkersFlush(s);
+    if (code != Z_OK) {
+      return code;
+    }
+
+    /* fill the current job */
+    if (!ZFAST_INPUT_IS_EMPTY(s)) {
+      if (w->tail - w->head < w->njobs) {
+        zfast_job *const job = JOB_AT(w, w->tail);
+        uInt size;
+        if (job->status == JOB_FREE) {
+          job->status = JOB_FILLING;
+          job->in_size = 0;
+        }
+        size = BLOCK_SIZE(s) - job->in_size;
+        if (size > s->avail_in) {
+          size = s->avail_in;
+        }
+        memcpy(&job->inBuff[job->in_size], s->next_in, size);
+        job->in_size += size;
+        inSeek(s, size);
+        STATS_ADD(&s->state->stats, bytes_buffered_in, size);
+        if (job->in_size == BLOCK_SIZE(s)) {
+          fastlzlibWorkersSubmit(w, Z_NO_FLUSH);
+        }
+        continue;
+      }
+    }
+
+    /* input is empty: flush pending data */
+    else if (flush != Z_NO_FLUSH) {
+      if (JOB_AT(w, w->tail)->status == JOB_FILLING) {
+        fastlzlibWorkersSubmit(w, Z_NO_FLUSH);
+        continue;
+      }
+      /* queue an empty block with the EOF marker (index: written after the
+         trailer, once all blocks are flushed) */
+      else if (flush == Z_FINISH && !w->finished
+               && w->tail - w->head < w->njobs) {
+        zfast_job *const job = JOB_AT(w, w->tail);
+        const int index = ( s->state->flags & ZFAST_FLAG_INDEX ) != 0;
+        job->status = JOB_FILLING;
+        job->in_size = 0;
+        fastlzlibWorkersSubmit(w, index ? Z_SYNC_FLUSH : Z_FINISH);
+        s->state->index_pending = index;
+        w->finished = 1;
+        continue;
+      }
+      /* otherwise wait below for pending jobs */
+      else if (w->head == w->tail) {
+        break;
+      }
+    }
 
-  /* read next block (note: output buffer is empty here) */
-  else if (s->state->str_size == 0) {
-    /* for error reporting only */
-    uInt block_size = 0;
+    /* no input can be processed: wait for the oldest block, if possible */
+    else {
+      break;
+    }
+    if (ZFAST_OUTPUT_IS_FULL(s)) {
+      break;
+    }
+    fastlzlibWorkersHeadDone(w, 1);
+  }
 
-    /* decompressing: header is present */
-    if (ZFAST_IS_DECOMPRESSING(s)) {
+  /* index trailer, followed by the EOF marker, once all blocks are flushed
+     (buffered as in single-threaded mode) */
+  while(w->finished && w->head == w->tail && !ZFAST_OUTPUT_IS_FULL(s)) {
+    if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+      uInt size = s->state->dec_size - s->state->outBuffOffs;
+      if (size > s->avail_out) {
+        size = s->avail_out;
+      }
+      memcpy(s->next_out, &s->state->outBuff[s->state->outBuffOffs], size);
+      STATS_ADD(&s->state->stats, bytes_buffered_out, size);
+      s->state->outBuffOffs += size;
+      outSeek(s, size);
+    }
+    else if (s->state->index_pending) {
+      const int code = fastlzlibWriteIndex(s, 1);
+      if (code != Z_OK && code != Z_STREAM_END) {
+        return code;
+      }
+    }
+    else {
+      break;
+    }
+  }
+
+  /* success and EOF */
+  if (flush == Z_FINISH && w->finished && w->head == w->tail
+      && !s->state->index_pending && !ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+    return Z_STREAM_END;
+  }
+  /* returns Z_OK if something was processed, Z_BUF_ERROR otherwise */
+  else {
+    return ( s->avail_in != prev_avail_in || s->avail_out != prev_avail_out )
+      ? Z_OK : Z_BUF_ERROR;
+  }
+}
+
+/*
+ * Multi-threaded decompression processing routine.
+ * Block headers are read ahead by the client thread, and complete compressed
+ * blocks are decompressed by worker threads ; decompressed blocks are flushed
+ * to the client in stream order.
+ */
+static int fastlzlibProcessDecompressMT(zfast_stream *const s, const int flush,
+                                        const int may_buffer) {
+  zfast_workers *const w = s->state->workers;
+  const uInt prev_avail_in = s->avail_in;
+  const uInt prev_avail_out = s->avail_out;
+
+  /* sanity check for next_in/next_out */
+  if (s->next_in == NULL && !ZFAST_INPUT_IS_EMPTY(s)) {
+    s->msg = "invalid input";
+    return Z_STREAM_ERROR;
+  }
+  else if (s->next_out == NULL && !ZFAST_OUTPUT_IS_FULL(s)) {
+    s->msg = "invalid output";
+    return Z_STREAM_ERROR;
+  }
+
+  for(;;) {
+    zfast_job *const job = JOB_AT(w, w->tail);
+    const int in_block = w->tail - w->head < w->njobs
+      && job->status == JOB_FILLING;
+
+    /* flush done jobs to the client, in order */
+    const int code = fastlzlibWorkersFlush(s);
+    if (code != Z_OK) {
+      return code;
+    }
+
+    /* EOF marker read, or sync to a block: wait for pending jobs */
+    if (w->finished || ( flush == Z_SYNC_FLUSH && !in_block ) ) {
+      if (w->head == w->tail) {
+        return w->finished ? Z_STREAM_END : Z_NEED_DICT;
+      }
+    }
+
+    /* read next header and block */
+    else if (!ZFAST_INPUT_IS_EMPTY(s) && w->tail - w->head < w->njobs) {
+      uInt size;
+
+      /* new block */
+      if (job->status == JOB_FREE) {
+        /* not buffered: check if we have the complete block */
+        if (!may_buffer) {
+          uInt block_type;
+          uInt block_size;
+          uInt str_size;
+          uInt dec_size;
+          const uInt hdr_size =
+            fastlz_read_any_header(s->state->compact, s->next_in,
+                                   s->avail_in, BLOCK_SIZE(s),
+                                   &block_type, &block_size,
+                                   &str_size, &dec_size);
+          if (hdr_size == 0 || s->avail_in - hdr_size < str_size) {
+            s->msg = "need more data on input";
+            break;
+          }
+        }
+        job->status = JOB_FILLING;
+        job->hdr_offs = 0;
+        job->hdr_size = 0;
+        job->in_size = 0;
+      }
+
+      /* header (compact headers are read byte by byte, as their size is only
+         known once complete) */
+      if (job->hdr_size == 0) {
+        uInt block_size = 0;
+        while (job->hdr_size == 0 && !ZFAST_INPUT_IS_EMPTY(s)) {
+          size = s->state->compact ? 1 : HEADER_SIZE - job->hdr_offs;
+          if (size > s->avail_in) {
+            size = s->avail_in;
+          }
+          memcpy(&job->hdr[job->hdr_offs], s->next_in, size);
+          job->hdr_offs += size;
+          inSeek(s, size);
+          job->hdr_size = fastlz_read_any_header(s->state->compact, job->hdr,
+                                                 job->hdr_offs, BLOCK_SIZE(s),
+                                                 &job->block_type,
+                                                 &block_size, &job->str_size,
+                                                 &job->out_size);
+        }
+
+        /* header completed */
+        if (job->hdr_size != 0) {
+          int code;
+          /* EOF marker */
+          if (job->str_size == 0 && job->out_size == 0) {
+            job->status = JOB_FREE;
+            w->finished = 1;
+            continue;
+          }
+          code = fastlz_check_header(s, job->block_type, block_size,
+                                     job->str_size, job->out_size);
+          if (code == Z_OK
+              && ( job->block_type & BLOCK_FLAG_LINKED ) != 0) {
+            s->msg = "linked blocks are not supported in multi-threaded mode";
+            code = Z_VERSION_ERROR;
+          }
+          if (code != Z_OK) {
+            job->status = JOB_FREE;
+            return code;
+          }
+        }
+      }
+
+      /* data */
+      if (job->hdr_size != 0) {
+        size = job->str_size - job->in_size;
+        if (size > s->avail_in) {
+          size = s->avail_in;
+        }
+        memcpy(&job->inBuff[job->in_size], s->next_in, size);
+        job->in_size += size;
+        inSeek(s, size);
+        STATS_ADD(&s->state->stats, bytes_buffered_in, size);
+        if (job->in_size == job->str_size) {
+          /* stream header: compact headers follow */
+          if (job->block_type == BLOCK_TYPE_STREAM) {
+            job->status = JOB_FREE;
+            if (job->inBuff[0] != STREAM_VERSION_COMPACT) {
+              s->msg = "unsupported stream version";
+              return Z_VERSION_ERROR;
+            }
+            s->state->compact = 1;
+            continue;
+          }
+          /* block checksum: verified by the worker with the next block */
+          job->verify = 0;
+          if (job->block_type == BLOCK_TYPE_META) {
+            if (job->inBuff[0] == META_TYPE_CHECKSUM) {
+              if (job->in_size != 1 + 4) {
+                s->msg = "corrupted compressed stream (illegal meta block)";
+                job->status = JOB_FREE;
+                return Z_DATA_ERROR;
+              }
+              w->checksum = (uInt) READ_32(&job->inBuff[1]);
+              w->checksum_pending = 1;
+            }
+            else if (job->inBuff[0] == META_TYPE_COMPRESSOR) {
+              if (job->in_size != 1 + 1) {
+                s->msg = "corrupted compressed stream (illegal meta block)";
+                job->status = JOB_FREE;
+                return Z_DATA_ERROR;
+              }
+              if (fastlzlibSelectDecompressor(s->state, job->inBuff[1])
+                  != Z_OK) {
+                s->msg = "unsupported compressor";
+                job->status = JOB_FREE;
+                return Z_VERSION_ERROR;
+              }
+            }
+          } else if (w->checksum_pending) {
+            job->verify = 1;
+            job->checksum = w->checksum;
+            w->checksum_pending = 0;
+          }
+          job->decompress = s->state->decompress;
+          fastlzlibWorkersSubmit(w, Z_NO_FLUSH);
+        }
+      }
+      continue;
+    }
+
+    /* input is empty: return as soon as something was produced */
+    else if (ZFAST_INPUT_IS_EMPTY(s)
+             && ( w->head == w->tail || s->avail_out != prev_avail_out ) ) {
+      break;
+    }
+
+    /* wait for the oldest block, if possible */
+    if (ZFAST_OUTPUT_IS_FULL(s)) {
+      break;
+    }
+    fastlzlibWorkersHeadDone(w, 1);
+  }
+
+  /* we are supposed to be done in decompressing but did not see any EOF */
+  if (flush == Z_FINISH && ZFAST_INPUT_IS_EMPTY(s) && w->head == w->tail) {
+    s->msg = "unexpected EOF";
+    return Z_BUF_ERROR;
+  }
+  /* returns Z_OK if something was processed, Z_BUF_ERROR otherwise */
+  else {
+    return ( s->avail_in != prev_avail_in || s->avail_out != prev_avail_out )
+      ? Z_OK : Z_BUF_ERROR;
+  }
+}
+
+#endif
+
+int fastlzlibSetAllocator(zfast_stream *s, zfast_alloc_func alloc,
+                          zfast_free_func dealloc, void *opaque) {
+  zfast_stream_internal *state;
+#ifdef ZFAST_USE_THREADS
+  int nthreads = 0;
+#endif
+  if (s == NULL || s->state == NULL || ( alloc != NULL && dealloc == NULL )) {
+    return Z_STREAM_ERROR;
+  }
+  state = s->state;
+  if (s->total_in != 0 || s->total_out != 0
+      || state->inBuff != NULL || state->outBuff != NULL
+      || state->wrk != NULL || state->preset_wrk != NULL
+      || state->dict != NULL || state->preset != NULL) {
+    s->msg = "allocator must be set before processing the stream";
+    return Z_STREAM_ERROR;
+  }
+#ifdef ZFAST_USE_THREADS
+  /* the job buffers of worker threads are allocated again */
+  if (state->workers != NULL) {
+    nthreads = state->workers->nthreads;
+    fastlzlibWorkersFree(s);
+  }
+#endif
+  state->alloc = alloc;
+  state->dealloc = alloc != NULL ? dealloc : NULL;
+  state->alloc_opaque = alloc != NULL ? opaque : NULL;
+#ifdef ZFAST_USE_THREADS
+  if (nthreads != 0) {
+    return fastlzlibWorkersInit(s, nthreads);
+  }
+#endif
+  return Z_OK;
+}
+
+/* huge pages size, and smallest allocation backed by huge pages */
+#define HUGE_PAGE_SIZE ( 2*1024*1024 )
+#define HUGE_PAGE_MIN_ALLOC ( 1024*1024 )
+
+/* rounded size of an allocation backed by huge pages */
+#define HUGE_PAGE_ROUND(SIZE)                                         \
+  ( ( (SIZE) + HUGE_PAGE_SIZE - 1 ) & ~( (size_t) HUGE_PAGE_SIZE - 1 ) )
+
+void* fastlzlibHugePageAlloc(void *opaque, size_t size, size_t alignment,
+                             zfast_alloc_kind kind) {
+  void *ptr;
+  (void) opaque;
+  (void) kind;
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+  if (size >= HUGE_PAGE_MIN_ALLOC) {
+    const size_t length = HUGE_PAGE_ROUND(size);
+    if (alignment > HUGE_PAGE_SIZE) {
+      return NULL;
+    }
+#ifdef MAP_HUGETLB
+    /* reserved huge pages */
+    ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      return ptr;
+    }
+#endif
+    /* otherwise, a huge page aligned mapping, trimmed, for transparent huge
+       pages */
+    ptr = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr != MAP_FAILED) {
+      Bytef *const start = (Bytef*) ptr;
+      Bytef *const aligned = (Bytef*)
+        HUGE_PAGE_ROUND((size_t) start);
+      if (aligned != start) {
+        munmap(start, aligned - start);
+      }
+      munmap(&aligned[length], &start[length + HUGE_PAGE_SIZE]
+             - &aligned[length]);
+#ifdef MADV_HUGEPAGE
+      madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+      return aligned;
+    }
+    return NULL;
+  }
+#endif
+#ifdef _WIN32
+  ptr = _aligned_malloc(size, alignment);
+#else
+  if (alignment < sizeof(void*)) {
+    alignment = sizeof(void*);
+  }
+  if (posix_memalign(&ptr, alignment, size) != 0) {
+    ptr = NULL;
+  }
+#endif
+  return ptr;
+}
+
+void fastlzlibHugePageFree(void *opaque, void *address, size_t size,
+                           zfast_alloc_kind kind) {
+  (void) opaque;
+  (void) kind;
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+  if (size >= HUGE_PAGE_MIN_ALLOC) {
+    munmap(address, HUGE_PAGE_ROUND(size));
+    return;
+  }
+#else
+  (void) size;
+#endif
+#ifdef _WIN32
+  _aligned_free(address);
+#else
+  free(address);
+#endif
+}
+
+int fastlzlibDecompress2(zfast_stream *s, int flush, const int may_buffer) {
+  if (ZFAST_IS_DECOMPRESSING(s)) {
+#ifdef ZFAST_USE_THREADS
+    const int code = s->state->workers != NULL
+      ? fastlzlibProcessDecompressMT(s, flush, may_buffer)
+      : fastlzlibProcess2(s, flush, may_buffer);
+#else
+    const int code = fastlzlibProcess2(s, flush, may_buffer);
+#endif
+    if (code == Z_BUF_ERROR) {
+      STATS_ADD(&s->state->stats, buf_errors, 1);
+    }
+    return code;
+  } else {
+    s->msg = "decompressing function used with a compressing stream";
+    return Z_STREAM_ERROR;
+  }
+}
+
+int fastlzlibDecompress(zfast_stream *s) {
+  return fastlzlibDecompress2(s, Z_NO_FLUSH, 1);
+}
+
+/* decompress whole blocks until the input is exhausted (see
+   fastlzlibDecompressBlocks()) ; plain data blocks are decoded here, other
+   blocks (and leftovers of a buffered call) go through fastlzlibProcess() */
+static int fastlzlibProcessBlocks(zfast_stream *const s) {
+  zfast_stream_internal *const state = s->state;
+  const uLong total_in = s->total_in;
+  const uLong total_out = s->total_out;
+  int code = Z_OK;
+
+  /* sanity check for next_in/next_out */
+  if (s->next_in == NULL && !ZFAST_INPUT_IS_EMPTY(s)) {
+    s->msg = "invalid input";
+    return Z_STREAM_ERROR;
+  }
+  else if (s->next_out == NULL && !ZFAST_OUTPUT_IS_FULL(s)) {
+    s->msg = "invalid output";
+    return Z_STREAM_ERROR;
+  }
+
+  while(code == Z_OK
+        && ( !ZFAST_INPUT_IS_EMPTY(s) || ZFAST_HAS_BUFFERED_OUTPUT(s) )) {
+    uInt block_type;
+    uInt block_size;
+    uInt str_size;
+    uInt dec_size;
+    uInt hdr_size = 0;
+    int done;
+    zfast_uint64 backend_start;
+
+    /* plain (raw or compressed) block, complete on input and fitting on
+       output */
+    if (!ZFAST_HAS_BUFFERED_OUTPUT(s)
+        && state->str_size == 0 && state->inHdrOffs == 0
+        && state->skip == 0 && !state->preset_pending) {
+      hdr_size = fastlz_read_any_header(state->compact,
+                                        s->next_in, s->avail_in,
+                                        BLOCK_SIZE(s), &block_type,
+                                        &block_size, &str_size, &dec_size);
+    }
+    if (hdr_size == 0
+        || ( block_type != BLOCK_TYPE_RAW
+             && block_type != BLOCK_TYPE_COMPRESSED )
+        || s->avail_in - hdr_size < str_size || s->avail_out < dec_size) {
+      const uInt prev_avail_in = s->avail_in;
+      const uInt prev_avail_out = s->avail_out;
+      code = fastlzlibProcess(s, Z_NO_FLUSH, 0);
+      /* state change only (resumed call): nothing more to do */
+      if (code == Z_OK
+          && s->avail_in == prev_avail_in && s->avail_out == prev_avail_out) {
+        break;
+      }
+      continue;
+    }
+
+    /* compressed and uncompressed == 0 : EOF marker */
+    if (str_size == 0 && dec_size == 0) {
+      inSeek(s, hdr_size);
+      return Z_STREAM_END;
+    }
+
+    /* sanity check */
+    code = fastlz_check_header(s, block_type, block_size, str_size, dec_size);
+    if (code != Z_OK) {
+      break;
+    }
+
+    /* rock'in, straight from client memory to client memory */
+    backend_start = STATS_CLOCK();
+    done = fastlz_decompress_hdr(state, block_type, &s->next_in[hdr_size],
+                                 str_size, s->next_out, dec_size);
+    STATS_ADD(&state->stats, backend_ns, STATS_CLOCK() - backend_start);
+    if (done != (int) dec_size) {
+      s->msg = "unable to decompress block stream";
+      return Z_STREAM_ERROR;
+    }
+    if (block_type == BLOCK_TYPE_RAW) {
+      STATS_ADD(&state->stats, blocks_raw, 1);
+    } else {
+      STATS_ADD(&state->stats, blocks_compressed, 1);
+    }
+    STATS_ADD(&state->stats, bytes_direct_in, str_size);
+    STATS_ADD(&state->stats, bytes_direct_out, dec_size);
+
+    /* verify the block while it is still in cache */
+    if (state->checksum_pending) {
+      state->checksum_pending = 0;
+      if (fastlz_crc32c(state, s->next_out, dec_size) != state->checksum) {
+        s->msg = "corrupted compressed stream (incorrect block checksum)";
+        return Z_DATA_ERROR;
+      }
+    }
+
+    inSeek(s, hdr_size + str_size);
+    outSeek(s, dec_size);
+  }
+
+  /* partial progress is not an error */
+  if (code == Z_BUF_ERROR
+      && ( s->total_in != total_in || s->total_out != total_out )) {
+    code = Z_OK;
+  }
+  return code;
+}
+
+int fastlzlibDecompressBlocks(zfast_stream *s) {
+  if (ZFAST_IS_DECOMPRESSING(s)) {
+    int code;
+#ifdef ZFAST_USE_THREADS
+    /* workers already process the input by batches of blocks */
+    if (s->state->workers != NULL) {
+      return fastlzlibDecompress2(s, Z_NO_FLUSH, 0);
+    }
+#endif
+    code = fastlzlibProcessBlocks(s);
+    if (code == Z_BUF_ERROR) {
+      STATS_ADD(&s->state->stats, buf_errors, 1);
+    }
+    return code;
+  } else {
+    s->msg = "decompressing function used with a compressing stream";
+    return Z_STREAM_ERROR;
+  }
+}
+
+int fastlzlibCompress2(zfast_stream *s, int flush, const int may_buffer) {
+  if (ZFAST_IS_COMPRESSING(s)) {
+#ifdef ZFAST_USE_THREADS
+    const int code = s->state->workers != NULL
+      ? fastlzlibProcessMT(s, flush, may_buffer)
+      : fastlzlibProcess2(s, flush, may_buffer);
+#else
+    const int code = fastlzlibProcess2(s, flush, may_buffer);
+#endif
+    if (code == Z_BUF_ERROR) {
+      STATS_ADD(&s->state->stats, buf_errors, 1);
+    }
+    return code;
+  } else {
+    s->msg = "compressing function used with a decompressing stream";
+    return Z_STREAM_ERROR;
+  }
+}
+
+int fastlzlibCompress(zfast_stream *s, int flush) {
+  return fastlzlibCompress2(s, flush, 1);
+}
+
+/* process input fragments into output fragments (see fastlzlibCompressV()) */
+static int fastlzlibProcessV(zfast_stream *s, int flush,
+                             const struct iovec *in, int nin,
+                             const struct iovec *out, int nout,
+                             uLong *consumed, uLong *produced) {
+  const uLong total_in = s->total_in;
+  const uLong total_out = s->total_out;
+  const int compressing = ZFAST_IS_COMPRESSING(s);
+  int i = 0;
+  int o = 0;
+  size_t in_offs = 0;
+  size_t out_offs = 0;
+  int code;
+
+  if (nin < 0 || nout < 0 || ( nin != 0 && in == NULL )
+      || ( nout != 0 && out == NULL )) {
+    s->msg = "invalid fragments";
+    return Z_STREAM_ERROR;
+  }
+
+  for(;;) {
+    uInt prev_avail_in;
+    uInt prev_avail_out;
+    int flush_now;
+
+    /* skip exhausted (or empty) fragments */
+    for( ; i < nin && in_offs == in[i].iov_len ; i++, in_offs = 0) ;
+    for( ; o < nout && out_offs == out[o].iov_len ; o++, out_offs = 0) ;
+
+    /* next chunks (the flush mode only applies to the last fragment) */
+    if (i < nin) {
+      const size_t size = in[i].iov_len - in_offs;
+      s->next_in = &((Bytef*) in[i].iov_base)[in_offs];
+      s->avail_in = size < UINT_MAX ? (uInt) size : UINT_MAX;
+    } else {
+      s->next_in = NULL;
+      s->avail_in = 0;
+    }
+    if (o < nout) {
+      const size_t size = out[o].iov_len - out_offs;
+      s->next_out = &((Bytef*) out[o].iov_base)[out_offs];
+      s->avail_out = size < UINT_MAX ? (uInt) size : UINT_MAX;
+    } else {
+      s->next_out = NULL;
+      s->avail_out = 0;
+    }
+    flush_now = i + 1 >= nin ? flush : Z_NO_FLUSH;
+    prev_avail_in = s->avail_in;
+    prev_avail_out = s->avail_out;
+
+    code = compressing
+      ? fastlzlibCompress2(s, flush_now, 1)
+      : fastlzlibDecompress2(s, Z_NO_FLUSH, 1);
+
+    in_offs += prev_avail_in - s->avail_in;
+    out_offs += prev_avail_out - s->avail_out;
+
+    /* Z_BUF_ERROR: no progress possible with the remaining fragments */
+    if (code != Z_OK) {
+      break;
+    }
+  }
+
+  if (consumed != NULL) {
+    *consumed = s->total_in - total_in;
+  }
+  if (produced != NULL) {
+    *produced = s->total_out - total_out;
+  }
+
+  /* some progress was made */
+  if (code == Z_BUF_ERROR
+      && ( s->total_in != total_in || s->total_out != total_out )) {
+    return Z_OK;
+  }
+  return code;
+}
+
+int fastlzlibCompressV(zfast_stream *s, int flush,
+                       const struct iovec *in, int nin,
+                       const struct iovec *out, int nout,
+                       uLong *consumed, uLong *produced) {
+  if (ZFAST_IS_COMPRESSING(s)) {
+    return fastlzlibProcessV(s, flush, in, nin, out, nout, consumed, produced);
+  } else {
+    s->msg = "compressing function used with a decompressing stream";
+    return Z_STREAM_ERROR;
+  }
+}
+
+int fastlzlibDecompressV(zfast_stream *s,
+                         const struct iovec *in, int nin,
+                         const struct iovec *out, int nout,
+                         uLong *consumed, uLong *produced) {
+  if (ZFAST_IS_DECOMPRESSING(s)) {
+    return fastlzlibProcessV(s, Z_NO_FLUSH, in, nin, out, nout, consumed,
+                             produced);
+  } else {
+    s->msg = "decompressing function used with a compressing stream";
+    return Z_STREAM_ERROR;
+  }
+}
+
+int fastlzlibIsCompressedStream(const void* input, int length) {
+  if (length >= HEADER_SIZE) {
+    const Bytef*const in = (const Bytef*) input;
+    return fastlzlibGetStreamBlockSize(in, length) != 0 ? Z_OK : Z_DATA_ERROR;
+  } else {
+    return Z_BUF_ERROR;
+  }
+}
+
+int fastlzlibDecompressSync(zfast_stream *s) {
+  if (ZFAST_IS_DECOMPRESSING(s)) {
+#ifdef ZFAST_USE_THREADS
+    zfast_workers *const w = s->state->workers;
+    if (w != NULL) {
+      /* not in an error state: uncompressed blocks pending */
+      if (w->head != w->tail) {
+        return Z_OK;
+      }
+      /* drop the partially read block */
+      JOB_AT(w, w->tail)->status = JOB_FREE;
+    }
+#endif
+    if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+      /* not in an error state: uncompressed data available in buffer */
+      return Z_OK;
+    }
+    else {
+      /* Note: if s->state->str_size == 0, we are not in an error state: the
+         next chunk is to be read; However, we check the chunk anyway. */
 
-      /* sync to a block */
-      if (flush == Z_SYNC_FLUSH && s->state->inHdrOffs == 0) {
-        return Z_NEED_DICT;
+      /* at least HEADER_SIZE data */
+      if (s->avail_in < HEADER_SIZE) {
+        s->msg = "need more data on input";
+        return Z_BUF_ERROR;
+      }
+        
+      /* in buffered read of the header.. reset to 0 */
+      if (s->state->inHdrOffs != 0) {
+        s->state->inHdrOffs = 0;
       }
       
-      /* if header read in progress or will be in multiple passes (sheesh) */
-      if (s->state->inHdrOffs != 0 || s->avail_in < HEADER_SIZE) {
-        /* we are to go buffered for the header - check if this is allowed */
-        if (s->state->inHdrOffs == 0 && !may_buffer) {
-          s->msg = "need more data on input";
-          return Z_BUF_ERROR;
-        }
-        /* copy up to HEADER_SIZE bytes */
-        for( ; s->avail_in > 0 && s->state->inHdrOffs < HEADER_SIZE
-               ; s->state->inHdrOffs++, inSeek(s, 1)) {
-          s->state->inHdr[s->state->inHdrOffs] = *s->next_in;
+      /* seek */
+      for( ; s->avail_in >= HEADER_SIZE
+             ; inSeek(s, 1), STATS_ADD(&s->state->stats, bytes_skipped, 1)) {
+        const Bytef *const in = s->next_in;
+        if (in[0] == BLOCK_MAGIC[0]
+            && in[1] == BLOCK_MAGIC[1]
+            && in[2] == BLOCK_MAGIC[2]
+            && in[3] == BLOCK_MAGIC[3]
+            && in[4] == BLOCK_MAGIC[4]
+            && in[5] == BLOCK_MAGIC[5]
+            && in[6] == BLOCK_MAGIC[6]
+            ) {
+          const int block_size = fastlzlibGetStreamBlockSize(in, HEADER_SIZE);
+          if (block_size != 0) {
+            /* successful seek */
+            STATS_ADD(&s->state->stats, syncs, 1);
+            return Z_OK;
+          }
         }
       }
-      /* process header if completed */
+      s->msg = "no flush point found";
+      return Z_DATA_ERROR;
+    }
+  } else {
+    s->msg = "decompressing function used with a compressing stream";
+    return Z_STREAM_ERROR;
+  }
+}
 
-      /* header on client region */
-      if (s->state->inHdrOffs == 0 && s->avail_in >= HEADER_SIZE) {
-        /* peek header */
-        uInt block_type;
-        uInt str_size;
-        uInt dec_size;
-        fastlz_read_header(s->next_in, &block_type, &block_size,
-                           &str_size, &dec_size);
+int fastlzlibGetStats(zfast_stream *s, zfast_stats *stats) {
+  if (s == NULL || s->state == NULL || stats == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  assert(strcmp(s->state->magic, MAGIC) == 0);
+#ifdef ZFAST_USE_STATS
+  *stats = s->state->stats;
+#ifdef ZFAST_USE_THREADS
+  if (s->state->workers != NULL) {
+    zfast_workers *const w = s->state->workers;
+    pthread_mutex_lock(&w->lock);
+    fastlz_stats_merge(stats, &w->stats);
+    pthread_mutex_unlock(&w->lock);
+  }
+#endif
+  return Z_OK;
+#else
+  memset(stats, 0, sizeof(*stats));
+  return Z_VERSION_ERROR;
+#endif
+}
 
-        /* not buffered: check if we can do the job at once */
-        if (!may_buffer) {
-          /* input buffer too small */
-          if (s->avail_in < str_size) {
-            s->msg = "need more data on input";
-            return Z_BUF_ERROR;
-          }
-          /* output buffer too small */
-          else if (s->avail_out < dec_size) {
-            s->msg = "need more room on output";
-            return Z_BUF_ERROR;
-          }
-        }
+int fastlzlibGetGlobalStats(zfast_stats *stats) {
+  if (stats == NULL) {
+    return Z_STREAM_ERROR;
+  }
+#ifdef ZFAST_USE_STATS
+#ifdef ZFAST_USE_THREADS
+  pthread_mutex_lock(&global_stats_lock);
+#endif
+  *stats = global_stats;
+#ifdef ZFAST_USE_THREADS
+  pthread_mutex_unlock(&global_stats_lock);
+#endif
+  return Z_OK;
+#else
+  memset(stats, 0, sizeof(*stats));
+  return Z_VERSION_ERROR;
+#endif
+}
 
-        /* apply/eat the header and continue */
-        s->state->block_type = block_type;
-        s->state->str_size =  str_size;
-        s->state->dec_size =  dec_size;
-        inSeek(s, HEADER_SIZE);
-      }
-      /* header in inHdrOffs buffer */
-      else if (s->state->inHdrOffs == HEADER_SIZE) {
-        /* peek header */
-        uInt block_type;
-        uInt str_size;
-        uInt dec_size;
-        assert(may_buffer);  /* impossible at this point */
-        fastlz_read_header(s->state->inHdr, &block_type, &block_size,
-                           &str_size, &dec_size);
-        s->state->block_type = block_type;
-        s->state->str_size = str_size;
-        s->state->dec_size = dec_size;
-        s->state->inHdrOffs = 0;
-      }
-      /* otherwise, please come back later (header not fully processed) */
-      else {
-        assert(may_buffer);  /* impossible at this point */
-        return PROGRESS_OK();
-      }
+/* initialize a stream on the stack for one-shot functions (no allocation) */
+static int fastlzlibInitBuffer(zfast_stream *s, zfast_stream_internal *state,
+                               int level, uInt block_size,
+                               zfast_stream_compressor compressor) {
+  memset(s, 0, sizeof(*s));
+  memset(state, 0, sizeof(*state));
+  s->state = state;
+  strcpy(state->magic, MAGIC);
+  state->level = level;
+  state->block_size = block_size;
+  state->crc32c = fastlz_cpu_crc32c();
+  return fastlzlibSetCompressor(s, compressor);
+}
 
-      /* compressed and uncompressed == 0 : EOF marker */
-      if (s->state->str_size == 0 && s->state->dec_size == 0) {
-        return Z_STREAM_END;
-      }
+uLong fastlzlibCompressBound(uLong sourceLen, int block_size) {
+  if (fastlzlibGetBlockSizeLevel(block_size) != -1) {
+    const uLong bs = (uLong) block_size;
+    const uLong nblocks = ( sourceLen + bs - 1 ) / bs;
+    const uLong largest = sourceLen < bs ? sourceLen : bs;
+    /* each block expands by its header at most (raw blocks), the largest one
+       also needing room for the backend worst case */
+    return sourceLen + nblocks*HEADER_SIZE + largest / EXPANSION_RATIO
+      + EXPANSION_SECURITY;
+  }
+  return 0;
+}
+
+uInt fastlzlibCompressNeeded(zfast_stream *s, int flush) {
+  const zfast_stream_internal *state;
+  uInt size;
+  if (s == NULL || s->state == NULL || !ZFAST_IS_COMPRESSING(s)
+      || s->state->eof) {
+    return 0;
+  }
+  state = s->state;
+  /* pending output: flushed by the next call */
+  if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+    return state->dec_size - state->outBuffOffs;
+  }
+  /* block being buffered (the next call completes it at most) */
+  if (state->str_size != 0) {
+    return fastlz_compress_room(state, state->str_size);
+  }
+  /* meta blocks, in the order they are written by fastlzlibProcess() */
+  if (state->index_pending) {
+    return fastlzlibIndexBlockSize(s);
+  }
+  if (ZFAST_SYNC_PENDING(s)) {
+    return STREAM_HEADER_SIZE;
+  }
+  if (state->compressor_pending && state->compressor >= 0) {
+    return META_COMPRESSOR_SIZE;
+  }
+  if (state->preset_pending) {
+    return META_DICTIONARY_SIZE;
+  }
+  /* next block: the whole block size, unless flushing a smaller input */
+  size = state->block_size;
+  if (s->avail_in < size && flush > Z_NO_FLUSH) {
+    size = s->avail_in;
+  }
+  return fastlz_compress_room(state, size);
+}
+
+int fastlzlibDecompressNeeded(zfast_stream *s, uInt *in_needed,
+                              uInt *out_needed) {
+  const zfast_stream_internal *state;
+  uInt in = 0;
+  uInt out = 0;
+  if (s == NULL || s->state == NULL || !ZFAST_IS_DECOMPRESSING(s)) {
+    return Z_STREAM_ERROR;
+  }
+  state = s->state;
+  /* pending output: flushed by the next call */
+  if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
+    out = state->dec_size - state->outBuffOffs;
+  }
+  /* block being buffered: the remaining input, and the whole block */
+  else if (state->str_size != 0) {
+    in = state->str_size - state->inBuffOffs;
+    out = state->dec_size;
+  }
+  /* next header, read on client memory */
+  else if (state->inHdrOffs == 0 && s->next_in != NULL) {
+    uInt block_type, block_size, str_size, dec_size;
+    const uInt hdr_size = fastlz_read_any_header(state->compact,
+                                                 s->next_in, s->avail_in,
+                                                 BLOCK_SIZE(s),
+                                                 &block_type, &block_size,
+                                                 &str_size, &dec_size);
+    if (hdr_size == 0) {
+      return Z_BUF_ERROR;
+    } else if (block_type == BLOCK_TYPE_BAD_MAGIC) {
+      return Z_DATA_ERROR;
     }
-    /* compressing: fixed input size (unless flush) */
-    else {
-      uInt block_type = BLOCK_TYPE_COMPRESSED;
-      uInt str_size = BLOCK_SIZE(s);
+    in = hdr_size + str_size;
+    out = dec_size;
+  }
+  /* header split across several calls: not known yet */
+  else {
+    return Z_BUF_ERROR;
+  }
+  if (in_needed != NULL) {
+    *in_needed = in;
+  }
+  if (out_needed != NULL) {
+    *out_needed = out;
+  }
+  return Z_OK;
+}
 
-      /* not enough room on input */
-      if (str_size > s->avail_in) {
-        if (flush > Z_NO_FLUSH) {
-          str_size = s->avail_in;
-        } else if (!may_buffer) {
-          s->msg = "need more data on input";
-          return Z_BUF_ERROR;
-        }
-      }
-      
-      /* apply/eat the header and continue */
-      s->state->block_type = block_type;
-      s->state->str_size = str_size;
-      s->state->dec_size = 0;  /* yet unknown */
+int fastlzlibCompressBuffer(Bytef *dest, uLongf *destLen,
+                            const Bytef *source, uLong sourceLen,
+                            int level, int block_size,
+                            zfast_stream_compressor compressor) {
+  zfast_stream s;
+  zfast_stream_internal state;
+  int code;
+  if (dest == NULL || destLen == NULL || ( source == NULL && sourceLen != 0 )
+      || fastlzlibGetBlockSizeLevel(block_size) == -1) {
+    return Z_STREAM_ERROR;
+  }
+  /* default or unrecognized compression level */
+  if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) {
+    level = Z_BEST_COMPRESSION;
+  }
+  if ( ( code = fastlzlibInitBuffer(&s, &state, level, (uInt) block_size,
+                                    compressor) ) != Z_OK) {
+    return code;
+  }
+  return fastlz_compress_buffer(&state, NULL, &state.stats, dest, destLen,
+                                source, sourceLen);
+}
+
+int fastlzlibCompressBatch(zfast_stream *s, zfast_batch_item *items,
+                           uInt count) {
+  uInt i;
+  int code = Z_OK;
+  if (s == NULL || s->state == NULL || ( items == NULL && count != 0 )) {
+    return Z_STREAM_ERROR;
+  }
+  if (!ZFAST_IS_COMPRESSING(s)) {
+    s->msg = "compressing function used with a decompressing stream";
+    return Z_STREAM_ERROR;
+  }
+  if ( ( s->state->flags & ZFAST_FLAG_LINKED_BLOCKS ) != 0) {
+    s->msg = "linked blocks can not be compressed in batches";
+    return Z_STREAM_ERROR;
+  }
+  for(i = 0 ; i < count ; i++) {
+    if (items[i].next_in == NULL && items[i].avail_in != 0) {
+      s->msg = "invalid input";
+      return Z_STREAM_ERROR;
     }
-    
-    /* output not buffered yet */
-    s->state->outBuffOffs = s->state->dec_size;
+    else if (items[i].next_out == NULL) {
+      s->msg = "invalid output";
+      return Z_STREAM_ERROR;
+    }
+  }
+  /* backend work area, kept for the stream lifetime */
+  if (s->state->wrk == NULL) {
+    s->state->wrk = fastlzlibAllocWork(s);
+  }
+#ifdef ZFAST_USE_THREADS
+  if (s->state->workers != NULL && count > 1) {
+    fastlzlibWorkersBatch(s, items, count);
+  } else
+#endif
+  for(i = 0 ; i < count ; i++) {
+    fastlz_compress_item(s->state, s->state->wrk, &s->state->stats, &items[i]);
+  }
+  for(i = 0 ; i < count ; i++) {
+    if (items[i].code != Z_OK) {
+      s->msg = "need more room on output";
+      code = Z_BUF_ERROR;
+    }
+  }
+  return code;
+}
 
-    /* sanity check */
-    if (s->state->block_type == BLOCK_TYPE_BAD_MAGIC) {
-      s->msg = "corrupted compressed stream (bad magic)";
+int fastlzlibUncompressBuffer(Bytef *dest, uLongf *destLen,
+                              const Bytef *source, uLong sourceLen,
+                              zfast_stream_compressor compressor) {
+  zfast_stream s;
+  zfast_stream_internal state;
+  uLong offs = 0;
+  uLong done = 0;
+  int checksum_pending = 0;
+  uInt checksum = 0;
+  int compact = 0;
+  int code;
+  if (dest == NULL || destLen == NULL || source == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if ( ( code = fastlzlibInitBuffer(&s, &state, ZFAST_LEVEL_DECOMPRESS,
+                                    DEFAULT_BLOCK_SIZE, compressor) )
+       != Z_OK) {
+    return code;
+  }
+  for(;;) {
+    uInt block_type;
+    uInt block_size;
+    uInt str_size;
+    uInt dec_size;
+    const uInt hdr_size =
+      fastlz_read_any_header(compact, &source[offs],
+                             sourceLen - offs < HEADER_SIZE
+                             ? (uInt) ( sourceLen - offs ) : HEADER_SIZE,
+                             state.block_size, &block_type, &block_size,
+                             &str_size, &dec_size);
+    if (hdr_size == 0) {
       return Z_DATA_ERROR;
     }
-    else if (s->state->block_type != BLOCK_TYPE_RAW
-             && s->state->block_type != BLOCK_TYPE_COMPRESSED) {
-      s->msg = "corrupted compressed stream (illegal block type)";
-      return Z_VERSION_ERROR;
+    offs += hdr_size;
+    /* EOF marker */
+    if (str_size == 0 && dec_size == 0 && block_type != BLOCK_TYPE_BAD_MAGIC) {
+      break;
     }
-    else if (block_size > BLOCK_SIZE(s)) {
-      s->msg = "block size too large";
-      return Z_VERSION_ERROR;
+    state.block_size = block_size;
+    if (fastlz_check_header(&s, block_type, block_size, str_size, dec_size)
+        != Z_OK || sourceLen - offs < str_size) {
+      return Z_DATA_ERROR;
     }
-    else if (s->state->dec_size > BUFFER_BLOCK_SIZE(s)) {
-      s->msg = "corrupted compressed stream (illegal decompressed size)";
-      return Z_VERSION_ERROR;
+    if (*destLen - done < dec_size) {
+      return Z_BUF_ERROR;
     }
-    else if (s->state->str_size > BUFFER_BLOCK_SIZE(s)) {
-      s->msg = "corrupted compressed stream (illegal stream size)";
-      return Z_VERSION_ERROR;
+    /* stream header: compact headers follow */
+    if (block_type == BLOCK_TYPE_STREAM) {
+      if (source[offs] != STREAM_VERSION_COMPACT) {
+        return Z_VERSION_ERROR;
+      }
+      compact = 1;
     }
-    
-    /* direct data fully available (ie. complete compressed block) ? */
-    if (s->avail_in >= s->state->str_size) {
-      in = s->next_in;
-      inSeek(s, s->state->str_size);
+    /* meta blocks: preset dictionaries are not supported */
+    else if (block_type == BLOCK_TYPE_META) {
+      if (source[offs] == META_TYPE_DICTIONARY) {
+        return Z_DATA_ERROR;
+      }
+      else if (source[offs] == META_TYPE_CHECKSUM) {
+        if (str_size != 1 + 4) {
+          return Z_DATA_ERROR;
+        }
+        checksum = (uInt) READ_32(&source[offs + 1]);
+        checksum_pending = 1;
+      }
+      else if (source[offs] == META_TYPE_COMPRESSOR) {
+        if (str_size != 1 + 1) {
+          return Z_DATA_ERROR;
+        }
+        if (fastlzlibSelectDecompressor(&state, source[offs + 1]) != Z_OK) {
+          return Z_VERSION_ERROR;
+        }
+      }
     }
-    /* otherwise, buffered */
     else {
-      s->state->inBuffOffs = 0;
+      /* linked blocks history is the client output itself */
+      const uLong history = done < HISTORY_SIZE ? done : HISTORY_SIZE;
+      state.dict = &dest[done - history];
+      state.dict_size = (uInt) history;
+      if (fastlz_decompress_hdr(&state, block_type, &source[offs], str_size,
+                                &dest[done], dec_size) != (int) dec_size
+          || ( checksum_pending
+               && fastlz_crc32c(&state, &dest[done], dec_size) != checksum ) ) {
+        return Z_DATA_ERROR;
+      }
+      checksum_pending = 0;
+      done += dec_size;
     }
+    offs += str_size;
   }
+  *destLen = done;
+  return Z_OK;
+}
 
-  /* notes: */
-  /* - header always processed at this point */
-  /* - no output buffer data to be processed (outBuffOffs == 0) */
- 
-  /* buffered data: copy as much as possible to inBuff until we have the
-     block data size */
-  if (in == NULL) {
-    /* remaining data to copy in input buffer */
-    if (s->state->inBuffOffs < s->state->str_size) {
-      uInt size = s->state->str_size - s->state->inBuffOffs;
-      if (size > s->avail_in) {
-        size = s->avail_in;
+/* number of stream pool shards (power of two) */
+#define POOL_SHARDS 16
+
+/* a stream pool shard, with its own lock */
+typedef struct zfast_pool_shard {
+#ifdef ZFAST_USE_THREADS
+  pthread_mutex_t lock;
+#endif
+  /* idle streams, and their maximum number in this shard */
+  zfast_stream_internal *streams;
+  int count;
+  int max_count;
+  /* avoid false sharing between shards */
+  char pad[64];
+} zfast_pool_shard;
+
+struct zfast_pool {
+  zfast_pool_shard shards[POOL_SHARDS];
+};
+
+#ifdef ZFAST_USE_THREADS
+#define POOL_LOCK(SH) pthread_mutex_lock(&(SH)->lock)
+#define POOL_TRYLOCK(SH) ( pthread_mutex_trylock(&(SH)->lock) == 0 )
+#define POOL_UNLOCK(SH) pthread_mutex_unlock(&(SH)->lock)
+#else
+#define POOL_LOCK(SH) do { } while(0)
+#define POOL_TRYLOCK(SH) ( 1 )
+#define POOL_UNLOCK(SH) do { } while(0)
+#endif
+
+/* preferred shard of the calling thread */
+static ZFASTINLINE unsigned int fastlzlibPoolShard(void) {
+#ifdef ZFAST_USE_THREADS
+  const pthread_t self = pthread_self();
+  size_t h = 0;
+  memcpy(&h, &self, sizeof(self) < sizeof(h) ? sizeof(self) : sizeof(h));
+  /* thread identifiers are usually aligned addresses */
+  h ^= h >> 7;
+  h ^= h >> 13;
+  return (unsigned int) ( h ^ ( h >> 4 ) ) % POOL_SHARDS;
+#else
+  return 0;
+#endif
+}
+
+/* free a stream internal state */
+static void fastlzlibPoolFree(zfast_stream_internal *state) {
+  zfast_stream s;
+  memset(&s, 0, sizeof(s));
+  s.state = state;
+  fastlzlibFree(&s);
+}
+
+zfast_pool* fastlzlibPoolCreate(int max_streams) {
+  zfast_pool *const pool = (zfast_pool*) malloc(sizeof(zfast_pool));
+  if (pool != NULL) {
+    int i;
+    if (max_streams < 0) {
+      max_streams = 0;
+    }
+    for(i = 0 ; i < POOL_SHARDS ; i++) {
+#ifdef ZFAST_USE_THREADS
+      if (pthread_mutex_init(&pool->shards[i].lock, NULL) != 0) {
+        while(i-- > 0) {
+          pthread_mutex_destroy(&pool->shards[i].lock);
+        }
+        free(pool);
+        return NULL;
       }
-      if (size > 0) {
-        memcpy(&s->state->inBuff[s->state->inBuffOffs], s->next_in, size);
-        s->state->inBuffOffs += size;
-        inSeek(s, size);
+#endif
+      pool->shards[i].streams = NULL;
+      pool->shards[i].count = 0;
+      /* the shards together keep at most max_streams idle streams */
+      pool->shards[i].max_count = max_streams / POOL_SHARDS
+        + ( i < max_streams % POOL_SHARDS ? 1 : 0 );
+    }
+  }
+  return pool;
+}
+
+void fastlzlibPoolDestroy(zfast_pool *pool) {
+  if (pool != NULL) {
+    int i;
+    for(i = 0 ; i < POOL_SHARDS ; i++) {
+      zfast_stream_internal *state = pool->shards[i].streams;
+      while(state != NULL) {
+        zfast_stream_internal *const next = state->next;
+        fastlzlibPoolFree(state);
+        state = next;
       }
+#ifdef ZFAST_USE_THREADS
+      pthread_mutex_destroy(&pool->shards[i].lock);
+#endif
     }
-    /* block stream size (ie. compressed one) reached */
-    if (s->state->inBuffOffs == s->state->str_size) {
-      in = s->state->inBuff;
-      /* we are about to eat buffered data */
-      s->state->inBuffOffs = 0;
+    free(pool);
+  }
+}
+
+/* take an idle stream with the given parameters from a locked shard */
+static ZFASTINLINE zfast_stream_internal*
+fastlzlibPoolTake(zfast_pool_shard *shard, int level, uInt block_size,
+                  int compressor) {
+  zfast_stream_internal **prev;
+  for(prev = &shard->streams ; *prev != NULL ; prev = &(*prev)->next) {
+    zfast_stream_internal *const state = *prev;
+    if (state->level == level && state->block_size == block_size
+        && state->default_compressor == compressor) {
+      *prev = state->next;
+      state->next = NULL;
+      shard->count--;
+      return state;
     }
-    /* forced flush: adjust str_size */
-    else if (ZFAST_IS_COMPRESSING(s) && flush != Z_NO_FLUSH) {
-      in = s->state->inBuff;
-      s->state->str_size = s->state->inBuffOffs;
-      /* we are about to eat buffered data, reset it (now empty) */
-      s->state->inBuffOffs = 0;
+  }
+  return NULL;
+}
+
+/* put an idle stream in a locked shard, if there is room */
+static ZFASTINLINE int fastlzlibPoolPut(zfast_pool_shard *shard,
+                                        zfast_stream_internal *state) {
+  if (shard->count < shard->max_count) {
+    state->next = shard->streams;
+    shard->streams = state;
+    shard->count++;
+    return 1;
+  }
+  return 0;
+}
+
+/* get an idle stream from the pool, or initialize a new one */
+static int fastlzlibPoolInit(zfast_pool *pool, zfast_stream *s, int level,
+                             int block_size,
+                             zfast_stream_compressor compressor) {
+  zfast_stream_internal *state = NULL;
+  int success;
+  if (pool == NULL || s == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  /* pooled streams use the default allocator */
+  if (s->zalloc == NULL && s->zfree == NULL) {
+    const unsigned int self = fastlzlibPoolShard();
+    unsigned int i;
+    POOL_LOCK(&pool->shards[self]);
+    state = fastlzlibPoolTake(&pool->shards[self], level, (uInt) block_size,
+                              compressor);
+    POOL_UNLOCK(&pool->shards[self]);
+    /* other shards, if not busy */
+    for(i = 1 ; state == NULL && i < POOL_SHARDS ; i++) {
+      zfast_pool_shard *const shard = &pool->shards[( self + i ) % POOL_SHARDS];
+      if (POOL_TRYLOCK(shard)) {
+        state = fastlzlibPoolTake(shard, level, (uInt) block_size,
+                                  compressor);
+        POOL_UNLOCK(shard);
+      }
+    }
+  }
+  if (state != NULL) {
+    s->state = state;
+    fastlzlibReset(s);
+    return Z_OK;
+  }
+  /* new stream */
+  if (level == ZFAST_LEVEL_DECOMPRESS) {
+    success = fastlzlibDecompressInit2(s, block_size);
+  } else {
+    success = fastlzlibCompressInit2(s, level, block_size);
+  }
+  if (success == Z_OK) {
+    success = fastlzlibSetCompressor(s, compressor);
+    if (success != Z_OK) {
+      fastlzlibFree(s);
     }
   }
+  return success;
+}
 
-  /* we have a complete compressed block (str_size) : where to uncompress ? */
-  if (in != NULL) {
-    Bytef *out = NULL;
-    const uInt in_size = s->state->str_size;
-
-    int flush_now = flush;
-    /* we are supposed to finish, but we did not eat all data: ignore for now */
-    if (flush_now == Z_FINISH && !ZFAST_INPUT_IS_EMPTY(s)) {
-      flush_now = Z_NO_FLUSH;
-    }
+int fastlzlibPoolCompressInit(zfast_pool *pool, zfast_stream *s, int level,
+                              int block_size,
+                              zfast_stream_compressor compressor) {
+  /* default or unrecognized compression level */
+  if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) {
+    level = Z_BEST_COMPRESSION;
+  }
+  return fastlzlibPoolInit(pool, s, level, block_size, compressor);
+}
 
-    /* decompressing */
-    if (ZFAST_IS_DECOMPRESSING(s)) {
-      int done = 0;
-      const uInt out_size = s->state->dec_size;
+int fastlzlibPoolDecompressInit(zfast_pool *pool, zfast_stream *s,
+                                int block_size,
+                                zfast_stream_compressor compressor) {
+  return fastlzlibPoolInit(pool, s, ZFAST_LEVEL_DECOMPRESS, block_size,
+                           compressor);
+}
 
-      /* can decompress directly on client memory */
-      if (s->avail_out >= s->state->dec_size) {
-        out = s->next_out;
-        outSeek(s, s->state->dec_size);
-        /* no buffer */
-        s->state->outBuffOffs = s->state->dec_size;
+int fastlzlibPoolEnd(zfast_pool *pool, zfast_stream *s) {
+  if (pool == NULL || s == NULL || s->state == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  /* only plain streams are kept */
+  if (s->zalloc == NULL && s->zfree == NULL
+      && s->state->alloc == NULL
+      && s->state->workers == NULL
+      && s->state->flags == 0
+      && s->state->table_log == 0
+      && s->state->preset == NULL
+      && s->state->default_compressor >= 0) {
+    const unsigned int self = fastlzlibPoolShard();
+    zfast_stream_internal *const state = s->state;
+    unsigned int i;
+    /* keep the work area, but not the (large) buffers and history */
+    fastlz_stats_retire(&state->stats);
+    state->target_speed = 0;
+    state->incompressible = DEFAULT_INCOMPRESSIBLE;
+    fastlzlibReset(s);
+    fastlzlibReleaseBuffers(s);
+    if (state->dict != NULL) {
+      zfree_block(s, state->dict);
+      state->dict = NULL;
+    }
+    /* preferred shard, then other shards with room, if not busy */
+    for(i = 0 ; i < POOL_SHARDS ; i++) {
+      zfast_pool_shard *const shard = &pool->shards[( self + i ) % POOL_SHARDS];
+      int kept = 0;
+      if (shard->max_count == 0) {
+        continue;
       }
-      /* otherwise in output buffer */
-      else {
-        out = s->state->outBuff;
-        s->state->outBuffOffs = 0;
+      if (i == 0) {
+        POOL_LOCK(shard);
+      } else if (!POOL_TRYLOCK(shard)) {
+        continue;
+      }
+      kept = fastlzlibPoolPut(shard, state);
+      POOL_UNLOCK(shard);
+      if (kept) {
+        s->state = NULL;
+        return Z_OK;
       }
+    }
+  }
+  fastlzlibFree(s);
+  return Z_OK;
+}
 
-      /* input eaten */
-      s->state->str_size = 0;
+/* checksum of a data block, if any, and its backend */
+typedef struct zfast_reader_block {
+  int verify;
+  uInt checksum;
+  int (*decompress)(const void* input, int length, void* output, int maxout);
+} zfast_reader_block;
 
-      /* rock'in */
-      switch(s->state->block_type) {
-      case BLOCK_TYPE_COMPRESSED:
-        done = ZFAST_DECOMPRESS(in, in_size, out, out_size);
+/* a read-only stream reader ; immutable once opened */
+struct zfast_reader {
+  /* decompressor (only the backend functions are used) */
+  zfast_stream_internal state;
+  /* data blocks index, and their checksums and backends */
+  zfast_index index;
+  zfast_reader_block *blocks;
+  /* stream data */
+  const Bytef *data;
+  zfast_uint64 size;
+  /* mapping (or allocated copy) to be released, if any */
+  void *map;
+  size_t map_size;
+};
+
+/* build the data blocks index of a reader, from the index trailer if any,
+   or by walking the block headers */
+static int fastlzlibReaderIndex(zfast_reader *reader) {
+  zfast_index *const index = &reader->index;
+  const Bytef *const data = reader->data;
+  const zfast_uint64 size = reader->size;
+  uInt trailer;
+  uInt i;
+  uInt j;
+  int verify = 0;
+  uInt checksum = 0;
+
+  /* the index trailer covers all the blocks preceding it */
+  if (size >= HEADER_SIZE + 4
+      && fastlzlibGetIndexSize(&data[size - HEADER_SIZE - 4],
+                               HEADER_SIZE + 4, &trailer) == Z_OK
+      && trailer <= size
+      && fastlzlibIndexLoad(index, &data[size - trailer], trailer) == Z_OK
+      && index->csize + trailer == size) {
+    uInt block_type;
+    uInt block_size;
+    uInt str_size;
+    uInt dec_size;
+    fastlz_read_header(&data[size - trailer], &block_type, &block_size,
+                       &str_size, &dec_size);
+    reader->state.block_size = block_size;
+  }
+  /* walk the headers */
+  else {
+    zfast_stream s;
+    zfast_uint64 offs = 0;
+    memset(&s, 0, sizeof(s));
+    s.state = &reader->state;
+    index->count = 0;
+    index->csize = index->usize = 0;
+    index->compact = 0;
+    index->compressor = -1;
+    for(;;) {
+      uInt block_type;
+      uInt block_size;
+      uInt str_size;
+      uInt dec_size;
+      const uInt hdr_size =
+        fastlz_read_any_header(index->compact, &data[offs],
+                               size - offs < HEADER_SIZE
+                               ? (uInt) ( size - offs ) : HEADER_SIZE,
+                               reader->state.block_size, &block_type,
+                               &block_size, &str_size, &dec_size);
+      if (hdr_size == 0) {
+        return Z_DATA_ERROR;
+      }
+      /* EOF marker */
+      if (str_size == 0 && dec_size == 0
+          && block_type != BLOCK_TYPE_BAD_MAGIC) {
         break;
-      case BLOCK_TYPE_RAW:
-        if (out_size >= in_size) {
-          memcpy(out, in, in_size);
-          done = in_size;
-        } else {
-          done = 0;
+      }
+      reader->state.block_size = block_size;
+      if (fastlz_check_header(&s, block_type, block_size, str_size, dec_size)
+          != Z_OK || size - offs - hdr_size < str_size) {
+        return Z_DATA_ERROR;
+      }
+      /* stream header: compact headers follow */
+      if (block_type == BLOCK_TYPE_STREAM) {
+        if (data[offs + hdr_size] != STREAM_VERSION_COMPACT) {
+          return Z_DATA_ERROR;
         }
-        break;
-      default:
-        assert(0);
-        break;
+        index->compact = 1;
       }
-      if (done != (int) s->state->dec_size) {
-        s->msg = "unable to decompress block stream";
-        return Z_STREAM_ERROR;
+      if (fastlzlibIndexAppend(index, hdr_size + str_size, dec_size)
+          != Z_OK) {
+        return Z_MEM_ERROR;
       }
+      offs += hdr_size + str_size;
     }
-    /* compressing */
-    else {
-      /* note: if < MIN_BLOCK_SIZE, fastlz_compress_hdr will not compress */
-      const uInt estimated_dec_size = in_size + in_size / EXPANSION_RATIO
-        + EXPANSION_SECURITY;
+  }
 
-      /* can compress directly on client memory */
-      if (s->avail_out >= estimated_dec_size) {
-        const int done = fastlz_compress_hdr(s, in, in_size,
-                                             s->next_out, estimated_dec_size,
-                                             BLOCK_SIZE(s),
-                                             s->state->level,
-                                             flush_now);
-        /* seek output */
-        outSeek(s, done);
-        /* no buffer */
-        s->state->outBuffOffs = s->state->dec_size;
+  /* keep data blocks only, with their checksum if any, and their backend */
+  reader->blocks = (zfast_reader_block*)
+    malloc(sizeof(zfast_reader_block) * ( index->count + 1 ));
+  if (reader->blocks == NULL) {
+    return Z_MEM_ERROR;
+  }
+  for(i = j = 0 ; i < index->count ; i++) {
+    const zfast_index_entry entry = index->entries[i];
+    if (entry.usize == 0) {
+      uInt block_type;
+      uInt block_size;
+      uInt str_size;
+      uInt dec_size;
+      fastlz_read_header(&data[entry.coffs], &block_type, &block_size,
+                         &str_size, &dec_size);
+      if (block_type == BLOCK_TYPE_META && str_size == 1 + 4
+          && entry.csize == META_CHECKSUM_SIZE
+          && data[entry.coffs + HEADER_SIZE] == META_TYPE_CHECKSUM) {
+        verify = 1;
+        checksum = (uInt) READ_32(&data[entry.coffs + HEADER_SIZE + 1]);
       }
-      /* otherwise in output buffer */
-      else {
-        const int done = fastlz_compress_hdr(s, in, in_size,
-                                             s->state->outBuff,
-                                             BUFFER_BLOCK_SIZE(s),
-                                             BLOCK_SIZE(s),
-                                             s->state->level,
-                                             flush_now);
-        /* produced size (in outBuff) */
-        s->state->dec_size = (uInt) done;
-        /* buffered */
-        s->state->outBuffOffs = 0;
+      else if (block_type == BLOCK_TYPE_META && str_size == 1 + 1
+               && entry.csize == META_COMPRESSOR_SIZE
+               && data[entry.coffs + HEADER_SIZE] == META_TYPE_COMPRESSOR) {
+        if (fastlzlibSelectDecompressor(&reader->state,
+                                        data[entry.coffs + HEADER_SIZE + 1])
+            != Z_OK) {
+          return Z_VERSION_ERROR;
+        }
+        index->compressor = reader->state.compressor;
       }
-
-      /* input eaten */
-      s->state->str_size = 0;
+    } else {
+      reader->blocks[j].verify = verify;
+      reader->blocks[j].checksum = checksum;
+      reader->blocks[j].decompress = reader->state.decompress;
+      verify = 0;
+      index->entries[j++] = entry;
     }
   }
+  index->count = j;
+  return Z_OK;
+}
 
-  /* new output buffer data to be processed ; same logic as begining */
-  if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
-    /* maximum size that can be copied */
-    uInt size = s->state->dec_size - s->state->outBuffOffs;
-    if (size > s->avail_out) {
-      size = s->avail_out;
-    }
-    /* copy and seek */
-    if (size > 0) {
-      memcpy(s->next_out, &s->state->outBuff[s->state->outBuffOffs], size);
-      s->state->outBuffOffs += size;
-      outSeek(s, size);
-    }
+zfast_reader* fastlzlibReaderOpenBuffer(const Bytef *data, zfast_uint64 size,
+                                        zfast_stream_compressor compressor) {
+  zfast_reader *reader;
+  zfast_stream s;
+  if (data == NULL && size != 0) {
+    return NULL;
   }
+  reader = (zfast_reader*) malloc(sizeof(zfast_reader));
+  if (reader == NULL) {
+    return NULL;
+  }
+  memset(&reader->index, 0, sizeof(reader->index));
+  reader->index.compressor = -1;
+  reader->blocks = NULL;
+  reader->data = data;
+  reader->size = size;
+  reader->map = NULL;
+  reader->map_size = 0;
+  if (fastlzlibInitBuffer(&s, &reader->state, ZFAST_LEVEL_DECOMPRESS,
+                          DEFAULT_BLOCK_SIZE, compressor) != Z_OK
+      || fastlzlibReaderIndex(reader) != Z_OK) {
+    fastlzlibReaderClose(reader);
+    return NULL;
+  }
+  return reader;
+}
 
-  /* so far so good */
-
-  /* success and EOF */
-  if (flush == Z_FINISH
-      && ZFAST_INPUT_IS_EMPTY(s)
-      && !ZFAST_HAS_BUFFERED_OUTPUT(s)) {
-    if (!ZFAST_IS_DECOMPRESSING(s)) {
-      return Z_STREAM_END;
+zfast_reader* fastlzlibReaderOpen(const char *filename,
+                                  zfast_stream_compressor compressor) {
+  zfast_reader *reader = NULL;
+  void *map = NULL;
+  size_t size = 0;
+#ifndef _WIN32
+  const int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &st) == 0 && st.st_size > 0
+      && (zfast_uint64) st.st_size == (size_t) st.st_size) {
+    size = (size_t) st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      map = NULL;
     }
-    /* we are supposed to be done in decompressing but did not see any EOF */
-    else {
-      s->msg = "unexpected EOF";
-      return Z_BUF_ERROR;
+  }
+  close(fd);
+#else
+  /* no mapping: read the whole file */
+  FILE *const fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  if (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) > 0) {
+    size = (size_t) ftell(fp);
+    map = malloc(size);
+    if (map != NULL && ( fseek(fp, 0, SEEK_SET) != 0
+                         || fread(map, 1, size, fp) != size ) ) {
+      free(map);
+      map = NULL;
     }
   }
-  /* success */
-  else {
-    return PROGRESS_OK();
+  fclose(fp);
+#endif
+  if (map != NULL) {
+    reader = fastlzlibReaderOpenBuffer((const Bytef*) map, size, compressor);
+    if (reader != NULL) {
+      reader->map = map;
+      reader->map_size = size;
+    } else {
+#ifndef _WIN32
+      munmap(map, size);
+#else
+      free(map);
+#endif
+    }
   }
-#undef PROGRESS_OK
+  return reader;
 }
 
-/* same as fastlzlibProcess(), but retry once if first call did not produce any
-   data (ie. only modified the state machine) */
-static ZFASTINLINE int fastlzlibProcess2(zfast_stream *const s, const int flush,
-                                         const int may_buffer) {
-  const uInt prev_avail_in = s->avail_in;
-  const uInt prev_avail_out = s->avail_out;
-  const int success = fastlzlibProcess(s, flush, may_buffer);
-  const uInt avail_in = s->avail_in;
-  const uInt avail_out = s->avail_out;
-  /* successful, ate input, no data on output ? */
-  if (success == 0
-      && avail_out == prev_avail_out && avail_in != prev_avail_in
-      && flush != Z_NO_FLUSH) {
-    return fastlzlibProcess(s, flush, may_buffer);
-  } else {
-    return success;
+void fastlzlibReaderClose(zfast_reader *reader) {
+  if (reader != NULL) {
+    if (reader->index.entries != NULL) {
+      free(reader->index.entries);
+    }
+    if (reader->blocks != NULL) {
+      free(reader->blocks);
+    }
+    if (reader->map != NULL) {
+#ifndef _WIN32
+      munmap(reader->map, reader->map_size);
+#else
+      free(reader->map);
+#endif
+    }
+    free(reader);
   }
 }
 
-int fastlzlibDecompress2(zfast_stream *s, int flush, const int may_buffer) {
-  if (ZFAST_IS_DECOMPRESSING(s)) {
-    return fastlzlibProcess2(s, flush, may_buffer);
-  } else {
-    s->msg = "decompressing function used with a compressing stream";
-    return Z_STREAM_ERROR;
-  }
+uInt fastlzlibReaderGetBlockCount(const zfast_reader *reader) {
+  return reader != NULL ? reader->index.count : 0;
 }
 
-int fastlzlibDecompress(zfast_stream *s) {
-  return fastlzlibDecompress2(s, Z_NO_FLUSH, 1);
+zfast_uint64 fastlzlibReaderGetSize(const zfast_reader *reader) {
+  return reader != NULL ? reader->index.usize : 0;
 }
 
-int fastlzlibCompress2(zfast_stream *s, int flush, const int may_buffer) {
-  if (ZFAST_IS_COMPRESSING(s)) {
-    return fastlzlibProcess2(s, flush, may_buffer);
-  } else {
-    s->msg = "compressing function used with a decompressing stream";
+const zfast_index* fastlzlibReaderGetIndex(const zfast_reader *reader) {
+  return reader != NULL ? &reader->index : NULL;
+}
+
+int fastlzlibReaderGetBlockInfo(const zfast_reader *reader, uInt block,
+                                zfast_uint64 *offset, uInt *size) {
+  if (reader == NULL || offset == NULL || size == NULL) {
     return Z_STREAM_ERROR;
   }
+  if (block >= reader->index.count) {
+    return Z_BUF_ERROR;
+  }
+  *offset = reader->index.entries[block].uoffs;
+  *size = reader->index.entries[block].usize;
+  return Z_OK;
 }
 
-int fastlzlibCompress(zfast_stream *s, int flush) {
-  return fastlzlibCompress2(s, flush, 1);
+int fastlzlibReaderFindBlock(const zfast_reader *reader, zfast_uint64 offset,
+                             uInt *block) {
+  zfast_uint64 compressed_offset;
+  zfast_uint64 block_offset;
+  uInt lo = 0;
+  uInt hi;
+  if (reader == NULL || block == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (offset >= reader->index.usize) {
+    return Z_BUF_ERROR;
+  }
+  if (fastlzlibIndexLookup(&reader->index, offset, &compressed_offset,
+                           &block_offset) != Z_OK) {
+    return Z_BUF_ERROR;
+  }
+  /* entry index (data blocks have distinct compressed offsets) */
+  for(hi = reader->index.count ; hi - lo > 1 ; ) {
+    const uInt mid = lo + ( hi - lo ) / 2;
+    if (reader->index.entries[mid].coffs <= compressed_offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  *block = lo;
+  return Z_OK;
 }
 
-int fastlzlibIsCompressedStream(const void* input, int length) {
-  if (length >= HEADER_SIZE) {
-    const Bytef*const in = (const Bytef*) input;
-    return fastlzlibGetStreamBlockSize(in, length) != 0 ? Z_OK : Z_DATA_ERROR;
+/* decompress the begining of a data block into "dest" (large enough for the
+   whole block), until at least "target" bytes are decoded ; returns the
+   decoded size, or -1 if the block is corrupted (note: blocks with a checksum
+   are always decoded as a whole, to be verified) */
+static int fastlzlibReaderDecode(const zfast_reader *reader, uInt block,
+                                 Bytef *dest, uInt target) {
+  const zfast_index_entry *const entry = &reader->index.entries[block];
+  const Bytef *input;
+  uInt hdr_size;
+  uInt block_type;
+  uInt block_size;
+  uInt str_size;
+  uInt dec_size;
+  int done;
+  /* the header must match the index entry */
+  hdr_size = fastlz_read_any_header(reader->index.compact,
+                                    &reader->data[entry->coffs],
+                                    entry->csize < HEADER_SIZE
+                                    ? entry->csize : HEADER_SIZE,
+                                    reader->state.block_size, &block_type,
+                                    &block_size, &str_size, &dec_size);
+  if (hdr_size == 0
+      || hdr_size + str_size != entry->csize || dec_size != entry->usize
+      || ( block_type != BLOCK_TYPE_RAW
+           && block_type != BLOCK_TYPE_COMPRESSED )) {
+    /* note: linked blocks need the previous blocks, and are not supported */
+    return -1;
+  }
+  if (reader->blocks[block].verify || target > dec_size) {
+    target = dec_size;
+  }
+  /* decode straight from the stream data, using the backend of the block */
+  input = &reader->data[entry->coffs + hdr_size];
+  if (block_type == BLOCK_TYPE_RAW) {
+    if (str_size != dec_size) {
+      return -1;
+    }
+    memcpy(dest, input, target);
+    done = (int) target;
+  } else if (target < dec_size) {
+    done = fastlz_decompress_prefix(reader->blocks[block].decompress,
+                                    input, str_size, dest, target, dec_size);
   } else {
+    done = reader->blocks[block].decompress(input, str_size, dest, dec_size);
+  }
+  if (done < (int) target || done > (int) dec_size
+      || ( reader->blocks[block].verify
+           && ( done != (int) dec_size
+                || fastlz_crc32c(&reader->state, dest, dec_size)
+                != reader->blocks[block].checksum ) ) ) {
+    return -1;
+  }
+  return done;
+}
+
+int fastlzlibReaderReadBlock(const zfast_reader *reader, uInt block,
+                             Bytef *dest, uInt *destLen) {
+  uInt size;
+  if (reader == NULL || dest == NULL || destLen == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (block >= reader->index.count) {
+    return Z_BUF_ERROR;
+  }
+  size = reader->index.entries[block].usize;
+  if (*destLen < size) {
     return Z_BUF_ERROR;
   }
+  if (fastlzlibReaderDecode(reader, block, dest, size) != (int) size) {
+    return Z_DATA_ERROR;
+  }
+  *destLen = size;
+  return Z_OK;
 }
 
-int fastlzlibDecompressSync(zfast_stream *s) {
-  if (ZFAST_IS_DECOMPRESSING(s)) {
-    if (ZFAST_HAS_BUFFERED_OUTPUT(s)) {
-      /* not in an error state: uncompressed data available in buffer */
-      return Z_OK;
+int fastlzlibReaderRead(const zfast_reader *reader, zfast_uint64 offset,
+                        Bytef *dest, uInt *length) {
+  Bytef *scratch = NULL;
+  uInt done = 0;
+  uInt block;
+  int code;
+  if (reader == NULL || dest == NULL || length == NULL) {
+    return Z_STREAM_ERROR;
+  }
+  if (offset >= reader->index.usize || *length == 0) {
+    if (offset > reader->index.usize) {
+      return Z_BUF_ERROR;
+    }
+    *length = 0;
+    return Z_OK;
+  }
+  code = fastlzlibReaderFindBlock(reader, offset, &block);
+  for( ; code == Z_OK && done < *length && block < reader->index.count
+         ; block++) {
+    const zfast_index_entry *const entry = &reader->index.entries[block];
+    const uInt skip = (uInt) ( offset + done - entry->uoffs );
+    const uInt remaining = *length - done;
+    uInt size = entry->usize;
+    /* whole block: directly on client memory */
+    if (skip == 0 && remaining >= size) {
+      code = fastlzlibReaderReadBlock(reader, block, &dest[done], &size);
+      done += size;
     }
+    /* partial block: through a scratch buffer (per call), only decoding the
+       block until the end of the range */
     else {
-      /* Note: if s->state->str_size == 0, we are not in an error state: the
-         next chunk is to be read; However, we check the chunk anyway. */
-
-      /* at least HEADER_SIZE data */
-      if (s->avail_in < HEADER_SIZE) {
-        s->msg = "need more data on input";
-        return Z_BUF_ERROR;
-      }
-        
-      /* in buffered read of the header.. reset to 0 */
-      if (s->state->inHdrOffs != 0) {
-        s->state->inHdrOffs = 0;
-      }
-      
-      /* seek */
-      for( ; s->avail_in >= HEADER_SIZE
-             ; s->state->inHdrOffs++, inSeek(s, 1)) {
-        const Bytef *const in = s->next_in;
-        if (in[0] == BLOCK_MAGIC[0]
-            && in[1] == BLOCK_MAGIC[1]
-            && in[2] == BLOCK_MAGIC[2]
-            && in[3] == BLOCK_MAGIC[3]
-            && in[4] == BLOCK_MAGIC[4]
-            && in[5] == BLOCK_MAGIC[5]
-            && in[6] == BLOCK_MAGIC[6]
-            ) {
-          const int block_size = fastlzlibGetStreamBlockSize(in, HEADER_SIZE);
-          if (block_size != 0) {
-            /* successful seek */
-            return Z_OK;
-          }
+      const uInt copy = size - skip < remaining ? size - skip : remaining;
+      if (scratch == NULL) {
+        scratch = (Bytef*) malloc(BUFFER_SIZE_FOR_BLOCK(reader->state
+                                                        .block_size));
+        if (scratch == NULL) {
+          code = Z_MEM_ERROR;
+          break;
         }
       }
-      s->msg = "no flush point found";
-      return Z_DATA_ERROR;
+      if (fastlzlibReaderDecode(reader, block, scratch, skip + copy) < 0) {
+        code = Z_DATA_ERROR;
+      } else {
+        memcpy(&dest[done], &scratch[skip], copy);
+        done += copy;
+      }
     }
-  } else {
-    s->msg = "decompressing function used with a compressing stream";
-    return Z_STREAM_ERROR;
   }
+  if (scratch != NULL) {
+    free(scratch);
+  }
+  *length = done;
+  return code;
 }
@@ -77,6 +77,84 @@ typedef enum zfast_stream_compressor {
   COMPRESSOR_DEFAULT = COMPRESSOR_FASTLZ
 } zfast_stream_compressor;
 
+/**
+ * Stream flags.
+ **/
+typedef enum zfast_stream_flags {
+  /* compressed blocks may reference up to 64KB of previous blocks data
+     (LZ4 only) ; linked blocks can not be decompressed independently */
+  ZFAST_FLAG_LINKED_BLOCKS = 1 << 0,
+  /* write a block index trailer before the EOF marker, to allow seeking
+     within the stream (see fastlzlibSeek()) */
+  ZFAST_FLAG_INDEX = 1 << 1,
+  /* write the CRC32C checksum of each block, verified upon decompression
+     (checksums found in a stream are always verified) */
+  ZFAST_FLAG_CHECKSUM = 1 << 2,
+  /* compact stream format: a stream header, followed by blocks using
+     variable-length headers (a few bytes instead of 16) ; the stream header
+     is repeated regularly as a sync marker (see fastlzlibDecompressSync()) */
+  ZFAST_FLAG_COMPACT_HEADERS = 1 << 3,
+  /* record the compressor in the stream, so that decoders select the right
+     backend regardless of fastlzlibSetCompressor() (compressor ids found in
+     a stream are always honored ; custom backends are not recorded) */
+  ZFAST_FLAG_COMPRESSOR_ID = 1 << 4,
+  /* adaptive mode: blocks which look incompressible are stored without
+     trying to compress them, and the level of each block is selected to meet
+     the target speed set with fastlzlibSetTargetSpeed() (linked blocks are
+     always compressed at the stream level) */
+  ZFAST_FLAG_ADAPTIVE = 1 << 5,
+  /* pre-scan each block, and store blocks which look incompressible (see
+     fastlzlibSetIncompressibleThreshold()) without trying to compress them
+     (implied by ZFAST_FLAG_ADAPTIVE ; linked blocks are always compressed) */
+  ZFAST_FLAG_SKIP_INCOMPRESSIBLE = 1 << 6
+} zfast_stream_flags;
+
+/**
+ * Scatter/gather buffer (struct iovec on POSIX systems).
+ **/
+#ifdef _WIN32
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+/**
+ * 64-bit unsigned offset type.
+ **/
+#ifdef _MSC_VER
+typedef unsigned __int64 zfast_uint64;
+#else
+typedef unsigned long long zfast_uint64;
+#endif
+
+/**
+ * Stream statistics (see fastlzlibGetStats()). The counters are only
+ * maintained when the library is built with -DZFAST_USE_STATS.
+ **/
+typedef struct zfast_stats {
+  /* blocks stored compressed, and stored as raw data */
+  zfast_uint64 blocks_compressed;
+  zfast_uint64 blocks_raw;
+  /* bytes processed directly from next_in / into next_out */
+  zfast_uint64 bytes_direct_in;
+  zfast_uint64 bytes_direct_out;
+  /* bytes copied through the internal input / output buffers */
+  zfast_uint64 bytes_buffered_in;
+  zfast_uint64 bytes_buffered_out;
+  /* time spent in the compression backend, in nanoseconds */
+  zfast_uint64 backend_ns;
+  /* number of Z_BUF_ERROR returned */
+  zfast_uint64 buf_errors;
+  /* number of fastlzlibDecompressSync() and fastlzlibSeek() calls which
+     succeeded, and number of input bytes skipped by the former */
+  zfast_uint64 syncs;
+  zfast_uint64 seeks;
+  zfast_uint64 bytes_skipped;
+} zfast_stats;
+
 /**
  * Return the fastlz library version.
  * (zlib equivalent: zlibVersion)
@@ -99,6 +177,19 @@ ZFASTEXTERN int fastlzlibCompressInit(zfast_stream *s, int level);
 ZFASTEXTERN int fastlzlibCompressInit2(zfast_stream *s, int level,
                                        int block_size);
 
+/**
+ * Initialize a compressing stream, set the block size to "block_size", and
+ * compress blocks in parallel using "nthreads" worker threads.
+ * The produced stream is identical to the one produced by
+ * fastlzlibCompressInit2(), blocks being written in stream order.
+ * Input and output data are always buffered internally in this mode.
+ * If nthreads is lower than 2, or if the library was built without thread
+ * support (ZFAST_USE_THREADS), blocks are compressed by the calling thread.
+ * Returns Z_OK upon success, Z_MEM_ERROR upon memory allocation error.
+ **/
+ZFASTEXTERN int fastlzlibCompressInitMT(zfast_stream *s, int level,
+                                        int block_size, int nthreads);
+
 /**
  * Initialize a decompressing stream.
  * Returns Z_OK upon success, Z_MEM_ERROR upon memory allocation error.
@@ -117,13 +208,174 @@ ZFASTEXTERN int fastlzlibDecompressInit(zfast_stream *s);
 ZFASTEXTERN int fastlzlibDecompressInit2(zfast_stream *s, int block_size);
 
 /**
- * Set the block compressor type.
+ * Initialize a decompressing stream, set the block size to "block_size", and
+ * decompress blocks in parallel using "nthreads" worker threads.
+ * Block headers are read ahead, and up to 2 * nthreads blocks are kept in
+ * flight ; decompressed data is returned in stream order.
+ * Output data is always buffered internally in this mode ; when may_buffer
+ * is zero, fastlzlibDecompress2() only requires complete blocks on input.
+ * If nthreads is lower than 2, or if the library was built without thread
+ * support (ZFAST_USE_THREADS), blocks are decompressed by the calling thread.
+ * Returns Z_OK upon success, Z_MEM_ERROR upon memory allocation error, and
+ * Z_DATA_ERROR if the block size is invalid.
+ **/
+ZFASTEXTERN int fastlzlibDecompressInitMT(zfast_stream *s, int block_size,
+                                          int nthreads);
+
+/**
+ * Set the block compressor type, before the stream is processed.
+ * When decompressing, this is the default backend: streams compressed with
+ * the ZFAST_FLAG_COMPRESSOR_ID flag select their own backend.
  * Returns Z_OK upon success, Z_VERSION_ERROR upon if the compressor is not
- * supported.
+ * supported, and Z_STREAM_ERROR if the stream has already been used.
  **/
 ZFASTEXTERN int fastlzlibSetCompressor(zfast_stream *s,
                                        zfast_stream_compressor compressor);
 
+/**
+ * Set the stream flags (ZFAST_FLAG_*), before the first block is processed.
+ * Linked blocks are decoded transparently by any decompressing stream ; they
+ * require the LZ4 compressor, are not supported in multi-threaded mode, and
+ * use the default hash table size (see fastlzlibSetHashTableSize()).
+ * Returns Z_OK upon success, Z_VERSION_ERROR if a flag is not supported,
+ * and Z_STREAM_ERROR if the stream has already been used, or if linked
+ * blocks are set on a stream with a custom hash table size.
+ **/
+ZFASTEXTERN int fastlzlibSetFlags(zfast_stream *s, int flags);
+
+/**
+ * Get the stream flags (ZFAST_FLAG_*).
+ **/
+ZFASTEXTERN int fastlzlibGetFlags(zfast_stream *s);
+
+/**
+ * Set the target compression speed of the adaptive mode (ZFAST_FLAG_ADAPTIVE),
+ * in MB/s per compressing thread. Each block is compressed using the
+ * slowest level meeting the target, from the fastest one up to the stream
+ * level (LZ4 Z_BEST_COMPRESSION streams only: fast LZ4, then LZ4HC levels).
+ * With no target (0, the default), the stream level is always used.
+ * Returns Z_OK upon success, Z_STREAM_ERROR if the stream is not a
+ * compressing stream.
+ **/
+ZFASTEXTERN int fastlzlibSetTargetSpeed(zfast_stream *s, uInt speed);
+
+/**
+ * Set the pre-scan threshold of incompressible blocks
+ * (ZFAST_FLAG_SKIP_INCOMPRESSIBLE and ZFAST_FLAG_ADAPTIVE), in per mille of
+ * the sampled positions of a block which must repeat a previous sequence for
+ * the block to be compressed. The default (16) only stores raw blocks which
+ * would not be compressed by more than a few percent ; 0 disables the
+ * pre-scan.
+ * Returns Z_OK upon success, Z_STREAM_ERROR if the stream is not a
+ * compressing stream or if the threshold is greater than 1000.
+ **/
+ZFASTEXTERN int fastlzlibSetIncompressibleThreshold(zfast_stream *s,
+                                                    uInt threshold);
+
+/**
+ * Range of the hash table sizes of fastlzlibSetHashTableSize().
+ **/
+#define ZFAST_TABLE_LOG_MIN 10
+#define ZFAST_TABLE_LOG_MAX 20
+
+/**
+ * Set the size of the LZ4 hash table of a compressing stream to 2^table_log
+ * bytes (ZFAST_TABLE_LOG_MIN to ZFAST_TABLE_LOG_MAX), or restore the default
+ * size (16KB) if table_log is 0, before the first block is processed. Small
+ * tables are faster on small blocks, large tables give a better ratio on
+ * large blocks ; the output is decoded by any decompressing stream. Only the
+ * LZ4 levels below Z_BEST_COMPRESSION use this table. Linked blocks use the
+ * default size: both setters reject the combination, in either order.
+ * Returns Z_OK upon success, Z_STREAM_ERROR if the size is invalid, if the
+ * stream has already been used, or if the stream uses linked blocks.
+ **/
+ZFASTEXTERN int fastlzlibSetHashTableSize(zfast_stream *s, int table_log);
+
+/**
+ * Use of the memory allocated by a zfast_alloc_func allocator.
+ **/
+typedef enum zfast_alloc_kind {
+  /* input and output block buffers (slightly larger than the block size) */
+  ZFAST_ALLOC_BUFFER,
+  /* history of linked blocks and preset dictionary (about 128KB plus the
+     block size) */
+  ZFAST_ALLOC_HISTORY,
+  /* backend work area (the 16KB LZ4 state by default) */
+  ZFAST_ALLOC_WORK
+} zfast_alloc_kind;
+
+/**
+ * Aligned allocator: allocate "size" bytes aligned on "alignment" bytes (a
+ * power of two), for the given use. Returns NULL upon failure.
+ **/
+typedef void* (*zfast_alloc_func)(void *opaque, size_t size, size_t alignment,
+                                  zfast_alloc_kind kind);
+
+/**
+ * Free memory allocated by a zfast_alloc_func allocator, given the same size
+ * and use.
+ **/
+typedef void (*zfast_free_func)(void *opaque, void *address, size_t size,
+                                zfast_alloc_kind kind);
+
+/**
+ * Set the allocator of the block buffers, history and backend work areas of
+ * a stream, which are then 64-byte aligned (the other allocations still use
+ * zalloc and zfree), or restore zalloc and zfree if "alloc" is NULL. The
+ * allocator must be set before the first block is processed, and before
+ * setting a dictionary ; streams using one are not kept by pools.
+ * Returns Z_OK upon success, Z_STREAM_ERROR if the stream was already used
+ * or if "alloc" is set without "dealloc".
+ **/
+ZFASTEXTERN int fastlzlibSetAllocator(zfast_stream *s, zfast_alloc_func alloc,
+                                      zfast_free_func dealloc, void *opaque);
+
+/**
+ * Built-in allocator (see fastlzlibSetAllocator()) backing allocations of
+ * 1MB and more with 2MB huge pages where available (reserved huge pages, or
+ * transparent huge pages), to cut TLB misses with large block sizes.
+ * Smaller allocations are aligned heap allocations. "opaque" is unused.
+ **/
+ZFASTEXTERN void* fastlzlibHugePageAlloc(void *opaque, size_t size,
+                                         size_t alignment,
+                                         zfast_alloc_kind kind);
+
+/**
+ * Free memory allocated by fastlzlibHugePageAlloc().
+ **/
+ZFASTEXTERN void fastlzlibHugePageFree(void *opaque, void *address,
+                                       size_t size, zfast_alloc_kind kind);
+
+/**
+ * Set the preset dictionary of a compressing stream, before the first block
+ * is compressed. Only the last 64KB of the dictionary are used ; the stream
+ * is then compressed with linked blocks (LZ4 only), the dictionary id
+ * (adler32 of the dictionary) being recorded at the begining of the stream.
+ * The dictionary is kept across fastlzlibCompressReset() calls, and does not
+ * need to be set again for each stream.
+ * Returns Z_OK upon success, Z_STREAM_ERROR if the stream has already been
+ * used or is multi-threaded, Z_VERSION_ERROR if the compressor is not LZ4
+ * (or LZ4 is not supported), and Z_MEM_ERROR upon memory allocation error.
+ * (zlib equivalent: deflateSetDictionary)
+ **/
+ZFASTEXTERN int fastlzlibCompressSetDictionary(zfast_stream *s,
+                                               const Bytef *dictionary,
+                                               uInt dictLength);
+
+/**
+ * Set the preset dictionary of a decompressing stream. The dictionary can be
+ * set in advance (and is kept across fastlzlibDecompressReset() calls), or
+ * after fastlzlibDecompress() returned Z_NEED_DICT, in which case s->adler
+ * holds the expected dictionary id (note: Z_NEED_DICT is also returned when
+ * synchronizing with Z_SYNC_FLUSH).
+ * Returns Z_OK upon success, Z_DATA_ERROR if the dictionary does not match
+ * the expected one, and Z_MEM_ERROR upon memory allocation error.
+ * (zlib equivalent: inflateSetDictionary)
+ **/
+ZFASTEXTERN int fastlzlibDecompressSetDictionary(zfast_stream *s,
+                                                 const Bytef *dictionary,
+                                                 uInt dictLength);
+
 /**
  * Set the block compressor function.
  * The corresponding decompressor should be set using fastlzlibSetDecompress()
@@ -196,6 +448,135 @@ ZFASTEXTERN int fastlzlibDecompress(zfast_stream *s);
  **/
 ZFASTEXTERN int fastlzlibCompress(zfast_stream *s, int flush);
 
+/**
+ * Compress the "nin" input fragments "in" into the "nout" output fragments
+ * "out", as fastlzlibCompress() would do with the concatenated input and
+ * output. Blocks are compressed straight from the input fragments, and
+ * written straight into the output fragments, when they fit in a single
+ * fragment (blocks spanning several fragments are gathered in the stream
+ * buffers). The flush mode applies to the end of the last input fragment.
+ * The number of input bytes consumed and output bytes produced are stored in
+ * "consumed" and "produced" (if not NULL) ; the client calls again the
+ * function with the remaining fragments. next_in, avail_in, next_out and
+ * avail_out are overwritten.
+ * Returns Z_OK if some progress was made, Z_STREAM_END upon completion
+ * (Z_FINISH), Z_BUF_ERROR if no progress was possible, or an error code.
+ **/
+ZFASTEXTERN int fastlzlibCompressV(zfast_stream *s, int flush,
+                                   const struct iovec *in, int nin,
+                                   const struct iovec *out, int nout,
+                                   uLong *consumed, uLong *produced);
+
+/**
+ * Decompress the "nin" input fragments "in" into the "nout" output fragments
+ * "out", as fastlzlibDecompress() would do with the concatenated input and
+ * output (see fastlzlibCompressV()). Blocks are decompressed straight from
+ * the input fragments, and into the output fragments, when they fit in a
+ * single fragment.
+ * Returns Z_OK if some progress was made, Z_STREAM_END when the EOF marker
+ * is reached, Z_BUF_ERROR if no progress was possible, or an error code
+ * (including Z_NEED_DICT).
+ **/
+ZFASTEXTERN int fastlzlibDecompressV(zfast_stream *s,
+                                     const struct iovec *in, int nin,
+                                     const struct iovec *out, int nout,
+                                     uLong *consumed, uLong *produced);
+
+/**
+ * Return the maximum compressed size of a buffer of "sourceLen" bytes
+ * compressed by fastlzlibCompressBuffer() using the given block size, or 0 if
+ * the block size is invalid.
+ * (zlib equivalent: compressBound)
+ **/
+ZFASTEXTERN uLong fastlzlibCompressBound(uLong sourceLen, int block_size);
+
+/**
+ * Return the output room the next fastlzlibCompress2() call needs to write
+ * directly into "next_out", without going through the internal output
+ * buffer, given the current input and the "flush" mode of the call: the
+ * pending stream header or meta block, or the next block using the worst
+ * case of the stream backend (much tighter for LZ4 than the 10% generic
+ * bound). Returns 0 if the stream has ended or is not a compressing stream.
+ * With "may_buffer" set to 0, a call with less room returns Z_BUF_ERROR
+ * without consuming anything.
+ * Note that multi-threaded streams always go through their job buffers.
+ **/
+ZFASTEXTERN uInt fastlzlibCompressNeeded(zfast_stream *s, int flush);
+
+/**
+ * Get the input and output sizes the next fastlzlibDecompress2() call needs
+ * to decode the next block at once, directly between "next_in" and
+ * "next_out": "in_needed" receives the whole block size (header included)
+ * and "out_needed" its decompressed size (0 for meta blocks).
+ * Returns Z_OK, Z_BUF_ERROR if the next block header is not fully available
+ * on input, Z_DATA_ERROR if it is invalid, or Z_STREAM_ERROR if this is not
+ * a decompressing stream.
+ **/
+ZFASTEXTERN int fastlzlibDecompressNeeded(zfast_stream *s, uInt *in_needed,
+                                          uInt *out_needed);
+
+/**
+ * Compress a whole buffer at once, directly into "dest", without any memory
+ * allocation. The produced stream is identical to the one produced by a
+ * stream compressor using the same parameters. "destLen" is the size of the
+ * destination buffer, which should be at least fastlzlibCompressBound()
+ * bytes long, and is updated with the compressed size upon success.
+ * Returns Z_OK upon success, Z_BUF_ERROR if the destination buffer is too
+ * small, and Z_STREAM_ERROR or Z_VERSION_ERROR if the arguments are invalid.
+ * (zlib equivalent: compress2)
+ **/
+ZFASTEXTERN int fastlzlibCompressBuffer(Bytef *dest, uLongf *destLen,
+                                        const Bytef *source, uLong sourceLen,
+                                        int level, int block_size,
+                                        zfast_stream_compressor compressor);
+
+/**
+ * A buffer compressed by fastlzlibCompressBatch().
+ **/
+typedef struct zfast_batch_item {
+  /* input data */
+  const Bytef *next_in;
+  uInt avail_in;
+  /* output buffer, and size of the compressed stream upon return */
+  Bytef *next_out;
+  uInt avail_out;
+  uInt total_out;
+  /* Z_OK upon success, or Z_BUF_ERROR if the output buffer is too small */
+  int code;
+} zfast_batch_item;
+
+/**
+ * Compress "count" independent buffers in a single call, each one into its
+ * own standalone stream (as produced by fastlzlibCompressBuffer(), and using
+ * a stream header if the ZFAST_FLAG_COMPACT_HEADERS flag is set), to be
+ * decompressed by fastlzlibUncompressBuffer(). The level, block size,
+ * backend, hash table size and ZFAST_FLAG_CHECKSUM flag of the compressing
+ * stream "s" are used, along with its backend work area ; the stream data
+ * and position are not modified. Items are spread across the worker threads
+ * of streams initialized by fastlzlibCompressInitMT().
+ * Each output buffer should be at least fastlzlibCompressBound() bytes long
+ * (plus the stream header and block checksums when enabled).
+ * Returns Z_OK upon success, Z_BUF_ERROR if the output buffer of at least
+ * one item is too small (see the item codes), and Z_STREAM_ERROR if the
+ * arguments are invalid or if the stream uses linked blocks.
+ **/
+ZFASTEXTERN int fastlzlibCompressBatch(zfast_stream *s,
+                                       zfast_batch_item *items, uInt count);
+
+/**
+ * Decompress a whole stream at once, directly into "dest", without any memory
+ * allocation. "destLen" is the size of the destination buffer, and is updated
+ * with the decompressed size upon success.
+ * Returns Z_OK upon success, Z_BUF_ERROR if the destination buffer is too
+ * small, Z_DATA_ERROR if the stream is corrupted, incomplete, or needs a preset
+ * dictionary, and Z_STREAM_ERROR or Z_VERSION_ERROR if the arguments are
+ * invalid.
+ * (zlib equivalent: uncompress)
+ **/
+ZFASTEXTERN int fastlzlibUncompressBuffer(Bytef *dest, uLongf *destLen,
+                                          const Bytef *source, uLong sourceLen,
+                                          zfast_stream_compressor compressor);
+
 /**
  * Decompress.
  * @arg may_buffer if non zero, accept to process partially a stream by using
@@ -216,6 +597,19 @@ ZFASTEXTERN int fastlzlibCompress(zfast_stream *s, int flush);
 ZFASTEXTERN int fastlzlibDecompress2(zfast_stream *s, int flush,
                                      const int may_buffer);
 
+/**
+ * Decompress as many blocks as possible in a single call, for clients
+ * providing whole blocks on input (the may_buffer == 0 contract of
+ * fastlzlibDecompress2()) : blocks are decoded straight from "next_in" to
+ * "next_out", without internal buffering.
+ * Returns Z_OK if blocks were decompressed (the input being exhausted, or
+ * the next block being incomplete on input or too large for the remaining
+ * output, "next_in" being left on it), Z_STREAM_END when the end of the
+ * stream is reached, Z_BUF_ERROR if no progress was possible, or the
+ * fastlzlibDecompress() error codes.
+ **/
+ZFASTEXTERN int fastlzlibDecompressBlocks(zfast_stream *s);
+
 /**
  * Compress.
  * @arg may_buffer if non zero, accept to process partially a stream by using
@@ -272,6 +666,8 @@ ZFASTEXTERN const char* fastlzlibGetLastErrorMessage(zfast_stream *s);
  * small, and Z_STREAM_ERROR if arguments are invalid (NULL pointer).
  * You may use fastlzlibGetHeaderSize() to know how many bytes needs to be
  * read for identifying a stream.
+ * Only regular block headers are parsed: compact block headers (see
+ * ZFAST_FLAG_COMPACT_HEADERS) are reported as Z_DATA_ERROR.
  **/
 ZFASTEXTERN int fastlzlibGetStreamInfo(const void* input, int length,
                                        uInt *compressed_size,
@@ -297,6 +693,301 @@ ZFASTEXTERN int fastlzlibCompressMemory(zfast_stream *s);
  **/
 ZFASTEXTERN int fastlzlibDecompressMemory(zfast_stream *s);
 
+/**
+ * Release the internal memory buffers which are not currently in use (such as
+ * the buffers used when the client input is not a complete block, or when the
+ * client output is too small). The buffers are allocated again when needed ;
+ * this function may be called on idle streams to reduce their memory
+ * footprint.
+ * Returns Z_OK upon success.
+ **/
+ZFASTEXTERN int fastlzlibRelease(zfast_stream *s);
+
+/**
+ * Get the statistics of the stream "s" since its initialization.
+ * Returns Z_OK upon success, and Z_VERSION_ERROR if the library was built
+ * without -DZFAST_USE_STATS.
+ **/
+ZFASTEXTERN int fastlzlibGetStats(zfast_stream *s, zfast_stats *stats);
+
+/**
+ * Get the cumulated statistics of all streams ended so far in this process
+ * (including the streams returned to a pool).
+ * Returns Z_OK upon success, and Z_VERSION_ERROR if the library was built
+ * without -DZFAST_USE_STATS.
+ **/
+ZFASTEXTERN int fastlzlibGetGlobalStats(zfast_stats *stats);
+
+/**
+ * Stream pool (opaque structure).
+ **/
+typedef struct zfast_pool zfast_pool;
+
+/**
+ * Create a pool of idle streams, which can be used to initialize streams
+ * without allocating their internal state each time. At most "max_streams"
+ * idle streams are kept in total. The pool is thread-safe (if the library
+ * was built with thread support), idle streams are spread across several
+ * locks to reduce contention (a stream returned while the other locks are
+ * busy may be freed instead of being kept).
+ * Returns NULL upon memory allocation error.
+ **/
+ZFASTEXTERN zfast_pool* fastlzlibPoolCreate(int max_streams);
+
+/**
+ * Destroy a pool and all its idle streams. Streams taken from the pool and
+ * not yet returned are not affected, and can be ended using
+ * fastlzlibCompressEnd() or fastlzlibDecompressEnd().
+ **/
+ZFASTEXTERN void fastlzlibPoolDestroy(zfast_pool *pool);
+
+/**
+ * Initialize a compressing stream, using an idle stream of the pool with the
+ * same level, block size and compressor if any. An idle stream is reset, and
+ * behaves as a newly initialized stream.
+ * Note: only streams using the default allocator (zalloc and zfree are NULL)
+ * are pooled.
+ * Returns Z_OK upon success, Z_MEM_ERROR upon memory allocation error.
+ **/
+ZFASTEXTERN int fastlzlibPoolCompressInit(zfast_pool *pool, zfast_stream *s,
+                                          int level, int block_size,
+                                          zfast_stream_compressor compressor);
+
+/**
+ * Initialize a decompressing stream, using an idle stream of the pool with
+ * the same block size and compressor if any.
+ * Returns Z_OK upon success, Z_MEM_ERROR upon memory allocation error.
+ **/
+ZFASTEXTERN int fastlzlibPoolDecompressInit(zfast_pool *pool, zfast_stream *s,
+                                            int block_size,
+                                            zfast_stream_compressor
+                                            compressor);
+
+/**
+ * End a stream, and return it to the pool as an idle stream if the pool is
+ * not full. Streams using flags, a preset dictionary, multiple threads or a
+ * custom compressor are not pooled, and are simply ended.
+ * Returns Z_OK upon success.
+ **/
+ZFASTEXTERN int fastlzlibPoolEnd(zfast_pool *pool, zfast_stream *s);
+
+/**
+ * Block index (opaque structure), mapping uncompressed offsets to compressed
+ * block offsets.
+ **/
+typedef struct zfast_index zfast_index;
+
+/**
+ * Create an empty block index.
+ * Returns NULL upon memory allocation error.
+ **/
+ZFASTEXTERN zfast_index* fastlzlibIndexCreate(void);
+
+/**
+ * Free a block index created with fastlzlibIndexCreate().
+ **/
+ZFASTEXTERN void fastlzlibIndexFree(zfast_index *index);
+
+/**
+ * Append the block whose header is pointed by "input" to the index. This
+ * function can be used to build the index of a stream without index trailer,
+ * by walking its block headers (see fastlzlibGetStreamInfo()).
+ * Compact streams can not be walked this way ; use fastlzlibReaderOpen().
+ * Returns Z_OK upon success, Z_STREAM_END if the header is the EOF marker,
+ * Z_BUF_ERROR if less than a header was given, Z_DATA_ERROR if the input is
+ * not a block header, Z_MEM_ERROR upon memory allocation error.
+ **/
+ZFASTEXTERN int fastlzlibIndexAddBlock(zfast_index *index, const void* input,
+                                       int length);
+
+/**
+ * Find the block containing the uncompressed "offset", and return its
+ * compressed and uncompressed starting offsets.
+ * Returns Z_OK upon success, Z_BUF_ERROR if the offset is beyond the end of
+ * the stream.
+ **/
+ZFASTEXTERN int fastlzlibIndexLookup(const zfast_index *index,
+                                     zfast_uint64 offset,
+                                     zfast_uint64 *compressed_offset,
+                                     zfast_uint64 *block_offset);
+
+/**
+ * Return the size of the serialized index trailer, for the given block size.
+ * Returns 0 upon error.
+ **/
+ZFASTEXTERN uLong fastlzlibIndexSerializedSize(const zfast_index *index,
+                                               int block_size);
+
+/**
+ * Serialize an index as a trailer (without the EOF marker) into "dest",
+ * whose size is "*destLen". Upon return, "*destLen" is set to the trailer
+ * size.
+ * Returns Z_OK upon success, Z_BUF_ERROR if the destination is too small.
+ **/
+ZFASTEXTERN int fastlzlibIndexSerialize(const zfast_index *index,
+                                        int block_size,
+                                        Bytef *dest, uLongf *destLen);
+
+/**
+ * Given the last "length" bytes of a stream (at least 20 bytes), return in
+ * "*size" the number of bytes, counted from the end of the stream, holding
+ * the index trailer and the EOF marker.
+ * The trailer itself is only validated by fastlzlibIndexLoad().
+ * Returns Z_OK upon success, Z_BUF_ERROR if the input is too small,
+ * Z_DATA_ERROR if the input does not end with an EOF marker or if the trailer
+ * size is invalid.
+ **/
+ZFASTEXTERN int fastlzlibGetIndexSize(const void* input, int length,
+                                      uInt *size);
+
+/**
+ * Load an empty index from a serialized index trailer, optionally followed
+ * by the EOF marker.
+ * Returns Z_OK upon success, Z_DATA_ERROR if the trailer is invalid,
+ * Z_MEM_ERROR upon memory allocation error.
+ **/
+ZFASTEXTERN int fastlzlibIndexLoad(zfast_index *index, const void* input,
+                                   uLong length);
+
+/**
+ * Return the index of the blocks written so far by a compressing stream
+ * using the ZFAST_FLAG_INDEX flag, or NULL if none. The index is owned by
+ * the stream.
+ **/
+ZFASTEXTERN const zfast_index* fastlzlibGetIndex(zfast_stream *s);
+
+/**
+ * Prepare a decompressing stream to restart at the uncompressed "offset"
+ * using the given index. The stream is reset, and the client must feed the
+ * compressed stream starting at "*compressed_offset" ; the output starts
+ * at "offset", and total_in and total_out are updated accordingly.
+ * Note: streams using linked blocks or a preset dictionary can not be
+ * decompressed from the middle, and are not seekable.
+ * Returns Z_OK upon success, Z_BUF_ERROR if the offset is beyond the end of
+ * the stream.
+ **/
+ZFASTEXTERN int fastlzlibSeek(zfast_stream *s, const zfast_index *index,
+                              zfast_uint64 offset,
+                              zfast_uint64 *compressed_offset);
+
+/**
+ * Prepare a compressing stream using the ZFAST_FLAG_INDEX flag to append
+ * blocks to an indexed stream, without rewriting nor walking it:
+ * - "index" is the index of the stream to be continued, loaded from its
+ *   tail using fastlzlibGetIndexSize() and fastlzlibIndexLoad() (or built
+ *   with fastlzlibIndexAddBlock() for streams without index trailer) ; the
+ *   stream must have been compressed with the same compact headers and
+ *   compressor id settings, and nothing must have been compressed yet
+ * - or NULL, to resume the stream itself once finished (Z_STREAM_END), so
+ *   that each Z_FINISH writes a directory checkpoint
+ * The client must write the following output at "*compressed_offset", which
+ * is the offset of the EOF marker of the previous stream, and total_in and
+ * total_out are updated accordingly. The previous index trailer is kept as
+ * meta blocks, and is indexed by the new trailer written upon Z_FINISH:
+ * until then, writing the previous EOF marker back at "*compressed_offset"
+ * (and truncating the file after it) restores the previous stream.
+ * Note: streams using linked blocks or a preset dictionary can not be
+ * appended.
+ * Returns Z_OK upon success, Z_DATA_ERROR if the index does not cover all
+ * the stream blocks (such as the index of a reader), Z_MEM_ERROR upon memory
+ * allocation error, Z_STREAM_ERROR if the stream can not be appended.
+ **/
+ZFASTEXTERN int fastlzlibCompressAppend(zfast_stream *s,
+                                        const zfast_index *index,
+                                        zfast_uint64 *compressed_offset);
+
+/**
+ * Read-only stream reader (opaque structure), giving random access to the
+ * blocks of a complete compressed stream. A reader is not modified once
+ * opened, and can be used by any number of threads concurrently.
+ **/
+typedef struct zfast_reader zfast_reader;
+
+/**
+ * Open a reader on a compressed stream file, which is memory-mapped (or read
+ * in memory on systems without mmap()). Blocks are located using the index
+ * trailer if the stream has one, or by walking the block headers otherwise.
+ * Note: streams using linked blocks or a preset dictionary are not supported.
+ * Returns NULL upon error (file error, or invalid stream).
+ **/
+ZFASTEXTERN zfast_reader* fastlzlibReaderOpen(const char *filename,
+                                              zfast_stream_compressor
+                                              compressor);
+
+/**
+ * Open a reader on a compressed stream in memory. The data must be kept
+ * until the reader is closed.
+ * Returns NULL upon error (memory error, or invalid stream).
+ **/
+ZFASTEXTERN zfast_reader* fastlzlibReaderOpenBuffer(const Bytef *data,
+                                                    zfast_uint64 size,
+                                                    zfast_stream_compressor
+                                                    compressor);
+
+/**
+ * Close a reader, and unmap its file.
+ **/
+ZFASTEXTERN void fastlzlibReaderClose(zfast_reader *reader);
+
+/**
+ * Return the number of data blocks of the stream.
+ **/
+ZFASTEXTERN uInt fastlzlibReaderGetBlockCount(const zfast_reader *reader);
+
+/**
+ * Return the uncompressed size of the stream.
+ **/
+ZFASTEXTERN zfast_uint64 fastlzlibReaderGetSize(const zfast_reader *reader);
+
+/**
+ * Return the index of the data blocks of the stream (owned by the reader),
+ * to be used with fastlzlibSeek() or serialized.
+ **/
+ZFASTEXTERN const zfast_index* fastlzlibReaderGetIndex(const zfast_reader
+                                                       *reader);
+
+/**
+ * Return the uncompressed offset and size of a data block.
+ * Returns Z_OK upon success, Z_BUF_ERROR if the block does not exist.
+ **/
+ZFASTEXTERN int fastlzlibReaderGetBlockInfo(const zfast_reader *reader,
+                                            uInt block,
+                                            zfast_uint64 *offset, uInt *size);
+
+/**
+ * Return the data block containing the uncompressed "offset".
+ * Returns Z_OK upon success, Z_BUF_ERROR if the offset is beyond the end of
+ * the stream.
+ **/
+ZFASTEXTERN int fastlzlibReaderFindBlock(const zfast_reader *reader,
+                                         zfast_uint64 offset, uInt *block);
+
+/**
+ * Decompress a data block into "dest", whose size is "*destLen", straight
+ * from the stream data. Upon return, "*destLen" is set to the block size.
+ * Returns Z_OK upon success, Z_BUF_ERROR if the block does not exist or if
+ * the destination is too small, Z_DATA_ERROR if the block is corrupted (or
+ * linked).
+ **/
+ZFASTEXTERN int fastlzlibReaderReadBlock(const zfast_reader *reader,
+                                         uInt block,
+                                         Bytef *dest, uInt *destLen);
+
+/**
+ * Read up to "*length" uncompressed bytes starting at "offset" into "dest".
+ * Whole blocks are decompressed directly into "dest" ; partial blocks at the
+ * range boundaries are decompressed in a temporary buffer, only until the end
+ * of the range (blocks with a checksum are decompressed as a whole, to be
+ * verified). Upon return, "*length" is set to the number of bytes read (less
+ * than requested at the end of the stream).
+ * Returns Z_OK upon success, Z_BUF_ERROR if the offset is beyond the end of
+ * the stream, Z_DATA_ERROR if a block is corrupted, Z_MEM_ERROR upon memory
+ * allocation error.
+ **/
+ZFASTEXTERN int fastlzlibReaderRead(const zfast_reader *reader,
+                                    zfast_uint64 offset,
+                                    Bytef *dest, uInt *length);
+
 #if defined (__cplusplus)
 }
 #endif
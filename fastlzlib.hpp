@@ -0,0 +1,522 @@
+/*
+  zlib-like interface to fast block compression (LZ4 or FastLZ) libraries
+  Copyright (C) 2010-2013 Exalead SA. (http://www.exalead.com/)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Remarks/Bugs:
+  LZ4 compression library by Yann Collet (yann.collet.73@gmail.com)
+  FastLZ compression library by Ariya Hidayat (ariya@kde.org)
+  Library encapsulation by Xavier Roche (fastlz@exalead.com)
+*/
+
+/* header-only C++ (C++11 or later) layer over the fastlzlib.h C API */
+
+#ifndef FASTLZ_FASTLZLIB_HPP
+#define FASTLZ_FASTLZLIB_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <climits>
+#include <stdexcept>
+#include <streambuf>
+#include <vector>
+
+#include "fastlzlib.h"
+
+#if defined(__has_include)
+#if __has_include(<span>) && __cplusplus >= 202002L
+#include <span>
+#define ZFAST_HAS_STD_SPAN
+#endif
+#endif
+
+namespace zfast {
+
+/**
+ * Stream error, holding the Z_* code and the stream message.
+ **/
+class error : public std::runtime_error {
+public:
+  error(int code, const char *msg)
+    : std::runtime_error(msg != NULL ? msg : "compression stream error"),
+      code_(code) {}
+  int code() const { return code_; }
+private:
+  int code_;
+};
+
+/**
+ * Contiguous view of bytes (std::span when available).
+ **/
+#ifdef ZFAST_HAS_STD_SPAN
+template<typename T> using span = std::span<T>;
+#else
+template<typename T> class span {
+public:
+  span() : data_(NULL), size_(0) {}
+  span(T *data, std::size_t size) : data_(data), size_(size) {}
+  template<typename U> span(const span<U> &other)
+    : data_(other.data()), size_(other.size()) {}
+  template<typename C> span(C &container)
+    : data_(container.data()), size_(container.size()) {}
+  T *data() const { return data_; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  span subspan(std::size_t offset) const {
+    return span(data_ + offset, size_ - offset);
+  }
+private:
+  T *data_;
+  std::size_t size_;
+};
+#endif
+
+/**
+ * Backends, as part of the stream type. "bind" selects the backend of the
+ * underlying C stream once, when the stream is created ; the library then
+ * calls its block functions through the stream state, once per block. A
+ * custom backend is a type with a static "int bind(zfast_stream *s)"
+ * function, setting its block functions with fastlzlibSetCompress() and
+ * fastlzlibSetDecompress().
+ **/
+template<zfast_stream_compressor C> struct backend {
+  static const zfast_stream_compressor id = C;
+  static int bind(zfast_stream *s) { return fastlzlibSetCompressor(s, C); }
+};
+typedef backend<COMPRESSOR_LZ4> lz4;
+typedef backend<COMPRESSOR_FASTLZ> fastlz;
+
+/**
+ * Outcome of a compress_into() or decompress_into() call: the bytes consumed
+ * and produced, and Z_OK, Z_STREAM_END, Z_NEED_DICT, or Z_BUF_ERROR if no
+ * progress was possible (errors are thrown).
+ **/
+struct result {
+  std::size_t consumed;
+  std::size_t produced;
+  int code;
+  bool finished() const { return code == Z_STREAM_END; }
+};
+
+namespace detail {
+
+/* move-only owner of a zfast_stream ; the stream state does not point back
+   to the stream, which can be moved as a plain structure */
+class stream {
+public:
+  stream() { std::memset(&s_, 0, sizeof(s_)); }
+  stream(stream &&other) : s_(other.s_) { other.s_.state = NULL; }
+  stream &operator=(stream &&other) {
+    if (this != &other) {
+      end();
+      s_ = other.s_;
+      other.s_.state = NULL;
+    }
+    return *this;
+  }
+  ~stream() { end(); }
+  stream(const stream&) = delete;
+  stream &operator=(const stream&) = delete;
+  zfast_stream *get() { return &s_; }
+  void check(int code) {
+    if (code != Z_OK) {
+      throw error(code, s_.msg);
+    }
+  }
+  /* call "step" until the output is full, or the input is exhausted (unless
+     flushing: a new block would then be buffered internally) */
+  template<typename Step>
+  result process(span<const Bytef> in, span<Bytef> out, int flush,
+                 Step step) {
+    const uInt avail_in = (uInt) ( in.size() < UINT_MAX
+                                   ? in.size() : UINT_MAX );
+    const uInt avail_out = (uInt) ( out.size() < UINT_MAX
+                                    ? out.size() : UINT_MAX );
+    result r;
+    s_.next_in = const_cast<Bytef*>(in.data());
+    s_.avail_in = avail_in;
+    s_.next_out = out.data();
+    s_.avail_out = avail_out;
+    do {
+      r.code = step(&s_);
+    } while(r.code == Z_OK && s_.avail_out != 0
+            && ( s_.avail_in != 0 || flush != Z_NO_FLUSH ));
+    r.consumed = avail_in - s_.avail_in;
+    r.produced = avail_out - s_.avail_out;
+    if (r.code == Z_BUF_ERROR && ( r.consumed != 0 || r.produced != 0 )) {
+      r.code = Z_OK;
+    } else if (r.code < 0 && r.code != Z_BUF_ERROR) {
+      throw error(r.code, s_.msg);
+    }
+    return r;
+  }
+private:
+  void end() {
+    if (s_.state != NULL) {
+      fastlzlibEnd(&s_);
+      s_.state = NULL;
+    }
+  }
+  zfast_stream s_;
+};
+
+}
+
+/**
+ * Move-only compressing stream (fastlzlibCompressInit2()), using the
+ * "Backend" compressor.
+ **/
+template<typename Backend = fastlz> class basic_compressor {
+public:
+  explicit basic_compressor(int level = 2, int block_size = 262144,
+                            int flags = 0) {
+    zfast_stream *const s = s_.get();
+    s_.check(fastlzlibCompressInit2(s, level, block_size));
+    s_.check(Backend::bind(s));
+    s_.check(fastlzlibSetFlags(s, flags));
+  }
+
+  /**
+   * Compress "in" into "out", straight from and to client memory when whole
+   * blocks fit (see needed()). "flush" is Z_NO_FLUSH, Z_SYNC_FLUSH or
+   * Z_FINISH ; using Z_NO_FLUSH, a trailing partial block is kept until the
+   * next call.
+   **/
+  result compress_into(span<const Bytef> in, span<Bytef> out,
+                       int flush = Z_NO_FLUSH) {
+    return s_.process(in, out, flush, [flush](zfast_stream *s) {
+        return fastlzlibCompress2(s, flush, 1);
+      });
+  }
+
+  /**
+   * Output room needed by the next call to write directly on client memory
+   * (see fastlzlibCompressNeeded()).
+   **/
+  std::size_t needed(int flush = Z_NO_FLUSH) {
+    return fastlzlibCompressNeeded(s_.get(), flush);
+  }
+
+  void set_dictionary(span<const Bytef> dictionary) {
+    s_.check(fastlzlibCompressSetDictionary(s_.get(), dictionary.data(),
+                                            (uInt) dictionary.size()));
+  }
+
+  void reset() { s_.check(fastlzlibCompressReset(s_.get())); }
+
+  /**
+   * Maximum compressed size of a buffer (see fastlzlibCompressBound()).
+   **/
+  static std::size_t bound(std::size_t size, int block_size = 262144) {
+    return fastlzlibCompressBound((uLong) size, block_size);
+  }
+
+  /**
+   * The underlying C stream.
+   **/
+  zfast_stream *get() { return s_.get(); }
+
+private:
+  detail::stream s_;
+};
+
+/**
+ * Move-only decompressing stream (fastlzlibDecompressInit2()), using the
+ * "Backend" decompressor (unless the stream records its compressor).
+ **/
+template<typename Backend = fastlz> class basic_decompressor {
+public:
+  explicit basic_decompressor(int block_size = 262144) {
+    zfast_stream *const s = s_.get();
+    s_.check(fastlzlibDecompressInit2(s, block_size));
+    s_.check(Backend::bind(s));
+  }
+
+  /**
+   * Decompress "in" into "out", straight from and to client memory when
+   * whole blocks fit (see needed()). Once "out" is full, the meta blocks and
+   * EOF marker available on input are consumed too, so that a stream
+   * decoded into an exactly-sized buffer is finished. Z_NEED_DICT is
+   * returned when the stream was compressed with a preset dictionary, to be
+   * set with set_dictionary().
+   **/
+  result decompress_into(span<const Bytef> in, span<Bytef> out) {
+    zfast_stream *const s = s_.get();
+    result r = s_.process(in, out, Z_NO_FLUSH, [](zfast_stream *s) {
+        return fastlzlibDecompress2(s, Z_NO_FLUSH, 1);
+      });
+    uInt i, o;
+    while(r.code == Z_OK && s->avail_out == 0 && s->avail_in != 0
+          && fastlzlibDecompressNeeded(s, &i, &o) == Z_OK
+          && o == 0 && i != 0 && i <= s->avail_in) {
+      const uInt avail_in = s->avail_in;
+      r.code = fastlzlibDecompress2(s, Z_NO_FLUSH, 1);
+      r.consumed += avail_in - s->avail_in;
+      if (r.code == Z_BUF_ERROR) {
+        r.code = Z_OK;
+        break;
+      } else if (r.code < 0) {
+        throw error(r.code, s->msg);
+      }
+    }
+    return r;
+  }
+
+  /**
+   * Input and output sizes of the next block, read from its header at the
+   * begining of "in" (see fastlzlibDecompressNeeded()) ; returns false if
+   * the header is incomplete.
+   **/
+  bool needed(span<const Bytef> in, std::size_t &in_needed,
+              std::size_t &out_needed) {
+    zfast_stream *const s = s_.get();
+    uInt i, o;
+    s->next_in = const_cast<Bytef*>(in.data());
+    s->avail_in = (uInt) ( in.size() < UINT_MAX ? in.size() : UINT_MAX );
+    const int code = fastlzlibDecompressNeeded(s, &i, &o);
+    if (code == Z_BUF_ERROR) {
+      return false;
+    } else if (code != Z_OK) {
+      throw error(code, "invalid block header");
+    }
+    in_needed = i;
+    out_needed = o;
+    return true;
+  }
+
+  void set_dictionary(span<const Bytef> dictionary) {
+    s_.check(fastlzlibDecompressSetDictionary(s_.get(), dictionary.data(),
+                                              (uInt) dictionary.size()));
+  }
+
+  void reset() { s_.check(fastlzlibDecompressReset(s_.get())); }
+
+  /**
+   * The underlying C stream.
+   **/
+  zfast_stream *get() { return s_.get(); }
+
+private:
+  detail::stream s_;
+};
+
+typedef basic_compressor<> compressor;
+typedef basic_decompressor<> decompressor;
+
+/**
+ * Output stream buffer compressing to the "sink" stream buffer. The put area
+ * is a single block, compressed in place once full into an output buffer
+ * large enough for the block ; large writes are compressed straight from the
+ * client data, block by block. sync() flushes a partial block, and finish()
+ * (or the destructor) ends the stream.
+ **/
+template<typename Backend = fastlz>
+class basic_ostreambuf : public std::streambuf {
+public:
+  explicit basic_ostreambuf(std::streambuf *sink, int level = 2,
+                            int block_size = 262144, int flags = 0)
+    : sink_(sink), c_(level, block_size, flags), block_(block_size),
+      finished_(false) {
+    /* room for a block, and the stream header and meta blocks before it */
+    out_.resize(basic_compressor<Backend>::bound(block_.size(), block_size)
+                + 256);
+    setp(&block_[0], &block_[0] + block_.size());
+  }
+
+  basic_ostreambuf(const basic_ostreambuf&) = delete;
+  basic_ostreambuf &operator=(const basic_ostreambuf&) = delete;
+
+  ~basic_ostreambuf() {
+    try {
+      finish();
+    } catch(...) {
+    }
+  }
+
+  /**
+   * The compressor, to set a preset dictionary.
+   **/
+  basic_compressor<Backend> &compressor() { return c_; }
+
+  /**
+   * Compress the pending data, and write the EOF marker.
+   **/
+  void finish() {
+    if (!finished_) {
+      finished_ = true;
+      compress(pbase(), (std::size_t) ( pptr() - pbase() ), Z_FINISH);
+      setp(NULL, NULL);
+    }
+  }
+
+protected:
+  int_type overflow(int_type ch) {
+    if (finished_) {
+      return traits_type::eof();
+    }
+    compress(pbase(), (std::size_t) ( pptr() - pbase() ), Z_NO_FLUSH);
+    setp(&block_[0], &block_[0] + block_.size());
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(ch);
+      pbump(1);
+    }
+    return traits_type::not_eof(ch);
+  }
+
+  std::streamsize xsputn(const char_type *data, std::streamsize size) {
+    std::streamsize done = 0;
+    if (finished_) {
+      return 0;
+    }
+    /* whole blocks: straight from the client data */
+    if (pptr() == pbase()) {
+      const std::size_t whole = (std::size_t) size
+        - (std::size_t) size % block_.size();
+      compress(data, whole, Z_NO_FLUSH);
+      done = (std::streamsize) whole;
+    }
+    while(done != size) {
+      const std::streamsize room = epptr() - pptr();
+      const std::streamsize n = size - done < room ? size - done : room;
+      std::memcpy(pptr(), &data[done], (std::size_t) n);
+      pbump((int) n);
+      done += n;
+      if (pptr() == epptr()) {
+        overflow(traits_type::eof());
+      }
+    }
+    return size;
+  }
+
+  int sync() {
+    if (finished_) {
+      return sink_->pubsync();
+    }
+    compress(pbase(), (std::size_t) ( pptr() - pbase() ), Z_SYNC_FLUSH);
+    setp(&block_[0], &block_[0] + block_.size());
+    return sink_->pubsync();
+  }
+
+private:
+  /* compress "size" bytes one block at a time, and write the output to the
+     sink */
+  void compress(const char *data, std::size_t size, int flush) {
+    span<const Bytef> in((const Bytef*) data, size);
+    for(;;) {
+      const std::size_t n = in.size() < block_.size()
+        ? in.size() : block_.size();
+      const result r =
+        c_.compress_into(span<const Bytef>(in.data(), n), span<Bytef>(out_),
+                         n == in.size() ? flush : Z_NO_FLUSH);
+      if (r.produced != 0
+          && sink_->sputn((const char*) &out_[0], (std::streamsize) r.produced)
+          != (std::streamsize) r.produced) {
+        throw error(Z_ERRNO, "write error");
+      }
+      in = in.subspan(r.consumed);
+      if (r.finished() || r.code == Z_BUF_ERROR
+          || ( in.empty() && flush == Z_NO_FLUSH )) {
+        break;
+      }
+    }
+  }
+
+  std::streambuf *sink_;
+  basic_compressor<Backend> c_;
+  std::vector<char> block_;
+  std::vector<Bytef> out_;
+  bool finished_;
+};
+
+/**
+ * Input stream buffer decompressing from the "source" stream buffer. Blocks
+ * are decompressed one at a time, straight into the get area (a single block
+ * of the stream block size).
+ **/
+template<typename Backend = fastlz>
+class basic_istreambuf : public std::streambuf {
+public:
+  explicit basic_istreambuf(std::streambuf *source, int block_size = 262144,
+                            std::size_t input_size = 65536)
+    : source_(source), d_(block_size), in_(input_size), in_offs_(0),
+      in_size_(0), block_(block_size), finished_(false) {
+    setg(&block_[0], &block_[0], &block_[0]);
+  }
+
+  basic_istreambuf(const basic_istreambuf&) = delete;
+  basic_istreambuf &operator=(const basic_istreambuf&) = delete;
+
+  /**
+   * The decompressor, to set a preset dictionary.
+   **/
+  basic_decompressor<Backend> &decompressor() { return d_; }
+
+protected:
+  int_type underflow() {
+    zfast_stream *const s = d_.get();
+    while(!finished_) {
+      int code;
+      std::size_t produced;
+      if (in_offs_ == in_size_) {
+        in_offs_ = 0;
+        in_size_ = (std::size_t) source_->sgetn((char*) &in_[0],
+                                                (std::streamsize) in_.size());
+      }
+      s->next_in = &in_[in_offs_];
+      s->avail_in = (uInt) ( in_size_ - in_offs_ );
+      s->next_out = (Bytef*) &block_[0];
+      s->avail_out = (uInt) block_.size();
+      code = fastlzlibDecompress2(s, Z_NO_FLUSH, 1);
+      in_offs_ = in_size_ - s->avail_in;
+      produced = block_.size() - s->avail_out;
+      if (code == Z_STREAM_END) {
+        finished_ = true;
+      } else if (code == Z_BUF_ERROR
+                 && ( in_size_ == 0 || in_offs_ != in_size_ )) {
+        throw error(Z_DATA_ERROR, "premature end of stream");
+      } else if (code != Z_OK && code != Z_BUF_ERROR) {
+        throw error(code, code == Z_NEED_DICT
+                    ? "missing preset dictionary" : s->msg);
+      }
+      if (produced != 0) {
+        setg(&block_[0], &block_[0], &block_[0] + produced);
+        return traits_type::to_int_type(*gptr());
+      }
+    }
+    return traits_type::eof();
+  }
+
+private:
+
+  std::streambuf *source_;
+  basic_decompressor<Backend> d_;
+  std::vector<Bytef> in_;
+  std::size_t in_offs_;
+  std::size_t in_size_;
+  std::vector<char> block_;
+  bool finished_;
+};
+
+typedef basic_ostreambuf<> ostreambuf;
+typedef basic_istreambuf<> istreambuf;
+
+}
+
+#endif
@@ -0,0 +1,1719 @@
+/*
+  zlib-like interface to fast block compression (LZ4 or FastLZ) libraries
+  Copyright (C) 2010-2013 Exalead SA. (http://www.exalead.com/)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Remarks/Bugs:
+  LZ4 compression library by Yann Collet (yann.collet.73@gmail.com)
+  FastLZ compression library by Ariya Hidayat (ariya@kde.org)
+  Library encapsulation by Xavier Roche (fastlz@exalead.com)
+*/
+
+/* regression tests of the library: stream format invariants, and bugs found
+   so far (run with "make check") */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fastlzlib.h"
+
+/* size of the test data */
+#define TEST_SIZE ( 1000*1000 )
+
+/* room of the compressed buffers */
+#define TEST_ROOM(N) ( (N)*2 + 65536 )
+
+/* number of worker threads of multi-threaded streams */
+#define TEST_THREADS 3
+
+/* abort the tests upon failure */
+#define CHECK(EXPR) do {                                                \
+    if (!(EXPR)) {                                                      \
+      test_failed(__FILE__, __LINE__, #EXPR);                           \
+    }                                                                   \
+  } while(0)
+
+static const char *current_test = NULL;
+
+static void test_failed(const char *file, int line, const char *expr) {
+  fprintf(stderr, "%s: %s:%d: check failed: %s\n",
+          current_test != NULL ? current_test : "-", file, line, expr);
+  exit(EXIT_FAILURE);
+}
+
+static void* test_malloc(size_t size) {
+  void *const ptr = malloc(size != 0 ? size : 1);
+  CHECK(ptr != NULL);
+  return ptr;
+}
+
+/* test data: text-like sequences of words, with a few random runs (stored
+   as raw blocks) ; the same seed always gives the same data */
+static Bytef* test_data(uLong size, unsigned int seed) {
+  static const char *const words[] = {
+    "block ", "stream ", "the ", "compressed ", "of ", "index ", "a ",
+    "header ", "fast ", "data\n", "and ", "LZ4 ", "FastLZ ", "marker. "
+  };
+  Bytef *const data = (Bytef*) test_malloc(size);
+  uLong i = 0;
+  while (i < size) {
+    seed = seed*1103515245 + 12345;
+    if (( seed >> 16 ) % 64 == 0) {
+      /* random run */
+      uLong run = 1 + ( seed >> 20 ) % 8192;
+      for(; run != 0 && i < size; run--) {
+        seed = seed*1103515245 + 12345;
+        data[i++] = (Bytef) ( seed >> 16 );
+      }
+    } else {
+      const char *const word =
+        words[( seed >> 16 ) % ( sizeof(words) / sizeof(words[0]) )];
+      size_t j;
+      for(j = 0; word[j] != '\0' && i < size; j++) {
+        data[i++] = (Bytef) word[j];
+      }
+    }
+  }
+  return data;
+}
+
+/* initialize a compressing stream */
+static void test_compress_init(zfast_stream *s, int level, int block_size,
+                               zfast_stream_compressor compressor, int flags,
+                               int nthreads) {
+  memset(s, 0, sizeof(*s));
+  if (nthreads != 0) {
+    CHECK(fastlzlibCompressInitMT(s, level, block_size, nthreads) == Z_OK);
+  } else {
+    CHECK(fastlzlibCompressInit2(s, level, block_size) == Z_OK);
+  }
+  CHECK(fastlzlibSetCompressor(s, compressor) == Z_OK);
+  CHECK(fastlzlibSetFlags(s, flags) == Z_OK);
+}
+
+/* initialize a decompressing stream */
+static void test_decompress_init(zfast_stream *s, int block_size,
+                                 zfast_stream_compressor compressor,
+                                 int nthreads) {
+  memset(s, 0, sizeof(*s));
+  if (nthreads != 0) {
+    CHECK(fastlzlibDecompressInitMT(s, block_size, nthreads) == Z_OK);
+  } else {
+    CHECK(fastlzlibDecompressInit2(s, block_size) == Z_OK);
+  }
+  CHECK(fastlzlibSetCompressor(s, compressor) == Z_OK);
+}
+
+/* compress "size" bytes into "dest" (whose room is "room"), feeding the
+   stream with "in_chunk" input bytes and "out_chunk" output bytes at a
+   time ; returns the compressed size */
+static uLong test_compress_feed(zfast_stream *s,
+                                const Bytef *source, uLong size,
+                                Bytef *dest, uLong room,
+                                uInt in_chunk, uInt out_chunk) {
+  const uLong start_in = s->total_in;
+  const uLong start = s->total_out;
+  uLong fed = 0;
+  int code;
+  s->next_in = (Bytef*) source;
+  s->avail_in = 0;
+  s->next_out = dest;
+  s->avail_out = 0;
+  do {
+    const uLong produced = (uLong) ( s->next_out - dest );
+    if (s->avail_in == 0 && fed < size) {
+      s->avail_in = size - fed < in_chunk ? size - fed : in_chunk;
+      fed += s->avail_in;
+    }
+    if (s->avail_out == 0) {
+      CHECK(produced < room);
+      s->avail_out = room - produced < out_chunk
+        ? room - produced : out_chunk;
+    }
+    code = fastlzlibCompress(s, fed == size ? Z_FINISH : Z_NO_FLUSH);
+    CHECK(code == Z_OK || code == Z_STREAM_END
+          || ( code == Z_BUF_ERROR
+               && ( s->avail_out == 0
+                    || ( s->avail_in == 0 && fed < size ) ) ));
+  } while (code != Z_STREAM_END);
+  CHECK(s->avail_in == 0);
+  CHECK(s->total_in - start_in == size);
+  return s->total_out - start;
+}
+
+/* compress "size" bytes at once */
+static uLong test_compress(zfast_stream *s, const Bytef *source, uLong size,
+                           Bytef *dest, uLong room) {
+  return test_compress_feed(s, source, size, dest, room, size + 1, room);
+}
+
+/* decompress a stream into "dest", feeding the stream with "in_chunk" input
+   bytes and "out_chunk" output bytes at a time ; returns Z_STREAM_END upon
+   success, or the error code */
+static int test_decompress_feed(zfast_stream *s,
+                                const Bytef *source, uLong size,
+                                Bytef *dest, uLong room,
+                                uInt in_chunk, uInt out_chunk) {
+  uLong fed = 0;
+  int code;
+  s->next_in = (Bytef*) source;
+  s->avail_in = 0;
+  s->next_out = dest;
+  s->avail_out = 0;
+  do {
+    const uLong produced = (uLong) ( s->next_out - dest );
+    if (s->avail_in == 0 && fed < size) {
+      s->avail_in = size - fed < in_chunk ? size - fed : in_chunk;
+      fed += s->avail_in;
+    }
+    if (s->avail_out == 0 && produced < room) {
+      s->avail_out = room - produced < out_chunk
+        ? room - produced : out_chunk;
+    }
+    code = fastlzlibDecompress(s);
+    if (code == Z_BUF_ERROR
+        && ( ( s->avail_in == 0 && fed < size )
+             || ( s->avail_out == 0 && produced < room ) )) {
+      code = Z_OK;
+    }
+  } while (code == Z_OK);
+  return code;
+}
+
+/* decompress a stream at once */
+static int test_decompress(zfast_stream *s, const Bytef *source, uLong size,
+                           Bytef *dest, uLong room) {
+  return test_decompress_feed(s, source, size, dest, room, size + 1, room);
+}
+
+/* decompress a stream, and check the output against "expected" */
+static void test_verify(const Bytef *source, uLong size,
+                        const Bytef *expected, uLong expected_size,
+                        int block_size, zfast_stream_compressor compressor,
+                        int nthreads, uInt in_chunk, uInt out_chunk) {
+  zfast_stream s;
+  Bytef *const dest = (Bytef*) test_malloc(expected_size + 1);
+  test_decompress_init(&s, block_size, compressor, nthreads);
+  CHECK(test_decompress_feed(&s, source, size, dest, expected_size + 1,
+                             in_chunk, out_chunk) == Z_STREAM_END);
+  CHECK(s.total_out == expected_size);
+  CHECK(memcmp(dest, expected, expected_size) == 0);
+  CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+  free(dest);
+}
+
+/* walk the blocks of a stream using regular headers, calling "visit" on
+   each data block ; returns the number of data blocks */
+static uInt test_walk(Bytef *stream, uLong size,
+                      void (*visit)(Bytef *block, uInt compressed,
+                                    uInt uncompressed, void *arg),
+                      void *arg) {
+  uLong offset = 0;
+  uInt count = 0;
+  for(;;) {
+    uInt compressed;
+    uInt uncompressed;
+    CHECK(offset < size);
+    CHECK(fastlzlibGetStreamInfo(&stream[offset], (int) ( size - offset ),
+                                 &compressed, &uncompressed) == Z_OK);
+    if (compressed == 0) {
+      return count;
+    }
+    if (uncompressed != 0) {
+      if (visit != NULL) {
+        visit(&stream[offset], compressed, uncompressed, arg);
+      }
+      count++;
+    }
+    offset += fastlzlibGetHeaderSize() + compressed;
+  }
+}
+
+/* the stream flag combinations tested */
+static const int test_flags[] = {
+  0,
+  ZFAST_FLAG_CHECKSUM,
+  ZFAST_FLAG_INDEX,
+  ZFAST_FLAG_COMPACT_HEADERS,
+  ZFAST_FLAG_COMPACT_HEADERS | ZFAST_FLAG_INDEX | ZFAST_FLAG_CHECKSUM,
+  ZFAST_FLAG_COMPRESSOR_ID | ZFAST_FLAG_INDEX,
+  ZFAST_FLAG_ADAPTIVE | ZFAST_FLAG_CHECKSUM,
+  ZFAST_FLAG_LINKED_BLOCKS
+};
+
+#define TEST_FLAGS ( (int) ( sizeof(test_flags) / sizeof(test_flags[0]) ) )
+
+/* round trip of all backends, levels, block sizes and stream flags, with
+   whole buffers and small fragments, and multi-threaded decoders (except for
+   linked blocks) */
+static void test_roundtrip(void) {
+  static const zfast_stream_compressor compressors[] = {
+    COMPRESSOR_LZ4, COMPRESSOR_FASTLZ
+  };
+  static const int levels[] = { Z_BEST_SPEED, Z_BEST_COMPRESSION };
+  static const int block_sizes[] = { 1024, 65536 };
+  const uLong size = TEST_SIZE / 4;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 1);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const z2 = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size);
+  int c, l, b, f;
+  for(c = 0; c < 2; c++) {
+    for(l = 0; l < 2; l++) {
+      for(b = 0; b < 2; b++) {
+        for(f = 0; f < TEST_FLAGS; f++) {
+          const int flags = test_flags[f];
+          zfast_stream s;
+          uLong zn;
+          uLong zn2;
+          uLongf dn = size;
+          if (( flags & ZFAST_FLAG_LINKED_BLOCKS ) != 0
+              && compressors[c] != COMPRESSOR_LZ4) {
+            continue;
+          }
+          test_compress_init(&s, levels[l], block_sizes[b], compressors[c],
+                             flags, 0);
+          zn = test_compress(&s, data, size, z, room);
+          CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+          /* fragmented input and output give the same stream */
+          test_compress_init(&s, levels[l], block_sizes[b], compressors[c],
+                             flags, 0);
+          zn2 = test_compress_feed(&s, data, size, z2, room, 997, 555);
+          CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+          CHECK(zn2 == zn && memcmp(z, z2, zn) == 0);
+
+          test_verify(z, zn, data, size, block_sizes[b], compressors[c], 0,
+                      (uInt) zn, (uInt) size);
+          test_verify(z, zn, data, size, block_sizes[b], compressors[c], 0,
+                      333, 999);
+          test_verify(z, zn, data, size, block_sizes[b], compressors[c], 0,
+                      1, 7);
+          if (( flags & ZFAST_FLAG_LINKED_BLOCKS ) == 0) {
+            CHECK(fastlzlibUncompressBuffer(d, &dn, z, zn, compressors[c])
+                  == Z_OK);
+            CHECK(dn == size && memcmp(d, data, size) == 0);
+            test_verify(z, zn, data, size, block_sizes[b], compressors[c],
+                        TEST_THREADS, 333, 999);
+          }
+        }
+      }
+    }
+  }
+
+  /* empty stream */
+  for(f = 0; f < TEST_FLAGS; f++) {
+    zfast_stream s;
+    uLong zn;
+    test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, test_flags[f],
+                       0);
+    zn = test_compress(&s, data, 0, z, room);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    CHECK(zn != 0);
+    test_verify(z, zn, data, 0, 65536, COMPRESSOR_LZ4, 0, (uInt) zn, 1);
+  }
+
+  free(data);
+  free(z);
+  free(z2);
+  free(d);
+}
+
+/* multi-threaded streams are identical to single-threaded ones, and are
+   decoded by multi-threaded decoders */
+static void test_threads(void) {
+  static const int flags[] = {
+    0,
+    ZFAST_FLAG_CHECKSUM,
+    ZFAST_FLAG_SKIP_INCOMPRESSIBLE,
+    ZFAST_FLAG_INDEX,
+    ZFAST_FLAG_COMPACT_HEADERS,
+    ZFAST_FLAG_COMPRESSOR_ID | ZFAST_FLAG_INDEX,
+    ZFAST_FLAG_COMPACT_HEADERS | ZFAST_FLAG_COMPRESSOR_ID
+    | ZFAST_FLAG_INDEX | ZFAST_FLAG_CHECKSUM
+  };
+  static const zfast_stream_compressor compressors[] = {
+    COMPRESSOR_LZ4, COMPRESSOR_FASTLZ
+  };
+  const uLong size = TEST_SIZE;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 2);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const z2 = (Bytef*) test_malloc(room);
+  int c, f, b;
+  for(c = 0; c < 2; c++) {
+    for(f = 0; f < (int) ( sizeof(flags) / sizeof(flags[0]) ); f++) {
+      for(b = 1024; b <= 262144; b *= 16) {
+        zfast_stream s;
+        uLong zn;
+        uLong zn2;
+        test_compress_init(&s, Z_BEST_SPEED, b, compressors[c], flags[f], 0);
+        zn = test_compress(&s, data, size, z, room);
+        CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+        test_compress_init(&s, Z_BEST_SPEED, b, compressors[c], flags[f],
+                           TEST_THREADS);
+        zn2 = test_compress(&s, data, size, z2, room);
+        CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+        CHECK(zn2 == zn && memcmp(z, z2, zn) == 0);
+
+        test_compress_init(&s, Z_BEST_SPEED, b, compressors[c], flags[f],
+                           TEST_THREADS);
+        zn2 = test_compress_feed(&s, data, size, z2, room, 777, 555);
+        CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+        CHECK(zn2 == zn && memcmp(z, z2, zn) == 0);
+
+        test_verify(z, zn, data, size, b, compressors[c], TEST_THREADS,
+                    (uInt) zn, (uInt) size);
+        test_verify(z, zn, data, size, b, compressors[c], TEST_THREADS,
+                    333, 999);
+        test_verify(z, zn, data, size, b, compressors[c], 0, 333, 999);
+      }
+
+      /* empty stream */
+      {
+        zfast_stream s;
+        uLong zn;
+        uLong zn2;
+        test_compress_init(&s, Z_BEST_SPEED, 65536, compressors[c], flags[f],
+                           0);
+        zn = test_compress(&s, data, 0, z, room);
+        CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+        test_compress_init(&s, Z_BEST_SPEED, 65536, compressors[c], flags[f],
+                           TEST_THREADS);
+        zn2 = test_compress_feed(&s, data, 0, z2, room, 777, 1);
+        CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+        CHECK(zn2 == zn && memcmp(z, z2, zn) == 0);
+      }
+    }
+  }
+  free(data);
+  free(z);
+  free(z2);
+}
+
+/* flip a byte in the middle of a data block */
+static void test_corrupt_block(Bytef *block, uInt compressed,
+                               uInt uncompressed, void *arg) {
+  uInt *const count = (uInt*) arg;
+  (void) uncompressed;
+  if (( *count )++ == 3) {
+    block[fastlzlibGetHeaderSize() + compressed / 2] ^= 0x20;
+  }
+}
+
+/* a corrupted block is detected by all decoders */
+static void test_checksum(void) {
+  const uLong size = TEST_SIZE / 2;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 3);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size);
+  int c;
+  for(c = 0; c < 2; c++) {
+    const zfast_stream_compressor compressor =
+      c == 0 ? COMPRESSOR_LZ4 : COMPRESSOR_FASTLZ;
+    zfast_stream s;
+    zfast_reader *reader;
+    uLong zn;
+    uLongf dn = size;
+    uInt count = 0;
+    uInt length;
+    int nthreads;
+    test_compress_init(&s, Z_BEST_SPEED, 16384, compressor,
+                       ZFAST_FLAG_CHECKSUM | ZFAST_FLAG_INDEX, 0);
+    zn = test_compress(&s, data, size, z, room);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    test_verify(z, zn, data, size, 16384, compressor, 0, (uInt) zn, 1000);
+
+    CHECK(test_walk(z, zn, test_corrupt_block, &count) > 3);
+    for(nthreads = 0; nthreads <= TEST_THREADS; nthreads += TEST_THREADS) {
+      test_decompress_init(&s, 16384, compressor, nthreads);
+      CHECK(test_decompress(&s, z, zn, d, size) == Z_DATA_ERROR);
+      CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+      test_decompress_init(&s, 16384, compressor, nthreads);
+      CHECK(test_decompress_feed(&s, z, zn, d, size, 100, 100)
+            == Z_DATA_ERROR);
+      CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+    }
+    CHECK(fastlzlibUncompressBuffer(d, &dn, z, zn, compressor)
+          == Z_DATA_ERROR);
+
+    /* the reader only fails on the corrupted block */
+    reader = fastlzlibReaderOpenBuffer(z, zn, compressor);
+    CHECK(reader != NULL);
+    length = 16384;
+    CHECK(fastlzlibReaderReadBlock(reader, 2, d, &length) == Z_OK);
+    CHECK(memcmp(d, &data[2*16384], length) == 0);
+    length = 16384;
+    CHECK(fastlzlibReaderReadBlock(reader, 3, d, &length) == Z_DATA_ERROR);
+    length = 100;
+    CHECK(fastlzlibReaderRead(reader, 3*16384 + 10, d, &length)
+          == Z_DATA_ERROR);
+    fastlzlibReaderClose(reader);
+  }
+  free(data);
+  free(z);
+  free(d);
+}
+
+/* check a reader range */
+static void test_reader_range(const zfast_reader *reader, const Bytef *data,
+                              uLong size, uLong offset, uInt length) {
+  Bytef *const d = (Bytef*) test_malloc(length);
+  const uInt expected = offset + length <= size
+    ? length : (uInt) ( size - offset );
+  uInt done = length;
+  CHECK(fastlzlibReaderRead(reader, offset, d, &done) == Z_OK);
+  CHECK(done == expected);
+  CHECK(memcmp(d, &data[offset], done) == 0);
+  free(d);
+}
+
+/* random access: readers, and seeking using the index trailer */
+static void test_seek(void) {
+  static const int flags[] = {
+    0,
+    ZFAST_FLAG_INDEX,
+    ZFAST_FLAG_INDEX | ZFAST_FLAG_CHECKSUM | ZFAST_FLAG_COMPACT_HEADERS,
+    ZFAST_FLAG_COMPACT_HEADERS
+  };
+  const int bs = 4096;
+  const uLong size = TEST_SIZE / 4;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 4);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size);
+  int f;
+  for(f = 0; f < (int) ( sizeof(flags) / sizeof(flags[0]) ); f++) {
+    zfast_stream s;
+    zfast_reader *reader;
+    zfast_uint64 offset;
+    zfast_uint64 block_offset;
+    uInt block;
+    uInt length;
+    uLong zn;
+    test_compress_init(&s, Z_BEST_SPEED, bs, COMPRESSOR_LZ4, flags[f], 0);
+    zn = test_compress(&s, data, size, z, room);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+    reader = fastlzlibReaderOpenBuffer(z, zn, COMPRESSOR_LZ4);
+    CHECK(reader != NULL);
+    CHECK(fastlzlibReaderGetSize(reader) == size);
+    CHECK(fastlzlibReaderGetBlockCount(reader) == ( size + bs - 1 ) / bs);
+    CHECK(fastlzlibReaderGetBlockInfo(reader, 5, &block_offset, &length)
+          == Z_OK);
+    CHECK(block_offset == 5*bs && length == (uInt) bs);
+    CHECK(fastlzlibReaderFindBlock(reader, 5*bs + 17, &block) == Z_OK);
+    CHECK(block == 5);
+    CHECK(fastlzlibReaderFindBlock(reader, size, &block) == Z_BUF_ERROR);
+
+    /* ranges within a block, at block boundaries, across blocks, and at the
+       end of the stream */
+    test_reader_range(reader, data, size, 0, 1);
+    test_reader_range(reader, data, size, 10, 100);
+    test_reader_range(reader, data, size, bs - 1, 2);
+    test_reader_range(reader, data, size, bs, bs);
+    test_reader_range(reader, data, size, 3*bs + 5, 5*bs);
+    test_reader_range(reader, data, size, 7*bs - 3, 17);
+    test_reader_range(reader, data, size, size - 10, 10);
+    test_reader_range(reader, data, size, size - 10, 1000);
+    test_reader_range(reader, data, size, 0, (uInt) size);
+    length = 10;
+    CHECK(fastlzlibReaderRead(reader, size, d, &length) == Z_OK);
+    CHECK(length == 0);
+    length = 10;
+    CHECK(fastlzlibReaderRead(reader, size + 1, d, &length) == Z_BUF_ERROR);
+    length = bs;
+    CHECK(fastlzlibReaderReadBlock(reader, 7, d, &length) == Z_OK);
+    CHECK(length == (uInt) bs && memcmp(d, &data[7*bs], bs) == 0);
+    length = bs - 1;
+    CHECK(fastlzlibReaderReadBlock(reader, 7, d, &length) == Z_BUF_ERROR);
+
+    /* seek a decompressing stream from the reader index */
+    test_decompress_init(&s, bs, COMPRESSOR_LZ4, 0);
+    for(offset = 0; offset < size; offset += 7777) {
+      zfast_uint64 compressed_offset;
+      int code;
+      CHECK(fastlzlibSeek(&s, fastlzlibReaderGetIndex(reader), offset,
+                          &compressed_offset) == Z_OK);
+      CHECK(s.total_out == offset);
+      s.next_in = &z[compressed_offset];
+      s.avail_in = (uInt) ( zn - compressed_offset );
+      s.next_out = d;
+      s.avail_out = 1000;
+      do {
+        code = fastlzlibDecompress(&s);
+      } while (code == Z_OK && s.avail_out != 0);
+      CHECK(code == Z_OK || code == Z_STREAM_END);
+      CHECK(memcmp(d, &data[offset], s.next_out - d) == 0);
+      CHECK(s.avail_out == 0 || s.total_out == size);
+    }
+    CHECK(fastlzlibSeek(&s, fastlzlibReaderGetIndex(reader), size + 1, &offset)
+          == Z_BUF_ERROR);
+    CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+    fastlzlibReaderClose(reader);
+
+    /* the index trailer gives the same offsets */
+    if (( flags[f] & ZFAST_FLAG_INDEX ) != 0) {
+      zfast_index *const index = fastlzlibIndexCreate();
+      zfast_uint64 compressed_offset;
+      uInt trailer;
+      CHECK(index != NULL);
+      CHECK(fastlzlibGetIndexSize(&z[zn - 20], 20, &trailer) == Z_OK);
+      CHECK(fastlzlibIndexLoad(index, &z[zn - trailer], trailer) == Z_OK);
+      CHECK(fastlzlibIndexLookup(index, 5*bs + 1, &compressed_offset,
+                                 &block_offset) == Z_OK);
+      CHECK(block_offset == 5*bs);
+      test_decompress_init(&s, bs, COMPRESSOR_LZ4, 0);
+      CHECK(fastlzlibSeek(&s, index, 5*bs + 1, &offset) == Z_OK);
+      CHECK(offset == compressed_offset);
+      CHECK(test_decompress(&s, &z[offset], zn - offset, d, size)
+            == Z_STREAM_END);
+      CHECK(s.total_out == size);
+      CHECK(memcmp(d, &data[5*bs + 1], size - 5*bs - 1) == 0);
+      CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+      fastlzlibIndexFree(index);
+    }
+  }
+  free(data);
+  free(z);
+  free(d);
+}
+
+/* load the index trailer of a stream */
+static zfast_index* test_load_index(const Bytef *stream, uLong size) {
+  zfast_index *const index = fastlzlibIndexCreate();
+  uInt trailer;
+  CHECK(index != NULL);
+  CHECK(fastlzlibGetIndexSize(&stream[size - 20], 20, &trailer) == Z_OK);
+  CHECK(fastlzlibIndexLoad(index, &stream[size - trailer], trailer) == Z_OK);
+  return index;
+}
+
+/* appending to indexed streams, and directory checkpoints */
+static void test_append(void) {
+  static const int flags[] = {
+    ZFAST_FLAG_INDEX,
+    ZFAST_FLAG_INDEX | ZFAST_FLAG_COMPACT_HEADERS | ZFAST_FLAG_CHECKSUM
+  };
+  const int bs = 8192;
+  const uLong size = TEST_SIZE / 4;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 5);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size);
+  /* three parts, the first one ending in the middle of a block */
+  const uLong part1 = size / 3 + 123;
+  const uLong part2 = size / 3;
+  const uLong part3 = size - part1 - part2;
+  int f;
+  for(f = 0; f < (int) ( sizeof(flags) / sizeof(flags[0]) ); f++) {
+    zfast_stream s;
+    zfast_index *index;
+    zfast_reader *reader;
+    zfast_uint64 offset;
+    uLong zn;
+    uLongf dn = size;
+
+    test_compress_init(&s, Z_BEST_SPEED, bs, COMPRESSOR_LZ4, flags[f], 0);
+    zn = test_compress(&s, data, part1, z, room);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+    /* append the second part using the loaded index */
+    index = test_load_index(z, zn);
+    test_compress_init(&s, Z_BEST_SPEED, bs, COMPRESSOR_LZ4, flags[f], 0);
+    CHECK(fastlzlibCompressAppend(&s, index, &offset) == Z_OK);
+    fastlzlibIndexFree(index);
+    CHECK(offset < zn && s.total_in == part1 && s.total_out == offset);
+    zn = offset + test_compress(&s, &data[part1], part2, &z[offset],
+                                room - offset);
+    test_verify(z, zn, data, part1 + part2, bs, COMPRESSOR_LZ4, 0,
+                (uInt) zn, 1000);
+
+    /* resume the finished stream itself for the third part */
+    CHECK(fastlzlibCompressAppend(&s, NULL, &offset) == Z_OK);
+    CHECK(offset < zn && s.total_out == offset);
+    zn = offset + test_compress(&s, &data[part1 + part2], part3, &z[offset],
+                                room - offset);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    test_verify(z, zn, data, size, bs, COMPRESSOR_LZ4, 0, 333, 999);
+    CHECK(fastlzlibUncompressBuffer(d, &dn, z, zn, COMPRESSOR_LZ4) == Z_OK);
+    CHECK(dn == size && memcmp(d, data, size) == 0);
+
+    /* the final index covers the whole stream */
+    reader = fastlzlibReaderOpenBuffer(z, zn, COMPRESSOR_LZ4);
+    CHECK(reader != NULL);
+    CHECK(fastlzlibReaderGetSize(reader) == size);
+    test_reader_range(reader, data, size, part1 - 100, 200);
+    test_reader_range(reader, data, size, part1 + part2 - 1, bs + 2);
+    fastlzlibReaderClose(reader);
+
+    /* an index which misses blocks is refused */
+    index = test_load_index(z, zn);
+    reader = fastlzlibReaderOpenBuffer(z, zn, COMPRESSOR_LZ4);
+    CHECK(reader != NULL);
+    test_compress_init(&s, Z_BEST_SPEED, bs, COMPRESSOR_LZ4, flags[f], 0);
+    CHECK(fastlzlibCompressAppend(&s, fastlzlibReaderGetIndex(reader),
+                                  &offset) == Z_DATA_ERROR);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    fastlzlibReaderClose(reader);
+
+    /* the compact setting must match */
+    test_compress_init(&s, Z_BEST_SPEED, bs, COMPRESSOR_LZ4,
+                       flags[f] ^ ZFAST_FLAG_COMPACT_HEADERS, 0);
+    CHECK(fastlzlibCompressAppend(&s, index, &offset) == Z_STREAM_ERROR);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    fastlzlibIndexFree(index);
+  }
+  free(data);
+  free(z);
+  free(d);
+}
+
+/* decompressing a compact stream from an arbitrary position resumes at the
+   next sync marker, and a corrupted stream resumes at the next block */
+static void test_resync(void) {
+  const uLong size = TEST_SIZE;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 6);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size);
+  zfast_stream s;
+  uLong zn;
+  uLong start;
+  test_compress_init(&s, Z_BEST_SPEED, 1024, COMPRESSOR_LZ4,
+                     ZFAST_FLAG_COMPACT_HEADERS, 0);
+  zn = test_compress(&s, data, size, z, room);
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+  /* the stream header is repeated every 64KB of compressed data */
+  for(start = 1; start + 2*65536 < zn; start += zn / 7) {
+    test_decompress_init(&s, 1024, COMPRESSOR_LZ4, 0);
+    s.next_in = &z[start];
+    s.avail_in = (uInt) ( zn - start );
+    CHECK(fastlzlibDecompressSync(&s) == Z_OK);
+    CHECK(test_decompress(&s, s.next_in, s.avail_in, d, size)
+          == Z_STREAM_END);
+    CHECK(s.total_out != 0 && s.total_out < size);
+    CHECK(memcmp(d, &data[size - s.total_out], s.total_out) == 0);
+    CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+  }
+
+  /* regular headers: skip a corrupted block */
+  test_compress_init(&s, Z_BEST_SPEED, 16384, COMPRESSOR_LZ4, 0, 0);
+  zn = test_compress(&s, data, size, z, room);
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+  z[zn / 2] ^= 0xff;
+  z[zn / 2 + 1] ^= 0xff;
+  test_decompress_init(&s, 16384, COMPRESSOR_LZ4, 0);
+  s.next_in = &z[zn / 2];
+  s.avail_in = (uInt) ( zn - zn / 2 );
+  CHECK(fastlzlibDecompressSync(&s) == Z_OK);
+  CHECK(test_decompress(&s, s.next_in, s.avail_in, d, size) == Z_STREAM_END);
+  CHECK(s.total_out != 0 && s.total_out % 16384 == size % 16384);
+  CHECK(memcmp(d, &data[size - s.total_out], s.total_out) == 0);
+  CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+
+  /* a long skip, followed by buffered headers (the skipped bytes used to be
+     counted as partial header bytes, overrunning the header buffer) */
+  test_decompress_init(&s, 16384, COMPRESSOR_LZ4, 0);
+  s.next_in = &z[zn / 2 + 1];
+  s.avail_in = (uInt) ( zn - zn / 2 - 1 );
+  CHECK(fastlzlibDecompressSync(&s) == Z_OK);
+  CHECK(s.total_in > (uLong) fastlzlibGetHeaderSize());
+  CHECK(test_decompress_feed(&s, s.next_in, s.avail_in, d, size, 3, 1000)
+        == Z_STREAM_END);
+  CHECK(s.total_out != 0 && s.total_out % 16384 == size % 16384);
+  CHECK(memcmp(d, &data[size - s.total_out], s.total_out) == 0);
+  CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+
+  free(data);
+  free(z);
+  free(d);
+}
+
+/* batches of small buffers */
+static void test_batch(void) {
+  static const int flags[] = {
+    0, ZFAST_FLAG_CHECKSUM, ZFAST_FLAG_COMPACT_HEADERS
+  };
+  static const uInt sizes[] = { 0, 1, 100, 1000, 5000, 70000 };
+#define BATCH_COUNT 48
+  const uLong size = TEST_SIZE;
+  Bytef *const data = test_data(size, 7);
+  Bytef *const d = (Bytef*) test_malloc(size);
+  zfast_batch_item items[BATCH_COUNT];
+  Bytef *outputs[BATCH_COUNT];
+  int f;
+  int nthreads;
+  int i;
+  for(i = 0; i < BATCH_COUNT; i++) {
+    outputs[i] = (Bytef*) test_malloc(TEST_ROOM(70000));
+  }
+  for(f = 0; f < (int) ( sizeof(flags) / sizeof(flags[0]) ); f++) {
+    for(nthreads = 0; nthreads <= TEST_THREADS; nthreads += TEST_THREADS) {
+      zfast_stream s;
+      uLong offset = 0;
+      test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, flags[f],
+                         nthreads);
+      for(i = 0; i < BATCH_COUNT; i++) {
+        items[i].next_in = &data[offset];
+        items[i].avail_in = sizes[i % ( sizeof(sizes) / sizeof(sizes[0]) )];
+        items[i].next_out = outputs[i];
+        items[i].avail_out = TEST_ROOM(70000);
+        offset += items[i].avail_in;
+      }
+      CHECK(offset <= size);
+      /* one output buffer is too small */
+      items[5].avail_out = 10;
+      CHECK(fastlzlibCompressBatch(&s, items, BATCH_COUNT) == Z_BUF_ERROR);
+      CHECK(items[5].code == Z_BUF_ERROR);
+      /* the stream itself is not modified */
+      CHECK(s.total_in == 0 && s.total_out == 0);
+      for(i = 0; i < BATCH_COUNT; i++) {
+        if (i != 5) {
+          uLongf dn = size;
+          CHECK(items[i].code == Z_OK);
+          CHECK(fastlzlibUncompressBuffer(d, &dn, items[i].next_out,
+                                          items[i].total_out, COMPRESSOR_LZ4)
+                == Z_OK);
+          CHECK(dn == items[i].avail_in);
+          CHECK(memcmp(d, items[i].next_in, dn) == 0);
+          if (flags[f] == 0) {
+            /* identical to the one-shot api */
+            Bytef *const z = (Bytef*) test_malloc(TEST_ROOM(70000));
+            uLongf zn = TEST_ROOM(70000);
+            CHECK(fastlzlibCompressBuffer(z, &zn, items[i].next_in,
+                                          items[i].avail_in, Z_BEST_SPEED,
+                                          65536, COMPRESSOR_LZ4) == Z_OK);
+            CHECK(zn == items[i].total_out);
+            CHECK(memcmp(z, items[i].next_out, zn) == 0);
+            free(z);
+          }
+        }
+      }
+      CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    }
+  }
+  for(i = 0; i < BATCH_COUNT; i++) {
+    free(outputs[i]);
+  }
+#undef BATCH_COUNT
+  free(data);
+  free(d);
+}
+
+/* build up to "max" fragments of "buffer" starting at "offset", whose sizes
+   cycle through "sizes" */
+static int test_iovec(struct iovec *iov, int max, Bytef *buffer, uLong size,
+                      uLong offset, const uInt *sizes, int nsizes) {
+  int n;
+  for(n = 0; n < max && offset < size; n++) {
+    const uInt length = sizes[( offset + n ) % nsizes];
+    iov[n].iov_base = &buffer[offset];
+    iov[n].iov_len = size - offset < length ? size - offset : length;
+    offset += iov[n].iov_len;
+  }
+  return n;
+}
+
+/* scatter/gather streams */
+static void test_scatter_gather(void) {
+  static const int flags[] = {
+    0, ZFAST_FLAG_CHECKSUM | ZFAST_FLAG_COMPACT_HEADERS
+  };
+  static const uInt in_sizes[] = { 1, 7, 1000, 70000, 8192, 3 };
+  static const uInt out_sizes[] = { 30000, 5, 65536, 100, 200000 };
+  const uLong size = TEST_SIZE / 2;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 8);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const z2 = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size);
+  int f;
+  for(f = 0; f < (int) ( sizeof(flags) / sizeof(flags[0]) ); f++) {
+    zfast_stream s;
+    struct iovec in[8];
+    struct iovec out[8];
+    uLong zn;
+    uLong consumed = 0;
+    uLong produced = 0;
+    int code;
+
+    test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, flags[f], 0);
+    zn = test_compress(&s, data, size, z, room);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+    /* compress: the same stream as contiguous buffers */
+    test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, flags[f], 0);
+    do {
+      uLong c;
+      uLong p;
+      const int nin = test_iovec(in, 8, (Bytef*) data, size, consumed,
+                                 in_sizes, 6);
+      const int nout = test_iovec(out, 8, z2, room, produced, out_sizes, 5);
+      const int last = nin == 0
+        || (Bytef*) in[nin - 1].iov_base + in[nin - 1].iov_len == &data[size];
+      code = fastlzlibCompressV(&s, last ? Z_FINISH : Z_NO_FLUSH,
+                                in, nin, out, nout, &c, &p);
+      CHECK(code == Z_OK || code == Z_STREAM_END);
+      consumed += c;
+      produced += p;
+    } while (code != Z_STREAM_END);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    CHECK(consumed == size);
+    CHECK(produced == zn && memcmp(z, z2, zn) == 0);
+
+    /* decompress */
+    test_decompress_init(&s, 65536, COMPRESSOR_LZ4, 0);
+    consumed = produced = 0;
+    do {
+      uLong c;
+      uLong p;
+      const int nin = test_iovec(in, 8, z, zn, consumed, out_sizes, 5);
+      const int nout = test_iovec(out, 8, d, size, produced, in_sizes, 6);
+      code = fastlzlibDecompressV(&s, in, nin, out, nout, &c, &p);
+      CHECK(code == Z_OK || code == Z_STREAM_END);
+      consumed += c;
+      produced += p;
+    } while (code != Z_STREAM_END);
+    CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+    CHECK(consumed == zn);
+    CHECK(produced == size && memcmp(d, data, size) == 0);
+  }
+  free(data);
+  free(z);
+  free(z2);
+  free(d);
+}
+
+/* custom backend storing all blocks */
+static int test_store_compress(int level, const void* input, int length,
+                               void* output) {
+  (void) level;
+  (void) input;
+  (void) length;
+  (void) output;
+  return 0;
+}
+
+/* changing the backend of a multi-threaded stream which has pending blocks
+   does not lose them, and the compressor type and the hash table size can
+   not be changed once the stream is used */
+static void test_backend_change(void) {
+  const uLong size = TEST_SIZE;
+  const uLong room = TEST_ROOM(size);
+  const uLong part = 501000;
+  Bytef *const data = test_data(size, 9);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  zfast_stream s;
+  uLong zn;
+  int code;
+  test_compress_init(&s, 6, 65536, COMPRESSOR_FASTLZ, 0, TEST_THREADS);
+  s.next_in = data;
+  s.avail_in = part;
+  s.next_out = z;
+  s.avail_out = room;
+  CHECK(fastlzlibCompress(&s, Z_NO_FLUSH) == Z_OK);
+  CHECK(s.avail_in == 0);
+  CHECK(fastlzlibSetCompressor(&s, COMPRESSOR_LZ4) == Z_STREAM_ERROR);
+  CHECK(fastlzlibSetHashTableSize(&s, 12) == Z_STREAM_ERROR);
+  fastlzlibSetCompress(&s, test_store_compress);
+  s.avail_in = size - part;
+  do {
+    code = fastlzlibCompress(&s, Z_FINISH);
+  } while (code == Z_OK);
+  CHECK(code == Z_STREAM_END);
+  zn = s.total_out;
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+  test_verify(z, zn, data, size, 65536, COMPRESSOR_FASTLZ, 0, (uInt) zn,
+              (uInt) size);
+
+  test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, 0,
+                     TEST_THREADS);
+  CHECK(fastlzlibSetHashTableSize(&s, 12) == Z_OK);
+  s.next_in = data;
+  s.avail_in = part;
+  s.next_out = z;
+  s.avail_out = room;
+  CHECK(fastlzlibCompress(&s, Z_NO_FLUSH) == Z_OK);
+  CHECK(fastlzlibSetHashTableSize(&s, 0) == Z_STREAM_ERROR);
+  s.avail_in = size - part;
+  do {
+    code = fastlzlibCompress(&s, Z_FINISH);
+  } while (code == Z_OK);
+  CHECK(code == Z_STREAM_END);
+  zn = s.total_out;
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+  test_verify(z, zn, data, size, 65536, COMPRESSOR_LZ4, 0, (uInt) zn,
+              (uInt) size);
+  free(data);
+  free(z);
+}
+
+/* the work area of adaptive LZ4HC streams also holds the hash table of the
+   fast levels */
+static void test_adaptive(void) {
+  const uLong size = TEST_SIZE;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 10);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  int nthreads;
+  for(nthreads = 0; nthreads <= TEST_THREADS; nthreads += TEST_THREADS) {
+    zfast_stream s;
+    uLong zn;
+    test_compress_init(&s, Z_BEST_COMPRESSION, 65536, COMPRESSOR_LZ4,
+                       ZFAST_FLAG_ADAPTIVE, nthreads);
+    CHECK(fastlzlibSetHashTableSize(&s, ZFAST_TABLE_LOG_MAX) == Z_OK);
+    CHECK(fastlzlibSetTargetSpeed(&s, 100000) == Z_OK);
+    zn = test_compress(&s, data, size, z, room);
+    CHECK(fastlzlibCompressMemory(&s) >= 1 << ZFAST_TABLE_LOG_MAX);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    test_verify(z, zn, data, size, 65536, COMPRESSOR_LZ4, 0, (uInt) zn,
+                (uInt) size);
+  }
+  free(data);
+  free(z);
+}
+
+/* the LZ4 hash table kept across blocks does not change the output: a
+   stream compressing other data first gives the same stream as a new one */
+static void test_table_reuse(void) {
+  static const int table_logs[] = {
+    0, ZFAST_TABLE_LOG_MIN, ZFAST_TABLE_LOG_MAX
+  };
+  const uLong size = TEST_SIZE;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 11);
+  Bytef *const other = test_data(size, 12);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const z2 = (Bytef*) test_malloc(room);
+  int t, b;
+  for(t = 0; t < (int) ( sizeof(table_logs) / sizeof(table_logs[0]) ); t++) {
+    for(b = 1024; b <= 262144; b *= 16) {
+      zfast_stream s;
+      uLong zn;
+      uLong zn2;
+      test_compress_init(&s, Z_BEST_SPEED, b, COMPRESSOR_LZ4, 0, 0);
+      CHECK(fastlzlibSetHashTableSize(&s, table_logs[t]) == Z_OK);
+      zn = test_compress(&s, data, size, z, room);
+      CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+      test_compress_init(&s, Z_BEST_SPEED, b, COMPRESSOR_LZ4, 0, 0);
+      CHECK(fastlzlibSetHashTableSize(&s, table_logs[t]) == Z_OK);
+      (void) test_compress(&s, other, size, z2, room);
+      CHECK(fastlzlibCompressReset(&s) == Z_OK);
+      zn2 = test_compress(&s, data, size, z2, room);
+      CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+      CHECK(zn2 == zn && memcmp(z, z2, zn) == 0);
+
+      test_verify(z, zn, data, size, b, COMPRESSOR_LZ4, 0, (uInt) zn,
+                  (uInt) size);
+    }
+  }
+
+  /* linked blocks use the default size: rejected in either order */
+  for(t = 0; t < 2; t++) {
+    zfast_stream s;
+    test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4,
+                       t == 0 ? ZFAST_FLAG_LINKED_BLOCKS : 0, 0);
+    if (t == 0) {
+      CHECK(fastlzlibSetHashTableSize(&s, ZFAST_TABLE_LOG_MIN)
+            == Z_STREAM_ERROR);
+    } else {
+      CHECK(fastlzlibSetHashTableSize(&s, ZFAST_TABLE_LOG_MIN) == Z_OK);
+      CHECK(fastlzlibSetFlags(&s, ZFAST_FLAG_LINKED_BLOCKS)
+            == Z_STREAM_ERROR);
+      CHECK(fastlzlibGetFlags(&s) == 0);
+      CHECK(fastlzlibSetHashTableSize(&s, 0) == Z_OK);
+      CHECK(fastlzlibSetFlags(&s, ZFAST_FLAG_LINKED_BLOCKS) == Z_OK);
+    }
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+  }
+  free(data);
+  free(other);
+  free(z);
+  free(z2);
+}
+
+/* the backend announced by a compressor meta block only applies until the
+   decompressing stream is reset (or returned to a pool), and the one of an
+   index applies to the stream seeked */
+static void test_compressor_reset(void) {
+  const uLong size = TEST_SIZE / 4;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 13);
+  Bytef *const tagged = (Bytef*) test_malloc(room);
+  Bytef *const plain = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size + 1);
+  zfast_pool *const pool = fastlzlibPoolCreate(4);
+  zfast_stream s;
+  uLong tn;
+  uLong pn;
+  int nthreads;
+  zfast_index *index;
+  zfast_uint64 offset;
+  test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4,
+                     ZFAST_FLAG_COMPRESSOR_ID | ZFAST_FLAG_INDEX, 0);
+  tn = test_compress(&s, data, size, tagged, room);
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+  test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_FASTLZ, 0, 0);
+  pn = test_compress(&s, data, size, plain, room);
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+  for(nthreads = 0; nthreads <= TEST_THREADS; nthreads += TEST_THREADS) {
+    test_decompress_init(&s, 65536, COMPRESSOR_FASTLZ, nthreads);
+    CHECK(test_decompress(&s, tagged, tn, d, size + 1) == Z_STREAM_END);
+    CHECK(s.total_out == size && memcmp(d, data, size) == 0);
+    CHECK(fastlzlibDecompressReset(&s) == Z_OK);
+    CHECK(test_decompress(&s, plain, pn, d, size + 1) == Z_STREAM_END);
+    CHECK(s.total_out == size && memcmp(d, data, size) == 0);
+    CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+  }
+
+  index = test_load_index(tagged, tn);
+  test_decompress_init(&s, 65536, COMPRESSOR_FASTLZ, 0);
+  CHECK(fastlzlibSeek(&s, index, 100000, &offset) == Z_OK);
+  CHECK(test_decompress(&s, &tagged[offset], tn - offset, d, size)
+        == Z_STREAM_END);
+  CHECK(s.total_out == size && memcmp(d, &data[100000], size - 100000) == 0);
+  CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+  fastlzlibIndexFree(index);
+
+  /* pooled streams are keyed by their configured compressor */
+  CHECK(pool != NULL);
+  memset(&s, 0, sizeof(s));
+  CHECK(fastlzlibPoolDecompressInit(pool, &s, 65536, COMPRESSOR_FASTLZ)
+        == Z_OK);
+  CHECK(test_decompress(&s, tagged, tn, d, size + 1) == Z_STREAM_END);
+  CHECK(fastlzlibPoolEnd(pool, &s) == Z_OK);
+  memset(&s, 0, sizeof(s));
+  CHECK(fastlzlibPoolDecompressInit(pool, &s, 65536, COMPRESSOR_FASTLZ)
+        == Z_OK);
+  CHECK(test_decompress(&s, plain, pn, d, size + 1) == Z_STREAM_END);
+  CHECK(s.total_out == size && memcmp(d, data, size) == 0);
+  CHECK(fastlzlibPoolEnd(pool, &s) == Z_OK);
+  fastlzlibPoolDestroy(pool);
+
+  free(data);
+  free(tagged);
+  free(plain);
+  free(d);
+}
+
+/* the final block and EOF marker are written once, even when a later call
+   drains them (with tiny output buffers, the stream used to restart with an
+   extra empty block and EOF marker, and could loop forever) */
+static void test_eof(void) {
+  static const int flags[] = {
+    0, ZFAST_FLAG_CHECKSUM, ZFAST_FLAG_LINKED_BLOCKS
+  };
+  static const uInt chunks[] = { 1, 7, 16, 17 };
+  static const Bytef dict[] = "stream block header of the compressed data";
+  const uLong size = TEST_SIZE / 10;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 11);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const z2 = (Bytef*) test_malloc(room);
+  int f, c, p;
+  for(p = 0; p < 2; p++) {
+    for(f = 0; f < (int) ( sizeof(flags) / sizeof(flags[0]) ); f++) {
+      zfast_stream s;
+      uLong zn;
+      uInt compressed;
+      uInt uncompressed;
+      if (p != 0 && flags[f] != 0) {
+        continue;
+      }
+      test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, flags[f],
+                         0);
+      if (p != 0) {
+        CHECK(fastlzlibCompressSetDictionary(&s, dict, sizeof(dict))
+              == Z_OK);
+      }
+      zn = test_compress(&s, data, size, z, room);
+      CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+      /* the stream ends with a single EOF marker */
+      CHECK(zn > (uLong) fastlzlibGetHeaderSize());
+      CHECK(fastlzlibGetStreamInfo(&z[zn - fastlzlibGetHeaderSize()],
+                                   fastlzlibGetHeaderSize(), &compressed,
+                                   &uncompressed) == Z_OK);
+      CHECK(compressed == 0 && uncompressed == 0);
+
+      for(c = 0; c < (int) ( sizeof(chunks) / sizeof(chunks[0]) ); c++) {
+        uLong zn2;
+        test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, flags[f],
+                           0);
+        if (p != 0) {
+          CHECK(fastlzlibCompressSetDictionary(&s, dict, sizeof(dict))
+                == Z_OK);
+        }
+        zn2 = test_compress_feed(&s, data, size, z2, room, 65536, chunks[c]);
+        CHECK(zn2 == zn && memcmp(z, z2, zn) == 0);
+        /* a finished stream produces nothing more */
+        s.next_out = &z2[zn2];
+        s.avail_out = chunks[c];
+        CHECK(fastlzlibCompress(&s, Z_FINISH) == Z_STREAM_END);
+        CHECK(s.total_out == zn);
+        CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+      }
+    }
+  }
+  free(data);
+  free(z);
+  free(z2);
+}
+
+/* preset dictionaries require the LZ4 compressor, and are requested by the
+   decompressor */
+static void test_dictionary(void) {
+  static const Bytef dict[] = "stream block header of the compressed data";
+  const uLong size = 4096;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 13);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size + 1);
+  zfast_stream s;
+  uLong zn;
+
+  /* FastLZ streams can not use a dictionary */
+  test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_FASTLZ, 0, 0);
+  CHECK(fastlzlibCompressSetDictionary(&s, dict, sizeof(dict))
+        == Z_VERSION_ERROR);
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+  test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, 0, 0);
+  CHECK(fastlzlibCompressSetDictionary(&s, dict, sizeof(dict)) == Z_OK);
+  zn = test_compress(&s, data, size, z, room);
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+  /* the decompressor asks for the dictionary */
+  test_decompress_init(&s, 65536, COMPRESSOR_LZ4, 0);
+  CHECK(test_decompress(&s, z, zn, d, size + 1) == Z_NEED_DICT);
+  CHECK(fastlzlibDecompressSetDictionary(&s, dict, sizeof(dict) - 1)
+        == Z_DATA_ERROR);
+  CHECK(fastlzlibDecompressSetDictionary(&s, dict, sizeof(dict)) == Z_OK);
+  CHECK(fastlzlibDecompressReset(&s) == Z_OK);
+  CHECK(test_decompress(&s, z, zn, d, size + 1) == Z_STREAM_END);
+  CHECK(s.total_out == size && memcmp(d, data, size) == 0);
+  CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+
+  free(data);
+  free(z);
+  free(d);
+}
+
+/* short-period runs decode correctly: LZ4 copies of overlapping matches
+   (offsets below 8) used to be merged by the gcc -O3 loop vectorizer */
+static void test_overlap(void) {
+  static const int levels[] = { Z_BEST_SPEED, Z_BEST_COMPRESSION };
+  const uLong size = TEST_SIZE / 5;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = (Bytef*) test_malloc(size);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  unsigned int seed = 5;
+  uLong i = 0;
+  int l;
+  /* a few random literals, followed by a run of period 1 to 15 */
+  while (i < size) {
+    uLong j;
+    uLong run;
+    uInt period;
+    for(j = 0; j < 5 && i < size; j++) {
+      seed = seed*1103515245 + 12345;
+      data[i++] = (Bytef) ( seed >> 16 );
+    }
+    seed = seed*1103515245 + 12345;
+    period = 1 + ( seed >> 16 ) % 15;
+    run = 16 + ( seed >> 20 ) % 64;
+    /* the first runs repeat the bytes written so far */
+    if (period > i) {
+      period = (uInt) i;
+    }
+    for(j = 0; j < run && i < size; j++, i++) {
+      data[i] = data[i - period];
+    }
+  }
+  for(l = 0; l < 2; l++) {
+    zfast_stream s;
+    uLong zn;
+    test_compress_init(&s, levels[l], 65536, COMPRESSOR_LZ4, 0, 0);
+    zn = test_compress(&s, data, size, z, room);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+    test_verify(z, zn, data, size, 65536, COMPRESSOR_LZ4, 0, (uInt) zn,
+                (uInt) size);
+    test_verify(z, zn, data, size, 65536, COMPRESSOR_LZ4, 0, 333, 999);
+  }
+  free(data);
+  free(z);
+}
+
+/* pools keep at most the requested number of idle streams, and reset the
+   settings of returned streams */
+static void test_pool(void) {
+  const uLong size = TEST_SIZE / 4;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 17);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const z2 = (Bytef*) test_malloc(room);
+  zfast_pool *pool = fastlzlibPoolCreate(2);
+  zfast_stream s[3];
+  void *kept[2];
+  uLong zn;
+  uLong zn2;
+  int i;
+
+  /* two idle streams are kept, whatever the shard of the calling thread */
+  CHECK(pool != NULL);
+  for(i = 0; i < 3; i++) {
+    memset(&s[i], 0, sizeof(s[i]));
+    CHECK(fastlzlibPoolCompressInit(pool, &s[i], Z_BEST_SPEED, 65536,
+                                    COMPRESSOR_LZ4) == Z_OK);
+  }
+  kept[0] = s[0].state;
+  kept[1] = s[1].state;
+  for(i = 0; i < 3; i++) {
+    CHECK(fastlzlibPoolEnd(pool, &s[i]) == Z_OK);
+  }
+  for(i = 0; i < 3; i++) {
+    memset(&s[i], 0, sizeof(s[i]));
+    CHECK(fastlzlibPoolCompressInit(pool, &s[i], Z_BEST_SPEED, 65536,
+                                    COMPRESSOR_LZ4) == Z_OK);
+  }
+  CHECK(( s[0].state == kept[0] && s[1].state == kept[1] )
+        || ( s[0].state == kept[1] && s[1].state == kept[0] ));
+  CHECK(s[2].state != kept[0] && s[2].state != kept[1]);
+  for(i = 0; i < 3; i++) {
+    CHECK(fastlzlibPoolEnd(pool, &s[i]) == Z_OK);
+  }
+  fastlzlibPoolDestroy(pool);
+
+  /* a reused stream does not inherit the previous settings */
+  test_compress_init(&s[0], Z_BEST_SPEED, 65536, COMPRESSOR_LZ4,
+                     ZFAST_FLAG_SKIP_INCOMPRESSIBLE, 0);
+  zn = test_compress(&s[0], data, size, z, room);
+  CHECK(fastlzlibCompressEnd(&s[0]) == Z_OK);
+  pool = fastlzlibPoolCreate(1);
+  CHECK(pool != NULL);
+  memset(&s[0], 0, sizeof(s[0]));
+  CHECK(fastlzlibPoolCompressInit(pool, &s[0], Z_BEST_SPEED, 65536,
+                                  COMPRESSOR_LZ4) == Z_OK);
+  CHECK(fastlzlibSetIncompressibleThreshold(&s[0], 1000) == Z_OK);
+  CHECK(fastlzlibSetTargetSpeed(&s[0], 1) == Z_OK);
+  CHECK(fastlzlibPoolEnd(pool, &s[0]) == Z_OK);
+  memset(&s[0], 0, sizeof(s[0]));
+  CHECK(fastlzlibPoolCompressInit(pool, &s[0], Z_BEST_SPEED, 65536,
+                                  COMPRESSOR_LZ4) == Z_OK);
+  CHECK(fastlzlibSetFlags(&s[0], ZFAST_FLAG_SKIP_INCOMPRESSIBLE) == Z_OK);
+  zn2 = test_compress(&s[0], data, size, z2, room);
+  CHECK(zn2 == zn && memcmp(z, z2, zn) == 0);
+  CHECK(fastlzlibPoolEnd(pool, &s[0]) == Z_OK);
+  fastlzlibPoolDestroy(pool);
+
+  free(data);
+  free(z);
+  free(z2);
+}
+
+/* a stream structure can be initialized again after its end, without
+   clearing its counters */
+static void test_reinit(void) {
+  const uLong size = TEST_SIZE / 10;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 19);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const z2 = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size + 1);
+  zfast_pool *const pool = fastlzlibPoolCreate(0);
+  zfast_stream s;
+  uLong zn;
+  int i;
+  test_compress_init(&s, Z_BEST_SPEED, 65536, COMPRESSOR_LZ4, 0, 0);
+  zn = test_compress(&s, data, size, z, room);
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+  CHECK(pool != NULL);
+  for(i = 0; i < 2; i++) {
+    /* stale counters */
+    s.total_in = 123;
+    s.total_out = 456;
+    if (i == 0) {
+      CHECK(fastlzlibCompressInit2(&s, Z_BEST_SPEED, 65536) == Z_OK);
+      CHECK(fastlzlibSetCompressor(&s, COMPRESSOR_LZ4) == Z_OK);
+    } else {
+      CHECK(fastlzlibPoolCompressInit(pool, &s, Z_BEST_SPEED, 65536,
+                                      COMPRESSOR_LZ4) == Z_OK);
+    }
+    CHECK(test_compress(&s, data, size, z2, room) == zn);
+    CHECK(memcmp(z, z2, zn) == 0);
+    CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+    s.total_in = 123;
+    s.total_out = 456;
+    if (i == 0) {
+      CHECK(fastlzlibDecompressInit2(&s, 65536) == Z_OK);
+      CHECK(fastlzlibSetCompressor(&s, COMPRESSOR_LZ4) == Z_OK);
+    } else {
+      CHECK(fastlzlibPoolDecompressInit(pool, &s, 65536, COMPRESSOR_LZ4)
+            == Z_OK);
+    }
+    CHECK(test_decompress(&s, z, zn, d, size + 1) == Z_STREAM_END);
+    CHECK(s.total_out == size && memcmp(d, data, size) == 0);
+    CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+  }
+  fastlzlibPoolDestroy(pool);
+  free(data);
+  free(z);
+  free(z2);
+  free(d);
+}
+
+/* offset of the block following the first "count" blocks of a stream using
+   regular headers */
+static uLong test_block_offset(const Bytef *stream, uLong size, int count) {
+  uLong offset = 0;
+  for(; count != 0; count--) {
+    uInt compressed;
+    uInt uncompressed;
+    CHECK(fastlzlibGetStreamInfo(&stream[offset], (int) ( size - offset ),
+                                 &compressed, &uncompressed) == Z_OK);
+    offset += fastlzlibGetHeaderSize() + compressed;
+  }
+  return offset;
+}
+
+/* whole blocks are decoded at once, and partial ones are left on input */
+static void test_decompress_blocks(void) {
+  const uLong size = TEST_SIZE / 10;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 23);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size + 1);
+  zfast_stream s;
+  uLong zn;
+  uLong third;
+  int code;
+  test_compress_init(&s, Z_BEST_SPEED, 16384, COMPRESSOR_LZ4, 0, 0);
+  zn = test_compress(&s, data, size, z, room);
+  CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+  third = test_block_offset(z, zn, 3);
+
+  /* whole stream */
+  test_decompress_init(&s, 16384, COMPRESSOR_LZ4, 0);
+  s.next_in = z;
+  s.avail_in = (uInt) zn;
+  s.next_out = d;
+  s.avail_out = (uInt) size;
+  CHECK(fastlzlibDecompressBlocks(&s) == Z_STREAM_END);
+  CHECK(s.avail_in == 0 && s.total_out == size);
+  CHECK(memcmp(d, data, size) == 0);
+  CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+
+  /* the next block is incomplete (header, then data): left on input */
+  test_decompress_init(&s, 16384, COMPRESSOR_LZ4, 0);
+  s.next_in = z;
+  s.avail_in = (uInt) third + 5;
+  s.next_out = d;
+  s.avail_out = (uInt) size;
+  CHECK(fastlzlibDecompressBlocks(&s) == Z_OK);
+  CHECK(s.next_in == &z[third] && s.total_out == 3*16384);
+  s.avail_in = (uInt) fastlzlibGetHeaderSize() + 5;
+  CHECK(fastlzlibDecompressBlocks(&s) == Z_BUF_ERROR);
+  CHECK(s.next_in == &z[third] && s.total_out == 3*16384);
+
+  /* the next block does not fit on output: left on input */
+  s.avail_in = (uInt) ( zn - third );
+  s.avail_out = 16384 - 1;
+  CHECK(fastlzlibDecompressBlocks(&s) == Z_BUF_ERROR);
+  CHECK(s.next_in == &z[third] && s.total_out == 3*16384);
+  s.avail_out = 2*16384 + 1;
+  CHECK(fastlzlibDecompressBlocks(&s) == Z_OK);
+  CHECK(s.next_in == &z[test_block_offset(z, zn, 5)]
+        && s.total_out == 5*16384);
+
+  /* the rest of the stream */
+  s.avail_in = (uInt) ( zn - ( s.next_in - z ) );
+  s.avail_out = (uInt) ( size + 1 - s.total_out );
+  do {
+    code = fastlzlibDecompressBlocks(&s);
+  } while(code == Z_OK);
+  CHECK(code == Z_STREAM_END);
+  CHECK(s.avail_in == 0 && s.total_out == size);
+  CHECK(memcmp(d, data, size) == 0);
+  CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+
+  free(data);
+  free(z);
+  free(d);
+}
+
+/* the room returned by fastlzlibCompressNeeded() and the sizes returned by
+   fastlzlibDecompressNeeded() are exact for unbuffered calls */
+static void test_needed(void) {
+  static const int flags[] = {
+    0,
+    ZFAST_FLAG_CHECKSUM | ZFAST_FLAG_INDEX,
+    ZFAST_FLAG_COMPACT_HEADERS | ZFAST_FLAG_COMPRESSOR_ID | ZFAST_FLAG_INDEX
+  };
+  const uLong size = TEST_SIZE / 4;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 29);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const z2 = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size);
+  int c, f;
+  CHECK(fastlzlibCompressNeeded(NULL, Z_NO_FLUSH) == 0);
+  CHECK(fastlzlibDecompressNeeded(NULL, NULL, NULL) == Z_STREAM_ERROR);
+  for(c = 0; c < 2; c++) {
+    const zfast_stream_compressor compressor =
+      c == 0 ? COMPRESSOR_LZ4 : COMPRESSOR_FASTLZ;
+    for(f = 0; f < (int) ( sizeof(flags) / sizeof(flags[0]) ); f++) {
+      zfast_stream s;
+      uLong zn;
+      int code;
+      test_compress_init(&s, Z_BEST_SPEED, 16384, compressor, flags[f], 0);
+      zn = test_compress(&s, data, size, z, room);
+      CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+      /* compressing: one byte less than needed makes no progress */
+      test_compress_init(&s, Z_BEST_SPEED, 16384, compressor, flags[f], 0);
+      s.next_in = data;
+      s.next_out = z2;
+      do {
+        const uLong total_in = s.total_in;
+        const uLong total_out = s.total_out;
+        uInt needed;
+        s.avail_in = (uInt) ( size - total_in < 20000
+                              ? size - total_in : 20000 );
+        needed = fastlzlibCompressNeeded(&s, Z_FINISH);
+        CHECK(needed != 0 && total_out + needed <= room);
+        s.avail_out = needed - 1;
+        CHECK(fastlzlibCompress2(&s, Z_FINISH, 0) == Z_BUF_ERROR);
+        CHECK(s.total_in == total_in && s.total_out == total_out);
+        s.avail_out = needed;
+        code = fastlzlibCompress2(&s, Z_FINISH, 0);
+        CHECK(code == Z_OK || code == Z_STREAM_END);
+        CHECK(s.total_in != total_in || s.total_out != total_out);
+      } while(code != Z_STREAM_END);
+      CHECK(fastlzlibCompressNeeded(&s, Z_FINISH) == 0);
+      CHECK(s.total_out == zn && memcmp(z, z2, zn) == 0);
+      CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+
+      /* decompressing: the exact block sizes, one block at a time */
+      test_decompress_init(&s, 16384, compressor, 0);
+      s.next_in = z;
+      s.next_out = d;
+      do {
+        const uLong total_in = s.total_in;
+        uInt in_needed;
+        uInt out_needed;
+        s.avail_in = (uInt) ( zn - total_in );
+        CHECK(fastlzlibDecompressNeeded(&s, &in_needed, &out_needed) == Z_OK);
+        CHECK(in_needed != 0 && in_needed <= zn - total_in);
+        CHECK(s.total_out + out_needed <= size);
+        s.avail_in = in_needed - 1;
+        s.avail_out = out_needed;
+        CHECK(fastlzlibDecompress2(&s, Z_NO_FLUSH, 0) == Z_BUF_ERROR);
+        CHECK(s.total_in == total_in);
+        if (out_needed != 0) {
+          s.avail_in = in_needed;
+          s.avail_out = out_needed - 1;
+          CHECK(fastlzlibDecompress2(&s, Z_NO_FLUSH, 0) == Z_BUF_ERROR);
+          CHECK(s.total_in == total_in);
+        }
+        s.avail_in = in_needed;
+        s.avail_out = out_needed;
+        code = fastlzlibDecompress2(&s, Z_NO_FLUSH, 0);
+        CHECK(code == Z_OK || code == Z_STREAM_END);
+        CHECK(s.total_in == total_in + in_needed && s.avail_out == 0);
+      } while(code != Z_STREAM_END);
+      CHECK(s.total_in == zn && s.total_out == size);
+      CHECK(memcmp(d, data, size) == 0);
+      CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+    }
+  }
+  free(data);
+  free(z);
+  free(z2);
+  free(d);
+}
+
+/* allocator hook recording the live allocations */
+#define TEST_MAX_ALLOCS 64
+typedef struct test_allocs {
+  void *address[TEST_MAX_ALLOCS];
+  size_t size[TEST_MAX_ALLOCS];
+  zfast_alloc_kind kind[TEST_MAX_ALLOCS];
+  int live;
+  int total;
+  int kinds;  /* bit mask of the allocated kinds */
+} test_allocs;
+
+static void* test_alloc_hook(void *opaque, size_t size, size_t alignment,
+                             zfast_alloc_kind kind) {
+  test_allocs *const allocs = (test_allocs*) opaque;
+  void *const ptr = fastlzlibHugePageAlloc(NULL, size, alignment, kind);
+  int i;
+  CHECK(alignment == 64);
+  CHECK(ptr != NULL && ( (size_t) ptr ) % alignment == 0);
+  memset(ptr, 0xaa, size);
+  for(i = 0; allocs->address[i] != NULL; i++) {
+    CHECK(i + 1 < TEST_MAX_ALLOCS);
+  }
+  allocs->address[i] = ptr;
+  allocs->size[i] = size;
+  allocs->kind[i] = kind;
+  allocs->live++;
+  allocs->total++;
+  allocs->kinds |= 1 << kind;
+  return ptr;
+}
+
+static void test_free_hook(void *opaque, void *address, size_t size,
+                           zfast_alloc_kind kind) {
+  test_allocs *const allocs = (test_allocs*) opaque;
+  int i;
+  for(i = 0; allocs->address[i] != address; i++) {
+    CHECK(i + 1 < TEST_MAX_ALLOCS);
+  }
+  CHECK(allocs->size[i] == size && allocs->kind[i] == kind);
+  allocs->address[i] = NULL;
+  allocs->live--;
+  fastlzlibHugePageFree(NULL, address, size, kind);
+}
+
+/* the allocator hooks get 64-byte aligned requests, and every allocation is
+   released once, with its size and kind, by the end of the stream ; large
+   blocks use the huge pages of the built-in allocator */
+static void test_allocator(void) {
+  static const int flags[] = {
+    0, ZFAST_FLAG_LINKED_BLOCKS, ZFAST_FLAG_CHECKSUM | ZFAST_FLAG_INDEX
+  };
+  const uLong size = TEST_SIZE * 3;
+  const uLong room = TEST_ROOM(size);
+  Bytef *const data = test_data(size, 31);
+  Bytef *const z = (Bytef*) test_malloc(room);
+  Bytef *const d = (Bytef*) test_malloc(size + 1);
+  int f, b, t;
+
+  /* built-in allocator, heap and huge pages */
+  for(b = 4096; b <= 4*1024*1024; b *= 32) {
+    Bytef *const ptr = (Bytef*) fastlzlibHugePageAlloc(NULL, b, 64,
+                                                       ZFAST_ALLOC_BUFFER);
+    CHECK(ptr != NULL && ( (size_t) ptr ) % 64 == 0);
+    memset(ptr, 0, b);
+    fastlzlibHugePageFree(NULL, ptr, b, ZFAST_ALLOC_BUFFER);
+  }
+
+  for(f = 0; f < (int) ( sizeof(flags) / sizeof(flags[0]) ); f++) {
+    for(b = 16384; b <= 1024*1024; b *= 64) {
+      for(t = 0; t <= TEST_THREADS; t += TEST_THREADS) {
+        test_allocs allocs;
+        zfast_stream s;
+        uLong zn;
+        /* linked blocks are not compressed in parallel */
+        if (t != 0 && flags[f] == ZFAST_FLAG_LINKED_BLOCKS) {
+          continue;
+        }
+        memset(&allocs, 0, sizeof(allocs));
+        test_compress_init(&s, Z_BEST_SPEED, b, COMPRESSOR_LZ4, flags[f], t);
+        CHECK(fastlzlibSetAllocator(&s, test_alloc_hook, NULL, &allocs)
+              == Z_STREAM_ERROR);
+        CHECK(fastlzlibSetAllocator(&s, test_alloc_hook, test_free_hook,
+                                    &allocs) == Z_OK);
+        zn = test_compress_feed(&s, data, size, z, room, 7777, 5555);
+        CHECK(fastlzlibSetAllocator(&s, NULL, NULL, NULL) == Z_STREAM_ERROR);
+        CHECK(allocs.live != 0);
+        CHECK(fastlzlibCompressEnd(&s) == Z_OK);
+        CHECK(allocs.live == 0);
+
+        test_decompress_init(&s, b, COMPRESSOR_LZ4, t);
+        CHECK(fastlzlibSetAllocator(&s, test_alloc_hook, test_free_hook,
+                                    &allocs) == Z_OK);
+        CHECK(test_decompress_feed(&s, z, zn, d, size + 1, 7777, 5555)
+              == Z_STREAM_END);
+        CHECK(s.total_out == size && memcmp(d, data, size) == 0);
+        CHECK(fastlzlibDecompressEnd(&s) == Z_OK);
+        CHECK(allocs.live == 0 && allocs.total != 0);
+        CHECK(( allocs.kinds & ( 1 << ZFAST_ALLOC_BUFFER ) ) != 0);
+        CHECK(( allocs.kinds & ( 1 << ZFAST_ALLOC_WORK ) ) != 0);
+        CHECK(( ( allocs.kinds & ( 1 << ZFAST_ALLOC_HISTORY ) ) != 0)
+              == ( flags[f] == ZFAST_FLAG_LINKED_BLOCKS ));
+      }
+    }
+  }
+  free(data);
+  free(z);
+  free(d);
+}
+
+/* the tests */
+static const struct test_entry {
+  const char *name;
+  void (*run)(void);
+} tests[] = {
+  { "roundtrip", test_roundtrip },
+  { "threads", test_threads },
+  { "checksum", test_checksum },
+  { "seek", test_seek },
+  { "append", test_append },
+  { "resync", test_resync },
+  { "batch", test_batch },
+  { "scatter-gather", test_scatter_gather },
+  { "backend-change", test_backend_change },
+  { "adaptive", test_adaptive },
+  { "table-reuse", test_table_reuse },
+  { "compressor-reset", test_compressor_reset },
+  { "eof", test_eof },
+  { "dictionary", test_dictionary },
+  { "overlap", test_overlap },
+  { "pool", test_pool },
+  { "reinit", test_reinit },
+  { "decompress-blocks", test_decompress_blocks },
+  { "needed", test_needed },
+  { "allocator", test_allocator },
+  { NULL, NULL }
+};
+
+int main(int argc, char **argv) {
+  int i;
+  int count = 0;
+  for(i = 0; tests[i].name != NULL; i++) {
+    int j;
+    int selected = argc == 1;
+    for(j = 1; j < argc; j++) {
+      if (strcmp(argv[j], tests[i].name) == 0) {
+        selected = 1;
+      }
+    }
+    if (selected) {
+      current_test = tests[i].name;
+      tests[i].run();
+      printf("%s: OK\n", tests[i].name);
+      count++;
+    }
+  }
+  if (count == 0) {
+    fprintf(stderr, "%s: no such test\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  printf("%d tests passed\n", count);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/*
+  zlib-like interface to fast block compression (LZ4 or FastLZ) libraries
+  Copyright (C) 2010-2013 Exalead SA. (http://www.exalead.com/)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+
+  Remarks/Bugs:
+  LZ4 compression library by Yann Collet (yann.collet.73@gmail.com)
+  FastLZ compression library by Ariya Hidayat (ariya@kde.org)
+  Library encapsulation by Xavier Roche (fastlz@exalead.com)
+*/
+
+/* regression tests of the C++ layer (fastlzlib.hpp): compress_into(),
+   decompress_into() and the stream buffers (run with "make check") */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "fastlzlib.hpp"
+
+/* size of the test data */
+#define TEST_SIZE ( 700*1000 + 1 )
+
+/* block size of the test streams */
+#define TEST_BLOCK_SIZE 65536
+
+/* abort the tests upon failure */
+#define CHECK(EXPR) do {                                                \
+    if (!(EXPR)) {                                                      \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n",                 \
+                   __FILE__, __LINE__, #EXPR);                          \
+      std::exit(EXIT_FAILURE);                                          \
+    }                                                                   \
+  } while(0)
+
+/* test data: text-like sequences of words, with a few random runs (see
+   fastlztest.c) */
+static std::vector<Bytef> test_data(std::size_t size, unsigned int seed) {
+  static const char *const words[] = {
+    "block ", "stream ", "the ", "compressed ", "of ", "index ", "a ",
+    "header ", "fast ", "data\n", "and ", "LZ4 ", "FastLZ ", "marker. "
+  };
+  std::vector<Bytef> data;
+  data.reserve(size);
+  while (data.size() < size) {
+    seed = seed*1103515245 + 12345;
+    if (( seed >> 16 ) % 64 == 0) {
+      std::size_t run = 1 + ( seed >> 20 ) % 8192;
+      for(; run != 0 && data.size() < size; run--) {
+        seed = seed*1103515245 + 12345;
+        data.push_back((Bytef) ( seed >> 16 ));
+      }
+    } else {
+      const char *const word =
+        words[( seed >> 16 ) % ( sizeof(words) / sizeof(words[0]) )];
+      for(std::size_t j = 0; word[j] != '\0' && data.size() < size; j++) {
+        data.push_back((Bytef) word[j]);
+      }
+    }
+  }
+  return data;
+}
+
+/* compress_into() at once, and decompress_into() in small chunks, then into
+   an exactly-sized buffer */
+template<typename B>
+static void test_buffers(const std::vector<Bytef> &data, int flags) {
+  zfast::basic_compressor<B> c(2, TEST_BLOCK_SIZE, flags);
+  zfast::basic_compressor<B> moved(std::move(c));
+  std::vector<Bytef> z(zfast::basic_compressor<B>::bound(data.size(),
+                                                         TEST_BLOCK_SIZE));
+  const zfast::result r =
+    moved.compress_into(zfast::span<const Bytef>(data), zfast::span<Bytef>(z),
+                        Z_FINISH);
+  CHECK(r.finished() && r.consumed == data.size());
+  z.resize(r.produced);
+
+  zfast::basic_decompressor<B> d(TEST_BLOCK_SIZE);
+  std::vector<Bytef> chunk(7777);
+  std::vector<Bytef> back;
+  std::size_t offset = 0;
+  for(;;) {
+    const std::size_t n = z.size() - offset < 1000 ? z.size() - offset : 1000;
+    const zfast::result q =
+      d.decompress_into(zfast::span<const Bytef>(&z[offset], n),
+                        zfast::span<Bytef>(chunk));
+    offset += q.consumed;
+    back.insert(back.end(), chunk.begin(), chunk.begin() + q.produced);
+    if (q.finished()) {
+      break;
+    }
+    CHECK(q.code != Z_BUF_ERROR || offset < z.size());
+  }
+  CHECK(offset == z.size() && back == data);
+
+  zfast::basic_decompressor<B> exact(TEST_BLOCK_SIZE);
+  std::vector<Bytef> out(data.size());
+  const zfast::result q =
+    exact.decompress_into(zfast::span<const Bytef>(z),
+                          zfast::span<Bytef>(out));
+  CHECK(q.finished() && q.consumed == z.size() && q.produced == data.size());
+  CHECK(out == data);
+}
+
+/* basic_ostreambuf mixing large writes, sync flushes and single characters,
+   read back through basic_istreambuf ; a truncated stream throws */
+template<typename B>
+static void test_streambufs(const std::vector<Bytef> &data, int flags) {
+  const std::size_t half = data.size() / 2;
+  std::stringbuf sink;
+  {
+    zfast::basic_ostreambuf<B> ob(&sink, 2, TEST_BLOCK_SIZE, flags);
+    std::ostream os(&ob);
+    os.write((const char*) &data[0], (std::streamsize) half);
+    os << std::flush;
+    for(std::size_t i = half; i < data.size(); i++) {
+      os.put((char) data[i]);
+    }
+    CHECK(os.good());
+  }
+  const std::string z = sink.str();
+  {
+    std::stringbuf source(z);
+    zfast::basic_istreambuf<B> ib(&source, TEST_BLOCK_SIZE, 3000);
+    std::istream is(&ib);
+    const std::string back((std::istreambuf_iterator<char>(is)),
+                           std::istreambuf_iterator<char>());
+    CHECK(back.size() == data.size()
+          && std::memcmp(back.data(), &data[0], data.size()) == 0);
+  }
+  {
+    std::stringbuf source(z.substr(0, z.size() / 2));
+    zfast::basic_istreambuf<B> ib(&source, TEST_BLOCK_SIZE);
+    std::istream is(&ib);
+    bool thrown = false;
+    is.exceptions(std::ios::badbit);
+    try {
+      const std::string back((std::istreambuf_iterator<char>(is)),
+                             std::istreambuf_iterator<char>());
+    } catch(const std::exception&) {
+      thrown = true;
+    }
+    CHECK(thrown);
+  }
+}
+
+int main() {
+  static const int flags[] = {
+    0,
+    ZFAST_FLAG_CHECKSUM | ZFAST_FLAG_INDEX,
+    ZFAST_FLAG_COMPACT_HEADERS | ZFAST_FLAG_COMPRESSOR_ID
+  };
+  const std::vector<Bytef> data = test_data(TEST_SIZE, 1);
+  bool thrown = false;
+  for(std::size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+    test_buffers<zfast::lz4>(data, flags[f]);
+    test_buffers<zfast::fastlz>(data, flags[f]);
+    test_streambufs<zfast::lz4>(data, flags[f]);
+    test_streambufs<zfast::fastlz>(data, flags[f]);
+  }
+  /* invalid block size */
+  try {
+    zfast::compressor c(2, 1000);
+  } catch(const zfast::error &e) {
+    thrown = e.code() != Z_OK;
+  }
+  CHECK(thrown);
+  std::printf("C++ tests passed\n");
+  return EXIT_SUCCESS;
+}
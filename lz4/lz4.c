@@ -266,19 +266,11 @@ static void LZ4_copy4(void* dstPtr, const void* srcPtr)
     memcpy(dstPtr, srcPtr, 4);
 }
 
+/* note: memcpy() is also used on unaligned-access targets, where it compiles
+   to a single move ; casted U64 copies let the loop vectorizer merge the
+   overlapping copies of LZ4_wildCopy() (corrupted matches at -O3) */
 static void LZ4_copy8(void* dstPtr, const void* srcPtr)
 {
-#if GCC_VERSION!=409  /* disabled on GCC 4.9, as it generates invalid opcode (crash) */
-    if (LZ4_UNALIGNED_ACCESS)
-    {
-        if (LZ4_64bits())
-            *(U64*)dstPtr = *(U64*)srcPtr;
-        else
-            ((U32*)dstPtr)[0] = ((U32*)srcPtr)[0],
-            ((U32*)dstPtr)[1] = ((U32*)srcPtr)[1];
-        return;
-    }
-#endif
     memcpy(dstPtr, srcPtr, 8);
 }
 
@@ -444,7 +436,7 @@ typedef struct {
 typedef enum { notLimited = 0, limitedOutput = 1 } limitedOutput_directive;
 typedef enum { byPtr, byU32, byU16 } tableType_t;
 
-typedef enum { noDict = 0, withPrefix64k, usingExtDict } dict_directive;
+typedef enum { noDict = 0, withPrefix64k, usingExtDict, reuseTable } dict_directive;
 typedef enum { noDictIssue = 0, dictSmall } dictIssue_directive;
 
 typedef enum { endOnOutputSize = 0, endOnInputSize = 1 } endCondition_directive;
@@ -456,15 +448,15 @@ typedef enum { full = 0, partial = 1 } earlyEnd_directive;
    Compression functions
 ********************************/
 
-static U32 LZ4_hashSequence(U32 sequence, tableType_t tableType)
+static U32 LZ4_hashSequence(U32 sequence, tableType_t tableType, U32 hashLog)
 {
     if (tableType == byU16)
-        return (((sequence) * 2654435761U) >> ((MINMATCH*8)-(LZ4_HASHLOG+1)));
+        return (((sequence) * 2654435761U) >> ((MINMATCH*8)-(hashLog+1)));
     else
-        return (((sequence) * 2654435761U) >> ((MINMATCH*8)-LZ4_HASHLOG));
+        return (((sequence) * 2654435761U) >> ((MINMATCH*8)-hashLog));
 }
 
-static U32 LZ4_hashPosition(const BYTE* p, tableType_t tableType) { return LZ4_hashSequence(LZ4_read32(p), tableType); }
+static U32 LZ4_hashPosition(const BYTE* p, tableType_t tableType, U32 hashLog) { return LZ4_hashSequence(LZ4_read32(p), tableType, hashLog); }
 
 static void LZ4_putPositionOnHash(const BYTE* p, U32 h, void* tableBase, tableType_t tableType, const BYTE* srcBase)
 {
@@ -476,9 +468,9 @@ static void LZ4_putPositionOnHash(const BYTE* p, U32 h, void* tableBase, tableTy
     }
 }
 
-static void LZ4_putPosition(const BYTE* p, void* tableBase, tableType_t tableType, const BYTE* srcBase)
+static void LZ4_putPosition(const BYTE* p, void* tableBase, tableType_t tableType, const BYTE* srcBase, U32 hashLog)
 {
-    U32 h = LZ4_hashPosition(p, tableType);
+    U32 h = LZ4_hashPosition(p, tableType, hashLog);
     LZ4_putPositionOnHash(p, h, tableBase, tableType, srcBase);
 }
 
@@ -489,13 +481,15 @@ static const BYTE* LZ4_getPositionOnHash(U32 h, void* tableBase, tableType_t tab
     { U16* hashTable = (U16*) tableBase; return hashTable[h] + srcBase; }   /* default, to ensure a return */
 }
 
-static const BYTE* LZ4_getPosition(const BYTE* p, void* tableBase, tableType_t tableType, const BYTE* srcBase)
+static const BYTE* LZ4_getPosition(const BYTE* p, void* tableBase, tableType_t tableType, const BYTE* srcBase, U32 hashLog)
 {
-    U32 h = LZ4_hashPosition(p, tableType);
+    U32 h = LZ4_hashPosition(p, tableType, hashLog);
     return LZ4_getPositionOnHash(h, tableBase, tableType, srcBase);
 }
 
-static int LZ4_compress_generic(
+/* note: with noDict, ctx may be a bare hash table of 2^(hashLog+2) bytes ;
+   with reuseTable, the table is followed by its current offset (see LZ4_compress_reuseTable) */
+FORCE_INLINE int LZ4_compress_generic(
                  void* ctx,
                  const char* source,
                  char* dest,
@@ -504,16 +498,18 @@ static int LZ4_compress_generic(
                  limitedOutput_directive outputLimited,
                  tableType_t tableType,
                  dict_directive dict,
-                 dictIssue_directive dictIssue)
+                 dictIssue_directive dictIssue,
+                 U32 hashLog)
 {
     LZ4_stream_t_internal* const dictPtr = (LZ4_stream_t_internal*)ctx;
 
     const BYTE* ip = (const BYTE*) source;
     const BYTE* base;
     const BYTE* lowLimit;
-    const BYTE* const lowRefLimit = ip - dictPtr->dictSize;
-    const BYTE* const dictionary = dictPtr->dictionary;
-    const BYTE* const dictEnd = dictionary + dictPtr->dictSize;
+    const U32 dictSize = ((dict==noDict) || (dict==reuseTable)) ? 0 : dictPtr->dictSize;
+    const BYTE* const lowRefLimit = ip - dictSize;
+    const BYTE* const dictionary = ((dict==noDict) || (dict==reuseTable)) ? (const BYTE*) source : dictPtr->dictionary;
+    const BYTE* const dictEnd = dictionary + dictSize;
     const size_t dictDelta = dictEnd - (const BYTE*)source;
     const BYTE* anchor = (const BYTE*) source;
     const BYTE* const iend = ip + inputSize;
@@ -537,19 +533,23 @@ static int LZ4_compress_generic(
         break;
     case withPrefix64k:
         base = (const BYTE*)source - dictPtr->currentOffset;
-        lowLimit = (const BYTE*)source - dictPtr->dictSize;
+        lowLimit = (const BYTE*)source - dictSize;
         break;
     case usingExtDict:
         base = (const BYTE*)source - dictPtr->currentOffset;
         lowLimit = (const BYTE*)source;
         break;
+    case reuseTable:
+        base = (const BYTE*)source - ((const U32*)ctx)[(size_t)1 << hashLog];
+        lowLimit = (const BYTE*)source;
+        break;
     }
     if ((tableType == byU16) && (inputSize>=LZ4_64Klimit)) return 0;   /* Size too large (not within 64K limit) */
     if (inputSize<LZ4_minLength) goto _last_literals;                  /* Input too small, no compression (all literals) */
 
     /* First Byte */
-    LZ4_putPosition(ip, ctx, tableType, base);
-    ip++; forwardH = LZ4_hashPosition(ip, tableType);
+    LZ4_putPosition(ip, ctx, tableType, base, hashLog);
+    ip++; forwardH = LZ4_hashPosition(ip, tableType, hashLog);
 
     /* Main Loop */
     for ( ; ; )
@@ -584,7 +584,7 @@ static int LZ4_compress_generic(
                         lowLimit = (const BYTE*)source;
                     }
                 }
-                forwardH = LZ4_hashPosition(forwardIp, tableType);
+                forwardH = LZ4_hashPosition(forwardIp, tableType, hashLog);
                 LZ4_putPositionOnHash(ip, h, ctx, tableType, base);
 
             } while ( ((dictIssue==dictSmall) ? (match < lowRefLimit) : 0)
@@ -663,10 +663,10 @@ _next_match:
         if (ip > mflimit) break;
 
         /* Fill table */
-        LZ4_putPosition(ip-2, ctx, tableType, base);
+        LZ4_putPosition(ip-2, ctx, tableType, base, hashLog);
 
         /* Test next position */
-        match = LZ4_getPosition(ip, ctx, tableType, base);
+        match = LZ4_getPosition(ip, ctx, tableType, base, hashLog);
         if (dict==usingExtDict)
         {
             if (match<(const BYTE*)source)
@@ -680,14 +680,14 @@ _next_match:
                 lowLimit = (const BYTE*)source;
             }
         }
-        LZ4_putPosition(ip, ctx, tableType, base);
+        LZ4_putPosition(ip, ctx, tableType, base, hashLog);
         if ( ((dictIssue==dictSmall) ? (match>=lowRefLimit) : 1)
             && (match+MAX_DISTANCE>=ip)
             && (LZ4_read32(match+refDelta)==LZ4_read32(ip)) )
         { token=op++; *token=0; goto _next_match; }
 
         /* Prepare next loop */
-        forwardH = LZ4_hashPosition(++ip, tableType);
+        forwardH = LZ4_hashPosition(++ip, tableType, hashLog);
     }
 
 _last_literals:
@@ -717,9 +717,9 @@ int LZ4_compress(const char* source, char* dest, int inputSize)
     int result;
 
     if (inputSize < LZ4_64Klimit)
-        result = LZ4_compress_generic((void*)ctx, source, dest, inputSize, 0, notLimited, byU16, noDict, noDictIssue);
+        result = LZ4_compress_generic((void*)ctx, source, dest, inputSize, 0, notLimited, byU16, noDict, noDictIssue, LZ4_HASHLOG);
     else
-        result = LZ4_compress_generic((void*)ctx, source, dest, inputSize, 0, notLimited, LZ4_64bits() ? byU32 : byPtr, noDict, noDictIssue);
+        result = LZ4_compress_generic((void*)ctx, source, dest, inputSize, 0, notLimited, LZ4_64bits() ? byU32 : byPtr, noDict, noDictIssue, LZ4_HASHLOG);
 
 #if (HEAPMODE)
     FREEMEM(ctx);
@@ -737,9 +737,9 @@ int LZ4_compress_limitedOutput(const char* source, char* dest, int inputSize, in
     int result;
 
     if (inputSize < LZ4_64Klimit)
-        result = LZ4_compress_generic((void*)ctx, source, dest, inputSize, maxOutputSize, limitedOutput, byU16, noDict, noDictIssue);
+        result = LZ4_compress_generic((void*)ctx, source, dest, inputSize, maxOutputSize, limitedOutput, byU16, noDict, noDictIssue, LZ4_HASHLOG);
     else
-        result = LZ4_compress_generic((void*)ctx, source, dest, inputSize, maxOutputSize, limitedOutput, LZ4_64bits() ? byU32 : byPtr, noDict, noDictIssue);
+        result = LZ4_compress_generic((void*)ctx, source, dest, inputSize, maxOutputSize, limitedOutput, LZ4_64bits() ? byU32 : byPtr, noDict, noDictIssue, LZ4_HASHLOG);
 
 #if (HEAPMODE)
     FREEMEM(ctx);
@@ -801,7 +801,7 @@ int LZ4_loadDict (LZ4_stream_t* LZ4_dict, const char* dictionary, int dictSize)
 
     while (p <= dictEnd-MINMATCH)
     {
-        LZ4_putPosition(p, dict, byU32, base);
+        LZ4_putPosition(p, dict, byU32, base, LZ4_HASHLOG);
         p+=3;
     }
 
@@ -858,9 +858,9 @@ FORCE_INLINE int LZ4_compress_continue_generic (void* LZ4_stream, const char* so
     {
         int result;
         if ((streamPtr->dictSize < 64 KB) && (streamPtr->dictSize < streamPtr->currentOffset))
-            result = LZ4_compress_generic(LZ4_stream, source, dest, inputSize, maxOutputSize, limit, byU32, withPrefix64k, dictSmall);
+            result = LZ4_compress_generic(LZ4_stream, source, dest, inputSize, maxOutputSize, limit, byU32, withPrefix64k, dictSmall, LZ4_HASHLOG);
         else
-            result = LZ4_compress_generic(LZ4_stream, source, dest, inputSize, maxOutputSize, limit, byU32, withPrefix64k, noDictIssue);
+            result = LZ4_compress_generic(LZ4_stream, source, dest, inputSize, maxOutputSize, limit, byU32, withPrefix64k, noDictIssue, LZ4_HASHLOG);
         streamPtr->dictSize += (U32)inputSize;
         streamPtr->currentOffset += (U32)inputSize;
         return result;
@@ -870,9 +870,9 @@ FORCE_INLINE int LZ4_compress_continue_generic (void* LZ4_stream, const char* so
     {
         int result;
         if ((streamPtr->dictSize < 64 KB) && (streamPtr->dictSize < streamPtr->currentOffset))
-            result = LZ4_compress_generic(LZ4_stream, source, dest, inputSize, maxOutputSize, limit, byU32, usingExtDict, dictSmall);
+            result = LZ4_compress_generic(LZ4_stream, source, dest, inputSize, maxOutputSize, limit, byU32, usingExtDict, dictSmall, LZ4_HASHLOG);
         else
-            result = LZ4_compress_generic(LZ4_stream, source, dest, inputSize, maxOutputSize, limit, byU32, usingExtDict, noDictIssue);
+            result = LZ4_compress_generic(LZ4_stream, source, dest, inputSize, maxOutputSize, limit, byU32, usingExtDict, noDictIssue, LZ4_HASHLOG);
         streamPtr->dictionary = (const BYTE*)source;
         streamPtr->dictSize = (U32)inputSize;
         streamPtr->currentOffset += (U32)inputSize;
@@ -902,7 +902,7 @@ int LZ4_compress_forceExtDict (LZ4_stream_t* LZ4_dict, const char* source, char*
     if (smallest > (const BYTE*) source) smallest = (const BYTE*) source;
     LZ4_renormDictT((LZ4_stream_t_internal*)LZ4_dict, smallest);
 
-    result = LZ4_compress_generic(LZ4_dict, source, dest, inputSize, 0, notLimited, byU32, usingExtDict, noDictIssue);
+    result = LZ4_compress_generic(LZ4_dict, source, dest, inputSize, 0, notLimited, byU32, usingExtDict, noDictIssue, LZ4_HASHLOG);
 
     streamPtr->dictionary = (const BYTE*)source;
     streamPtr->dictSize = (U32)inputSize;
@@ -1335,9 +1335,9 @@ int LZ4_compress_withState (void* state, const char* source, char* dest, int inp
     MEM_INIT(state, 0, LZ4_STREAMSIZE);
 
     if (inputSize < LZ4_64Klimit)
-        return LZ4_compress_generic(state, source, dest, inputSize, 0, notLimited, byU16, noDict, noDictIssue);
+        return LZ4_compress_generic(state, source, dest, inputSize, 0, notLimited, byU16, noDict, noDictIssue, LZ4_HASHLOG);
     else
-        return LZ4_compress_generic(state, source, dest, inputSize, 0, notLimited, LZ4_64bits() ? byU32 : byPtr, noDict, noDictIssue);
+        return LZ4_compress_generic(state, source, dest, inputSize, 0, notLimited, LZ4_64bits() ? byU32 : byPtr, noDict, noDictIssue, LZ4_HASHLOG);
 }
 
 int LZ4_compress_limitedOutput_withState (void* state, const char* source, char* dest, int inputSize, int maxOutputSize)
@@ -1346,9 +1346,95 @@ int LZ4_compress_limitedOutput_withState (void* state, const char* source, char*
     MEM_INIT(state, 0, LZ4_STREAMSIZE);
 
     if (inputSize < LZ4_64Klimit)
-        return LZ4_compress_generic(state, source, dest, inputSize, maxOutputSize, limitedOutput, byU16, noDict, noDictIssue);
+        return LZ4_compress_generic(state, source, dest, inputSize, maxOutputSize, limitedOutput, byU16, noDict, noDictIssue, LZ4_HASHLOG);
     else
-        return LZ4_compress_generic(state, source, dest, inputSize, maxOutputSize, limitedOutput, LZ4_64bits() ? byU32 : byPtr, noDict, noDictIssue);
+        return LZ4_compress_generic(state, source, dest, inputSize, maxOutputSize, limitedOutput, LZ4_64bits() ? byU32 : byPtr, noDict, noDictIssue, LZ4_HASHLOG);
+}
+
+
+/*  Hash table size variants : one specialized compressor per table size (see LZ4_compress_withStateLog) */
+
+/*  The state is the hash table, followed by its current offset and a tag (the table type) :
+    positions are stored relative to the current offset, which moves forward after each input,
+    so positions of previous inputs fall before the source and are ignored (dictSmall).
+    The output does not depend on previous inputs, and the table is only cleared when its type
+    changes or when positions would overflow. */
+#define LZ4_STATELOG_HEADER(state, hashLog) ((U32*)(state) + ((size_t)1 << (hashLog)))
+#define LZ4_STATELOG_TAG(tableType) (0x4C5A3400U + (U32)(tableType))
+
+int LZ4_sizeofStateLog(int memoryUsage)
+{
+    if ((memoryUsage < LZ4_MEMORY_USAGE_MIN) || (memoryUsage > LZ4_MEMORY_USAGE_MAX)) return 0;
+    return (1 << memoryUsage) + 2*sizeof(U32);
+}
+
+void LZ4_resetStateLog(void* state, int memoryUsage)
+{
+    if ((memoryUsage < LZ4_MEMORY_USAGE_MIN) || (memoryUsage > LZ4_MEMORY_USAGE_MAX)) return;
+    LZ4_STATELOG_HEADER(state, memoryUsage-2)[1] = 0;
+}
+
+FORCE_INLINE int LZ4_compress_reuseTable(void* state, const char* source, char* dest, int inputSize, tableType_t tableType, U32 hashLog)
+{
+    U32* const header = LZ4_STATELOG_HEADER(state, hashLog);
+    const U64 limit = (tableType == byU16) ? 0x10000 : 0x80000000;
+    int result;
+
+    if ((U32)inputSize > (U32)LZ4_MAX_INPUT_SIZE) return 0;   /* Unsupported input size, too large (or negative) */
+    if ((header[1] != LZ4_STATELOG_TAG(tableType)) || ((U64)header[0] + (U32)inputSize > limit))
+    {
+        MEM_INIT(state, 0, (size_t)1 << (hashLog+2));
+        header[0] = 1;   /* empty entries are before the source, too */
+        header[1] = LZ4_STATELOG_TAG(tableType);
+    }
+    result = LZ4_compress_generic(state, source, dest, inputSize, 0, notLimited, tableType, reuseTable, dictSmall, hashLog);
+    header[0] += (U32)inputSize;
+    return result;
+}
+
+#define LZ4_COMPRESS_WITHSTATE_LOG(LOG) \
+static int LZ4_compress_withState##LOG(void* state, const char* source, char* dest, int inputSize) \
+{ \
+    if (inputSize < LZ4_64Klimit) \
+        return LZ4_compress_reuseTable(state, source, dest, inputSize, byU16, LOG-2); \
+    else if (LZ4_64bits()) \
+        return LZ4_compress_reuseTable(state, source, dest, inputSize, byU32, LOG-2); \
+    MEM_INIT(state, 0, (size_t)1 << LOG); \
+    LZ4_resetStateLog(state, LOG); \
+    return LZ4_compress_generic(state, source, dest, inputSize, 0, notLimited, byPtr, noDict, noDictIssue, LOG-2); \
+}
+
+LZ4_COMPRESS_WITHSTATE_LOG(10)
+LZ4_COMPRESS_WITHSTATE_LOG(11)
+LZ4_COMPRESS_WITHSTATE_LOG(12)
+LZ4_COMPRESS_WITHSTATE_LOG(13)
+LZ4_COMPRESS_WITHSTATE_LOG(14)
+LZ4_COMPRESS_WITHSTATE_LOG(15)
+LZ4_COMPRESS_WITHSTATE_LOG(16)
+LZ4_COMPRESS_WITHSTATE_LOG(17)
+LZ4_COMPRESS_WITHSTATE_LOG(18)
+LZ4_COMPRESS_WITHSTATE_LOG(19)
+LZ4_COMPRESS_WITHSTATE_LOG(20)
+
+int LZ4_compress_withStateLog (void* state, const char* source, char* dest, int inputSize, int memoryUsage)
+{
+    if (((size_t)(state)&3) != 0) return 0;   /* Error : state is not aligned on 4-bytes boundary */
+
+    switch(memoryUsage)
+    {
+    case 10: return LZ4_compress_withState10(state, source, dest, inputSize);
+    case 11: return LZ4_compress_withState11(state, source, dest, inputSize);
+    case 12: return LZ4_compress_withState12(state, source, dest, inputSize);
+    case 13: return LZ4_compress_withState13(state, source, dest, inputSize);
+    case 14: return LZ4_compress_withState14(state, source, dest, inputSize);
+    case 15: return LZ4_compress_withState15(state, source, dest, inputSize);
+    case 16: return LZ4_compress_withState16(state, source, dest, inputSize);
+    case 17: return LZ4_compress_withState17(state, source, dest, inputSize);
+    case 18: return LZ4_compress_withState18(state, source, dest, inputSize);
+    case 19: return LZ4_compress_withState19(state, source, dest, inputSize);
+    case 20: return LZ4_compress_withState20(state, source, dest, inputSize);
+    default: return 0;   /* Error : unsupported table size */
+    }
 }
 
 /* Obsolete streaming decompression functions */
@@ -80,6 +80,10 @@ ZFASTEXTERN int LZ4_versionNumber (void);
  */
 #define LZ4_MEMORY_USAGE 14
 
+/* range of the table sizes supported by LZ4_compress_withStateLog() */
+#define LZ4_MEMORY_USAGE_MIN 10
+#define LZ4_MEMORY_USAGE_MAX 20
+
 
 /**************************************
    Simple Functions
@@ -154,6 +158,22 @@ ZFASTEXTERN int LZ4_sizeofState(void);
 ZFASTEXTERN int LZ4_compress_withState               (void* state, const char* source, char* dest, int inputSize);
 ZFASTEXTERN int LZ4_compress_limitedOutput_withState (void* state, const char* source, char* dest, int inputSize, int maxOutputSize);
 
+/*
+LZ4_compress_withStateLog() :
+    Same as LZ4_compress_withState(), but using a hash table of 2^memoryUsage bytes
+    (from LZ4_MEMORY_USAGE_MIN to LZ4_MEMORY_USAGE_MAX) instead of 2^LZ4_MEMORY_USAGE.
+    Small tables are faster on small inputs, large tables improve the ratio of large inputs.
+    The output is decoded by any LZ4 decompression function.
+    Use LZ4_sizeofStateLog() to know how much memory must be allocated (0 if memoryUsage is unsupported).
+    The hash table is kept between calls rather than cleared on each input (the output does not
+    depend on previous inputs) : the state must be zeroed, or reset with LZ4_resetStateLog(),
+    before its first use and after being used by any other function.
+    return : the number of bytes written in buffer 'dest', or 0 if compression fails
+*/
+ZFASTEXTERN int LZ4_sizeofStateLog(int memoryUsage);
+ZFASTEXTERN void LZ4_resetStateLog(void* state, int memoryUsage);
+ZFASTEXTERN int LZ4_compress_withStateLog (void* state, const char* source, char* dest, int inputSize, int memoryUsage);
+
 
 /*
 LZ4_decompress_fast() :